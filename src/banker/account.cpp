@@ -11,6 +11,13 @@
 using namespace std;
 using namespace ML;
 
+namespace {
+
+/// Age after which a pending commitment is counted as expired
+const double COMMITMENT_EXPIRY_SECONDS = 15.0;
+
+} // file scope
+
 
 namespace RTBKIT {
 
@@ -137,9 +144,10 @@ std::ostream & operator << (std::ostream & stream, const Account & account)
 
     auto addCurrencies = [&] (const CurrencyPool & c)
         {
-            for (auto a: c.currencyAmounts) {
-                if (a) currencies.insert(a.currencyCode);
-            }
+            c.forEach([&] (const Amount & a)
+                {
+                    if (a) currencies.insert(a.currencyCode);
+                });
         };
 
     addCurrencies(account.budgetIncreases);
@@ -228,6 +236,42 @@ std::ostream & operator << (std::ostream & stream, const Account & account)
     return stream;
 }
 
+void
+Account::
+serialize(ML::DB::Store_Writer & store) const
+{
+    store << (unsigned char)0
+          << (int)type << (int)status
+          << budgetIncreases << budgetDecreases
+          << recycledIn << allocatedIn
+          << commitmentsRetired << adjustmentsIn
+          << recycledOut << allocatedOut
+          << commitmentsMade << adjustmentsOut
+          << spent << balance
+          << lineItems << adjustmentLineItems;
+}
+
+void
+Account::
+reconstitute(ML::DB::Store_Reader & store)
+{
+    unsigned char version;
+    store >> version;
+    if (version != 0)
+        throw ML::Exception("error reconstituting account");
+    int t, st;
+    store >> t >> st;
+    type = (AccountType)t;
+    status = (Status)st;
+    store >> budgetIncreases >> budgetDecreases
+          >> recycledIn >> allocatedIn
+          >> commitmentsRetired >> adjustmentsIn
+          >> recycledOut >> allocatedOut
+          >> commitmentsMade >> adjustmentsOut
+          >> spent >> balance
+          >> lineItems >> adjustmentLineItems;
+}
+
 
 /*****************************************************************************/
 /* SHADOW ACCOUNT                                                            */
@@ -239,14 +283,122 @@ logBidEvents(const string & accountKey)
 {
     attachedBids = 0;
     detachedBids = 0;
-    Date now = Date::now();
-    lastExpiredCommitments = 0;
-    for (auto & it: commitments) {
-        Commitment & commitment = it.second;
-        if (now >= commitment.timestamp.plusSeconds(15.0)) {
-            lastExpiredCommitments++;
+    lastExpiredCommitments = countExpiredCommitments(Date::now());
+}
+
+void
+ShadowAccount::
+indexCommitment(uint32_t id)
+{
+    Commitment & commitment = commitments[id];
+
+    // a clock going backwards files the commitment with the newest ones
+    if (expiryBuckets.empty() || expiryBuckets.back().tick < commitment.tick)
+        expiryBuckets.emplace_back(commitment.tick);
+    else commitment.tick = expiryBuckets.back().tick;
+
+    ExpiryBucket & bucket = expiryBuckets.back();
+    bucket.items.push_back(id);
+    bucket.live++;
+    if (commitment.tick <= expiredTick)
+        expiredCommitments++;
+}
+
+void
+ShadowAccount::
+unindexCommitment(int64_t tick)
+{
+    auto it = std::lower_bound(expiryBuckets.begin(), expiryBuckets.end(),
+                               tick,
+                               [] (const ExpiryBucket & b, int64_t t)
+                               { return b.tick < t; });
+    ExcAssert(it != expiryBuckets.end() && it->tick == tick);
+    ExcAssert(it->live > 0);
+
+    if (tick <= expiredTick)
+        expiredCommitments--;
+    if (--it->live == 0)
+        vector<uint32_t>().swap(it->items);
+
+    while (!expiryBuckets.empty() && expiryBuckets.front().live == 0)
+        expiryBuckets.pop_front();
+}
+
+uint32_t
+ShadowAccount::
+countExpiredCommitments(Date now)
+{
+    int64_t deadline = tickOf(now.plusSeconds(-COMMITMENT_EXPIRY_SECONDS)) - 1;
+    if (deadline <= expiredTick)
+        return expiredCommitments;
+
+    auto it = std::upper_bound(expiryBuckets.begin(), expiryBuckets.end(),
+                               expiredTick,
+                               [] (int64_t t, const ExpiryBucket & b)
+                               { return t < b.tick; });
+    for (;  it != expiryBuckets.end() && it->tick <= deadline;  ++it)
+        expiredCommitments += it->live;
+    expiredTick = deadline;
+
+    return expiredCommitments;
+}
+
+size_t
+ShadowAccount::
+reclaimExpiredCommitments(Date now, double maxAgeSeconds)
+{
+    int64_t deadline = tickOf(now.plusSeconds(-maxAgeSeconds)) - 1;
+    size_t result = 0;
+
+    while (!expiryBuckets.empty() && expiryBuckets.front().tick <= deadline) {
+        ExpiryBucket & bucket = expiryBuckets.front();
+        for (uint32_t id: bucket.items) {
+            if (bucket.live == 0)
+                break;
+            // detached, or its node reused by a later commitment
+            if (!commitments.live(id) || commitments[id].tick != bucket.tick)
+                continue;
+
+            Amount amountAuthorized = commitments[id].amount;
+            commitments.erase(id);
+            bucket.live--;
+            if (bucket.tick <= expiredTick)
+                expiredCommitments--;
+            detachedBids++;
+            commitDetachedBid(amountAuthorized, Amount(), LineItems());
+            ++result;
         }
+        expiryBuckets.pop_front();
     }
+
+    return result;
+}
+
+void
+ShadowAccount::
+serialize(ML::DB::Store_Writer & store) const
+{
+    store << (unsigned char)0
+          << (int)status
+          << netBudget << commitmentsRetired
+          << commitmentsMade << spent
+          << balance << lineItems;
+}
+
+void
+ShadowAccount::
+reconstitute(ML::DB::Store_Reader & store)
+{
+    unsigned char version;
+    store >> version;
+    if (version != 0)
+        throw ML::Exception("error reconstituting shadow account");
+    int st;
+    store >> st;
+    status = (Account::Status)st;
+    store >> netBudget >> commitmentsRetired
+          >> commitmentsMade >> spent
+          >> balance >> lineItems;
 }
 
 std::ostream &
@@ -256,9 +408,10 @@ operator << (std::ostream & stream, const ShadowAccount & account)
 
     auto addCurrencies = [&] (const CurrencyPool & c)
         {
-            for (auto a: c.currencyAmounts) {
-                if (a) currencies.insert(a.currencyCode);
-            }
+            c.forEach([&] (const Amount & a)
+                {
+                    if (a) currencies.insert(a.currencyCode);
+                });
         };
 
     addCurrencies(account.netBudget);
@@ -353,33 +506,378 @@ logBidEvents()
     }
 }
 
+size_t
+ShadowAccounts::
+reclaimExpiredCommitments(double maxAgeSeconds)
+{
+    Date now = Date::now();
+    size_t result = 0;
+    for (auto & it: accounts)
+        result += it.second.reclaimExpiredCommitments(now, maxAgeSeconds);
+    return result;
+}
+
 /*****************************************************************************/
 /* ACCOUNTS                                                                  */
 /*****************************************************************************/
 
+// push_back() binds it to a reference, it needs a definition
+const uint32_t Accounts::AccountColumns::NO_ID;
+
 void
 Accounts::
-ensureInterAccountConsistency()
+serialize(ML::DB::Store_Writer & store) const
 {
+    store << (unsigned char)0
+          << (uint64_t)accounts.size();
+    // parents sort before their children, which is what reconstitute needs
     for (const auto & it: accounts) {
-        if (it.first.size() == 1) {
-            if (!checkBudgetConsistencyImpl(it.first, -1, 0)) {
-                // cerr << "budget of account " << it.first
-                //      << " is not consistent\n";
-                inconsistentAccounts.insert(it.first);
-            }
-            CurrencyPool recycledInUp, recycledOutUp, nullPool;
-            getRecycledUp(it.first, recycledInUp, recycledOutUp);            
-            if (recycledInUp != nullPool) {
-                cerr << "upward recycledIn of account " << it.first
-                     << " is not null: " << recycledInUp
-                     << "\n";
-            }
-            if (recycledOutUp != nullPool) {
-                cerr << "upward recycledOut of account " << it.first
-                     << " is not null: " << recycledOutUp
-                     << "\n";
-            }
+        store << it.first.toString()
+              << static_cast<const Account &>(it.second)
+              << it.second.initialSpent;
+    }
+
+    store << (uint64_t)outOfSyncAccounts.size();
+    for (const auto & key: outOfSyncAccounts)
+        store << key.toString();
+}
+
+void
+Accounts::
+reconstitute(ML::DB::Store_Reader & store)
+{
+    unsigned char version;
+    store >> version;
+    if (version != 0)
+        throw ML::Exception("error reconstituting accounts");
+
+    accounts.clear();
+    clearIndex();
+    outOfSyncAccounts.clear();
+    inconsistentAccounts.clear();
+
+    uint64_t n;
+    store >> n;
+    for (uint64_t i = 0;  i < n;  ++i) {
+        std::string key;
+        Account account;
+        CurrencyPool initialSpent;
+        store >> key >> account >> initialSpent;
+        AccountInfo & info = ensureAccount(AccountKey(key), account.type);
+        static_cast<Account &>(info) = account;
+        info.initialSpent = initialSpent;
+        accountChanged(AccountKey(key));
+    }
+
+    store >> n;
+    for (uint64_t i = 0;  i < n;  ++i) {
+        std::string key;
+        store >> key;
+        outOfSyncAccounts.insert(AccountKey(key));
+    }
+}
+
+std::vector<Accounts>
+Accounts::
+partition(size_t n,
+          const std::function<size_t (const std::string &)> & partitionOf)
+    const
+{
+    std::vector<Accounts> result(n);
+    for (auto & p: result) {
+        p.sessionStart = sessionStart;
+        p.lastVersion = lastVersion;
+    }
+
+    for (const auto & it: accounts) {
+        Accounts & p = result[partitionOf(it.first[0]) % n];
+        p.accounts.insert(p.accounts.end(), it);
+        if (outOfSyncAccounts.count(it.first))
+            p.outOfSyncAccounts.insert(it.first);
+        if (inconsistentAccounts.count(it.first))
+            p.inconsistentAccounts.insert(it.first);
+    }
+
+    for (auto & p: result)
+        p.rebuildIndex();
+
+    return result;
+}
+
+void
+Accounts::
+merge(const Accounts & other)
+{
+    for (const auto & it: other.accounts) {
+        if (it.first.size() == 1 && accounts.count(it.first))
+            throw ML::Exception("merging account " + it.first.toString()
+                                + " which is already present");
+        accounts.insert(it);
+    }
+    uint64_t otherVersion = other.lastVersion->load();
+    uint64_t version = lastVersion->load();
+    while (version < otherVersion
+           && !lastVersion->compare_exchange_weak(version, otherVersion))
+        ;
+    outOfSyncAccounts.insert(other.outOfSyncAccounts.begin(),
+                             other.outOfSyncAccounts.end());
+    inconsistentAccounts.insert(other.inconsistentAccounts.begin(),
+                                other.inconsistentAccounts.end());
+    rebuildIndex();
+}
+
+void
+Accounts::
+clearIndex()
+{
+    registry.clear();
+    byId.clear();
+    columns.clear();
+    // the logged ids are no longer valid
+    changeLog.reset(lastVersion->load());
+}
+
+size_t
+Accounts::
+evictClosedAccounts(Datacratic::Date closedBefore, uint64_t savedVersion)
+{
+    size_t result = 0;
+
+    auto evictable = [&] (uint32_t id)
+        {
+            return columns.status[id] == Account::CLOSED && byId[id]
+                && columns.firstChild[id] == AccountColumns::NO_ID
+                && columns.version[id] <= savedVersion
+                && byId[id]->closedAt < closedBefore;
+        };
+
+    // only the closed accounts are looked at past their status
+    const size_t n = columns.size();
+    for (uint32_t first = 0;  first < n;  ++first) {
+        // a parent left without children can go right after them
+        for (uint32_t id = first;  id != AccountColumns::NO_ID
+                 && evictable(id);) {
+            auto it = accounts.find(registry.key(id));
+            if (outOfSyncAccounts.count(it->first))
+                break;
+            uint32_t parentId = evictOne(it);
+            ++result;
+            id = parentId;
+        }
+    }
+
+    return result;
+}
+
+uint32_t
+Accounts::
+evictOne(AccountMap::iterator it)
+{
+    AccountInfo & info = it->second;
+    uint32_t id = info.id;
+
+    // the parent no longer counts the account in its totals
+    uint32_t parentId = columns.parent[id];
+    if (parentId != AccountColumns::NO_ID) {
+        for (uint32_t p = parentId;  p != AccountColumns::NO_ID;
+             p = columns.parent[p])
+            byId[p]->subtree = byId[p]->subtree - info.subtree;
+        newVersion(parentId);
+
+        uint32_t * link = &columns.firstChild[parentId];
+        while (*link != id)
+            link = &columns.nextSibling[*link];
+        *link = columns.nextSibling[id];
+    }
+
+    registry.erase(id);
+    byId[id] = nullptr;
+    columns.parent[id] = AccountColumns::NO_ID;
+    inconsistentAccounts.erase(it->first);
+    evictedAccounts.insert(it->first);
+    accounts.erase(it);
+    return parentId;
+}
+
+std::vector<AccountKey>
+Accounts::
+getEvictedPrefixes(const AccountKey & accountKey) const
+{
+    std::vector<AccountKey> result;
+    if (evictedAccounts.empty())
+        return result;
+
+    for (size_t i = 1;  i <= accountKey.size();  ++i) {
+        AccountKey prefix(std::vector<std::string>(accountKey.begin(),
+                                                   accountKey.begin() + i));
+        if (evictedAccounts.count(prefix))
+            result.push_back(prefix);
+    }
+    return result;
+}
+
+void
+Accounts::
+restoreEvictedAccount(const AccountKey & accountKey,
+                      const Json::Value & jsonValue)
+{
+    if (!evictedAccounts.erase(accountKey) || jsonValue.isNull())
+        return;
+
+    restoreAccount(accountKey, jsonValue);
+    AccountInfo & info = getAccountImpl(accountKey);
+    setStatus(info, Account::fromJson(jsonValue).status);
+    accountChanged(info);
+}
+
+void
+Accounts::
+enableChangeLog(size_t size)
+{
+    changeLog.size = size;
+    changeLog.reset(lastVersion->load());
+}
+
+bool
+Accounts::
+getChangesSince(uint64_t since, std::vector<AccountKey> & keys,
+                uint64_t & upTo) const
+{
+    upTo = lastVersion->load();
+    keys.clear();
+    if (changeLog.dropped > since)
+        return false;
+
+    // newest first, keeping the last change of every account
+    const auto & entries = changeLog.entries;
+    std::vector<uint32_t> ids;
+    std::unordered_set<uint32_t> seen;
+    for (size_t n = 0;  n < entries.size();  ++n) {
+        size_t i = (changeLog.next + entries.size() - 1 - n) % entries.size();
+        if (entries[i].first <= since)
+            break;
+        if (seen.insert(entries[i].second).second)
+            ids.push_back(entries[i].second);
+    }
+    // an evicted account is no longer listed, its id may be another's
+    for (auto it = ids.rbegin();  it != ids.rend();  ++it) {
+        if (byId[*it])
+            keys.push_back(registry.key(*it));
+    }
+    return true;
+}
+
+void
+Accounts::
+rebuildIndex()
+{
+    clearIndex();
+    // parents sort before their children so they already have their id
+    for (auto & it: accounts) {
+        AccountInfo & info = it.second;
+        uint32_t parentId = AccountRegistry::NO_ID;
+        if (it.first.size() > 1)
+            parentId = registry.find(it.first.parent());
+        addToIndex(it.first, parentId, info);
+    }
+}
+
+void
+Accounts::
+addToIndex(const AccountKey & key, uint32_t parentId, AccountInfo & info)
+{
+    info.id = registry.insert(key, parentId);
+    columns.add(info.id, parentId);
+    if (info.id == byId.size())
+        byId.push_back(&info);
+    else byId[info.id] = &info;
+    columns.update(info.id, info, info.version);
+}
+
+void
+Accounts::
+ensureInterAccountConsistency()
+{
+    /* The allocatedOut of every account must be the sum of the budget
+       increases of its children, and what the accounts of a tree recycle
+       up and down must cancel out at its top.  Both are added up into the
+       parents in one pass over the columns, children first. */
+    enum { NUM_SLOTS = AccountColumns::NUM_SLOTS };
+    const size_t n = columns.size();
+
+    // the accounts of every tree, top first then depth first
+    std::vector<uint32_t> order, roots;
+    order.reserve(n);
+    for (uint32_t id = 0;  id < n;  ++id) {
+        if (columns.parent[id] != AccountColumns::NO_ID || !byId[id])
+            continue;
+        roots.push_back(id);
+        size_t begin = order.size();
+        order.push_back(id);
+        for (size_t i = begin;  i < order.size();  ++i) {
+            for (uint32_t child = columns.firstChild[order[i]];
+                 child != AccountColumns::NO_ID;
+                 child = columns.nextSibling[child])
+                order.push_back(child);
+        }
+    }
+
+    std::vector<int64_t> childBudget(n * NUM_SLOTS);
+    std::vector<int64_t> inUp(n * NUM_SLOTS);
+    std::vector<int64_t> outUp(n * NUM_SLOTS);
+    std::vector<uint8_t> budgetOk(n, 1), overflow(n, 0);
+    for (size_t i = order.size();  i-- > 0;) {
+        uint32_t id = order[i];
+        int64_t * in = &inUp[id * NUM_SLOTS];
+        int64_t * out = &outUp[id * NUM_SLOTS];
+        for (unsigned s = 0;  s < NUM_SLOTS;  ++s) {
+            budgetOk[id] &= columns.allocatedOut[s][id]
+                         == childBudget[id * NUM_SLOTS + s];
+            // the children already took their own children's share off
+            in[s] += columns.recycledIn[s][id];
+            out[s] += columns.recycledOut[s][id];
+        }
+        overflow[id] |= columns.overflow[id];
+
+        uint32_t parent = columns.parent[id];
+        if (parent == AccountColumns::NO_ID)
+            continue;
+        budgetOk[parent] &= budgetOk[id];
+        overflow[parent] |= overflow[id];
+        for (unsigned s = 0;  s < NUM_SLOTS;  ++s) {
+            childBudget[parent * NUM_SLOTS + s]
+                += columns.budgetIncreases[s][id];
+            inUp[parent * NUM_SLOTS + s] -= out[s];
+            outUp[parent * NUM_SLOTS + s] -= in[s];
+        }
+    }
+
+    for (uint32_t id: roots) {
+        bool recycledOk = true;
+        for (unsigned s = 0;  s < NUM_SLOTS;  ++s)
+            recycledOk &= inUp[id * NUM_SLOTS + s] == 0
+                       && outUp[id * NUM_SLOTS + s] == 0;
+        if (budgetOk[id] && recycledOk && !overflow[id])
+            continue;
+
+        // walked again through the map, for the report
+        AccountKey key = registry.key(id);
+        if (!checkBudgetConsistencyImpl(key, -1, 0)) {
+            // cerr << "budget of account " << key
+            //      << " is not consistent\n";
+            inconsistentAccounts.insert(key);
+        }
+        CurrencyPool recycledInUp, recycledOutUp, nullPool;
+        getRecycledUp(key, recycledInUp, recycledOutUp);            
+        if (recycledInUp != nullPool) {
+            cerr << "upward recycledIn of account " << key
+                 << " is not null: " << recycledInUp
+                 << "\n";
+        }
+        if (recycledOutUp != nullPool) {
+            cerr << "upward recycledOut of account " << key
+                 << " is not null: " << recycledOutUp
+                 << "\n";
         }
     }
 }
@@ -403,7 +901,8 @@ checkBudgetConsistencyImpl(const AccountKey & accountKey, int maxRecursion,
     const AccountInfo & account = getAccountImpl(accountKey);
     CurrencyPool sumBudgetInc;
 
-    for (const AccountKey & childKey: account.children) {
+    std::vector<AccountKey> childKeys = getChildKeys(account);
+    for (const AccountKey & childKey: childKeys) {
         const Account & childAccount = getAccountImpl(childKey);
         sumBudgetInc += childAccount.budgetIncreases;
     }
@@ -420,7 +919,7 @@ checkBudgetConsistencyImpl(const AccountKey & accountKey, int maxRecursion,
     }
 
     if (maxRecursion == -1 || level < maxRecursion) {
-        for (const AccountKey & childKey: account.children) {
+        for (const AccountKey & childKey: childKeys) {
             if (!checkBudgetConsistencyImpl(childKey,
                                             maxRecursion, level + 1))
                 return false;
@@ -441,7 +940,7 @@ getRecycledUp(const AccountKey & accountKey,
  
     const AccountInfo & account = getAccountImpl(accountKey);
  
-    for (const AccountKey & childKey: account.children) {
+    for (const AccountKey & childKey: getChildKeys(account)) {
         CurrencyPool subRecycledIn, subRecycledOut;
         getRecycledUp(childKey, subRecycledIn, subRecycledOut);
         sumSubRecycledIn += subRecycledIn;
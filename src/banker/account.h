@@ -8,15 +8,19 @@
 
 #include <string>
 #include <vector>
+#include <deque>
 #include <unordered_map>
 #include <memory>
 #include <unordered_set>
 #include "currency.h"
 #include "account_key.h"
+#include "account_registry.h"
+#include "commitment_table.h"
 #include "soa/types/date.h"
 #include "jml/utils/string_functions.h"
 #include <mutex>
 #include <thread>
+#include <atomic>
 #include "jml/arch/spinlock.h"
 
 namespace Datacratic {
@@ -426,8 +430,13 @@ public:
 
         checkInvariants("recuperateTo");
     }
+
+    void serialize(ML::DB::Store_Writer & store) const;
+    void reconstitute(ML::DB::Store_Reader & store);
 };
 
+IMPL_SERIALIZE_RECONSTITUTE(Account);
+
 
 /*****************************************************************************/
 /* SHADOW ACCOUNT                                                            */
@@ -440,7 +449,8 @@ public:
 
 struct ShadowAccount {
     ShadowAccount()
-        : status(Account::ACTIVE), attachedBids(0), detachedBids(0)
+        : status(Account::ACTIVE), expiredTick(0), expiredCommitments(0),
+          attachedBids(0), detachedBids(0), lastExpiredCommitments(0)
         {}
 
     Account::Status status;
@@ -457,17 +467,50 @@ struct ShadowAccount {
 
     LineItems lineItems;  ///< Line items for spend
 
-    struct Commitment {
-        Commitment(Amount amount, Date timestamp)
-            : amount(amount), timestamp(timestamp)
+    typedef RTBKIT::Commitment Commitment;
+
+    CommitmentTable commitments;
+
+    /** Pending commitments bucketed by the second they were made in, oldest
+        first, so that expiring them only looks at the buckets that went
+        past the deadline instead of at every commitment.  Detaching a bid
+        just decrements the count of its bucket; its node id stays in the
+        bucket until the bucket empties or is reclaimed.
+    */
+    struct ExpiryBucket {
+        ExpiryBucket(int64_t tick)
+            : tick(tick), live(0)
         {
         }
 
-        Amount amount;   ///< Amount the commitment is for
-        Date timestamp;  ///< When the commitment was made
+        int64_t tick;
+        uint32_t live;                   ///< commitments still pending
+        std::vector<uint32_t> items;     ///< includes detached ones
     };
 
-    std::unordered_map<std::string, Commitment> commitments; 
+    std::deque<ExpiryBucket> expiryBuckets;
+    int64_t expiredTick;          ///< buckets up to this one are expired
+    uint32_t expiredCommitments;  ///< pending commitments in those
+
+    static int64_t tickOf(Date date)
+    {
+        return (int64_t)date.secondsSinceEpoch();
+    }
+
+    /** Bring expiredCommitments up to date, only visiting the buckets
+        that expired since the last call.  A bucket expires once all of
+        the commitments in it are older than 15 seconds, so the count lags
+        by at most a second.
+    */
+    uint32_t countExpiredCommitments(Date now);
+
+    /** Cancel the commitments older than maxAgeSeconds, whose win or loss
+        will never be heard of, and give their amounts back to the
+        balance.  Only the buckets being reclaimed are visited.
+
+        Returns the number of commitments cancelled.
+    */
+    size_t reclaimExpiredCommitments(Date now, double maxAgeSeconds);
 
     void checkInvariants() const
     {
@@ -610,12 +653,13 @@ struct ShadowAccount {
     {
         checkInvariants();
 
-        auto cit = commitments.find(item);
-        if (cit == commitments.end())
+        uint32_t id = commitments.find(item);
+        if (id == CommitmentTable::NO_ID)
             throw ML::Exception("unknown commitment being committed");
 
-        Amount amountAuthorized = cit->second.amount;
-        commitments.erase(cit);
+        Amount amountAuthorized = commitments[id].amount;
+        unindexCommitment(commitments[id].tick);
+        commitments.erase(id);
 
         checkInvariants();
 
@@ -628,12 +672,16 @@ struct ShadowAccount {
                    Amount amount)
     {
         Date now = Date::now();
-        auto c = commitments.insert(make_pair(item, Commitment(amount, now)));
+        auto c = commitments.insert(item, Commitment(amount, now));
         if (!c.second)
             throw ML::Exception("attempt to re-open commitment");
+        indexCommitment(c.first);
         attachedBids++;
     }
 
+    void indexCommitment(uint32_t id);
+    void unindexCommitment(int64_t tick);
+
     /*************************************************************************/
     /* SYNCHRONIZATION                                                       */
     /*************************************************************************/
@@ -719,8 +767,16 @@ struct ShadowAccount {
     uint32_t lastExpiredCommitments;
 
     void logBidEvents(const std::string & accountKey);
+
+    /** Binary form of the state synced to the master; pending commitments
+        and the logging counters are local to the slave and not included.
+    */
+    void serialize(ML::DB::Store_Writer & store) const;
+    void reconstitute(ML::DB::Store_Reader & store);
 };
 
+IMPL_SERIALIZE_RECONSTITUTE(ShadowAccount);
+
 
 /*****************************************************************************/
 /* ACCOUNT SUMMARY                                                           */
@@ -831,17 +887,216 @@ operator << (std::ostream & stream, const AccountSummary & summary)
 
 struct Accounts {
     Accounts()
-        : sessionStart(Datacratic::Date::now())
+        : sessionStart(Datacratic::Date::now()),
+          lastVersion(std::make_shared<std::atomic<uint64_t>>(0))
+    {
+    }
+
+    /* the index points into the map, so it is rebuilt on copies */
+    Accounts(const Accounts & other)
+        : sessionStart(other.sessionStart),
+          lastVersion(other.lastVersion),
+          accounts(other.accounts),
+          outOfSyncAccounts(other.outOfSyncAccounts),
+          inconsistentAccounts(other.inconsistentAccounts)
+    {
+        rebuildIndex();
+    }
+
+    Accounts & operator = (const Accounts & other)
     {
+        if (this != &other) {
+            sessionStart = other.sessionStart;
+            lastVersion = other.lastVersion;
+            accounts = other.accounts;
+            outOfSyncAccounts = other.outOfSyncAccounts;
+            inconsistentAccounts = other.inconsistentAccounts;
+            rebuildIndex();
+        }
+        return *this;
     }
 
+    Accounts(Accounts && other) = default;
+    Accounts & operator = (Accounts && other) = default;
+
     Datacratic::Date sessionStart;
 
+    /** Last account version given out, see AccountInfo::version.  It is
+        shared with the copies and partitions of these accounts so that
+        versions are ordered across all of them.
+    */
+    std::shared_ptr<std::atomic<uint64_t>> lastVersion;
+
+    /** The amounts of an account that roll up into the summaries of its
+        parents.
+    */
+    struct SummaryTotals {
+        CurrencyPool effectiveBudget;
+        CurrencyPool inFlight;
+        CurrencyPool spent;
+        CurrencyPool adjustments;
+
+        static SummaryTotals of(const Account & a)
+        {
+            SummaryTotals result;
+            result.effectiveBudget = a.budgetIncreases - a.budgetDecreases
+                + a.recycledIn - a.recycledOut
+                + a.allocatedIn - a.allocatedOut;
+            result.inFlight = a.commitmentsMade - a.commitmentsRetired;
+            result.spent = a.spent;
+            result.adjustments = a.adjustmentsIn - a.adjustmentsOut;
+            return result;
+        }
+
+        SummaryTotals & operator += (const SummaryTotals & other)
+        {
+            effectiveBudget += other.effectiveBudget;
+            inFlight += other.inFlight;
+            spent += other.spent;
+            adjustments += other.adjustments;
+            return *this;
+        }
+
+        SummaryTotals operator - (const SummaryTotals & other) const
+        {
+            SummaryTotals result;
+            result.effectiveBudget = effectiveBudget - other.effectiveBudget;
+            result.inFlight = inFlight - other.inFlight;
+            result.spent = spent - other.spent;
+            result.adjustments = adjustments - other.adjustments;
+            return result;
+        }
+    };
+
+    /** Structure-of-arrays copy of the fields of every account that the
+        bulk scans read, indexed by a dense account id, so that they walk
+        contiguous columns instead of the map and its large AccountInfo
+        nodes : the status for the active listing and the eviction, the
+        version for the dirty checks of the dumps and the amounts checked
+        by ensureInterAccountConsistency.  The tree is mirrored as parent
+        / first child / next sibling id links, which the subtree totals
+        and versions follow up to the root.  Ids are the ones given by the
+        AccountRegistry, which holds the keys.
+
+        Amounts are kept per CurrencyPool slot.  An account with amounts
+        in a currency without a slot is flagged in overflow, and the
+        scans read it from the map instead.
+    */
+    struct AccountColumns {
+        static const uint32_t NO_ID = AccountRegistry::NO_ID;
+        enum { NUM_SLOTS = CurrencyPool::NUM_SLOTS };
+
+        std::vector<uint8_t> status;       ///< Account::Status
+        std::vector<uint8_t> overflow;     ///< amounts not all in slots
+        std::vector<uint64_t> version;     ///< AccountInfo::version
+        std::vector<uint32_t> parent;
+        std::vector<uint32_t> firstChild;
+        std::vector<uint32_t> nextSibling;
+
+        std::vector<int64_t> budgetIncreases[NUM_SLOTS];
+        std::vector<int64_t> allocatedOut[NUM_SLOTS];
+        std::vector<int64_t> recycledIn[NUM_SLOTS];
+        std::vector<int64_t> recycledOut[NUM_SLOTS];
+
+        size_t size() const
+        {
+            return parent.size();
+        }
+
+        void clear()
+        {
+            status.clear();
+            overflow.clear();
+            version.clear();
+            parent.clear();
+            firstChild.clear();
+            nextSibling.clear();
+            for (unsigned s = 0;  s < NUM_SLOTS;  ++s) {
+                budgetIncreases[s].clear();
+                allocatedOut[s].clear();
+                recycledIn[s].clear();
+                recycledOut[s].clear();
+            }
+        }
+
+        /** Columns of a new account, id being past the end or one an
+            evicted account left.
+        */
+        void add(uint32_t id, uint32_t parentId)
+        {
+            if (id == size()) {
+                status.push_back(0);
+                overflow.push_back(0);
+                version.push_back(0);
+                parent.push_back(NO_ID);
+                firstChild.push_back(NO_ID);
+                nextSibling.push_back(NO_ID);
+                for (unsigned s = 0;  s < NUM_SLOTS;  ++s) {
+                    budgetIncreases[s].push_back(0);
+                    allocatedOut[s].push_back(0);
+                    recycledIn[s].push_back(0);
+                    recycledOut[s].push_back(0);
+                }
+            }
+            status[id] = Account::ACTIVE;
+            overflow[id] = 0;
+            version[id] = 0;
+            parent[id] = parentId;
+            firstChild[id] = NO_ID;
+            nextSibling[id] = NO_ID;
+            if (parentId != NO_ID) {
+                nextSibling[id] = firstChild[parentId];
+                firstChild[parentId] = id;
+            }
+            for (unsigned s = 0;  s < NUM_SLOTS;  ++s) {
+                budgetIncreases[s][id] = 0;
+                allocatedOut[s][id] = 0;
+                recycledIn[s][id] = 0;
+                recycledOut[s][id] = 0;
+            }
+        }
+
+        void update(uint32_t id, const Account & account, uint64_t v)
+        {
+            status[id] = account.status;
+            version[id] = v;
+            overflow[id] = !account.budgetIncreases.overflow.empty()
+                || !account.allocatedOut.overflow.empty()
+                || !account.recycledIn.overflow.empty()
+                || !account.recycledOut.overflow.empty();
+            for (unsigned s = 0;  s < NUM_SLOTS;  ++s) {
+                budgetIncreases[s][id] = account.budgetIncreases.slots[s];
+                allocatedOut[s][id] = account.allocatedOut.slots[s];
+                recycledIn[s][id] = account.recycledIn.slots[s];
+                recycledOut[s][id] = account.recycledOut.slots[s];
+            }
+        }
+    };
+
     struct AccountInfo: public Account {
-        std::set<AccountKey> children;
+        AccountInfo()
+            : id(AccountColumns::NO_ID), version(0)
+        {
+        }
+
+        /* id of the account in the registry and the columns */
+        uint32_t id;
+
+        /* raised whenever the account or one of its descendants changes,
+           so it identifies the state of the whole subtree */
+        uint64_t version;
+
+        /* when the account was last closed */
+        Datacratic::Date closedAt;
 
         /* spend tracking across sessions */
         CurrencyPool initialSpent;
+
+        /* totals of the account alone and of its whole subtree, kept up
+           to date by accountChanged so that summaries are not recomputed
+           recursively */
+        SummaryTotals own;
+        SummaryTotals subtree;
     };
 
     const Account createAccount(const AccountKey & account,
@@ -879,13 +1134,14 @@ struct Accounts {
         newAccount.lineItems = validAccount.lineItems;
         newAccount.adjustmentLineItems = validAccount.adjustmentLineItems;
         newAccount.status = Account::ACTIVE;
+        accountChanged(accountKey);
     }
 
     void reactivateAccount(const AccountKey & accountKey)
     {
         AccountKey parents = accountKey;
         while (!parents.empty()) {
-            getAccountImpl(parents).status = Account::ACTIVE;
+            setStatus(getAccountImpl(parents), Account::ACTIVE);
             parents.pop_back();
         }
         reactivateAccountChildren(accountKey);
@@ -924,6 +1180,31 @@ struct Accounts {
         return closeAccountImpl(account);
     }
 
+    /** Drops from memory the closed accounts that were closed before a
+        given date and have no child left, as if they had never been
+        loaded: they no longer count in the summaries of their parents
+        until they are restored.  Only the accounts whose version is at
+        most savedVersion, the last one a successful dump wrote, go as
+        the others may not be archived yet.  Accounts out of sync are
+        kept.  Returns the number of accounts dropped.
+    */
+    size_t evictClosedAccounts(Datacratic::Date closedBefore,
+                               uint64_t savedVersion = (uint64_t)-1);
+
+    /** Key and ancestors of an account that evictClosedAccounts dropped,
+        from the top, which must be restored with restoreEvictedAccount
+        before the account is used.  Empty when none of them was evicted.
+    */
+    std::vector<AccountKey>
+    getEvictedPrefixes(const AccountKey & accountKey) const;
+
+    /** Brings back an evicted account as it was archived, into the
+        summaries of its parents.  A null value only forgets it was
+        evicted, for an account the archive no longer has.
+    */
+    void restoreEvictedAccount(const AccountKey & accountKey,
+                               const Json::Value & jsonValue);
+
     void checkInvariants() const
     {
         for (auto & a: accounts) {
@@ -960,6 +1241,7 @@ struct Accounts {
             throw ML::Exception("can't setBudget except at top level");
         auto & a = ensureAccount(topLevelAccount, AT_BUDGET);
         a.setBudget(newBudget);
+        accountChanged(topLevelAccount);
         return a;
     }
 
@@ -973,9 +1255,11 @@ struct Accounts {
                              CurrencyPool amount,
                              AccountType typeToCreate)
     {
-        if (typeToCreate != AT_NONE && !accounts.count(account)) {
+        if (typeToCreate != AT_NONE && !findAccountImpl(account)) {
             auto & a = ensureAccount(account, typeToCreate);
             a.setBalance(getParentAccount(account), amount);
+            accountChanged(account);
+            accountChanged(account.parent());
             return a;
         }
         else {
@@ -990,16 +1274,18 @@ struct Accounts {
 #endif
 
             a.setBalance(getParentAccount(account), amount);
+            accountChanged(account);
+            accountChanged(account.parent());
             return a;
         }
     }
 
     const CurrencyPool getBalance(const AccountKey & account) const
     {
-        auto it = accounts.find(account);
-        if (it == accounts.end())
+        const AccountInfo * info = findAccountImpl(account);
+        if (!info)
             return CurrencyPool();
-        return it->second.balance;
+        return info->balance;
     }
 
     const Account addAdjustment(const AccountKey & account,
@@ -1007,6 +1293,7 @@ struct Accounts {
     {
         auto & a = getAccountImpl(account);
         a.addAdjustment(amount);
+        accountChanged(account);
 
         return a;
     }
@@ -1024,12 +1311,14 @@ struct Accounts {
     void recuperate(const AccountKey & account)
     {
         getAccountImpl(account).recuperateTo(getParentAccount(account));
+        accountChanged(account);
+        accountChanged(account.parent());
     }
 
     AccountSummary getAccountSummary(const AccountKey & account,
                                      int maxDepth = -1) const
     {
-        return getAccountSummaryImpl(account, 0, maxDepth);
+        return getAccountSummaryImpl(getAccountImpl(account).id, 0, maxDepth);
     }
 
     Json::Value
@@ -1038,9 +1327,14 @@ struct Accounts {
     {
         Json::Value summaries;
 
+        // sub-accounts are not part of the simplified output
+        if (simplified)
+            maxDepth = 0;
+
         for (const auto & it: accounts) {
             const AccountKey & key = it.first;
-            AccountSummary summary = getAccountSummaryImpl(key, 0, maxDepth);
+            AccountSummary summary
+                = getAccountSummaryImpl(it.second.id, 0, maxDepth);
             summaries[key.toString()] = summary.toJson(simplified);
         }
 
@@ -1052,6 +1346,7 @@ struct Accounts {
     {
         auto & a = getAccountImpl(account);
         a.importSpend(amount);
+        accountChanged(account);
         return a;
     }
                       
@@ -1073,10 +1368,12 @@ struct Accounts {
         // In the case that an account was added and the banker crashed
         // before it could be written to persistent storage, we need to
         // create the empty account here.
-        if (!accounts.count(account))
-            return shadow.syncToMaster(ensureAccount(account, AT_SPEND));
-        
-        return shadow.syncToMaster(getAccountImpl(account));
+        AccountInfo & a = findAccountImpl(account)
+            ? getAccountImpl(account)
+            : ensureAccount(account, AT_SPEND);
+        const Account result = shadow.syncToMaster(a);
+        accountChanged(a);
+        return result;
     }
 
     /* "Out of sync" here means that the in-memory version of the relevant
@@ -1112,6 +1409,26 @@ struct Accounts {
     bool checkBudgetConsistency(const AccountKey & accountKey,
                                 int maxRecursion = -1) const;
 
+    /** Binary form of the whole account tree, used for local snapshots.
+        Children are rebuilt on reconstitution and the inconsistent
+        accounts need to be recomputed with ensureInterAccountConsistency.
+    */
+    void serialize(ML::DB::Store_Writer & store) const;
+    void reconstitute(ML::DB::Store_Reader & store);
+
+    /** Splits the accounts in n sets by top level account, every tree
+        ending up whole in the set given by partitionOf.
+    */
+    std::vector<Accounts>
+    partition(size_t n,
+              const std::function<size_t (const std::string &)> & partitionOf)
+        const;
+
+    /** Adds the accounts of another partition. None of its top level
+        accounts can already be present here.
+    */
+    void merge(const Accounts & other);
+
     /* Returns the amounts in recycledIn and recycledOut that were transferred
      * strictly from and to the parent account. */
     void getRecycledUp(const AccountKey & accountKey,
@@ -1120,6 +1437,7 @@ struct Accounts {
 
 private:
     friend class ShadowAccounts;
+    friend class ConcurrentShadowAccounts;
 
     typedef std::map<AccountKey, AccountInfo> AccountMap;
     AccountMap accounts;
@@ -1128,7 +1446,145 @@ private:
     AccountSet outOfSyncAccounts;
     AccountSet inconsistentAccounts;
 
+    /* dropped by evictClosedAccounts and still archived, not copied : a
+       copy of the accounts is only saved, never restored into */
+    AccountSet evictedAccounts;
+
+    /* index over the map: key to id, id to account and the columns */
+    AccountRegistry registry;
+    std::vector<AccountInfo *> byId;
+    AccountColumns columns;
+
+    /* ring of the last changes as (version, account id) */
+    struct ChangeLog {
+        ChangeLog()
+            : size(0), next(0), dropped(0)
+        {
+        }
+
+        std::vector<std::pair<uint64_t, uint32_t> > entries;
+        size_t size;        ///< 0 when disabled
+        size_t next;        ///< where the next change goes once full
+        uint64_t dropped;   ///< last version no longer in the log
+
+        void add(uint64_t version, uint32_t id)
+        {
+            if (entries.size() < size) {
+                entries.push_back(std::make_pair(version, id));
+                return;
+            }
+            dropped = entries[next].first;
+            entries[next] = std::make_pair(version, id);
+            next = (next + 1) % size;
+        }
+
+        void reset(uint64_t version)
+        {
+            entries.clear();
+            next = 0;
+            dropped = version;
+        }
+    };
+    ChangeLog changeLog;
+
+    void clearIndex();
+
+    /** Reassigns the ids and rebuilds the index from the map, for when
+        accounts were copied in wholesale from another Accounts.
+    */
+    void rebuildIndex();
+
+    /** Registers the account and fills its columns, under an id that may
+        be one an evicted account left.
+    */
+    void addToIndex(const AccountKey & key, uint32_t parentId,
+                    AccountInfo & info);
+
+    /** Drops a closed account without children, returns its parent id. */
+    uint32_t evictOne(AccountMap::iterator it);
+
 public:
+    /** Id of an account from its raw "a:b:c" name, without splitting it,
+        or AccountRegistry::NO_ID if there is no such account.  The
+        ById methods then reach it without another lookup, for the
+        requests on a single account.
+    */
+    uint32_t getAccountId(const std::string & name) const
+    {
+        return registry.find(name);
+    }
+
+    uint64_t getAccountVersionById(uint32_t id) const
+    {
+        return getAccountById(id).version;
+    }
+
+    AccountSummary getAccountSummaryById(uint32_t id,
+                                         int maxDepth = -1) const
+    {
+        return getAccountSummaryImpl(getAccountById(id).id, 0, maxDepth);
+    }
+
+    /** syncFromShadow for an account that exists. */
+    const Account syncFromShadowById(uint32_t id,
+                                     const ShadowAccount & shadow)
+    {
+        AccountInfo & a = getAccountById(id);
+        const Account result = shadow.syncToMaster(a);
+        accountChanged(a);
+        return result;
+    }
+
+    /** Version of the subtree of an account, which changes whenever
+        anything in it does, or 0 if there is no such account.
+    */
+    uint64_t getAccountVersion(const AccountKey & account) const
+    {
+        const AccountInfo * info = findAccountImpl(account);
+        return info ? info->version : 0;
+    }
+
+    /** Starts logging the versions of the accounts that change, keeping
+        the last size changes.  The log is not copied with the accounts
+        and is emptied when the ids are reassigned.
+    */
+    void enableChangeLog(size_t size);
+
+    /** Keys of the accounts that changed after version since, in the
+        order of their last change, with in upTo the last version given
+        out when they were read.  Returns false, and no keys, when the log
+        doesn't go back as far as since.
+    */
+    bool getChangesSince(uint64_t since, std::vector<AccountKey> & keys,
+                         uint64_t & upTo) const;
+
+    const AccountInfo & getAccountById(uint32_t id) const
+    {
+        if (id >= byId.size() || !byId[id])
+            throw ML::Exception("couldn't get account id %d", (int)id);
+        return *byId[id];
+    }
+
+    AccountInfo & getAccountById(uint32_t id)
+    {
+        if (id >= byId.size() || !byId[id])
+            throw ML::Exception("couldn't get account id %d", (int)id);
+        return *byId[id];
+    }
+
+    /** Keys of all the accounts whose status is ACTIVE, in key order. */
+    std::vector<AccountKey> getActiveAccountKeys() const
+    {
+        std::vector<AccountKey> result;
+        const std::vector<uint8_t> & status = columns.status;
+        for (uint32_t id = 0;  id < status.size();  ++id) {
+            if (status[id] == Account::ACTIVE)
+                result.push_back(registry.key(id));
+        }
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
     std::vector<AccountKey>
     getAccountKeys(const AccountKey & prefix = AccountKey(),
                    int maxDepth = -1) const
@@ -1152,12 +1608,36 @@ public:
             onAccount(a.first, a.second);
         }
     }
+
+    /** Calls onAccount for the accounts whose version is greater than
+        since, found from the version column, in no particular order.
+    */
+    void
+    forEachAccountChangedSince(uint64_t since,
+                               const std::function<void (const AccountKey &,
+                                                         const Account &)>
+                               & onAccount) const
+    {
+        const std::vector<uint64_t> & version = columns.version;
+        for (uint32_t id = 0;  id < version.size();  ++id) {
+            if (version[id] > since && byId[id])
+                onAccount(registry.key(id), *byId[id]);
+        }
+    }
                         
     size_t size() const
     {
         return accounts.size();
     }
 
+    /** Number of ids the index holds, those evicted accounts left for
+        reuse included, which is what the columns are sized for.
+    */
+    size_t indexSize() const
+    {
+        return byId.size();
+    }
+
     bool empty() const
     {
         return accounts.empty();
@@ -1170,15 +1650,19 @@ public:
         std::function<void (const AccountKey &, int, int)> doAccount
             = [&] (const AccountKey & key, int depth, int maxDepth)
             {
-                auto it = accounts.find(key);
-                if (it == accounts.end())
+                const AccountInfo * info = findAccountImpl(key);
+                if (!info)
                     return;
-                result.ensureAccount(it->first, it->second.type) = it->second;
+                AccountInfo & copy = result.ensureAccount(key, info->type);
+                uint32_t id = copy.id;
+                copy = *info;
+                copy.id = id;
+                result.columns.update(id, copy, copy.version);
 
                 if (depth >= maxDepth)
                     return;
 
-                for (auto & k: it->second.children)
+                for (auto & k: getChildKeys(*info))
                     doAccount(k, depth + 1, maxDepth);
             };
               
@@ -1194,41 +1678,125 @@ private:
     {
         ExcAssertGreaterEqual(accountKey.size(), 1);
 
-        auto it = accounts.find(accountKey);
-        if (it != accounts.end()) {
-            ExcAssertEqual(it->second.type, type);
-            return it->second;
+        AccountInfo * existing = findAccountImpl(accountKey);
+        if (existing) {
+            ExcAssertEqual(existing->type, type);
+            return *existing;
         }
         else {
+            uint32_t parentId = AccountRegistry::NO_ID;
             if (accountKey.size() == 1) {
                 ExcAssertEqual(type, AT_BUDGET);
             }
             else {
                 AccountInfo & parent
                     = ensureAccount(accountKey.parent(), AT_BUDGET);
-                parent.children.insert(accountKey);
+                parentId = parent.id;
             }
 
             auto & result = accounts[accountKey];
             result.type = type;
+            addToIndex(accountKey, parentId, result);
+            newVersion(result.id);
             return result;
         }
     }
 
+    /** Single hook through which every change to the amounts of an
+        account reaches the subtree totals of the account and of all its
+        ancestors.
+    */
+    void accountChanged(const AccountKey & accountKey)
+    {
+        accountChanged(getAccountImpl(accountKey));
+    }
+
+    void accountChanged(AccountInfo & info)
+    {
+        SummaryTotals now = SummaryTotals::of(info);
+        SummaryTotals delta = now - info.own;
+        info.own = now;
+        info.subtree += delta;
+        uint64_t version = nextVersion(info.id);
+        info.version = version;
+        columns.update(info.id, info, version);
+
+        for (uint32_t id = columns.parent[info.id];
+             id != AccountRegistry::NO_ID;  id = columns.parent[id]) {
+            byId[id]->subtree += delta;
+            byId[id]->version = version;
+            columns.version[id] = version;
+        }
+    }
+
+    /** Gives a new version to an account and its ancestors. */
+    void newVersion(uint32_t id)
+    {
+        uint64_t version = nextVersion(id);
+        for (;  id != AccountRegistry::NO_ID;  id = columns.parent[id]) {
+            byId[id]->version = version;
+            columns.version[id] = version;
+        }
+    }
+
+    /** Takes the next version for a change to an account and logs it. */
+    uint64_t nextVersion(uint32_t id)
+    {
+        uint64_t version
+            = lastVersion->fetch_add(1, std::memory_order_relaxed) + 1;
+        if (changeLog.size)
+            changeLog.add(version, id);
+        return version;
+    }
+
+    void setStatus(AccountInfo & info, Account::Status status)
+    {
+        if (info.status == status)
+            return;
+        if (status == Account::CLOSED)
+            info.closedAt = Datacratic::Date::now();
+        info.status = status;
+        columns.status[info.id] = status;
+        newVersion(info.id);
+    }
+
+    AccountInfo * findAccountImpl(const AccountKey & account)
+    {
+        uint32_t id = registry.find(account);
+        return id == AccountRegistry::NO_ID ? nullptr : byId[id];
+    }
+
+    const AccountInfo * findAccountImpl(const AccountKey & account) const
+    {
+        uint32_t id = registry.find(account);
+        return id == AccountRegistry::NO_ID ? nullptr : byId[id];
+    }
+
+    /** Keys of the direct children of an account, in key order. */
+    std::vector<AccountKey> getChildKeys(const AccountInfo & info) const
+    {
+        std::vector<AccountKey> result;
+        for (uint32_t id = columns.firstChild[info.id];
+             id != AccountRegistry::NO_ID;  id = columns.nextSibling[id])
+            result.push_back(registry.key(id));
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
     AccountInfo & getAccountImpl(const AccountKey & account)
     {
-        auto it = accounts.find(account);
-        if (it == accounts.end())
+        AccountInfo * info = findAccountImpl(account);
+        if (!info)
             throw ML::Exception("couldn't get account: " + account.toString());
-        return it->second;
+        return *info;
     }
 
     std::pair<bool, bool> accountPresentAndActiveImpl(const AccountKey & account) const
     {
-        auto it = accounts.find(account);
-        if (it == accounts.end())
+        const AccountInfo * info = findAccountImpl(account);
+        if (!info)
             return std::make_pair(false, false);
-        if (it->second.status == Account::CLOSED)
+        if (info->status == Account::CLOSED)
             return std::make_pair(true, false);
         else
             return std::make_pair(true, true);
@@ -1241,14 +1809,17 @@ private:
         if (account.status == Account::CLOSED)
             return account;
 
-        for ( AccountKey child : account.children ) {
+        for ( AccountKey child : getChildKeys(account) ) {
             closeAccountImpl(child);
         }
 
-        if (accountKey.size() > 1)
+        if (accountKey.size() > 1) {
             account.recuperateTo(getParentAccount(accountKey));
+            accountChanged(accountKey);
+            accountChanged(accountKey.parent());
+        }
 
-        account.status = Account::CLOSED;
+        setStatus(account, Account::CLOSED);
 
         return account;
     }
@@ -1256,19 +1827,19 @@ private:
     void reactivateAccountChildren(const AccountKey & accountKey) {
         if (accountPresentAndActiveImpl(accountKey).first) {
             AccountInfo & account = getAccountImpl(accountKey);
-            for (auto child : account.children)
+            for (auto child : getChildKeys(account))
                 reactivateAccountChildren(child);
 
-            account.status = Account::ACTIVE;
+            setStatus(account, Account::ACTIVE);
         }
     }
 
     const AccountInfo & getAccountImpl(const AccountKey & account) const
     {
-        auto it = accounts.find(account);
-        if (it == accounts.end())
+        const AccountInfo * info = findAccountImpl(account);
+        if (!info)
             throw ML::Exception("couldn't get account: " + account.toString());
-        return it->second;
+        return *info;
     }
 
     Account & getParentAccount(const AccountKey & accountKey)
@@ -1288,33 +1859,39 @@ private:
                              std::function<void (const AccountKey & key)> cb) const
     {
         auto & info = getAccountImpl(account);
-        for (const AccountKey & ch: info.children)
+        for (const AccountKey & ch: getChildKeys(info))
             cb(ch);
     }
 
-    AccountSummary getAccountSummaryImpl(const AccountKey & account,
+    AccountSummary getAccountSummaryImpl(uint32_t id,
                                          int depth, int maxDepth) const
     {
         AccountSummary result;
 
-        const Account & a = getAccountImpl(account);
+        const AccountInfo & a = *byId[id];
 
         result.account = a;
-        result.spent = a.spent;
         result.budget = a.budgetIncreases - a.budgetDecreases;
-        result.effectiveBudget = a.budgetIncreases - a.budgetDecreases 
-                        + a.recycledIn - a.recycledOut
-                        + a.allocatedIn - a.allocatedOut;
-        result.inFlight = a.commitmentsMade - a.commitmentsRetired;
-        result.adjustments = a.adjustmentsIn - a.adjustmentsOut;
-
-        auto doChildAccount = [&] (const AccountKey & key) {
-            auto childSummary = getAccountSummaryImpl(key, depth + 1,
-                                                      maxDepth);
-            result.addChild(key.back(), childSummary,
-                            maxDepth == -1 || depth < maxDepth);
-        };
-        forEachChildAccount(account, doChildAccount);
+
+        /* The subtree totals of the children already include theirs, so
+           this doesn't descend further unless for output.  They are added
+           up rather than a.subtree read, so that a currency that a child
+           doesn't have a non zero amount of isn't listed, as with the
+           summaries computed from the whole subtree. */
+        SummaryTotals totals = SummaryTotals::of(a);
+        bool descend = maxDepth == -1 || depth < maxDepth;
+        for (uint32_t child = columns.firstChild[id];
+             child != AccountRegistry::NO_ID;
+             child = columns.nextSibling[child]) {
+            totals += byId[child]->subtree;
+            if (descend)
+                result.subAccounts[registry.segment(child)]
+                    = getAccountSummaryImpl(child, depth + 1, maxDepth);
+        }
+        result.effectiveBudget = totals.effectiveBudget;
+        result.inFlight = totals.inFlight;
+        result.spent = totals.spent;
+        result.adjustments = totals.adjustments;
         
         result.adjustedSpent = result.spent - result.adjustments;
 
@@ -1401,8 +1978,10 @@ struct ShadowAccounts {
 
     void syncTo(Accounts & master) const
     {
-        for (auto & a: accounts)
+        for (auto & a: accounts) {
             a.second.syncToMaster(master.getAccountImpl(a.first));
+            master.accountChanged(a.first);
+        }
     }
 
     void syncFrom(const Accounts & master)
@@ -1419,6 +1998,7 @@ struct ShadowAccounts {
     {
         for (auto & a: accounts) {
             a.second.syncToMaster(master.getAccountImpl(a.first));
+            master.accountChanged(a.first);
             a.second.syncFromMaster(master.getAccountImpl(a.first));
         }
     }
@@ -1506,6 +2086,11 @@ struct ShadowAccounts {
 
     void logBidEvents();
 
+    /** Cancel the commitments of every account that are older than
+        maxAgeSeconds; see ShadowAccount::reclaimExpiredCommitments.
+    */
+    size_t reclaimExpiredCommitments(double maxAgeSeconds);
+
 private:
 
     struct AccountEntry : public ShadowAccount {
@@ -0,0 +1,327 @@
+#include "account_json.h"
+
+#include "rapidjson/reader.h"
+#include "soa/jsoncpp/reader.h"
+
+#include <string.h>
+#include <limits>
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+typedef std::pair<std::string, int64_t> CurrencyEntry;
+
+bool by_name(const CurrencyEntry& lhs, const CurrencyEntry& rhs){
+    return lhs.first < rhs.first;
+}
+
+void write_md(MTX::JsonStream& out, const char* object_type){
+    out.key("md", 2);
+    out.begin_object();
+    out.key("objectType", 10);
+    out.value(object_type, strlen(object_type));
+    out.key("version", 7);
+    out.value(1);
+    out.end_object();
+}
+
+void write_pool(MTX::JsonStream& out, const char* name,
+                const RTBKIT::CurrencyPool& pool){
+    out.key(name, strlen(name));
+    MTX::write_json(out, pool);
+}
+
+/*
+SAX handler filling a ShadowAccount. It mirrors what fromJson() does on
+the Json::Value: unknown members are ignored, amounts are converted like
+Json::Value::asInt(), and a member given twice keeps its last value.
+What fromJson() would reject stops the parse, and read_shadow_account()
+then lets fromJson() throw its own error.
+*/
+struct ShadowHandler
+    : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, ShadowHandler>{
+
+    enum Context { TOP, MD, POOL, LINE_ITEMS, SKIP };
+
+    ShadowHandler() : next(TOP), pool(nullptr), version(0){ }
+
+    // the object that starts with the next value
+    Context next;
+    std::vector<Context> contexts;
+
+    std::string key;
+    RTBKIT::CurrencyPool* pool;
+    // amounts of the pool being read, merged when it ends
+    std::vector<std::pair<std::string, int64_t>> amounts;
+
+    std::string object_type;
+    int64_t version;
+
+    RTBKIT::ShadowAccount result;
+
+    Context current() const{
+        return contexts.empty() ? SKIP : contexts.back();
+    }
+
+    bool Key(const char* str, rapidjson::SizeType length, bool){
+        key.assign(str, length);
+        switch(current()){
+            case TOP:
+                next = SKIP;
+                pool = nullptr;
+                if(key == "md"){
+                    next = MD;
+                }else if(key == "lineItems"){
+                    result.lineItems = RTBKIT::LineItems();
+                    next = LINE_ITEMS;
+                }else{
+                    pool = top_level_pool(key);
+                    if(pool){
+                        *pool = RTBKIT::CurrencyPool();
+                        next = POOL;
+                    }
+                }
+                break;
+            case LINE_ITEMS:
+                pool = &result.lineItems[key];
+                *pool = RTBKIT::CurrencyPool();
+                next = POOL;
+                break;
+            default:
+                next = SKIP;
+                break;
+        }
+        return true;
+    }
+
+    RTBKIT::CurrencyPool* top_level_pool(const std::string& name){
+        if(name == "netBudget") return &result.netBudget;
+        if(name == "commitmentsRetired") return &result.commitmentsRetired;
+        if(name == "commitmentsMade") return &result.commitmentsMade;
+        if(name == "spent") return &result.spent;
+        if(name == "balance") return &result.balance;
+        return nullptr;
+    }
+
+    bool StartObject(){
+        contexts.push_back(contexts.empty() ? TOP : next);
+        next = SKIP;
+        return true;
+    }
+
+    bool EndObject(rapidjson::SizeType){
+        if(current() == POOL){
+            for(size_t i = 0; i < amounts.size(); ++i){
+                bool overwritten = false;
+                for(size_t j = i + 1; j < amounts.size() && !overwritten; ++j)
+                    overwritten = amounts[j].first == amounts[i].first;
+                if(!overwritten)
+                    *pool += RTBKIT::Amount(amounts[i].first, amounts[i].second);
+            }
+            amounts.clear();
+        }
+        contexts.pop_back();
+        return true;
+    }
+
+    bool StartArray(){
+        if(contexts.empty())
+            return false;
+        if(current() == POOL || current() == LINE_ITEMS || next == POOL
+                || next == LINE_ITEMS || next == MD)
+            return false;
+        contexts.push_back(SKIP);
+        return true;
+    }
+
+    bool EndArray(rapidjson::SizeType){
+        contexts.pop_back();
+        return true;
+    }
+
+    // a scalar where an object is expected reads as an empty one
+    bool scalar(){
+        return !contexts.empty() && !(current() == TOP && next == MD);
+    }
+
+    bool integer(int64_t v){
+        if(current() == POOL)
+            amounts.push_back(std::make_pair(key, v));
+        else if(current() == MD && key == "version")
+            version = v;
+        return scalar();
+    }
+
+    bool not_integer(){
+        if(current() == POOL || (current() == MD && key == "version"))
+            return false;
+        return scalar();
+    }
+
+    bool Null(){ return integer(0); }
+    bool Bool(bool b){ return integer(b ? 1 : 0); }
+    bool Int(int i){ return integer(i); }
+    bool Uint(unsigned u){ return integer(u); }
+    bool Int64(int64_t i){ return integer(i); }
+
+    bool Uint64(uint64_t u){
+        if(u > (uint64_t)std::numeric_limits<int64_t>::max())
+            return false;
+        return integer(u);
+    }
+
+    bool Double(double d){
+        if(d < (double)std::numeric_limits<int64_t>::min()
+                || d > (double)std::numeric_limits<int64_t>::max())
+            return false;
+        return integer((int64_t)d);
+    }
+
+    bool String(const char* str, rapidjson::SizeType length, bool){
+        if(current() == MD && key == "objectType"){
+            object_type.assign(str, length);
+            return scalar();
+        }
+        return not_integer();
+    }
+};
+
+}
+
+void
+MTX::write_json(JsonStream& out, const RTBKIT::CurrencyPool& pool){
+    // the slots are in currency name order, only overflow currencies
+    // may need sorting
+    std::vector<CurrencyEntry> entries;
+    entries.reserve(pool.size());
+    pool.forEach([&](const RTBKIT::Amount& a){
+        entries.push_back(CurrencyEntry(a.getCurrencyStr(), a.value));
+    });
+    if(!pool.overflow.empty())
+        std::stable_sort(entries.begin(), entries.end(), by_name);
+
+    out.begin_object();
+    for(size_t i = 0; i < entries.size(); ++i){
+        // a duplicate name overwrites the previous entry in toJson()
+        if(i + 1 < entries.size() && entries[i + 1].first == entries[i].first)
+            continue;
+        out.key(entries[i].first);
+        out.value(entries[i].second);
+    }
+    out.end_object();
+}
+
+void
+MTX::write_json(JsonStream& out, const RTBKIT::LineItems& items){
+    out.begin_object();
+    for(auto& e : items.entries){
+        out.key(e.first);
+        write_json(out, e.second);
+    }
+    out.end_object();
+}
+
+void
+MTX::write_json(JsonStream& out, const RTBKIT::Account& account){
+    out.begin_object();
+    out.key("adjustmentLineItems", 19);
+    write_json(out, account.adjustmentLineItems);
+    write_pool(out, "adjustmentsIn", account.adjustmentsIn);
+    write_pool(out, "adjustmentsOut", account.adjustmentsOut);
+    write_pool(out, "allocatedIn", account.allocatedIn);
+    write_pool(out, "allocatedOut", account.allocatedOut);
+    write_pool(out, "budgetDecreases", account.budgetDecreases);
+    write_pool(out, "budgetIncreases", account.budgetIncreases);
+    write_pool(out, "commitmentsMade", account.commitmentsMade);
+    write_pool(out, "commitmentsRetired", account.commitmentsRetired);
+    out.key("lineItems", 9);
+    write_json(out, account.lineItems);
+    write_md(out, "Account");
+    write_pool(out, "recycledIn", account.recycledIn);
+    write_pool(out, "recycledOut", account.recycledOut);
+    write_pool(out, "spent", account.spent);
+    out.key("status", 6);
+    if(account.status == RTBKIT::Account::CLOSED)
+        out.value("closed", 6);
+    else
+        out.value("active", 6);
+    out.key("type", 4);
+    out.value(RTBKIT::AccountTypeToString(account.type));
+    out.end_object();
+}
+
+void
+MTX::write_json(JsonStream& out, const RTBKIT::AccountSummary& summary,
+                bool simplified){
+    out.begin_object();
+    if(!simplified){
+        out.key("account", 7);
+        write_json(out, summary.account);
+    }
+    write_pool(out, "adjustedSpent", summary.adjustedSpent);
+    write_pool(out, "adjustments", summary.adjustments);
+    write_pool(out, "available", summary.available);
+    write_pool(out, "budget", summary.budget);
+    write_pool(out, "effectiveBudget", summary.effectiveBudget);
+    write_pool(out, "inFlight", summary.inFlight);
+    write_md(out, simplified ? "AccountSimpleSummary" : "AccountSummary");
+    write_pool(out, "spent", summary.spent);
+    if(!simplified && !summary.subAccounts.empty()){
+        out.key("subAccounts", 11);
+        out.begin_object();
+        for(auto& sa : summary.subAccounts){
+            out.key(sa.first);
+            write_json(out, sa.second);
+        }
+        out.end_object();
+    }
+    out.end_object();
+}
+
+void
+MTX::write_json(JsonStream& out, const RTBKIT::Accounts& accounts){
+    // toJson() is keyed on the account names, which don't sort like keys
+    std::vector<std::pair<std::string, const RTBKIT::Account*>> entries;
+    entries.reserve(accounts.size());
+    accounts.forEachAccount([&](const RTBKIT::AccountKey& key,
+                                const RTBKIT::Account& account){
+        entries.push_back(std::make_pair(key.toString(), &account));
+    });
+    std::sort(entries.begin(), entries.end());
+
+    out.begin_object();
+    for(auto& e : entries){
+        out.key(e.first);
+        write_json(out, *e.second);
+    }
+    out.end_object();
+}
+
+void
+MTX::write_json(JsonStream& out, const std::vector<RTBKIT::AccountKey>& keys){
+    out.begin_array();
+    for(auto& key : keys){
+        out.begin_array();
+        for(auto& segment : key)
+            out.value(segment);
+        out.end_array();
+    }
+    out.end_array();
+}
+
+RTBKIT::ShadowAccount
+MTX::read_shadow_account(const std::string& body){
+    ShadowHandler handler;
+    rapidjson::Reader reader;
+    rapidjson::StringStream stream(body.c_str());
+    rapidjson::ParseResult ok = reader.Parse(stream, handler);
+    // bodies the handler stops on go through the jsoncpp reader and
+    // fromJson(), which give the error replies of old, and still accept
+    // jsoncpp's extensions (comments)
+    if(!ok || handler.object_type != "ShadowAccount" || handler.version != 1)
+        return RTBKIT::ShadowAccount::fromJson(Json::parse(body));
+
+    handler.result.checkInvariants();
+    return handler.result;
+}
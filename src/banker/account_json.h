@@ -0,0 +1,42 @@
+#ifndef __MTX_ACCOUNT_JSON_H__
+#define __MTX_ACCOUNT_JSON_H__
+
+#include <vector>
+
+#include "account.h"
+#include "utils/json_stream.h"
+
+namespace MTX {
+
+/*
+Streaming counterparts of the toJson() methods of the banker types, they
+produce the same text as toJson().toString() without going through a
+Json::Value. Members are written in the order FastWriter sorts them in.
+*/
+
+void write_json(JsonStream& out, const RTBKIT::CurrencyPool& pool);
+
+void write_json(JsonStream& out, const RTBKIT::LineItems& items);
+
+void write_json(JsonStream& out, const RTBKIT::Account& account);
+
+void write_json(JsonStream& out, const RTBKIT::AccountSummary& summary,
+                bool simplified = false);
+
+// same as Accounts::toJson()
+void write_json(JsonStream& out, const RTBKIT::Accounts& accounts);
+
+// same as Datacratic::jsonEncode(keys), every key being an array
+void write_json(JsonStream& out, const std::vector<RTBKIT::AccountKey>& keys);
+
+/*
+Same result as ShadowAccount::fromJson(Json::parse(body)), decoded with
+rapidjson's SAX reader straight into the ShadowAccount, without building
+a Json::Value. Bodies that are not valid JSON for rapidjson are handed to
+the jsoncpp reader, so the parse errors are the ones Json::parse() throws.
+*/
+RTBKIT::ShadowAccount read_shadow_account(const std::string& body);
+
+}
+
+#endif
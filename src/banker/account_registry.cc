@@ -0,0 +1,272 @@
+/* account_registry.cc
+
+   Interned account keys with dense integer ids.
+*/
+
+#include "account_registry.h"
+#include "jml/utils/exc_assert.h"
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+
+namespace RTBKIT {
+
+namespace {
+
+// FNV-1a, which can be computed over the segments of an AccountKey and
+// over its raw string with the same result
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+inline uint64_t hashBytes(uint64_t h, const char * p, size_t n)
+{
+    for (size_t i = 0;  i < n;  ++i) {
+        h ^= (unsigned char)p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+const size_t INITIAL_TABLE_SIZE = 64;
+
+} // file scope
+
+
+/*****************************************************************************/
+/* ACCOUNT REGISTRY                                                          */
+/*****************************************************************************/
+
+const uint32_t AccountRegistry::NO_ID;
+
+AccountRegistry::
+AccountRegistry()
+{
+    clear();
+}
+
+void
+AccountRegistry::
+clear()
+{
+    table.assign(INITIAL_TABLE_SIZE, Slot{0, NO_ID});
+    parents.clear();
+    segments.clear();
+    freeIds.clear();
+    live = 0;
+    segmentNames.clear();
+    segmentUses.clear();
+    freeSegments.clear();
+    segmentIds.clear();
+}
+
+uint64_t
+AccountRegistry::
+hashKey(const AccountKey & key)
+{
+    uint64_t h = FNV_OFFSET;
+    for (unsigned i = 0;  i < key.size();  ++i) {
+        if (i != 0)
+            h = hashBytes(h, ":", 1);
+        h = hashBytes(h, key[i].data(), key[i].size());
+    }
+    return h;
+}
+
+uint64_t
+AccountRegistry::
+hashName(const char * name, size_t size)
+{
+    return hashBytes(FNV_OFFSET, name, size);
+}
+
+bool
+AccountRegistry::
+equals(uint32_t id, const AccountKey & key) const
+{
+    // walk up from the last segment
+    for (int i = key.size() - 1;  i >= 0;  --i) {
+        if (id == NO_ID || segmentNames[segments[id]] != key[i])
+            return false;
+        id = parents[id];
+    }
+    return id == NO_ID;
+}
+
+bool
+AccountRegistry::
+equals(uint32_t id, const char * name, size_t size) const
+{
+    size_t end = size;
+    for (;;) {
+        const string & segment = segmentNames[segments[id]];
+        if (segment.size() > end)
+            return false;
+        size_t start = end - segment.size();
+        if (memcmp(name + start, segment.data(), segment.size()) != 0)
+            return false;
+        id = parents[id];
+        if (id == NO_ID)
+            return start == 0;
+        if (start == 0 || name[start - 1] != ':')
+            return false;
+        end = start - 1;
+    }
+}
+
+uint32_t
+AccountRegistry::
+find(const AccountKey & key) const
+{
+    uint64_t h = hashKey(key);
+    size_t mask = table.size() - 1;
+    for (size_t i = h & mask;  table[i].id != NO_ID;  i = (i + 1) & mask) {
+        if (table[i].hash == h && equals(table[i].id, key))
+            return table[i].id;
+    }
+    return NO_ID;
+}
+
+uint32_t
+AccountRegistry::
+find(const std::string & name) const
+{
+    uint64_t h = hashName(name.data(), name.size());
+    size_t mask = table.size() - 1;
+    for (size_t i = h & mask;  table[i].id != NO_ID;  i = (i + 1) & mask) {
+        if (table[i].hash == h && equals(table[i].id, name.data(), name.size()))
+            return table[i].id;
+    }
+    return NO_ID;
+}
+
+uint32_t
+AccountRegistry::
+internSegment(const std::string & segment)
+{
+    auto it = segmentIds.find(segment);
+    if (it != segmentIds.end()) {
+        ++segmentUses[it->second];
+        return it->second;
+    }
+    uint32_t result;
+    if (freeSegments.empty()) {
+        result = segmentNames.size();
+        segmentNames.push_back(segment);
+        segmentUses.push_back(1);
+    }
+    else {
+        result = freeSegments.back();
+        freeSegments.pop_back();
+        segmentNames[result] = segment;
+        segmentUses[result] = 1;
+    }
+    segmentIds[segment] = result;
+    return result;
+}
+
+void
+AccountRegistry::
+releaseSegment(uint32_t segment)
+{
+    if (--segmentUses[segment] != 0)
+        return;
+    segmentIds.erase(segmentNames[segment]);
+    std::string().swap(segmentNames[segment]);
+    freeSegments.push_back(segment);
+}
+
+uint32_t
+AccountRegistry::
+insert(const AccountKey & key, uint32_t parentId)
+{
+    ExcAssert(!key.empty());
+
+    if (2 * (live + 1) > table.size())
+        grow();
+
+    uint32_t id;
+    if (freeIds.empty()) {
+        id = parents.size();
+        parents.push_back(parentId);
+        segments.push_back(internSegment(key.back()));
+    }
+    else {
+        id = freeIds.back();
+        freeIds.pop_back();
+        parents[id] = parentId;
+        segments[id] = internSegment(key.back());
+    }
+    ++live;
+
+    uint64_t h = hashKey(key);
+    size_t mask = table.size() - 1;
+    size_t i = h & mask;
+    while (table[i].id != NO_ID)
+        i = (i + 1) & mask;
+    table[i] = Slot{h, id};
+
+    return id;
+}
+
+void
+AccountRegistry::
+erase(uint32_t id)
+{
+    size_t mask = table.size() - 1;
+    size_t i = hashKey(key(id)) & mask;
+    while (table[i].id != id) {
+        ExcAssert(table[i].id != NO_ID);
+        i = (i + 1) & mask;
+    }
+
+    // shift back the following entries of the probe sequence that would
+    // no longer be reachable across the hole
+    for (size_t j = (i + 1) & mask;  table[j].id != NO_ID;
+         j = (j + 1) & mask) {
+        size_t home = table[j].hash & mask;
+        bool reachable = i <= j ? (i < home && home <= j)
+                                : (i < home || home <= j);
+        if (reachable)
+            continue;
+        table[i] = table[j];
+        i = j;
+    }
+    table[i] = Slot{0, NO_ID};
+
+    releaseSegment(segments[id]);
+    parents[id] = NO_ID;
+    freeIds.push_back(id);
+    --live;
+}
+
+void
+AccountRegistry::
+grow()
+{
+    vector<Slot> old(table.size() * 2, Slot{0, NO_ID});
+    old.swap(table);
+    size_t mask = table.size() - 1;
+    for (const Slot & slot: old) {
+        if (slot.id == NO_ID)
+            continue;
+        size_t i = slot.hash & mask;
+        while (table[i].id != NO_ID)
+            i = (i + 1) & mask;
+        table[i] = slot;
+    }
+}
+
+AccountKey
+AccountRegistry::
+key(uint32_t id) const
+{
+    AccountKey result;
+    for (;  id != NO_ID;  id = parents[id])
+        result.push_back(segmentNames[segments[id]]);
+    std::reverse(result.begin(), result.end());
+    return result;
+}
+
+} // namespace RTBKIT
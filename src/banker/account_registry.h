@@ -0,0 +1,112 @@
+/* account_registry.h                                              -*- C++ -*-
+
+   Interned account keys with dense integer ids.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include "account_key.h"
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* ACCOUNT REGISTRY                                                          */
+/*****************************************************************************/
+
+/** Maps account keys to dense integer ids.
+
+    Every key segment is interned once and an account is stored as the id
+    of its last segment plus the id of its parent account, so the hierarchy
+    is a pair of integer arrays.  Lookups go through an open addressed
+    hash table that is keyed on the raw "a:b:c" form, and give the same
+    result whether they are done with an AccountKey or with the raw
+    string, which then doesn't need to be split.
+
+    A parent must be inserted before its children.  Erased ids and the
+    segments no account uses any more are given out again by later
+    inserts, so an erased id must not be looked up.  Ids stay below the
+    largest number of accounts registered at once.
+*/
+struct AccountRegistry {
+
+    static const uint32_t NO_ID = (uint32_t)-1;
+
+    AccountRegistry();
+
+    /** Return the id of the account or NO_ID if it is unknown. */
+    uint32_t find(const AccountKey & key) const;
+    uint32_t find(const std::string & name) const;
+
+    /** Register a new account whose parent is already registered (or
+        NO_ID for a top level account) and return its id.
+    */
+    uint32_t insert(const AccountKey & key, uint32_t parentId);
+
+    /** Forget an account, which can't be found any more.  Its children
+        must have been erased first, as their keys go through it.
+    */
+    void erase(uint32_t id);
+
+    AccountKey key(uint32_t id) const;
+
+    /** Last segment of the key of an account. */
+    const std::string & segment(uint32_t id) const
+    {
+        return segmentNames[segments[id]];
+    }
+
+    uint32_t parent(uint32_t id) const
+    {
+        return parents[id];
+    }
+
+    /** Bound on the ids given out, erased ones not reused yet included. */
+    size_t size() const
+    {
+        return parents.size();
+    }
+
+    /** Number of distinct key segments held, erased ones excluded. */
+    size_t segmentCount() const
+    {
+        return segmentIds.size();
+    }
+
+    void clear();
+
+private:
+    struct Slot {
+        uint64_t hash;
+        uint32_t id;    ///< NO_ID when the slot is free
+    };
+
+    static uint64_t hashKey(const AccountKey & key);
+    static uint64_t hashName(const char * name, size_t size);
+
+    bool equals(uint32_t id, const AccountKey & key) const;
+    bool equals(uint32_t id, const char * name, size_t size) const;
+
+    uint32_t internSegment(const std::string & segment);
+    void releaseSegment(uint32_t segment);
+
+    void grow();
+
+    std::vector<Slot> table;            ///< power of two, at most half full
+    std::vector<uint32_t> parents;      ///< parent id per account
+    std::vector<uint32_t> segments;     ///< last segment id per account
+    std::vector<uint32_t> freeIds;      ///< erased, to be given out again
+    size_t live;                        ///< ids in use
+
+    std::vector<std::string> segmentNames;
+    std::vector<uint32_t> segmentUses;  ///< accounts ending with the segment
+    std::vector<uint32_t> freeSegments;
+    std::unordered_map<std::string, uint32_t> segmentIds;
+};
+
+} // namespace RTBKIT
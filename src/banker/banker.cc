@@ -1,8 +1,11 @@
 #include "banker.h"
+#include "account_json.h"
+#include "utils/json_stream.h"
 
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/document.h"
+#include "jml/utils/xxhash.h"
 
 #include <glog/logging.h>
 #include "utils/dlog.h"
@@ -17,24 +20,339 @@
 
 #include <boost/algorithm/string.hpp>
 
+#include <string.h>
+#include <strings.h>
 #include <algorithm>
+#include <iterator>
 #include <thread>
 #include <memory>
 #include <ostream>
+#include <condition_variable>
+
+DEFINE_string(journal_dir, "", "Directory of the local mutation journal, disabled if empty");
+DEFINE_int32(journal_sync_ms, 10, "Interval between two journal fdatasync in ms");
+DEFINE_string(snapshot_path, "", "Local snapshot of the accounts written at every dump, disabled if empty");
+DEFINE_int32(account_partitions, 0, "Threads owning the accounts, 0 to keep them on the event loop");
+DEFINE_int32(change_log_size, 100000, "Account changes kept for /v1/changes, 0 to disable it");
+DEFINE_int32(change_poll_ms, 50, "Interval between two checks of a /v1/changes long poll");
+DEFINE_int32(evict_closed_after, 0, "Seconds after which archived closed accounts leave memory, 0 to keep them. Until a request reads one back its amounts are out of its parents' summaries and of the listings of every account");
+DEFINE_int32(restore_timeout_ms, 1000, "Time given to redis to read back an evicted account before its request fails");
+DEFINE_bool(redis_cas, false, "Save the accounts through a server side compare-and-set script, without reading them back");
+DEFINE_int32(loop_lag_probe_ms, 10, "Interval between two measures of the event loops lag in ms, 0 to disable them");
+DEFINE_int32(shed_lag_ms, 250, "Lag of the accounts owner in ms above which global reads get a 503, 0 to never shed them");
+DEFINE_int32(shed_retry_after, 1, "Seconds in the Retry-After of a shed request");
+DEFINE_int32(stats_interval, 10, "Seconds between two flushes of the banker stats to carbon, 0 to disable them");
 
 const std::string PREFIX = "banker-";
+const std::string JOURNAL_KEY = "banker:journal";
+const std::string GENERATION_KEY = "banker:generation";
+// accounts left out of the dumps, with the journal segments they still need
+const std::string JOURNAL_PENDING_KEY = "banker:journal:pending";
+// dump generation that last wrote every account, with --redis_cas
+const std::string ACCOUNT_GENERATIONS_KEY = "banker:account_generations";
 
 MTX::MasterBanker::MasterBanker(
             struct event_base *base,
-            std::shared_ptr<Redis::AsyncConnection> r,
+            std::vector<std::shared_ptr<Redis::AsyncConnection>> shards,
             std::shared_ptr<CarbonLogger> logger):
-                persisting(false), redis(r){
+                http(nullptr), owner_wakeup(EFD_NONBLOCK), owner_event(nullptr),
+                stats_event(nullptr), persisting(false), shutting_down(false),
+                final_dump_started(false), shutdown_wakeup(EFD_NONBLOCK),
+                shutdown_event(nullptr), redis_shards(shards), redis(shards.at(0)),
+                journal_segment(0), segment_to_save(0), loaded(false),
+                generation(0), generation_to_save(0),
+                version_to_save(0), saved_version(0){
     LOG(INFO) << "building configuration ...";
     this->base = base;
     this->clog = logger;
+    std::ostringstream prefix;
+    prefix << std::hex << (uint64_t)(Datacratic::Date::now().secondsSinceEpoch()
+                                     * 1000000);
+    etag_prefix = prefix.str();
+
+    for (auto& conn : redis_shards)
+        save_scripts.emplace_back(new SaveScript(conn, PREFIX,
+                ACCOUNT_GENERATIONS_KEY, "banker:accounts", "banker:archive"));
 }
 
 MTX::MasterBanker::~MasterBanker(){
+    stop_http();
+    stop_partitions();
+    if(shutdown_event)
+        event_free(shutdown_event);
+}
+
+namespace {
+
+// what the operations of the router run on, the accounts of a partition
+struct Owner{
+    RTBKIT::Accounts& accounts;
+    size_t partition;
+};
+
+typedef std::function<MTX::Router::response_encoder
+                      (RTBKIT::Accounts& accounts, size_t partition)>
+        partition_apply;
+
+// {"a:b": "<first segment>"}, as stored in JOURNAL_PENDING_KEY
+std::string
+pending_to_json(const std::map<std::string, uint64_t>& pending){
+    Json::Value value(Json::objectValue);
+    for(auto& p : pending)
+        value[p.first] = std::to_string(p.second);
+    return boost::trim_copy(value.toString());
+}
+
+std::map<std::string, uint64_t>
+pending_from_json(const std::string& json){
+    std::map<std::string, uint64_t> pending;
+    Json::Value value = Json::parse(json);
+    for(auto it = value.begin(); it != value.end(); ++it)
+        pending[it.memberName()] = std::stoull((*it).asString());
+    return pending;
+}
+
+/* where an account tree lives, in memory or in redis, can't depend on
+   the standard library build the banker comes from, unlike std::hash */
+size_t
+top_level_hash(const std::string& top_level){
+    return XXH32(top_level.data(), top_level.size(), 0);
+}
+
+// binds apply to the owner the router hands over
+std::function<MTX::Router::response_encoder (void*)>
+on_owner(const partition_apply& apply){
+    return [=](void* owner){
+        Owner* o = (Owner*)owner;
+        return apply(o->accounts, o->partition);
+    };
+}
+
+// parks the operation while the evicted accounts of key are read back
+void
+check_evicted(const RTBKIT::Accounts& accounts, const RTBKIT::AccountKey& key){
+    std::vector<RTBKIT::AccountKey> keys = accounts.getEvictedPrefixes(key);
+    if(keys.size())
+        throw MTX::EvictedAccounts{std::move(keys)};
+}
+
+// operation confined to the tree of key
+MTX::Router::account_operation
+tree_operation(const RTBKIT::AccountKey& key,
+               const std::function<MTX::Router::response_encoder
+                                   (RTBKIT::Accounts&)>& apply){
+    if(key.empty())
+        throw ML::Exception("empty account key");
+    MTX::Router::account_operation op;
+    op.top_level = key[0];
+    op.apply = on_owner([=](RTBKIT::Accounts& accounts, size_t){
+        check_evicted(accounts, key);
+        return apply(accounts);
+    });
+    return op;
+}
+
+// value of a request header, whatever its case
+std::string
+header_value(const std::map<std::string, std::string>& headers,
+             const char* name){
+    for(auto& h : headers){
+        if(!strcasecmp(h.first.c_str(), name))
+            return h.second;
+    }
+    return std::string();
+}
+
+// whether an If-None-Match header lists etag
+bool
+etag_matches(const std::string& if_none_match, const std::string& etag){
+    std::vector<std::string> tags;
+    boost::split(tags, if_none_match, boost::is_any_of(","));
+    for(auto& tag : tags){
+        boost::trim(tag);
+        if(boost::starts_with(tag, "W/"))
+            tag.erase(0, 2);
+        if(tag == "*" || tag == etag)
+            return true;
+    }
+    return false;
+}
+
+typedef std::function<MTX::Router::response_encoder
+                      (RTBKIT::Accounts& accounts, uint32_t id)> id_apply;
+
+typedef std::function<MTX::Router::response_encoder
+                      (RTBKIT::Accounts& accounts,
+                       const RTBKIT::AccountKey& key)> key_apply;
+
+/*
+Operation confined to the tree of the account called name. An account
+that exists is found from the raw name with a single probe of the
+registry and handed to known by id, without its key being built; the
+others go to unknown with the parsed key, which rejects a malformed name.
+*/
+MTX::Router::account_operation
+named_operation(const std::string& name, const id_apply& known,
+                const key_apply& unknown){
+    if(name.empty())
+        throw ML::Exception("empty account key");
+    MTX::Router::account_operation op;
+    op.top_level = name.substr(0, name.find(':'));
+    op.apply = on_owner([=](RTBKIT::Accounts& accounts, size_t){
+        uint32_t id = accounts.getAccountId(name);
+        if(id != RTBKIT::AccountRegistry::NO_ID)
+            return known(accounts, id);
+        RTBKIT::AccountKey key(name);
+        check_evicted(accounts, key);
+        return unknown(accounts, key);
+    });
+    return op;
+}
+
+/*
+Read of the account called name whose reply carries the version of its
+tree as ETag. When the client already has that version apply isn't
+called and the reply is a 304.
+*/
+MTX::Router::account_operation
+versioned_operation(const std::string& name,
+                    const std::string& etag_prefix,
+                    const std::map<std::string, std::string>& headers,
+                    const id_apply& apply){
+    std::string if_none_match = header_value(headers, "If-None-Match");
+    auto etag = std::make_shared<std::string>();
+    MTX::Router::account_operation op = named_operation(name,
+        [=](RTBKIT::Accounts& accounts, uint32_t id)
+                -> MTX::Router::response_encoder{
+            uint64_t version = accounts.getAccountVersionById(id);
+            *etag = "\"" + etag_prefix + "-" + std::to_string(version) + "\"";
+            if(if_none_match.size() && etag_matches(if_none_match, *etag))
+                return nullptr;
+            return apply(accounts, id);
+        },
+        [](RTBKIT::Accounts& accounts, const RTBKIT::AccountKey& key)
+                -> MTX::Router::response_encoder{
+            // throws, there is no such account
+            accounts.getAccount(key);
+            return nullptr;
+        });
+    op.etag = etag;
+    return op;
+}
+
+// encoder streaming the JSON form of value
+template<typename T>
+MTX::Router::response_encoder
+json_encoder(const T& value){
+    return [=](struct evbuffer* out) -> bool{
+        MTX::JsonStream json(out);
+        MTX::write_json(json, value);
+        json.end();
+        return false;
+    };
+}
+
+// body size written between two chunks of a large reply
+const size_t REPLY_CHUNK_SIZE = 64 * 1024;
+
+/*
+Encoder writing the members of a JSON object a batch at a time, so a
+large reply goes out in chunks while it is produced. fill() builds the
+members, in output order, on the first call.
+This bounds the encoded body, not the snapshot : the members are all
+there from the first chunk, and each one is only released once written.
+*/
+template<typename T>
+MTX::Router::response_encoder
+chunked_object_encoder(
+        std::function<void (std::vector<std::pair<std::string, T>>&)> fill,
+        std::function<void (MTX::JsonStream&, const T&)> write){
+    struct state{
+        std::vector<std::pair<std::string, T>> members;
+        size_t next;
+        std::unique_ptr<MTX::JsonStream> json;
+    };
+    auto s = std::make_shared<state>();
+    s->next = 0;
+    return [=](struct evbuffer* out) -> bool{
+        if(!s->json){
+            fill(s->members);
+            s->json.reset(new MTX::JsonStream(out));
+            s->json->begin_object();
+        }
+        MTX::JsonStream& json = *s->json;
+        while(s->next < s->members.size()){
+            if(evbuffer_get_length(out) >= REPLY_CHUNK_SIZE){
+                json.flush();
+                return true;
+            }
+            auto& member = s->members[s->next++];
+            json.key(member.first);
+            write(json, member.second);
+            member = std::pair<std::string, T>();
+        }
+        json.end_object();
+        json.end();
+        return false;
+    };
+}
+
+// a reply whose body is encoded and sent a chunk at a time
+struct ChunkedReply{
+    evhttp_request* req;
+    MTX::Router::response_encoder encoder;
+    struct evbuffer* body;
+
+    ~ChunkedReply(){
+        // the encoder may still hold a stream over the body
+        encoder = nullptr;
+        evbuffer_free(body);
+    }
+};
+
+// the client went away before the end of the reply
+void
+chunked_reply_closed_cb(struct evhttp_connection* conn, void* arg){
+    delete (ChunkedReply*)arg;
+}
+
+// the previous chunk was written, encode and send the next one
+void
+chunk_sent_cb(struct evhttp_connection* conn, void* arg){
+    ChunkedReply* reply = (ChunkedReply*)arg;
+    bool more = false;
+    try{
+        do{
+            more = reply->encoder(reply->body);
+        }while(more && !evbuffer_get_length(reply->body));
+    }catch(std::exception& e){
+        // too late for an error status, the body is left truncated
+        LOG(ERROR) << "error encoding a chunked reply: " << e.what();
+        evbuffer_drain(reply->body, evbuffer_get_length(reply->body));
+        more = false;
+    }
+    if(more){
+        evhttp_send_reply_chunk_with_cb(reply->req, reply->body,
+                                        chunk_sent_cb, reply);
+        return;
+    }
+    evhttp_send_reply_chunk(reply->req, reply->body);
+    evhttp_connection_set_closecb(conn, NULL, NULL);
+    evhttp_send_reply_end(reply->req);
+    delete reply;
+}
+
+// account keys gathered from every partition, in the accounts order
+std::vector<RTBKIT::AccountKey>
+merge_keys(const std::vector<std::vector<RTBKIT::AccountKey>>& parts){
+    std::vector<RTBKIT::AccountKey> keys;
+    for(auto& p : parts)
+        keys.insert(keys.end(), p.begin(), p.end());
+    if(parts.size() > 1)
+        std::sort(keys.begin(), keys.end());
+    return keys;
+}
+
 }
 
 void MTX::MasterBanker::initialize(){
@@ -45,14 +363,20 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string{
+                 const std::string& body) -> Router::account_operation{
         DLOGINFO("adjustment : " << path << " -> " << account_name);
         RTBKIT::AccountKey key(account_name);
         Json::Value v = Json::parse(body);
         RTBKIT::Amount a("USD/1M", v["USD/1M"].asInt());
         RTBKIT::CurrencyPool amount(a);
-        this->reactivatePresentAccounts(key);
-        return this->accounts.addAdjustment(key, amount).toJson().toString();
+        return tree_operation(key,
+                [=](RTBKIT::Accounts& accounts) -> Router::response_encoder{
+            this->reactivatePresentAccounts(accounts, key);
+            RTBKIT::Account account = accounts.addAdjustment(key, amount);
+            if (journal)
+                journal->log_add_adjustment(key, amount);
+            return json_encoder(account);
+        });
     };
 
     Router::request_async_action balance = [&](
@@ -60,7 +384,7 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string{
+                 const std::string& body) -> Router::account_operation{
         DLOGINFO("balance : " << path << " -> " << account_name);
         RTBKIT::AccountKey key(account_name);
         Json::Value v = Json::parse(body);
@@ -73,9 +397,16 @@ void MTX::MasterBanker::initialize(){
 				acc_type = this->rest_decode(it->second);
         }
 
-        this->reactivatePresentAccounts(key);
-        LOG_HIT(clog, "setBalance");
-        return this->accounts.setBalance(key, newBalance, acc_type).toJson().toString();
+        return tree_operation(key,
+                [=](RTBKIT::Accounts& accounts) -> Router::response_encoder{
+            this->reactivatePresentAccounts(accounts, key);
+            LOG_HIT(clog, "setBalance");
+            RTBKIT::Account account =
+                    accounts.setBalance(key, newBalance, acc_type);
+            if (journal)
+                journal->log_set_balance(key, newBalance, acc_type);
+            return json_encoder(account);
+        });
     };
 
     Router::request_async_action shadow = [&](
@@ -83,18 +414,31 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string{
+                 const std::string& body) -> Router::account_operation{
         DLOGINFO("shadow : " << path << " -> " << account_name);
-        RTBKIT::AccountKey key(account_name);
-        Json::Value s_acc = Json::parse(body);
-        RTBKIT::ShadowAccount sacc = RTBKIT::ShadowAccount::fromJson(s_acc);
-        LOG_HIT(clog, "syncFromShadow");
-        // ignore if account is closed.
-        std::pair<bool, bool> presentActive =
-                this->accounts.accountPresentAndActive(key);
-        if (presentActive.first && !presentActive.second)
-            return this->accounts.getAccount(key).toJson().toString();
-        return this->accounts.syncFromShadow(key, sacc).toJson().toString();
+        RTBKIT::ShadowAccount sacc = MTX::read_shadow_account(body);
+        return named_operation(account_name,
+                [=](RTBKIT::Accounts& accounts, uint32_t id)
+                        -> Router::response_encoder{
+            LOG_HIT(clog, "syncFromShadow");
+            // ignore if account is closed.
+            RTBKIT::Account account = accounts.getAccountById(id);
+            if (account.status != RTBKIT::Account::CLOSED){
+                account = accounts.syncFromShadowById(id, sacc);
+                if (journal)
+                    journal->log_sync_from_shadow(account_name, sacc);
+            }
+            return json_encoder(account);
+        },
+                [=](RTBKIT::Accounts& accounts, const RTBKIT::AccountKey& key)
+                        -> Router::response_encoder{
+            // created, as a shadow account can get ahead of the last dump
+            LOG_HIT(clog, "syncFromShadow");
+            RTBKIT::Account account = accounts.syncFromShadow(key, sacc);
+            if (journal)
+                journal->log_sync_from_shadow(account_name, sacc);
+            return json_encoder(account);
+        });
     };
 
 
@@ -103,16 +447,21 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string{
+                 const std::string& body) -> Router::account_operation{
         DLOGINFO("budget : " << path << " -> " << account_name);
         RTBKIT::AccountKey key(account_name);
-        RTBKIT::CurrencyPool budget;
         Json::Value v = Json::parse(body);
         RTBKIT::Amount a("USD/1M", v["USD/1M"].asInt());
         RTBKIT::CurrencyPool newBudget(a);
-        reactivatePresentAccounts(key);
-        LOG_HIT(clog, "setBudget");
-        return accounts.setBudget(key, newBudget).toJson().toString();
+        return tree_operation(key,
+                [=](RTBKIT::Accounts& accounts) -> Router::response_encoder{
+            reactivatePresentAccounts(accounts, key);
+            LOG_HIT(clog, "setBudget");
+            RTBKIT::Account account = accounts.setBudget(key, newBudget);
+            if (journal)
+                journal->log_set_budget(key, newBudget);
+            return json_encoder(account);
+        });
     };
 
     Router::request_async_action children = [&](
@@ -120,16 +469,19 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string{
+                 const std::string& body) -> Router::account_operation{
         DLOGINFO("children : " << path << " -> " << account_name);
         RTBKIT::AccountKey key(account_name);
         int depth = 0;
         std::map<std::string, std::string>::const_iterator it;
         if((it = qs.find("depth")) != qs.end())
             depth = atoi(it->second.c_str());
-        std::vector<RTBKIT::AccountKey> keys;
-        keys = this->accounts.getAccountKeys(key, depth);
-        return Datacratic::jsonEncode(keys).toString();
+        return tree_operation(key,
+                [=](RTBKIT::Accounts& accounts) -> Router::response_encoder{
+            std::vector<RTBKIT::AccountKey> keys;
+            keys = accounts.getAccountKeys(key, depth);
+            return json_encoder(keys);
+        });
     };
 
     Router::request_async_action close = [&](
@@ -137,19 +489,28 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string{
+                 const std::string& body) -> Router::account_operation{
         DLOGINFO("close : " << path << " -> " << account_name);
-        LOG_HIT(clog, "closeAccount");
         RTBKIT::AccountKey key(account_name);
-        this->reactivatePresentAccounts(key);
-        auto account = this->accounts.closeAccount(key);
-        if (account.status == RTBKIT::Account::CLOSED)
-            return "{\"message\":\"account was closed\"}";
-        else{
-            std::ostringstream msg;
-            msg << "account could not be closed";
-            throw std::logic_error(this->create_error_msg(msg.str()));
-        }
+        return tree_operation(key,
+                [=](RTBKIT::Accounts& accounts) -> Router::response_encoder{
+            LOG_HIT(clog, "closeAccount");
+            this->reactivatePresentAccounts(accounts, key);
+            auto account = accounts.closeAccount(key);
+            if (account.status == RTBKIT::Account::CLOSED){
+                if (journal)
+                    journal->log_close_account(key);
+                return [](struct evbuffer* out) -> bool{
+                    evbuffer_add_printf(out, "{\"message\":\"account was closed\"}");
+                    return false;
+                };
+            }
+            else{
+                std::ostringstream msg;
+                msg << "account could not be closed";
+                throw std::logic_error(this->create_error_msg(msg.str()));
+            }
+        });
     };
 
     Router::request_async_action subtree = [&](
@@ -157,15 +518,31 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string{
+                 const std::string& body) -> Router::account_operation{
         DLOGINFO("subtree : " << path << " -> " << account_name);
         RTBKIT::AccountKey key(account_name);
         int depth = 0;
         std::map<std::string, std::string>::const_iterator it;
         if((it = qs.find("depth")) != qs.end())
             depth = atoi(it->second.c_str());
-        RTBKIT::Accounts accs = this->accounts.getAccounts(key, depth);
-        return accs.toJson().toString();
+        return tree_operation(key,
+                [=](RTBKIT::Accounts& accounts) -> Router::response_encoder{
+            auto accs = std::make_shared<RTBKIT::Accounts>(
+                                accounts.getAccounts(key, depth));
+            // same member order as write_json(Accounts)
+            typedef const RTBKIT::Account* account_ptr;
+            return chunked_object_encoder<account_ptr>(
+                [accs](std::vector<std::pair<std::string, account_ptr>>& m){
+                    accs->forEachAccount([&](const RTBKIT::AccountKey& k,
+                                             const RTBKIT::Account& account){
+                        m.push_back(std::make_pair(k.toString(), &account));
+                    });
+                    std::sort(m.begin(), m.end());
+                },
+                [accs](MTX::JsonStream& json, const account_ptr& account){
+                    MTX::write_json(json, *account);
+                });
+        });
     };
 
     Router::request_async_action summary = [&](
@@ -173,18 +550,63 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string{
+                 const std::string& body) -> Router::account_operation{
         DLOGINFO("summary : " << path << " -> " << account_name);
         if(account_name != "*" && account_name.size()){
-            RTBKIT::AccountKey key(account_name);
-            RTBKIT::AccountSummary s = this->accounts.getAccountSummary(key);
-            return s.toJson().toString();
+            return versioned_operation(account_name, etag_prefix, headers,
+                    [=](RTBKIT::Accounts& accounts, uint32_t id)
+                            -> Router::response_encoder{
+                RTBKIT::AccountSummary s = accounts.getAccountSummaryById(id);
+                return json_encoder(s);
+            });
         }else if(account_name == "*"){
-            int depth = 3;
-            std::map<std::string, std::string>::const_iterator it;
-            if((it = qs.find("depth")) != qs.end())
-                depth = atoi(it->second.c_str());
-            return accounts.getAccountSummariesJson(true, depth).toString();
+            typedef std::vector<std::pair<std::string, RTBKIT::AccountSummary>>
+                    summaries;
+            auto parts = std::make_shared<std::vector<summaries>>(
+                                this->partition_count());
+            Router::account_operation op;
+            op.apply = on_owner([=](RTBKIT::Accounts& accounts, size_t partition)
+                                -> Router::response_encoder{
+                // simplified summaries have no sub accounts
+                summaries& s = (*parts)[partition];
+                for(auto& key : accounts.getAccountKeys())
+                    s.push_back(std::make_pair(key.toString(),
+                                    accounts.getAccountSummary(key, 0)));
+                return nullptr;
+            });
+            op.gather = [=]() -> Router::response_encoder{
+                size_t total = 0;
+                for(auto& part : *parts)
+                    total += part.size();
+                if(!total){
+                    return [](struct evbuffer* out) -> bool{
+                        evbuffer_add_printf(out, "null\n");
+                        return false;
+                    };
+                }
+                return chunked_object_encoder<RTBKIT::AccountSummary>(
+                    [parts](summaries& s){
+                        // moved, so the summaries are never held twice
+                        for(auto& part : *parts){
+                            s.insert(s.end(),
+                                     std::make_move_iterator(part.begin()),
+                                     std::make_move_iterator(part.end()));
+                            summaries().swap(part);
+                        }
+                        parts->clear();
+                        // same member order as getAccountSummariesJson()
+                        std::stable_sort(s.begin(), s.end(),
+                            [](const summaries::value_type& lhs,
+                               const summaries::value_type& rhs){
+                                return lhs.first < rhs.first;
+                            });
+                    },
+                    [](MTX::JsonStream& json,
+                       const RTBKIT::AccountSummary& summary){
+                        MTX::write_json(json, summary, true);
+                    });
+            };
+            return op;
         }
         std::ostringstream msg;
         msg << "error getting " << account_name;
@@ -196,16 +618,29 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string {
+                 const std::string& body) -> Router::account_operation {
         DLOGINFO("accounts : " << path << " -> " << account_name);
         if(account_name != "*" && account_name.size()){
-            RTBKIT::Accounts::AccountInfo account =
-                    this->accounts.getAccount(RTBKIT::AccountKey(account_name));
-            return account.toJson().toString();
+            return versioned_operation(account_name, etag_prefix, headers,
+                    [=](RTBKIT::Accounts& accounts, uint32_t id)
+                            -> Router::response_encoder{
+                RTBKIT::Account account = accounts.getAccountById(id);
+                return json_encoder(account);
+            });
         }else if(account_name == "*"){
-            std::vector<RTBKIT::AccountKey> keys =
-                        this->accounts.getAccountKeys();
-            return Datacratic::jsonEncode(keys).toString();
+            auto parts = std::make_shared<
+                    std::vector<std::vector<RTBKIT::AccountKey>>>(
+                                this->partition_count());
+            Router::account_operation op;
+            op.apply = on_owner([=](RTBKIT::Accounts& accounts, size_t partition)
+                                -> Router::response_encoder{
+                (*parts)[partition] = accounts.getAccountKeys();
+                return nullptr;
+            });
+            op.gather = [=]() -> Router::response_encoder{
+                return json_encoder(merge_keys(*parts));
+            };
+            return op;
         }
         std::string msg = "{\"message\":\"Error getting ";
         msg += account_name;
@@ -218,7 +653,7 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string {
+                 const std::string& body) -> Router::account_operation {
         // get the qs params
         std::string acc_name, acc_type;
         std::map<std::string, std::string>::const_iterator it;
@@ -233,8 +668,106 @@ void MTX::MasterBanker::initialize(){
         }
         RTBKIT::AccountKey k = RTBKIT::AccountKey(acc_name);
         RTBKIT::AccountType t = this->rest_decode(acc_type);
-        reactivatePresentAccounts(k);
-        return this->accounts.createAccount(k, t).toJson().toString();
+        return tree_operation(k,
+                [=](RTBKIT::Accounts& accounts) -> Router::response_encoder{
+            reactivatePresentAccounts(accounts, k);
+            RTBKIT::Account account = accounts.createAccount(k, t);
+            if (journal)
+                journal->log_create_account(k, t);
+            return json_encoder(account);
+        });
+    };
+
+    Router::request_async_action changes = [&](
+                 const std::string& path,
+                 const std::map<std::string, std::string>& qs,
+                 const std::map<std::string, std::string>& headers,
+                 const std::string& account_name,
+                 const std::string& body) -> Router::account_operation{
+        DLOGINFO("changes : " << path);
+        if(FLAGS_change_log_size <= 0)
+            throw ML::Exception("change log disabled");
+        // versions from another process start over, they get everything
+        uint64_t since = 0;
+        std::map<std::string, std::string>::const_iterator it;
+        if((it = qs.find("since")) != qs.end()
+                && boost::starts_with(it->second, etag_prefix + "-"))
+            since = strtoull(it->second.c_str() + etag_prefix.size() + 1,
+                             NULL, 10);
+        int wait_ms = 0;
+        if((it = qs.find("wait")) != qs.end())
+            wait_ms = std::min(std::max(atoi(it->second.c_str()), 0), 60000);
+        Datacratic::Date deadline =
+                Datacratic::Date::now().plusSeconds(wait_ms / 1000.0);
+
+        struct changed{
+            // false when the log didn't go back to since, all the
+            // accounts are then listed
+            bool complete;
+            uint64_t up_to;
+            std::vector<std::pair<std::string, RTBKIT::Account>> accounts;
+        };
+        auto parts = std::make_shared<std::vector<changed>>(
+                            this->partition_count());
+        std::string prefix = etag_prefix;
+        Router::account_operation op;
+        op.long_poll = wait_ms > 0;
+        op.apply = on_owner([=](RTBKIT::Accounts& accounts, size_t partition)
+                            -> Router::response_encoder{
+            changed& c = (*parts)[partition];
+            std::vector<RTBKIT::AccountKey> keys;
+            c.complete = accounts.getChangesSince(since, keys, c.up_to);
+            if(!c.complete)
+                keys = accounts.getAccountKeys();
+            c.accounts.clear();
+            for(auto& key : keys){
+                // evicted since, it was closed when last listed
+                if(!accounts.accountPresentAndActive(key).first)
+                    continue;
+                c.accounts.push_back(std::make_pair(key.toString(),
+                                            accounts.getAccount(key)));
+            }
+            return nullptr;
+        });
+        op.gather = [=]() -> Router::response_encoder{
+            // changes with a version up to the lowest one seen by the
+            // partitions were logged by the time they were read
+            bool full = true, empty = true;
+            uint64_t up_to = (uint64_t)-1;
+            for(auto& c : *parts){
+                full = full && !c.complete;
+                empty = empty && c.complete && c.accounts.empty();
+                up_to = std::min(up_to, c.up_to);
+            }
+            if(empty && Datacratic::Date::now() < deadline)
+                return nullptr;
+            std::string version = prefix + "-" + std::to_string(up_to);
+            return [=](struct evbuffer* out) -> bool{
+                std::vector<std::pair<std::string, const RTBKIT::Account*>> s;
+                for(auto& c : *parts){
+                    for(auto& a : c.accounts)
+                        s.push_back(std::make_pair(a.first, &a.second));
+                }
+                std::sort(s.begin(), s.end());
+                MTX::JsonStream json(out);
+                json.begin_object();
+                json.key("accounts", 8);
+                json.begin_object();
+                for(auto& a : s){
+                    json.key(a.first);
+                    MTX::write_json(json, *a.second);
+                }
+                json.end_object();
+                json.key("full", 4);
+                json.raw(full ? "true" : "false", full ? 4 : 5);
+                json.key("version", 7);
+                json.value(version);
+                json.end_object();
+                json.end();
+                return false;
+            };
+        };
+        return op;
     };
 
     Router::request_async_action active_accounts = [&](
@@ -242,16 +775,21 @@ void MTX::MasterBanker::initialize(){
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
                  const std::string& account_name,
-                 const std::string& body) -> std::string{
+                 const std::string& body) -> Router::account_operation{
         DLOGINFO("active accounts : " << path << " -> " << account_name);
-        std::vector<RTBKIT::AccountKey> activeAccounts;
-        auto addActive =
-            [&activeAccounts] (const RTBKIT::AccountKey & ak, const RTBKIT::Account & a) {
-                if (a.status == RTBKIT::Account::ACTIVE)
-                    activeAccounts.push_back(ak);
-            };
-        this->accounts.forEachAccount(addActive);
-        return Datacratic::jsonEncode(activeAccounts).toString();
+        auto parts = std::make_shared<
+                std::vector<std::vector<RTBKIT::AccountKey>>>(
+                            this->partition_count());
+        Router::account_operation op;
+        op.apply = on_owner([=](RTBKIT::Accounts& accounts, size_t partition)
+                            -> Router::response_encoder{
+            (*parts)[partition] = accounts.getActiveAccountKeys();
+            return nullptr;
+        });
+        op.gather = [=]() -> Router::response_encoder{
+            return json_encoder(merge_keys(*parts));
+        };
+        return op;
     };
 
     // POST,PUT /v1/accounts/<accountName>/adjustment
@@ -278,21 +816,370 @@ void MTX::MasterBanker::initialize(){
 
     // GET  /v1/accounts
     // GET  /v1/accounts/<accountName>
-    router.addAsyncRoute("GET", "", accounts);
+    router.addAsyncRoute("GET", "", accounts, "accounts");
 
     // GET /v1/activeaccounts
     router.addAsyncRoute("GET", "activeaccounts", active_accounts);
+    // GET /v1/changes?since=<version>&wait=<ms>
+    router.addAsyncRoute("GET", "changes", changes);
     // POST /v1/accounts
-    router.addAsyncRoute("POST", "", create_account);
+    router.addAsyncRoute("POST", "", create_account, "create_account");
 
     //load data from redis
     load_redis();
-    
+
+    //replay what was applied after the last redis dump
+    if (FLAGS_journal_dir.size() && !loaded){
+        LOG(ERROR) << "accounts not loaded, journal "
+                   << FLAGS_journal_dir << " left untouched";
+    }else if (FLAGS_journal_dir.size()){
+        journal = std::make_shared<AccountJournal>(
+                        FLAGS_journal_dir, FLAGS_journal_sync_ms);
+        size_t n = journal->replay(journal_segment, journal_pending,
+                [&](const AccountJournal::Record& record){
+                    this->apply_journal_record(this->accounts, record);
+                });
+        LOG(INFO) << "replayed " << n << " journal records after segment "
+                  << journal_segment;
+        journal->start();
+    }
+
+    if (FLAGS_account_partitions > 0)
+        start_partitions(FLAGS_account_partitions);
+    else if (FLAGS_change_log_size > 0)
+        this->accounts.enableChangeLog(FLAGS_change_log_size);
+}
+
+void
+MTX::MasterBanker::start_partitions(size_t n){
+    std::vector<RTBKIT::Accounts> parts = accounts.partition(n,
+                                                            top_level_hash);
+    accounts = RTBKIT::Accounts();
+    for(size_t i = 0; i < n; ++i){
+        auto partition = std::make_shared<AccountsPartition>(i);
+        partition->accounts = parts[i];
+        if (FLAGS_change_log_size > 0)
+            partition->accounts.enableChangeLog(FLAGS_change_log_size);
+        partitions.push_back(partition);
+    }
+    for(auto& partition : partitions){
+        AccountsPartition* p = partition.get();
+        p->thread = std::thread([this, p](){ this->run_partition(*p); });
+    }
+    LOG(INFO) << "accounts split over " << n << " partitions";
+}
+
+void
+MTX::MasterBanker::stop_partitions(){
+    for(auto& partition : partitions){
+        post(*partition, [](AccountsPartition& p){ p.stopping = true; });
+        partition->thread.join();
+    }
+    partitions.clear();
+}
+
+void
+MTX::MasterBanker::post(AccountsPartition& partition,
+                        std::function<void (AccountsPartition&)> run){
+    PartitionTask* task = new PartitionTask();
+    task->run = std::move(run);
+    task->posted = LoopLagMonitor::now();
+    if(partition.tasks.push(task))
+        partition.wakeup.signal();
+}
+
+void
+MTX::MasterBanker::run_partition(AccountsPartition& partition){
+    while(!partition.stopping){
+        partition.wakeup.read();
+        partition.tasks.clear_signal();
+        while(PartitionTask* task = partition.tasks.pop()){
+            int64_t now = LoopLagMonitor::now();
+            partition.waited.store(now - task->posted,
+                                   std::memory_order_relaxed);
+            partition.busy_since.store(now, std::memory_order_relaxed);
+            stats.partition_lag.record(now - task->posted);
+            task->run(partition);
+            partition.busy_since.store(0, std::memory_order_relaxed);
+            delete task;
+        }
+        partition.waited.store(0, std::memory_order_relaxed);
+    }
+}
+
+size_t
+MTX::MasterBanker::partition_count() const{
+    return std::max<size_t>(partitions.size(), 1);
+}
+
+size_t
+MTX::MasterBanker::partition_of(const std::string& top_level) const{
+    return top_level_hash(top_level) % partitions.size();
+}
+
+size_t
+MTX::MasterBanker::shard_of(const std::string& top_level) const{
+    if(redis_shards.size() == 1)
+        return 0;
+    return top_level_hash(top_level) % redis_shards.size();
+}
+
+void
+MTX::MasterBanker::apply_journal_record(RTBKIT::Accounts& accounts,
+                                        const AccountJournal::Record& record){
+    try{
+        RTBKIT::AccountKey key(record.key);
+        switch (record.type){
+            case AccountJournal::SET_BUDGET:
+                reactivatePresentAccounts(accounts, key);
+                accounts.setBudget(key, record.amount);
+                break;
+            case AccountJournal::SET_BALANCE:
+                reactivatePresentAccounts(accounts, key);
+                accounts.setBalance(key, record.amount, record.account_type);
+                break;
+            case AccountJournal::ADD_ADJUSTMENT:
+                reactivatePresentAccounts(accounts, key);
+                accounts.addAdjustment(key, record.amount);
+                break;
+            case AccountJournal::SYNC_FROM_SHADOW:{
+                std::pair<bool, bool> presentActive =
+                        accounts.accountPresentAndActive(key);
+                if (presentActive.first && !presentActive.second)
+                    break;
+                accounts.syncFromShadow(key, record.shadow);
+                break;
+            }
+            case AccountJournal::CREATE_ACCOUNT:
+                reactivatePresentAccounts(accounts, key);
+                accounts.createAccount(key, record.account_type);
+                break;
+            case AccountJournal::CLOSE_ACCOUNT:
+                reactivatePresentAccounts(accounts, key);
+                accounts.closeAccount(key);
+                break;
+        }
+    }catch(const std::exception& e){
+        LOG(ERROR) << "couldn't replay journal record for "
+                   << record.key << ": " << e.what();
+    }
+}
+
+bool
+MTX::MasterBanker::listen(const std::string& ip, int port, int threads){
+    if(threads <= 0 && partitions.size()){
+        // the base loop does the I/O, partitions post back to it
+        auto worker = std::make_shared<HttpWorker>(this);
+        workers.push_back(worker);
+        worker->base = base;
+        worker->http = evhttp_new(base);
+        if(!worker->http)
+            return false;
+        evhttp_set_gencb(worker->http,
+                         MTX::MasterBanker::worker_request_cb, worker.get());
+        worker->wakeup_event = event_new(base, worker->wakeup.fd(),
+                            EV_READ | EV_PERSIST,
+                            MTX::MasterBanker::worker_wakeup_cb, worker.get());
+        event_add(worker->wakeup_event, NULL);
+        if(!evhttp_bind_socket_with_handle(worker->http, ip.c_str(), port))
+            return false;
+        start_stats();
+        return true;
+    }
+    if(threads <= 0){
+        http = evhttp_new(base);
+        if(!http)
+            return false;
+        evhttp_set_gencb(http, MTX::MasterBanker::request_cb, this);
+        if(!evhttp_bind_socket_with_handle(http, ip.c_str(), port))
+            return false;
+        start_stats();
+        return true;
+    }
+
+    owner_event = event_new(base, owner_wakeup.fd(), EV_READ | EV_PERSIST,
+                            MTX::MasterBanker::owner_wakeup_cb, this);
+    event_add(owner_event, NULL);
+
+    // every worker accepts on the same listening socket
+    evutil_socket_t fd = -1;
+    for(int i = 0; i < threads; ++i){
+        auto worker = std::make_shared<HttpWorker>(this);
+        workers.push_back(worker);
+        worker->base = event_base_new();
+        if(!worker->base)
+            return false;
+        worker->http = evhttp_new(worker->base);
+        if(!worker->http)
+            return false;
+        evhttp_set_gencb(worker->http,
+                         MTX::MasterBanker::worker_request_cb, worker.get());
+        if(i == 0){
+            struct evhttp_bound_socket *handle =
+                evhttp_bind_socket_with_handle(worker->http, ip.c_str(), port);
+            if(!handle)
+                return false;
+            fd = evhttp_bound_socket_get_fd(handle);
+        }else if(evhttp_accept_socket(worker->http, fd) != 0){
+            return false;
+        }
+        worker->wakeup_event = event_new(worker->base, worker->wakeup.fd(),
+                            EV_READ | EV_PERSIST,
+                            MTX::MasterBanker::worker_wakeup_cb, worker.get());
+        event_add(worker->wakeup_event, NULL);
+    }
+
+    start_stats();
+    for(auto& worker : workers){
+        HttpWorker* w = worker.get();
+        w->thread = std::thread([w](){ event_base_dispatch(w->base); });
+    }
+    LOG(INFO) << "serving http from " << threads << " I/O threads";
+    return true;
+}
+
+void
+MTX::MasterBanker::stop_http(){
+    for(auto& worker : workers){
+        if(worker->thread.joinable()){
+            worker->stopping = true;
+            worker->wakeup.signal();
+            worker->thread.join();
+        }
+        worker->lag.reset();
+        if(worker->http)
+            evhttp_free(worker->http);
+        if(worker->wakeup_event)
+            event_free(worker->wakeup_event);
+        if(worker->base && worker->base != base)
+            event_base_free(worker->base);
+    }
+    workers.clear();
+    loop_lag.reset();
+    if(stats_event){
+        event_free(stats_event);
+        stats_event = nullptr;
+    }
+    if(owner_event){
+        event_free(owner_event);
+        owner_event = nullptr;
+    }
+    if(http){
+        evhttp_free(http);
+        http = nullptr;
+    }
+}
+
+void
+MTX::MasterBanker::start_stats(){
+    if(FLAGS_loop_lag_probe_ms > 0){
+        loop_lag.reset(new LoopLagMonitor(base, FLAGS_loop_lag_probe_ms,
+                                          &stats.loop_lag));
+        for(auto& worker : workers){
+            if(worker->base != base)
+                worker->lag.reset(new LoopLagMonitor(worker->base,
+                                                     FLAGS_loop_lag_probe_ms,
+                                                     &stats.io_loop_lag));
+        }
+    }
+    if(FLAGS_stats_interval > 0 && clog){
+        stats_event = event_new(base, -1, EV_PERSIST,
+                                MTX::MasterBanker::stats_cb, this);
+        struct timeval tv = {FLAGS_stats_interval, 0};
+        event_add(stats_event, &tv);
+    }
+}
+
+uint64_t
+MTX::MasterBanker::owner_lag() const{
+    if(partitions.empty())
+        return loop_lag ? loop_lag->lag() : 0;
+    int64_t now = LoopLagMonitor::now();
+    int64_t result = 0;
+    for(const auto& partition : partitions){
+        // a long task delays everything queued behind it
+        int64_t busy_since =
+            partition->busy_since.load(std::memory_order_relaxed);
+        int64_t lag = std::max<int64_t>(
+            partition->waited.load(std::memory_order_relaxed),
+            busy_since ? now - busy_since : 0);
+        result = std::max(result, lag);
+    }
+    return result;
+}
+
+bool
+MTX::MasterBanker::shed(BankerRequest* r){
+    // only global reads, the operations on an account are always served
+    if(FLAGS_shed_lag_ms <= 0 || r->error
+            || r->operation.top_level.size()
+            || owner_lag() <= (uint64_t)FLAGS_shed_lag_ms * 1000)
+        return false;
+    std::string retry_after = std::to_string(FLAGS_shed_retry_after);
+    evhttp_add_header(evhttp_request_get_output_headers(r->req),
+                      "Retry-After", retry_after.c_str());
+    evhttp_send_reply(r->req, 503, "Service Unavailable", NULL);
+    stats.shed.fetch_add(1, std::memory_order_relaxed);
+    if(r->stats){
+        BankerStats::record_reply(*r->stats, 503,
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - r->start).count());
+    }
+    delete r;
+    return true;
+}
+
+void
+MTX::MasterBanker::stats_cb(evutil_socket_t fd, short what, void* arg){
+    MasterBanker* banker = (MasterBanker*)arg;
+    banker->stats.flush(*banker->clog, banker->router);
+}
+
+void
+MTX::MasterBanker::send_stats(struct evhttp_request *req){
+    struct evbuffer *evb = evbuffer_new();
+    {
+        JsonStream out(evb);
+        stats.write_json(out, router, owner_lag());
+        out.end();
+    }
+    evhttp_add_header(evhttp_request_get_output_headers(req),
+                        "Content-Type", "application/json");
+    evhttp_send_reply(req, 200, "Ok", evb);
+    evbuffer_free(evb);
 }
 
 void
 MTX::MasterBanker::request_cb(struct evhttp_request *req, void *arg){
-    ((MTX::MasterBanker*)arg)->process_request(req);
+    ((MTX::MasterBanker*)arg)->process_request(req, nullptr);
+}
+
+void
+MTX::MasterBanker::worker_request_cb(struct evhttp_request *req, void *arg){
+    HttpWorker* worker = (HttpWorker*)arg;
+    worker->banker->process_request(req, worker);
+}
+
+void
+MTX::MasterBanker::owner_wakeup_cb(evutil_socket_t fd, short what, void* arg){
+    MasterBanker* banker = (MasterBanker*)arg;
+    banker->owner_wakeup.tryRead();
+    banker->pending.clear_signal();
+    while(BankerRequest* r = banker->pending.pop()){
+        if(banker->execute(r))
+            banker->complete(r);
+    }
+}
+
+void
+MTX::MasterBanker::worker_wakeup_cb(evutil_socket_t fd, short what, void* arg){
+    HttpWorker* worker = (HttpWorker*)arg;
+    worker->wakeup.tryRead();
+    worker->completed.clear_signal();
+    while(BankerRequest* r = worker->completed.pop())
+        worker->banker->finish(r);
+    if(worker->stopping)
+        event_base_loopbreak(worker->base);
 }
 
 std::string
@@ -344,8 +1231,9 @@ MTX::MasterBanker::get_body(struct evbuffer *buf){
 }
 
 
-void
-MTX::MasterBanker::process_request(struct evhttp_request *req){
+bool
+MTX::MasterBanker::decode_request(struct evhttp_request *req,
+                                  Router::account_operation& operation){
 
     std::string uri = evhttp_request_get_uri(req);
     struct evhttp_uri* http_uri = evhttp_uri_parse(uri.c_str());
@@ -384,66 +1272,626 @@ MTX::MasterBanker::process_request(struct evhttp_request *req){
         DLOGINFO("\t" << it->first << " : " << it->second);
 #endif
 
+    return router.route(cmdtype, path, qs_map, heads, body, operation);
+}
+
+void
+MTX::MasterBanker::process_request(struct evhttp_request *req,
+                                   HttpWorker* worker){
+    const char* uri = evhttp_request_get_uri(req);
+    if(strncmp(uri, "/v1/_stats", 10) == 0
+            && (uri[10] == '\0' || uri[10] == '?')){
+        send_stats(req);
+        return;
+    }
+
+    BankerRequest* r = new BankerRequest(this, req, worker);
     try{
-        std::string response_body;
-        bool ok = router.route(cmdtype, path, qs_map, heads, body, response_body);
-        if(ok){
-            // set the response body
-            struct evbuffer *evb = evbuffer_new();
-            evbuffer_add_printf(evb, "%s", response_body.c_str());
-            evhttp_add_header(evhttp_request_get_output_headers(req),
-                                "Content-Type", "application/json");
-            evhttp_add_header(evhttp_request_get_output_headers(req),
-                                "Connection", "Keep-Alive");
-            evhttp_send_reply(req, 200, "Ok", evb);
-            evbuffer_free(evb);
-        }else
+        if(!decode_request(req, r->operation)){
             evhttp_send_reply(req, 404, "Not Found", NULL);
+            BankerStats::record_reply(stats.not_found, 404,
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - r->start).count());
+            delete r;
+            return;
+        }
+    }catch(...){
+        r->error = std::current_exception();
+    }
+    r->stats = r->operation.stats;
+    r->etag = r->operation.etag;
+    if(r->operation.long_poll)
+        r->poll = r->operation;
+
+    if(shed(r))
+        return;
+
+    if(worker && !r->error){
+        dispatch(r);
+        return;
+    }
+
+    if(!r->error && !execute(r))
+        return;
+    finish(r);
+}
+
+void
+MTX::MasterBanker::finish(BankerRequest* r){
+    if(r->poll.long_poll){
+        if(!r->req){
+            // the client went away while the operation ran again
+            event_free(r->poll_event);
+            delete r;
+            return;
+        }
+        if(!r->error && !r->encoder){
+            // nothing to reply yet
+            if(!r->poll_event){
+                r->poll_event = evtimer_new(r->worker ? r->worker->base : base,
+                                            MTX::MasterBanker::poll_cb, r);
+                evhttp_connection_set_closecb(
+                        evhttp_request_get_connection(r->req),
+                        MTX::MasterBanker::poll_closed_cb, r);
+            }
+            struct timeval tv;
+            tv.tv_sec = FLAGS_change_poll_ms / 1000;
+            tv.tv_usec = (FLAGS_change_poll_ms % 1000) * 1000;
+            r->polling = true;
+            evtimer_add(r->poll_event, &tv);
+            return;
+        }
+        if(r->poll_event){
+            evhttp_connection_set_closecb(
+                    evhttp_request_get_connection(r->req), NULL, NULL);
+            event_free(r->poll_event);
+        }
+    }
+    int code = send_reply(r);
+    if(r->stats){
+        BankerStats::record_reply(*r->stats, code,
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - r->start).count());
+    }
+    delete r;
+}
+
+void
+MTX::MasterBanker::poll_cb(evutil_socket_t fd, short what, void* arg){
+    BankerRequest* r = (BankerRequest*)arg;
+    r->polling = false;
+    r->operation = r->poll;
+    r->encoder = nullptr;
+    if(r->worker){
+        r->banker->dispatch(r);
+    }else if(r->banker->execute(r)){
+        r->banker->finish(r);
+    }
+}
+
+void
+MTX::MasterBanker::poll_closed_cb(struct evhttp_connection* conn, void* arg){
+    BankerRequest* r = (BankerRequest*)arg;
+    if(r->polling){
+        event_free(r->poll_event);
+        delete r;
+    }else{
+        // still running, finish() drops it
+        r->req = nullptr;
+    }
+}
+
+void
+MTX::MasterBanker::dispatch(BankerRequest* r){
+    if(partitions.empty()){
+        // hand over to the accounts owner
+        if(pending.push(r))
+            owner_wakeup.signal();
+    }else if(r->operation.top_level.size()){
+        post(*partitions[partition_of(r->operation.top_level)],
+             [this, r](AccountsPartition& p){
+                 try{
+                     Owner owner{p.accounts, p.index};
+                     r->encoder = r->operation.apply(&owner);
+                 }catch(EvictedAccounts& e){
+                     this->restore_evicted(r, std::move(e.keys));
+                     return;
+                 }catch(...){
+                     r->error = std::current_exception();
+                 }
+                 this->complete(r);
+             });
+    }else{
+        r->remaining = partitions.size();
+        for(auto& partition : partitions){
+            post(*partition, [this, r](AccountsPartition& p){
+                try{
+                    Owner owner{p.accounts, p.index};
+                    r->operation.apply(&owner);
+                }catch(...){
+                    std::lock_guard<std::mutex> guard(r->lock);
+                    if(!r->error)
+                        r->error = std::current_exception();
+                }
+                if(r->remaining.fetch_sub(1) != 1)
+                    return;
+                // last partition to be done
+                if(!r->error){
+                    try{
+                        r->encoder = r->operation.gather();
+                    }catch(...){
+                        r->error = std::current_exception();
+                    }
+                }
+                this->complete(r);
+            });
+        }
+    }
+}
+
+bool
+MTX::MasterBanker::execute(BankerRequest* r){
+    try{
+        Owner owner{accounts, 0};
+        r->encoder = r->operation.apply(&owner);
+        if(r->operation.gather)
+            r->encoder = r->operation.gather();
+    }catch(EvictedAccounts& e){
+        restore_evicted(r, std::move(e.keys));
+        return false;
+    }catch(...){
+        r->error = std::current_exception();
+    }
+    r->operation = Router::account_operation();
+    return true;
+}
+
+void
+MTX::MasterBanker::restore_evicted(BankerRequest* r,
+                                   std::vector<RTBKIT::AccountKey> keys){
+    LOG_HIT(clog, "restoreAttempt");
+    Redis::Command fetch = Redis::MGET;
+    for(auto& key : keys)
+        fetch.addArg(PREFIX + key.toString());
+    auto restored = std::make_shared<std::vector<RTBKIT::AccountKey>>(
+                                std::move(keys));
+
+    // replies come on the base loop, the accounts may belong to a partition
+    auto on_result = [this, r, restored](const Redis::Result& result){
+        if(!result.ok()){
+            LOG(ERROR) << "couldn't restore evicted accounts of "
+                       << r->operation.top_level << ": " << result.error();
+            r->error = std::make_exception_ptr(std::logic_error(
+                create_error_msg("couldn't restore account: " + result.error())));
+            r->operation = Router::account_operation();
+            if(r->worker)
+                complete(r);
+            else
+                finish(r);
+            return;
+        }
+        auto restore = [restored, result](RTBKIT::Accounts& accounts){
+            const Redis::Reply& reply = result.reply();
+            for(size_t i = 0; i < restored->size(); ++i){
+                Json::Value value;
+                if(reply[i].type() == Redis::STRING)
+                    value = Json::parse(reply[i].asString());
+                accounts.restoreEvictedAccount((*restored)[i], value);
+            }
+        };
+        LOG_HIT(clog, "restored");
+        if(partitions.size()){
+            post(*partitions[partition_of(r->operation.top_level)],
+                 [this, r, restore](AccountsPartition& p){
+                     restore(p.accounts);
+                     this->dispatch(r);
+                 });
+            return;
+        }
+        restore(accounts);
+        if(!execute(r))
+            return;
+        if(r->worker)
+            complete(r);
+        else
+            finish(r);
+    };
+    redis_shards[shard_of(r->operation.top_level)]->queue(fetch, on_result,
+            Redis::AsyncConnection::Timeout(FLAGS_restore_timeout_ms / 1000.0));
+}
+
+void
+MTX::MasterBanker::complete(BankerRequest* r){
+    r->operation = Router::account_operation();
+    HttpWorker* worker = r->worker;
+    if(worker->completed.push(r))
+        worker->wakeup.signal();
+}
+
+int
+MTX::MasterBanker::send_reply(BankerRequest* r){
+    evhttp_request* req = r->req;
+    struct evbuffer *evb = evbuffer_new();
+    int code = 200;
+    try{
+        if(r->error)
+            std::rethrow_exception(r->error);
+        if(r->etag && r->etag->size()){
+            evhttp_add_header(evhttp_request_get_output_headers(req),
+                                "ETag", r->etag->c_str());
+            if(!r->encoder){
+                // the client's copy is current
+                evhttp_send_reply(req, 304, "Not Modified", NULL);
+                evbuffer_free(evb);
+                return 304;
+            }
+        }
+        // the encoder writes the response body, or its first chunk
+        bool more = r->encoder(evb);
+        evhttp_add_header(evhttp_request_get_output_headers(req),
+                            "Content-Type", "application/json");
+        evhttp_add_header(evhttp_request_get_output_headers(req),
+                            "Connection", "Keep-Alive");
+        if(more){
+            // the rest is encoded as the chunks are written out, which
+            // leaves the loop free for other requests in between
+            ChunkedReply* reply = new ChunkedReply();
+            reply->req = req;
+            reply->encoder = std::move(r->encoder);
+            reply->body = evb;
+            evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                          chunked_reply_closed_cb, reply);
+            evhttp_send_reply_start(req, 200, "Ok");
+            evhttp_send_reply_chunk_with_cb(req, evb, chunk_sent_cb, reply);
+            return 200;
+        }
+        evhttp_send_reply(req, 200, "Ok", evb);
     }catch(ML::Exception& e){
+        code = 404;
         evhttp_send_reply(req, 404, "Not Found", NULL);
     }catch(std::logic_error& e){
-        struct evbuffer *evb = evbuffer_new();
+        code = 500;
+        evbuffer_drain(evb, evbuffer_get_length(evb));
         evbuffer_add_printf(evb, "%s", e.what());
         evhttp_add_header(evhttp_request_get_output_headers(req),
                             "Content-Type", "application/json");
         evhttp_send_reply(req, 500, "ERROR", evb);
-        evbuffer_free(evb);
     }catch(...){
+        code = 500;
         evhttp_send_reply(req, 500, "ERROR", NULL);
     }
+    evbuffer_free(evb);
+    return code;
 }
 
 void
 MTX::MasterBanker::persist(evutil_socket_t fd, short what, void* args){
     MasterBanker* banker = (MasterBanker*)args;
+    // the last dump is started by shutdown_step
+    if(banker->shutting_down)
+        return;
     banker->persist_redis();
 }
 
+void
+MTX::MasterBanker::shutdown(){
+    if(shutting_down)
+        return;
+    // nothing can change the accounts once the requests stop coming, the
+    // ones already handed to the partitions are run before the dump's cut
+    stop_http();
+    shutdown_event = event_new(base, shutdown_wakeup.fd(), EV_READ | EV_PERSIST,
+                               MTX::MasterBanker::shutdown_cb, this);
+    event_add(shutdown_event, NULL);
+    shutting_down = true;
+    shutdown_step();
+}
+
+void
+MTX::MasterBanker::shutdown_cb(evutil_socket_t fd, short what, void* arg){
+    MasterBanker* banker = (MasterBanker*)arg;
+    banker->shutdown_wakeup.tryRead();
+    banker->shutdown_step();
+}
+
+void
+MTX::MasterBanker::shutdown_step(){
+    // a running dump may have cut the accounts before the last requests,
+    // it wakes the loop up when done
+    if(persisting)
+        return;
+    if(!final_dump_started){
+        final_dump_started = true;
+        LOG(WARNING) << "writing the last dump";
+        persist_redis();
+        return;
+    }
+    LOG(WARNING) << "last dump done";
+    event_base_loopbreak(base);
+}
+
+
+namespace {
+
+/*
+Sends a command to every shard with one and waits for all the replies, so
+the redis instances work at the same time. Their connections run on the
+base loop, driven from here, which is only possible before it dispatches.
+*/
+std::vector<Redis::Result>
+exec_on_shards(struct event_base* base,
+               const std::vector<std::shared_ptr<Redis::AsyncConnection>>& shards,
+               const std::vector<Redis::CommandBuffer>& commands){
+    std::vector<Redis::Result> results(shards.size());
+    size_t left = 0;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (commands[i].empty())
+            continue;
+        ++left;
+        shards[i]->queueMulti(commands[i], [&, i](const Redis::Results& r){
+            results[i] = r.at(0);
+            --left;
+        });
+    }
+    while (left)
+        event_base_loop(base, EVLOOP_ONCE);
+    return results;
+}
+
+// consistent cut of the partitions for a dump
+struct PersistCut {
+    std::mutex lock;
+    std::condition_variable cond;
+    size_t arrived;
+    bool released;
+    std::shared_ptr<std::vector<RTBKIT::Accounts>> parts;
+};
+
+}
 
 void
 MTX::MasterBanker::persist_redis(){
     if(!persisting){
         persisting = true;
-        accounts_to_save = accounts;
-        std::thread t(
-            [&](){
-                try{
-                    DLOGINFO("Persisting to redis");
-                    this->save_to_redis(this->accounts_to_save);
-                }catch(...){
-                    LOG(ERROR) << "unkown error persisting";
+        evict_closed();
+        generation_to_save = ++generation;
+        if(partitions.empty()){
+            accounts_to_save = accounts;
+            version_to_save = accounts.lastVersion->load();
+            if (journal)
+                segment_to_save = journal->rotate();
+            start_save(nullptr);
+            return;
+        }
+
+        /* Every partition copies its accounts then waits for the others,
+           so that the journal is rotated while nothing can be mutated. */
+        auto cut = std::make_shared<PersistCut>();
+        cut->arrived = 0;
+        cut->released = false;
+        cut->parts = std::make_shared<std::vector<RTBKIT::Accounts>>(
+                                partitions.size());
+        for(auto& partition : partitions){
+            post(*partition, [this, cut](AccountsPartition& p){
+                RTBKIT::Accounts copy = p.accounts;
+                std::unique_lock<std::mutex> guard(cut->lock);
+                (*cut->parts)[p.index] = std::move(copy);
+                if(++cut->arrived == this->partitions.size()){
+                    // no partition can take a version until released
+                    version_to_save = p.accounts.lastVersion->load();
+                    if (journal)
+                        segment_to_save = journal->rotate();
+                    cut->released = true;
+                    guard.unlock();
+                    cut->cond.notify_all();
+                    this->start_save(cut->parts);
+                    return;
                 }
-                persisting = false;
-            }
-        );
-        t.detach();
+                cut->cond.wait(guard, [&](){ return cut->released; });
+            });
+        }
     }else{
         LOG(WARNING) << "Persisting is taking too long!";
     }
 }
 
 void
-MTX::MasterBanker::save_to_redis(const RTBKIT::Accounts& toSave){
+MTX::MasterBanker::evict_closed(){
+    if(FLAGS_evict_closed_after <= 0)
+        return;
+    Datacratic::Date before =
+            Datacratic::Date::now().plusSeconds(-FLAGS_evict_closed_after);
+    // only the accounts the last successful dump wrote, closed, are sure
+    // to be in the archive
+    uint64_t archived = saved_version;
+
+    if(partitions.empty()){
+        size_t n = accounts.evictClosedAccounts(before, archived);
+        if(n)
+            LOG(INFO) << "evicted " << n << " closed accounts";
+        return;
+    }
+    for(auto& partition : partitions){
+        post(*partition, [before, archived](AccountsPartition& p){
+            size_t n = p.accounts.evictClosedAccounts(before, archived);
+            if(n)
+                LOG(INFO) << "evicted " << n << " closed accounts from "
+                          << "partition " << p.index;
+        });
+    }
+}
+
+std::map<std::string, uint64_t>
+MTX::MasterBanker::pending_after(const RTBKIT::Accounts& toSave) const{
+    std::map<std::string, uint64_t> pending;
+    toSave.forEachAccount([&](const RTBKIT::AccountKey& key,
+                              const RTBKIT::Account&){
+        if(!toSave.isAccountOutOfSync(key))
+            return;
+        // still needs everything since the last dump that included it
+        std::string name = key.toString();
+        auto it = journal_pending.find(name);
+        pending[name] = it == journal_pending.end() ? journal_segment + 1
+                                                    : it->second;
+    });
+    return pending;
+}
+
+Redis::Command
+MTX::MasterBanker::meta_command() const{
+    Redis::Command meta(Redis::MSET);
+    if (journal) {
+        meta.addArg(JOURNAL_KEY);
+        meta.addArg((int64_t)segment_to_save);
+        meta.addArg(JOURNAL_PENDING_KEY);
+        meta.addArg(pending_to_json(journal_pending_to_save));
+    }
+    meta.addArg(GENERATION_KEY);
+    meta.addArg((int64_t)generation_to_save);
+    return meta;
+}
+
+void
+MTX::MasterBanker::start_save(
+            std::shared_ptr<std::vector<RTBKIT::Accounts>> parts){
+    std::thread t(
+        [this, parts](){
+            if (parts){
+                this->accounts_to_save = RTBKIT::Accounts();
+                for (auto& p : *parts)
+                    this->accounts_to_save.merge(p);
+            }
+            this->stats.accounts = this->accounts_to_save.size();
+            if (this->journal)
+                this->journal_pending_to_save =
+                        this->pending_after(this->accounts_to_save);
+            if (FLAGS_snapshot_path.size()){
+                try{
+                    AccountsSnapshot::write(FLAGS_snapshot_path,
+                                            this->accounts_to_save,
+                                            this->generation_to_save,
+                                            this->segment_to_save);
+                }catch(const std::exception& e){
+                    LOG(ERROR) << "couldn't write snapshot: " << e.what();
+                }
+            }
+            try{
+                DLOGINFO("Persisting to redis");
+                this->save_to_shards(this->accounts_to_save);
+            }catch(...){
+                LOG(ERROR) << "unkown error persisting";
+            }
+            persisting = false;
+            if (shutting_down)
+                shutdown_wakeup.signal();
+        }
+    );
+    t.detach();
+}
+
+void
+MTX::MasterBanker::save_to_shards(const RTBKIT::Accounts& toSave){
+    auto save = [&](size_t shard, bool with_meta,
+                    const BankerPersistence::OnSavedCallback& done){
+        if (FLAGS_redis_cas)
+            this->save_to_redis_cas(toSave, shard, with_meta, done);
+        else
+            this->save_to_redis(toSave, shard, with_meta, done);
+    };
+    if (redis_shards.size() == 1) {
+        save(0, true, [this](const BankerPersistence::Result& result,
+                             const std::string& info){
+            this->on_state_saved(result, info);
+        });
+        return;
+    }
+
+    // the shards don't wait for each other, their connections are all
+    // driven by the base loop
+    const Datacratic::Date begin = Datacratic::Date::now();
+    std::vector<BankerPersistence::Result> results(redis_shards.size());
+    std::vector<std::string> infos(redis_shards.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < redis_shards.size(); ++i) {
+        threads.emplace_back([&, i](){
+            results[i].status = BankerPersistence::PERSISTENCE_ERROR;
+            try {
+                save(i, false, [&, i](const BankerPersistence::Result& result,
+                                      const std::string& info){
+                    results[i] = result;
+                    infos[i] = info;
+                });
+            } catch (const std::exception& e) {
+                infos[i] = e.what();
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    // every shard reports its own phases, as shard<i>.<phase>, the dump
+    // as a whole only its total and the metadata write
+    BankerPersistence::Result saveResult(BankerPersistence::SUCCESS);
+    Json::Value archivedAccounts(Json::arrayValue);
+    Json::Value badAccounts(Json::arrayValue);
+    std::string error;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const std::string prefix = "shard" + std::to_string(i) + ".";
+        for (const auto& latency : results[i].latencies)
+            saveResult.recordLatency(prefix + latency.first, latency.second);
+        switch (results[i].status) {
+        case BankerPersistence::SUCCESS:
+            if (infos[i].empty())
+                break;
+            for (const auto& key : Json::parse(infos[i]))
+                archivedAccounts.append(key);
+            break;
+        case BankerPersistence::DATA_INCONSISTENCY:
+            for (const auto& key : Json::parse(infos[i]))
+                badAccounts.append(key);
+            break;
+        default:
+            LOG(ERROR) << "couldn't save redis shard " << i << ": " << infos[i];
+            error = infos[i];
+            break;
+        }
+    }
+    if (error.size()) {
+        saveResult.status = BankerPersistence::PERSISTENCE_ERROR;
+        on_state_saved(saveResult, error);
+        return;
+    }
+    if (badAccounts.size() > 0) {
+        saveResult.status = BankerPersistence::DATA_INCONSISTENCY;
+        on_state_saved(saveResult, boost::trim_copy(badAccounts.toString()));
+        return;
+    }
+
+    /* The dump is not atomic across the shards : each one committed its
+       accounts on its own, and a failure or a crash from here on leaves
+       some shards holding this dump while the metadata, written to shard 0
+       only and last, still names the previous one. The journal is not
+       truncated before the metadata is stored, so it still has every
+       record since that previous dump. */
+    const Datacratic::Date beforeMeta = Datacratic::Date::now();
+    Redis::Result metaResult = redis->exec(meta_command());
+    const Datacratic::Date end = Datacratic::Date::now();
+    saveResult.recordLatency("metaTimeMs", end.secondsSince(beforeMeta) * 1000);
+    saveResult.recordLatency("totalTimeMs", end.secondsSince(begin) * 1000);
+    if (!metaResult.ok()) {
+        saveResult.status = BankerPersistence::PERSISTENCE_ERROR;
+        on_state_saved(saveResult, metaResult.error());
+        return;
+    }
+    on_state_saved(saveResult, boost::trim_copy(archivedAccounts.toString()));
+}
+
+void
+MTX::MasterBanker::save_to_redis(const RTBKIT::Accounts& toSave,
+        size_t shard, bool with_meta,
+        const BankerPersistence::OnSavedCallback& done){
+    std::shared_ptr<Redis::AsyncConnection> conn = redis_shards[shard];
+
     /* TODO: we need to check the content of the "banker:accounts" set for
      * "extra" account keys */
 
@@ -453,7 +1901,7 @@ MTX::MasterBanker::save_to_redis(const RTBKIT::Accounts& toSave){
     const Datacratic::Date begin = Datacratic::Date::now();
     std::vector<std::string> keys;
 
-    Redis::Command fetchCommand(Redis::MGET);
+    const Redis::Command meta = meta_command();
 
     auto latencyBetween = [](const Datacratic::Date& lhs, const Datacratic::Date& rhs) {
         return rhs.secondsSince(lhs) * 1000;
@@ -463,9 +1911,8 @@ MTX::MasterBanker::save_to_redis(const RTBKIT::Accounts& toSave){
     auto onAccount = [&] (const RTBKIT::AccountKey & key,
                           const RTBKIT::Account & account)
         {
-            std::string keyStr = key.toString();
-            keys.push_back(keyStr);
-            fetchCommand.addArg(PREFIX + keyStr);
+            if (shard_of(key[0]) == shard)
+                keys.push_back(key.toString());
         };
     toSave.forEachAccount(onAccount);
     const Datacratic::Date beforePhase1Time = Datacratic::Date::now();
@@ -484,12 +1931,12 @@ MTX::MasterBanker::save_to_redis(const RTBKIT::Accounts& toSave){
                         "totalTimeMs", latencyBetween(begin, Datacratic::Date::now()));
                 LOG(ERROR) << "phase1 save operation failed with error '"
                            << result.error() << "'" << std::endl;
-                on_state_saved(saveResult, result.error());
+                done(saveResult, result.error());
                 return;
             }
 
-            std::vector<Redis::Command> storeCommands;
-            storeCommands.push_back(Redis::MULTI);
+            Redis::CommandBuffer storeCommands;
+            storeCommands.start("MULTI", 0);
 
             const Redis::Reply & reply = result.reply();
             ExcAssert(reply.type() == Redis::ARRAY);
@@ -540,14 +1987,18 @@ MTX::MasterBanker::save_to_redis(const RTBKIT::Accounts& toSave){
                             // move an account from Active accounts to Closed archive
                             if (bankerAccount.status == RTBKIT::Account::CLOSED
                                     && storageAccount.status == RTBKIT::Account::ACTIVE) {
-                                storeCommands.push_back(Redis::SMOVE("banker:accounts",
-                                            "banker:archive", key));
+                                storeCommands.start("SMOVE", 3);
+                                storeCommands.addArg("banker:accounts");
+                                storeCommands.addArg("banker:archive");
+                                storeCommands.addArg(key);
                                 archivedAccounts.append(Json::Value(key));
                             }
                             else if (bankerAccount.status == RTBKIT::Account::ACTIVE
                                     && storageAccount.status == RTBKIT::Account::CLOSED) {
-                                storeCommands.push_back(Redis::SMOVE("banker:archive",
-                                            "banker:accounts", key));
+                                storeCommands.start("SMOVE", 3);
+                                storeCommands.addArg("banker:archive");
+                                storeCommands.addArg("banker:accounts");
+                                storeCommands.addArg(key);
                             }
                         }
                     }
@@ -560,17 +2011,30 @@ MTX::MasterBanker::save_to_redis(const RTBKIT::Accounts& toSave){
                 else {
                     /* The account does not exist yet in storage, thus we
                        create it. */
-                    storeCommands.push_back(Redis::SADD("banker:accounts", key));
+                    storeCommands.start("SADD", 2);
+                    storeCommands.addArg("banker:accounts");
+                    storeCommands.addArg(key);
                     saveAccount = true;
                 }
 
                 if (saveAccount) {
-                    Redis::Command command = Redis::SET(
-                        PREFIX + key, boost::trim_copy(bankerValue.toString()));
-                    storeCommands.push_back(command);
+                    storeCommands.start("SET", 2);
+                    storeCommands.addArg(PREFIX, key);
+                    storeCommands.addArg(
+                            boost::trim_copy(bankerValue.toString()));
                 }
             }
 
+            /* the journal segments up to this one can go once this is
+               stored, so redis must know not to replay them, but for the
+               accounts skipped above.  A local snapshot is only used if
+               it is at least as recent as what redis holds. */
+            if (with_meta) {
+                storeCommands.start(meta.formatStr, meta.args.size());
+                for (const std::string & arg : meta.args)
+                    storeCommands.addArg(arg);
+            }
+
             if (badAccounts.size() > 0) {
                 /* For now we do not save any account when at least one has
                    been detected as inconsistent. */
@@ -580,10 +2044,10 @@ MTX::MasterBanker::save_to_redis(const RTBKIT::Accounts& toSave){
                         "inPhase1TimeMs", latencyBetween(afterPhase1Time, now));
                 saveResult.recordLatency(
                         "totalTimeMs", latencyBetween(begin, now));
-                on_state_saved(saveResult, boost::trim_copy(badAccounts.toString()));
+                done(saveResult, boost::trim_copy(badAccounts.toString()));
             }
             else if (storeCommands.size() > 1) {
-                 storeCommands.push_back(Redis::EXEC);
+                 storeCommands.start("EXEC", 0);
 
                  const Datacratic::Date beforePhase2Time = Datacratic::Date::now();
 
@@ -601,20 +2065,16 @@ MTX::MasterBanker::save_to_redis(const RTBKIT::Accounts& toSave){
 
                      if (results.ok()) {
                          saveResult.status = BankerPersistence::SUCCESS;
-                         on_state_saved(saveResult, boost::trim_copy(archivedAccounts.toString()));
+                         done(saveResult, boost::trim_copy(archivedAccounts.toString()));
                      }
                      else {
                          LOG(ERROR) << "phase2 save operation failed with error '"
                                    << results.error() << "'";
                          saveResult.status = BankerPersistence::PERSISTENCE_ERROR;
-                         on_state_saved(saveResult, results.error());
+                         done(saveResult, results.error());
                      }
                  };
-                 Redis::Results results;
-                 for(auto c : storeCommands){
-                     results.push_back(redis->exec(c));
-                 }
-                 onPhase2Result(results);
+                 onPhase2Result(conn->execMulti(storeCommands));
             }
             else {
                 saveResult.status = BankerPersistence::SUCCESS;
@@ -622,80 +2082,252 @@ MTX::MasterBanker::save_to_redis(const RTBKIT::Accounts& toSave){
                         "inPhase1TimeMs", latencyBetween(afterPhase1Time, Datacratic::Date::now()));
                 saveResult.recordLatency(
                         "totalTimeMs", latencyBetween(begin, Datacratic::Date::now()));
-                on_state_saved(saveResult, "");
+                done(saveResult, "");
             }
         };
 
     if (keys.size() == 0) {
-        /* no account to save */
+        /* no account to save, only the dump metadata */
         BankerPersistence::Result result;
         result.status = BankerPersistence::SUCCESS;
+        if (with_meta) {
+            Redis::Result metaResult = conn->exec(meta);
+            if (!metaResult.ok()) {
+                LOG(ERROR) << "couldn't save the dump metadata: "
+                           << metaResult.error();
+                result.status = BankerPersistence::PERSISTENCE_ERROR;
+            }
+        }
         result.recordLatency("totalTimeMs", latencyBetween(begin, Datacratic::Date::now()));
-        on_state_saved(result, "");
+        done(result, "");
         return;
     }
 
-    Redis::Result r = redis->exec(fetchCommand);
-    onPhase1Result(r);
+    Redis::CommandBuffer fetchCommand;
+    fetchCommand.start("MGET", keys.size());
+    for (const std::string & key : keys)
+        fetchCommand.addArg(PREFIX, key);
+    onPhase1Result(conn->execMulti(fetchCommand)[0]);
 
 }
 
 void
-MTX::MasterBanker::
-on_state_saved(const MTX::BankerPersistence::Result& result, const std::string& info){
-}
+MTX::MasterBanker::save_to_redis_cas(const RTBKIT::Accounts& toSave,
+        size_t shard, bool with_meta,
+        const BankerPersistence::OnSavedCallback& done){
+    std::shared_ptr<Redis::AsyncConnection> conn = redis_shards[shard];
 
-void
-MTX::MasterBanker::load_redis(){
-    std::shared_ptr<RTBKIT::Accounts> newAccounts;
+    const Datacratic::Date begin = Datacratic::Date::now();
+    BankerPersistence::Result saveResult;
+    auto since = [&](const Datacratic::Date& start){
+        return Datacratic::Date::now().secondsSince(start) * 1000;
+    };
 
-    Redis::Result result = redis->exec(Redis::SMEMBERS("banker:accounts"));
-    if (!result.ok()) {
-        on_redis_loaded(newAccounts, PERSISTENCE_ERROR, result.error());
+    std::vector<SaveScript::Write> writes;
+    auto store = [&](const RTBKIT::AccountKey& key,
+                     const RTBKIT::Account& account){
+        if (shard_of(key[0]) != shard || toSave.isAccountOutOfSync(key))
+            return;
+        SaveScript::Write write;
+        write.key = key.toString();
+        write.account = boost::trim_copy(account.toJson().toString());
+        write.closed = account.status == RTBKIT::Account::CLOSED;
+        writes.push_back(std::move(write));
+    };
+    // accounts untouched since the last successful dump are already stored
+    toSave.forEachAccountChangedSince(saved_version, store);
+    // but for the ones that were skipped, whatever their version
+    for (const auto& p : journal_pending) {
+        RTBKIT::AccountKey key(p.first);
+        uint64_t version = toSave.getAccountVersion(key);
+        if (version && version <= saved_version)
+            store(key, toSave.getAccount(key));
+    }
+
+    Json::Value badAccounts(Json::arrayValue);
+    Json::Value archivedAccounts(Json::arrayValue);
+    const Datacratic::Date beforeWrite = Datacratic::Date::now();
+    if (!writes.empty()) {
+        Redis::Results results =
+                save_scripts[shard]->run(writes, generation_to_save);
+        saveResult.recordLatency("redisWriteTimeMs", since(beforeWrite));
+        if (!results.ok()) {
+            saveResult.status = BankerPersistence::PERSISTENCE_ERROR;
+            saveResult.recordLatency("totalTimeMs", since(begin));
+            LOG(ERROR) << "save operation failed with error '"
+                       << results.error() << "'";
+            done(saveResult, results.error());
+            return;
+        }
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Redis::Reply& reply = results.reply(i);
+            if (reply.type() != Redis::INTEGER || reply.asInt() == 0)
+                badAccounts.append(Json::Value(writes[i].key));
+            else if (reply.asInt() == 2)
+                archivedAccounts.append(Json::Value(writes[i].key));
+        }
+    }
+
+    if (badAccounts.size() > 0) {
+        /* unlike save_to_redis, which writes nothing when an account
+           doesn't match, the other accounts are already written. The
+           dump doesn't count as done : the journal keeps their records,
+           and the next dump writes them again with its own generation */
+        saveResult.status = BankerPersistence::DATA_INCONSISTENCY;
+        saveResult.recordLatency("totalTimeMs", since(begin));
+        done(saveResult, boost::trim_copy(badAccounts.toString()));
         return;
     }
 
-    const Redis::Reply & keysReply = result.reply();
-    if (keysReply.type() != Redis::ARRAY) {
-        on_redis_loaded(newAccounts, DATA_INCONSISTENCY,
-                 "SMEMBERS 'banker:accounts' must return an array");
+    if (!with_meta) {
+        saveResult.recordLatency("totalTimeMs", since(begin));
+        saveResult.status = BankerPersistence::SUCCESS;
+        done(saveResult, boost::trim_copy(archivedAccounts.toString()));
         return;
     }
 
-    newAccounts = std::make_shared<RTBKIT::Accounts>();
-    if (keysReply.length() == 0) {
-        on_redis_loaded(newAccounts, SUCCESS, "");
+    Redis::Result metaResult = conn->exec(meta_command());
+    saveResult.recordLatency("totalTimeMs", since(begin));
+    if (!metaResult.ok()) {
+        saveResult.status = BankerPersistence::PERSISTENCE_ERROR;
+        done(saveResult, metaResult.error());
         return;
     }
+    saveResult.status = BankerPersistence::SUCCESS;
+    done(saveResult, boost::trim_copy(archivedAccounts.toString()));
+}
 
-    Redis::Command fetchCommand(Redis::MGET);
-    std::vector<std::string> keys;
-    for (int i = 0; i < keysReply.length(); i++) {
-        std::string key(keysReply[i].asString());
-        keys.push_back(key);
-        fetchCommand.addArg(PREFIX + key);
+void
+MTX::MasterBanker::
+on_state_saved(const MTX::BankerPersistence::Result& result, const std::string& info){
+    stats.record_save(result.latencies,
+                      result.status == BankerPersistence::SUCCESS);
+    if (result.status != BankerPersistence::SUCCESS)
+        return;
+    if (journal) {
+        // the skipped accounts keep their records
+        uint64_t segment = segment_to_save;
+        for (const auto& p : journal_pending_to_save)
+            segment = std::min(segment, p.second - 1);
+        journal->truncate(segment);
+        journal_segment = segment_to_save;
+        journal_pending = journal_pending_to_save;
     }
+    saved_version = version_to_save;
+}
+
+void
+MTX::MasterBanker::load_redis(){
+    std::shared_ptr<RTBKIT::Accounts> newAccounts;
 
-    result = redis->exec(fetchCommand);
+    Redis::Result result = redis->exec(
+            Redis::MGET(JOURNAL_KEY, GENERATION_KEY, JOURNAL_PENDING_KEY));
     if (!result.ok()) {
         on_redis_loaded(newAccounts, PERSISTENCE_ERROR, result.error());
         return;
     }
-
-    const Redis::Reply & accountsReply = result.reply();
-    ExcAssert(accountsReply.type() == Redis::ARRAY);
-    for (int i = 0; i < accountsReply.length(); i++) {
-        if (accountsReply[i].type() == Redis::NIL) {
+    const Redis::Reply & metaReply = result.reply();
+    ExcAssert(metaReply.type() == Redis::ARRAY);
+    if (metaReply[0].type() == Redis::STRING)
+        journal_segment = std::stoull(metaReply[0].asString());
+    if (metaReply[1].type() == Redis::STRING)
+        generation = std::stoull(metaReply[1].asString());
+
+    if (FLAGS_snapshot_path.size() && load_snapshot(generation))
+        return;
+    // a snapshot holds every account, redis may lack the out of sync ones
+    if (metaReply[2].type() == Redis::STRING)
+        journal_pending = pending_from_json(metaReply[2].asString());
+
+    // the accounts of every shard are read at the same time
+    std::vector<Redis::CommandBuffer> commands(redis_shards.size());
+    for (auto& command : commands) {
+        command.start("SMEMBERS", 1);
+        command.addArg("banker:accounts");
+    }
+    std::vector<Redis::Result> results =
+            exec_on_shards(base, redis_shards, commands);
+
+    std::vector<std::vector<std::string>> keys(redis_shards.size());
+    for (size_t shard = 0; shard < results.size(); ++shard) {
+        if (!results[shard].ok()) {
+            on_redis_loaded(newAccounts, PERSISTENCE_ERROR,
+                            results[shard].error());
+            return;
+        }
+        const Redis::Reply & keysReply = results[shard].reply();
+        if (keysReply.type() != Redis::ARRAY) {
             on_redis_loaded(newAccounts, DATA_INCONSISTENCY,
-                     "nil key '" + keys[i]
-                     + "' referenced in 'banker:accounts'");
+                     "SMEMBERS 'banker:accounts' must return an array");
             return;
         }
-        Json::Value storageValue = Json::parse(accountsReply[i]);
-        newAccounts->restoreAccount(RTBKIT::AccountKey(keys[i]), storageValue);
+
+        Redis::CommandBuffer& fetchCommand = commands[shard];
+        fetchCommand.clear();
+        if (keysReply.length() == 0)
+            continue;
+        fetchCommand.start("MGET", keysReply.length());
+        keys[shard].reserve(keysReply.length());
+        for (int i = 0; i < keysReply.length(); i++) {
+            keys[shard].push_back(keysReply[i].asString());
+            fetchCommand.addArg(PREFIX, keys[shard].back());
+        }
     }
 
+    newAccounts = std::make_shared<RTBKIT::Accounts>();
+    results = exec_on_shards(base, redis_shards, commands);
+
+    for (size_t shard = 0; shard < results.size(); ++shard) {
+        if (keys[shard].empty())
+            continue;
+        if (!results[shard].ok()) {
+            on_redis_loaded(newAccounts, PERSISTENCE_ERROR,
+                            results[shard].error());
+            return;
+        }
+
+        const Redis::Reply & accountsReply = results[shard].reply();
+        ExcAssert(accountsReply.type() == Redis::ARRAY);
+        for (int i = 0; i < accountsReply.length(); i++) {
+            if (accountsReply[i].type() == Redis::NIL) {
+                on_redis_loaded(newAccounts, DATA_INCONSISTENCY,
+                         "nil key '" + keys[shard][i]
+                         + "' referenced in 'banker:accounts'");
+                return;
+            }
+            Json::Value storageValue = Json::parse(accountsReply[i]);
+            newAccounts->restoreAccount(RTBKIT::AccountKey(keys[shard][i]),
+                                        storageValue);
+        }
+    }
+
+    on_redis_loaded(newAccounts, SUCCESS, "");
+}
+
+bool
+MTX::MasterBanker::load_snapshot(uint64_t min_generation){
+    AccountsSnapshot::Header header;
+    if (!AccountsSnapshot::read_header(FLAGS_snapshot_path, header))
+        return false;
+    if (header.generation < min_generation){
+        LOG(INFO) << "snapshot generation " << header.generation
+                  << " is older than redis generation " << min_generation;
+        return false;
+    }
+
+    const Datacratic::Date begin = Datacratic::Date::now();
+    auto newAccounts = std::make_shared<RTBKIT::Accounts>();
+    if (!AccountsSnapshot::read(FLAGS_snapshot_path, *newAccounts, header)
+            || header.generation < min_generation)
+        return false;
+
+    LOG(INFO) << "loaded " << header.accounts << " accounts from snapshot "
+              << header.generation << " in "
+              << Datacratic::Date::now().secondsSince(begin) * 1000 << "ms";
+    generation = header.generation;
+    journal_segment = header.journal_segment;
     on_redis_loaded(newAccounts, SUCCESS, "");
+    return true;
 }
 
 void
@@ -707,6 +2339,7 @@ MTX::MasterBanker::on_redis_loaded(
         LOG_HIT(clog, "load.success");
         newAccounts->ensureInterAccountConsistency();
         accounts = *newAccounts;
+        loaded = true;
         LOG(INFO) << "successfully loaded accounts";
     }
     else if (status == DATA_INCONSISTENCY) {
@@ -733,10 +2366,11 @@ MTX::MasterBanker::create_error_msg(const std::string& m){
 }
 
 void
-MTX::MasterBanker::reactivatePresentAccounts(const RTBKIT::AccountKey & key) {
+MTX::MasterBanker::reactivatePresentAccounts(RTBKIT::Accounts & accounts,
+                                             const RTBKIT::AccountKey & key) {
     std::pair<bool, bool> presentActive = accounts.accountPresentAndActive(key);
     if (!presentActive.first) {
-        restoreAccount(key);
+        restoreAccount(accounts, key);
     }
     else if (presentActive.first && !presentActive.second) {
         accounts.reactivateAccount(key);
@@ -744,7 +2378,8 @@ MTX::MasterBanker::reactivatePresentAccounts(const RTBKIT::AccountKey & key) {
 }
 
 void
-MTX::MasterBanker::restoreAccount(const RTBKIT::AccountKey & key){
+MTX::MasterBanker::restoreAccount(RTBKIT::Accounts & accounts,
+                                  const RTBKIT::AccountKey & key){
     LOG_HIT(clog, "restoreAttempt");
     std::pair<bool, bool> pAndA = accounts.accountPresentAndActive(key);
     if (pAndA.first && pAndA.second == RTBKIT::Account::CLOSED) {
@@ -7,15 +7,36 @@
 #include <rapidjson/document.h>
 #include <string>
 #include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <chrono>
 #include <carboncxx/carbon_logger.h>
+#include <gflags/gflags.h>
 
 #include "utils/router.h"
+#include "utils/mpsc_queue.h"
+#include "utils/loop_lag.h"
+#include "jml/arch/wakeup_fd.h"
 #include "account.h"
 #include "account_key.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "banker_stats.h"
+#include "save_script.h"
 #include "soa/service/redis.h"
 
 namespace MTX {
 
+/*
+Thrown by an operation on accounts that were evicted from memory, before
+it changes anything : the request is parked while keys are read back from
+redis, then it runs again.
+*/
+struct EvictedAccounts {
+    std::vector<RTBKIT::AccountKey> keys;
+};
 
 struct BankerPersistence {
 
@@ -46,9 +67,15 @@ struct BankerPersistence {
 
 struct MasterBanker{
 
-    // constructor
+    /*
+    constructor
+    @param redis_shards one connection per redis instance, the accounts are
+    spread across them by top level account and the dump metadata lives in
+    the first one. Adding or removing one moves most top level accounts to
+    another shard : the accounts must be migrated, see shard_of
+    */
     MasterBanker(struct event_base *base,
-                 std::shared_ptr<Redis::AsyncConnection> redis,
+                 std::vector<std::shared_ptr<Redis::AsyncConnection>> redis_shards,
                  std::shared_ptr<CarbonLogger> logger);
 
     // destructor
@@ -57,6 +84,17 @@ struct MasterBanker{
     //initialize
     void initialize();
 
+    /*
+    Binds the http server. With threads == 0 everything runs on the base
+    event loop, otherwise requests are decoded and responses encoded by
+    that many I/O threads, each with its own event loop, and only the
+    account operations run on the base event loop which stays the single
+    writer of the accounts. With --account_partitions the operations run
+    on the partition threads instead.
+    @return false if the server couldn't be set up
+    */
+    bool listen(const std::string& ip, int port, int threads);
+
     // callback for the http event loop
     static void
     request_cb(struct evhttp_request *req, void *arg);
@@ -67,17 +105,234 @@ struct MasterBanker{
     void
     persist_redis();
 
+    /*
+    Stops serving, writes a last dump then breaks the base loop once it is
+    stored. Runs on the base loop, which drives the redis connections the
+    dump goes through : the loop must not be broken before.
+    */
+    void shutdown();
+
 private :
 
     struct context{
         evhttp_request* req;
     };
 
-    void process_request(struct evhttp_request *req);
+    struct HttpWorker;
+
+    // a request in flight between an I/O thread and the accounts owner
+    struct BankerRequest : public MpscQueue<BankerRequest>::Node {
+        BankerRequest(MasterBanker* banker, evhttp_request* req,
+                      HttpWorker* worker)
+            : banker(banker), req(req), worker(worker),
+              poll_event(nullptr), polling(false), stats(nullptr),
+              start(std::chrono::steady_clock::now()) { }
+
+        MasterBanker* banker;
+        evhttp_request* req;  // nullptr once the client went away
+        HttpWorker* worker;   // nullptr when served on the base loop
+        Router::account_operation operation;
+        Router::response_encoder encoder;
+        std::shared_ptr<std::string> etag;
+        std::exception_ptr error;
+
+        // long polling : the operation to run again, its timer, and
+        // whether the timer is pending
+        Router::account_operation poll;
+        struct event* poll_event;
+        bool polling;
+
+        // partitions still to run a global operation
+        std::atomic<size_t> remaining;
+        std::mutex lock;
+
+        // route the request was counted under, and when it came in
+        RequestStats* stats;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    struct HttpWorker {
+        HttpWorker(MasterBanker* banker)
+            : banker(banker), base(nullptr), http(nullptr),
+              wakeup(EFD_NONBLOCK), wakeup_event(nullptr), stopping(false) { }
+
+        MasterBanker* banker;
+        struct event_base* base;
+        struct evhttp* http;
+        ML::Wakeup_Fd wakeup;
+        struct event* wakeup_event;
+        MpscQueue<BankerRequest> completed;
+        std::atomic<bool> stopping;
+        std::thread thread;
+        std::unique_ptr<LoopLagMonitor> lag;
+    };
+
+    struct AccountsPartition;
+
+    struct PartitionTask : public MpscQueue<PartitionTask>::Node {
+        std::function<void (AccountsPartition&)> run;
+        int64_t posted;   // LoopLagMonitor::now()
+    };
+
+    /*
+    Top level accounts are hashed over the partitions, each one owned by
+    its own thread. As an account only ever touches its own tree no
+    operation needs more than one partition, apart from global reads
+    which are gathered from all of them.
+    */
+    struct AccountsPartition {
+        AccountsPartition(size_t index)
+            : index(index), stopping(false), waited(0), busy_since(0) { }
+
+        size_t index;
+        RTBKIT::Accounts accounts;
+        MpscQueue<PartitionTask> tasks;
+        ML::Wakeup_Fd wakeup;
+        bool stopping;    // only touched by the partition thread
+        std::thread thread;
+
+        // how long the last task waited in the queue, 0 once it is empty,
+        // and when the running task started, 0 when idle, in us
+        std::atomic<int64_t> waited;
+        std::atomic<int64_t> busy_since;
+    };
+
+    void start_partitions(size_t n);
+
+    void stop_partitions();
+
+    void post(AccountsPartition& partition,
+              std::function<void (AccountsPartition&)> run);
+
+    void run_partition(AccountsPartition& partition);
+
+    size_t partition_count() const;
+
+    size_t partition_of(const std::string& top_level) const;
+
+    /* redis instance storing the accounts under a top level account, from
+       a hash of its name modulo the number of shards : the placement is
+       persisted, changing the number of shards needs the accounts moved */
+    size_t shard_of(const std::string& top_level) const;
+
+    static void
+    worker_request_cb(struct evhttp_request *req, void *arg);
+
+    static void
+    worker_wakeup_cb(evutil_socket_t fd, short what, void* arg);
+
+    static void
+    owner_wakeup_cb(evutil_socket_t fd, short what, void* arg);
+
+    static void
+    poll_cb(evutil_socket_t fd, short what, void* arg);
+
+    static void
+    shutdown_cb(evutil_socket_t fd, short what, void* arg);
+
+    // starts the last dump once none is running, breaks the loop after it
+    void shutdown_step();
+
+    static void
+    poll_closed_cb(struct evhttp_connection* conn, void* arg);
+
+    static void
+    stats_cb(evutil_socket_t fd, short what, void* arg);
+
+    // starts the loop lag monitors and the carbon flushes
+    void start_stats();
+
+    /*
+    How long a request handed to the accounts owner would wait before
+    running, in us : the lag of the base loop, or of the slowest partition.
+    */
+    uint64_t owner_lag() const;
+
+    /*
+    Replies 503 to global reads while the accounts owner lags, so that the
+    updates moving money keep their latency.
+    @return whether r was answered and freed
+    */
+    bool shed(BankerRequest* r);
+
+    // replies to /v1/_stats from the I/O thread
+    void send_stats(struct evhttp_request *req);
+
+    void process_request(struct evhttp_request *req, HttpWorker* worker);
+
+    bool decode_request(struct evhttp_request *req,
+                        Router::account_operation& operation);
+
+    void dispatch(BankerRequest* r);
+
+    // @return false when r was parked by restore_evicted, which goes on
+    // with it once the accounts are back
+    bool execute(BankerRequest* r);
+
+    /*
+    Reads back the evicted keys r needs, without blocking the owner of the
+    accounts, then restores them on the owner and runs r again. The request
+    fails with a 500 if redis doesn't reply within --restore_timeout_ms.
+    */
+    void restore_evicted(BankerRequest* r,
+                         std::vector<RTBKIT::AccountKey> keys);
+
+    void complete(BankerRequest* r);
+
+    // @return the status code of the reply
+    int send_reply(BankerRequest* r);
+
+    // replies, or waits to run a long polling operation again
+    void finish(BankerRequest* r);
+
+    void stop_http();
 
     void load_redis();
 
-    void save_to_redis(const RTBKIT::Accounts& toSave);
+    bool load_snapshot(uint64_t min_generation);
+
+    void start_save(std::shared_ptr<std::vector<RTBKIT::Accounts>> parts);
+
+    // drops the closed accounts already archived by a dump
+    void evict_closed();
+
+    /*
+    Out of sync accounts that a dump of toSave leaves out, with the first
+    journal segment each one still needs after it.
+    */
+    std::map<std::string, uint64_t>
+    pending_after(const RTBKIT::Accounts& toSave) const;
+
+    // MSET of the dump metadata : journal segment, pending accounts and
+    // generation
+    Redis::Command meta_command() const;
+
+    /*
+    Saves the accounts of every shard at the same time, then the dump
+    metadata once they all succeeded. With several shards, the latencies of
+    each one are reported under names prefixed with shard<i>.
+    */
+    void save_to_shards(const RTBKIT::Accounts& toSave);
+
+    /*
+    Saves the accounts of one shard and reports to done.
+    @param with_meta also writes the dump metadata, with a single shard
+    */
+    void save_to_redis(const RTBKIT::Accounts& toSave,
+                       size_t shard, bool with_meta,
+                       const BankerPersistence::OnSavedCallback& done);
+
+    /*
+    Write only save : the accounts changed since the last dump go through
+    a script checking on the server that the stored account wasn't written
+    by a later generation, instead of being read back and compared. The
+    accounts are written one by one : when the script refuses some of
+    them, the dump fails with DATA_INCONSISTENCY but the others stay
+    written.
+    */
+    void save_to_redis_cas(const RTBKIT::Accounts& toSave,
+                           size_t shard, bool with_meta,
+                           const BankerPersistence::OnSavedCallback& done);
 
     void on_state_saved(
         const BankerPersistence::Result& result, const std::string& info);
@@ -97,16 +352,38 @@ private :
     get_body(struct evbuffer *buf);
 
     struct event_base* base;
+    struct evhttp* http;
+
+    // I/O threads, empty when serving from the base loop
+    std::vector<std::shared_ptr<HttpWorker>> workers;
+    // accounts owners, empty when the base loop owns the accounts
+    std::vector<std::shared_ptr<AccountsPartition>> partitions;
+    // decoded requests waiting for the accounts owner
+    MpscQueue<BankerRequest> pending;
+    ML::Wakeup_Fd owner_wakeup;
+    struct event* owner_event;
 
     std::shared_ptr<CarbonLogger> clog;
 
+    BankerStats stats;
+    std::unique_ptr<LoopLagMonitor> loop_lag;
+    struct event* stats_event;
+
     Router router;
 
     RTBKIT::Accounts accounts;
     RTBKIT::Accounts accounts_to_save;
 
-    bool persisting;
+    std::atomic<bool> persisting;
+
+    // set by shutdown(), the save thread then wakes the loop when it is done
+    std::atomic<bool> shutting_down;
+    bool final_dump_started;
+    ML::Wakeup_Fd shutdown_wakeup;
+    struct event* shutdown_event;
 
+    std::vector<std::shared_ptr<Redis::AsyncConnection>> redis_shards;
+    // first shard, which also holds the dump metadata
     std::shared_ptr<Redis::AsyncConnection> redis;
 
     enum PersistenceCallbackStatus {
@@ -119,7 +396,8 @@ private :
     create_error_msg(const std::string& m);
 
     void
-    reactivatePresentAccounts(const RTBKIT::AccountKey & key);
+    reactivatePresentAccounts(RTBKIT::Accounts & accounts,
+                              const RTBKIT::AccountKey & key);
 
     inline RTBKIT::AccountType rest_decode(const std::string & param){
         if (param == "none")
@@ -132,7 +410,39 @@ private :
             throw std::logic_error(create_error_msg("unknown account type " + param));
     }
 
-    void restoreAccount(const RTBKIT::AccountKey & key);
+    void restoreAccount(RTBKIT::Accounts & accounts,
+                        const RTBKIT::AccountKey & key);
+
+    void apply_journal_record(RTBKIT::Accounts& accounts,
+                              const AccountJournal::Record& record);
+
+    // mutations since the last redis dump, when --journal_dir is set
+    std::shared_ptr<AccountJournal> journal;
+    // last journal segment included in the redis state
+    uint64_t journal_segment;
+    // journal segment covered by accounts_to_save
+    uint64_t segment_to_save;
+    // out of sync accounts that the redis state leaves out, with the first
+    // journal segment they still need, as stored and as being saved
+    std::map<std::string, uint64_t> journal_pending;
+    std::map<std::string, uint64_t> journal_pending_to_save;
+    bool loaded;
+
+    // bumped at every dump, stored in redis and in the local snapshot
+    uint64_t generation;
+    uint64_t generation_to_save;
+
+    // start of the ETags, unique to this process as the account versions
+    // start over at every restart
+    std::string etag_prefix;
+
+    // last account version in the accounts being saved and in the last
+    // ones saved successfully
+    uint64_t version_to_save;
+    uint64_t saved_version;
+
+    // the --redis_cas script of every shard
+    std::vector<std::unique_ptr<SaveScript>> save_scripts;
 
 };
 
@@ -0,0 +1,155 @@
+#include "banker_stats.h"
+#include "utils/json_stream.h"
+
+namespace {
+
+void
+write_latency(MTX::JsonStream& out, const MTX::LatencyHistogram& histogram){
+    MTX::LatencyHistogram::Snapshot s = histogram.snapshot();
+    out.begin_object();
+    out.key("count");
+    out.value((int64_t)s.count);
+    out.key("mean_us");
+    out.value((int64_t)s.mean());
+    out.key("p50_us");
+    out.value((int64_t)s.percentile(0.5));
+    out.key("p90_us");
+    out.value((int64_t)s.percentile(0.9));
+    out.key("p99_us");
+    out.value((int64_t)s.percentile(0.99));
+    out.end_object();
+}
+
+void
+write_requests(MTX::JsonStream& out, const MTX::RequestStats& stats){
+    out.begin_object();
+    out.key("errors");
+    out.value((int64_t)stats.errors.load(std::memory_order_relaxed));
+    out.key("latency");
+    write_latency(out, stats.latency);
+    out.key("requests");
+    out.value((int64_t)stats.requests.load(std::memory_order_relaxed));
+    out.end_object();
+}
+
+}
+
+MTX::BankerStats::BankerStats():
+                shed(0), accounts(0), saves(0), failed_saves(0),
+                flushed_saves(0), flushed_failed_saves(0), flushed_shed(0){
+}
+
+void
+MTX::BankerStats::record_save(
+        const std::map<std::string, uint64_t>& latencies, bool ok){
+    (ok ? saves : failed_saves).fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> guard(lock);
+    for(const auto& latency : latencies){
+        std::unique_ptr<LatencyHistogram>& phase = save_phases[latency.first];
+        if(!phase)
+            phase.reset(new LatencyHistogram());
+        phase->record(latency.second * 1000);
+    }
+}
+
+void
+MTX::BankerStats::write_json(JsonStream& out, const Router& router,
+                             uint64_t lag_us) const{
+    out.begin_object();
+    out.key("accounts");
+    out.value((int64_t)accounts.load(std::memory_order_relaxed));
+    out.key("io_loop_lag");
+    write_latency(out, io_loop_lag);
+    out.key("lag_us");
+    out.value((int64_t)lag_us);
+    out.key("loop_lag");
+    write_latency(out, loop_lag);
+    out.key("not_found");
+    write_requests(out, not_found);
+    out.key("partition_lag");
+    write_latency(out, partition_lag);
+
+    out.key("persistence");
+    out.begin_object();
+    out.key("failed_saves");
+    out.value((int64_t)failed_saves.load(std::memory_order_relaxed));
+    out.key("phases");
+    out.begin_object();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for(const auto& phase : save_phases){
+            out.key(phase.first);
+            write_latency(out, *phase.second);
+        }
+    }
+    out.end_object();
+    out.key("saves");
+    out.value((int64_t)saves.load(std::memory_order_relaxed));
+    out.end_object();
+
+    out.key("routes");
+    out.begin_object();
+    for(const auto& route : router.stats()){
+        out.key(route.first);
+        write_requests(out, *route.second);
+    }
+    out.end_object();
+    out.key("shed");
+    out.value((int64_t)shed.load(std::memory_order_relaxed));
+    out.end_object();
+}
+
+void
+MTX::BankerStats::flush_latency(CarbonLogger& logger,
+                                const std::string& prefix,
+                                const LatencyHistogram& histogram){
+    Flushed& last = flushed[prefix];
+    LatencyHistogram::Snapshot now = histogram.snapshot();
+    LatencyHistogram::Snapshot interval = now - last.latency;
+    last.latency = now;
+    if(interval.count == 0)
+        return;
+    LOG_VALUE(&logger, prefix + ".mean_us", interval.mean());
+    LOG_VALUE(&logger, prefix + ".p50_us", interval.percentile(0.5));
+    LOG_VALUE(&logger, prefix + ".p99_us", interval.percentile(0.99));
+}
+
+void
+MTX::BankerStats::flush_requests(CarbonLogger& logger,
+                                 const std::string& prefix,
+                                 const RequestStats& stats){
+    Flushed& last = flushed[prefix];
+    uint64_t requests = stats.requests.load(std::memory_order_relaxed);
+    uint64_t errors = stats.errors.load(std::memory_order_relaxed);
+    LOG_COUNT(&logger, prefix + ".requests", requests - last.requests);
+    LOG_COUNT(&logger, prefix + ".errors", errors - last.errors);
+    last.requests = requests;
+    last.errors = errors;
+    flush_latency(logger, prefix + ".latency", stats.latency);
+}
+
+void
+MTX::BankerStats::flush(CarbonLogger& logger, const Router& router){
+    for(const auto& route : router.stats())
+        flush_requests(logger, "routes." + route.first, *route.second);
+    flush_requests(logger, "not_found", not_found);
+    flush_latency(logger, "loop_lag", loop_lag);
+    flush_latency(logger, "io_loop_lag", io_loop_lag);
+    flush_latency(logger, "partition_lag", partition_lag);
+    LOG_VALUE(&logger, "accounts", accounts.load(std::memory_order_relaxed));
+
+    uint64_t s = saves.load(std::memory_order_relaxed);
+    uint64_t f = failed_saves.load(std::memory_order_relaxed);
+    LOG_COUNT(&logger, "persistence.saves", s - flushed_saves);
+    LOG_COUNT(&logger, "persistence.failed_saves", f - flushed_failed_saves);
+    flushed_saves = s;
+    flushed_failed_saves = f;
+
+    uint64_t shed_now = shed.load(std::memory_order_relaxed);
+    LOG_COUNT(&logger, "shed", shed_now - flushed_shed);
+    flushed_shed = shed_now;
+
+    std::lock_guard<std::mutex> guard(lock);
+    for(const auto& phase : save_phases)
+        flush_latency(logger, "persistence." + phase.first, *phase.second);
+}
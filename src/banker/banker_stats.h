@@ -0,0 +1,99 @@
+#ifndef __MTX_BANKER_STATS_H__
+#define __MTX_BANKER_STATS_H__
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <stdint.h>
+#include <carboncxx/carbon_logger.h>
+
+#include "utils/router.h"
+#include "utils/stats.h"
+
+namespace MTX {
+
+struct JsonStream;
+
+/*
+Instrumentation of the master banker. The requests of every route are
+counted by the router's RequestStats; this keeps what isn't tied to a
+route, renders it all for /v1/_stats and sends the figures of every
+interval to carbon.
+
+Everything on the request path is lock free, only dumps take a lock.
+*/
+struct BankerStats{
+
+    BankerStats();
+
+    // requests matching no route
+    RequestStats not_found;
+
+    // how late the timers of the accounts loop and of the I/O loops fire
+    LatencyHistogram loop_lag;
+    LatencyHistogram io_loop_lag;
+    // how long the tasks of the partitions wait in their queue
+    LatencyHistogram partition_lag;
+
+    // global reads answered 503 while the accounts owner lagged
+    std::atomic<uint64_t> shed;
+
+    // accounts in the last dump
+    std::atomic<uint64_t> accounts;
+
+    static void record_reply(RequestStats& stats, int code, uint64_t us){
+        stats.requests.fetch_add(1, std::memory_order_relaxed);
+        if(code >= 400)
+            stats.errors.fetch_add(1, std::memory_order_relaxed);
+        stats.latency.record(us);
+    }
+
+    /*
+    Records a dump, safe from any thread.
+    @param latencies duration of its phases, in ms
+    */
+    void record_save(const std::map<std::string, uint64_t>& latencies,
+                     bool ok);
+
+    /*
+    Body of /v1/_stats.
+    @param lag_us current lag of the accounts owner
+    */
+    void write_json(JsonStream& out, const Router& router,
+                    uint64_t lag_us) const;
+
+    // sends what happened since the previous flush, from a single thread
+    void flush(CarbonLogger& logger, const Router& router);
+
+private:
+
+    struct Flushed{
+        uint64_t requests;
+        uint64_t errors;
+        LatencyHistogram::Snapshot latency;
+    };
+
+    void flush_requests(CarbonLogger& logger, const std::string& prefix,
+                        const RequestStats& stats);
+
+    void flush_latency(CarbonLogger& logger, const std::string& prefix,
+                       const LatencyHistogram& histogram);
+
+    std::atomic<uint64_t> saves;
+    std::atomic<uint64_t> failed_saves;
+
+    mutable std::mutex lock;
+    // dump phases, in us like the other histograms
+    std::map<std::string, std::unique_ptr<LatencyHistogram>> save_phases;
+
+    // counts seen by the previous flush, by carbon prefix
+    std::map<std::string, Flushed> flushed;
+    uint64_t flushed_saves;
+    uint64_t flushed_failed_saves;
+    uint64_t flushed_shed;
+};
+
+}
+
+#endif
@@ -0,0 +1,192 @@
+/* commitment_table.cc
+
+   Open addressed table of the pending commitments of a shadow account.
+*/
+
+#include "commitment_table.h"
+#include "jml/utils/exc_assert.h"
+#include <string.h>
+
+using namespace std;
+
+
+namespace RTBKIT {
+
+namespace {
+
+const size_t INITIAL_TABLE_SIZE = 16;
+
+inline uint64_t mix(uint64_t h)
+{
+    // murmur3's 64 bit finalizer
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* COMMITMENT TABLE                                                          */
+/*****************************************************************************/
+
+CommitmentTable::
+CommitmentTable()
+{
+    clear();
+}
+
+void
+CommitmentTable::
+clear()
+{
+    table.assign(INITIAL_TABLE_SIZE, Slot{0, NO_ID});
+    nodes.clear();
+    freeList = NO_ID;
+    count = 0;
+    longItems.clear();
+}
+
+uint32_t
+CommitmentTable::
+hashItem(const char * item, size_t size)
+{
+    // a word at a time; bid ids are a few dozen bytes
+    uint64_t h = size * 0x9e3779b97f4a7c15ULL;
+    for (;  size >= 8;  item += 8, size -= 8) {
+        uint64_t w;
+        memcpy(&w, item, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    if (size) {
+        uint64_t w = 0;
+        memcpy(&w, item, size);
+        h ^= w;
+    }
+    return mix(h);
+}
+
+bool
+CommitmentTable::
+equals(uint32_t id, const string & item) const
+{
+    const Node & node = nodes[id];
+    if (node.size != item.size())
+        return false;
+    if (item.size() <= INLINE_SIZE)
+        return memcmp(node.key, item.data(), item.size()) == 0;
+    auto it = longItems.find(id);
+    return it != longItems.end() && it->second == item;
+}
+
+uint32_t
+CommitmentTable::
+find(const string & item) const
+{
+    uint32_t h = hashItem(item.data(), item.size());
+    size_t mask = table.size() - 1;
+    for (size_t i = h & mask;  table[i].id != NO_ID;  i = (i + 1) & mask) {
+        if (table[i].hash == h && equals(table[i].id, item))
+            return table[i].id;
+    }
+    return NO_ID;
+}
+
+pair<uint32_t, bool>
+CommitmentTable::
+insert(const string & item, const Commitment & commitment)
+{
+    uint32_t h = hashItem(item.data(), item.size());
+    size_t mask = table.size() - 1;
+    size_t i = h & mask;
+    for (;  table[i].id != NO_ID;  i = (i + 1) & mask) {
+        if (table[i].hash == h && equals(table[i].id, item))
+            return make_pair(table[i].id, false);
+    }
+
+    uint32_t id;
+    if (freeList != NO_ID) {
+        id = freeList;
+        freeList = nodes[id].hash;
+        nodes[id].commitment = commitment;
+    }
+    else {
+        id = nodes.size();
+        ExcAssert(id != NO_ID);
+        nodes.emplace_back(commitment);
+    }
+
+    Node & node = nodes[id];
+    node.hash = h;
+    node.size = item.size();
+    if (item.size() <= INLINE_SIZE)
+        memcpy(node.key, item.data(), item.size());
+    else longItems[id] = item;
+
+    ++count;
+    if (2 * count > table.size())
+        grow();
+    else table[i] = Slot{h, id};
+    return make_pair(id, true);
+}
+
+void
+CommitmentTable::
+erase(uint32_t id)
+{
+    ExcAssert(live(id));
+    Node & node = nodes[id];
+
+    size_t mask = table.size() - 1;
+    size_t i = node.hash & mask;
+    while (table[i].id != id) {
+        ExcAssert(table[i].id != NO_ID);
+        i = (i + 1) & mask;
+    }
+
+    // shift back the following entries of the probe sequence that would
+    // no longer be reachable across the hole
+    for (size_t j = (i + 1) & mask;  table[j].id != NO_ID;
+         j = (j + 1) & mask) {
+        size_t home = table[j].hash & mask;
+        bool reachable = i <= j ? (i < home && home <= j)
+                                : (i < home || home <= j);
+        if (reachable)
+            continue;
+        table[i] = table[j];
+        i = j;
+    }
+    table[i] = Slot{0, NO_ID};
+
+    if (node.size > INLINE_SIZE)
+        longItems.erase(id);
+    node.size = FREE;
+    node.hash = freeList;
+    freeList = id;
+    --count;
+}
+
+void
+CommitmentTable::
+grow()
+{
+    // rebuilt from the nodes, which picks up one just inserted
+    table.assign(table.size() * 2, Slot{0, NO_ID});
+    size_t mask = table.size() - 1;
+    for (uint32_t id = 0;  id < nodes.size();  ++id) {
+        const Node & node = nodes[id];
+        if (node.size == FREE)
+            continue;
+        size_t i = node.hash & mask;
+        while (table[i].id != NO_ID)
+            i = (i + 1) & mask;
+        table[i] = Slot{node.hash, id};
+    }
+}
+
+} // namespace RTBKIT
@@ -0,0 +1,136 @@
+/* commitment_table.h                                              -*- C++ -*-
+
+   Open addressed table of the pending commitments of a shadow account.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <stdint.h>
+#include "currency.h"
+#include "soa/types/date.h"
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* COMMITMENT                                                                */
+/*****************************************************************************/
+
+struct Commitment {
+    Commitment(Amount amount, Datacratic::Date timestamp)
+        : amount(amount), timestamp(timestamp),
+          tick((int64_t)timestamp.secondsSinceEpoch())
+    {
+    }
+
+    Amount amount;               ///< Amount the commitment is for
+    Datacratic::Date timestamp;  ///< When the commitment was made
+    int64_t tick;                ///< Expiry bucket the commitment is indexed in
+};
+
+
+/*****************************************************************************/
+/* COMMITMENT TABLE                                                          */
+/*****************************************************************************/
+
+/** Maps bid items to their commitment without allocating per bid.
+
+    Commitments live in a slab of nodes that is recycled through a free
+    list, with the item stored inline in the node when it is short enough,
+    which bid ids are.  Lookups go through an open addressed, linear probed
+    table of (hash, node id) pairs that is kept at most half full, so that
+    authorizing then committing a bid is a couple of cache misses and no
+    malloc once the table has warmed up.
+
+    Node ids stay valid until the commitment is erased and are then reused;
+    references to a commitment are invalidated by the next insert.
+*/
+struct CommitmentTable {
+
+    static const uint32_t NO_ID = (uint32_t)-1;
+
+    CommitmentTable();
+
+    /** Return the node id of the item's commitment or NO_ID. */
+    uint32_t find(const std::string & item) const;
+
+    /** Add a commitment for the item.  Returns its node id and true, or
+        the id of the existing commitment and false if the item is already
+        there.
+    */
+    std::pair<uint32_t, bool>
+    insert(const std::string & item, const Commitment & commitment);
+
+    /** Remove a commitment by node id. */
+    void erase(uint32_t id);
+
+    Commitment & operator [] (uint32_t id)
+    {
+        return nodes[id].commitment;
+    }
+
+    const Commitment & operator [] (uint32_t id) const
+    {
+        return nodes[id].commitment;
+    }
+
+    /** Whether the node holds a commitment, as opposed to being free. */
+    bool live(uint32_t id) const
+    {
+        return id < nodes.size() && nodes[id].size != FREE;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    void clear();
+
+private:
+    static const size_t INLINE_SIZE = 52;
+    static const uint32_t FREE = (uint32_t)-1;
+
+    struct Slot {
+        uint32_t hash;
+        uint32_t id;    ///< NO_ID when the slot is free
+    };
+
+    struct Node {
+        Node(const Commitment & commitment)
+            : commitment(commitment), hash(0), size(FREE)
+        {
+        }
+
+        Commitment commitment;
+        uint32_t hash;     ///< next free node when free
+        uint32_t size;     ///< FREE when free
+        char key[INLINE_SIZE];
+    };
+
+    static uint32_t hashItem(const char * item, size_t size);
+
+    bool equals(uint32_t id, const std::string & item) const;
+
+    void grow();
+
+    std::vector<Slot> table;   ///< power of two, at most half full
+    std::vector<Node> nodes;
+    uint32_t freeList;
+    size_t count;
+
+    /// Items too long to be stored inline, by node id
+    std::unordered_map<uint32_t, std::string> longItems;
+};
+
+} // namespace RTBKIT
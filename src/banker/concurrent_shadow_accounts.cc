@@ -0,0 +1,392 @@
+/* concurrent_shadow_accounts.cc
+
+   Shadow accounts that can be used from several threads at once.
+*/
+
+#include "concurrent_shadow_accounts.h"
+#include <algorithm>
+
+using namespace std;
+
+
+namespace RTBKIT {
+
+namespace {
+
+/** The part of a shadow account that is synchronized with the master,
+    without its pending commitments.
+*/
+ShadowAccount amountsOf(const ShadowAccount & account)
+{
+    ShadowAccount result;
+    result.status = account.status;
+    result.netBudget = account.netBudget;
+    result.commitmentsRetired = account.commitmentsRetired;
+    result.commitmentsMade = account.commitmentsMade;
+    result.spent = account.spent;
+    result.balance = account.balance;
+    result.lineItems = account.lineItems;
+    return result;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* CONCURRENT SHADOW ACCOUNTS                                                */
+/*****************************************************************************/
+
+ConcurrentShadowAccounts::
+ConcurrentShadowAccounts()
+    : numAccounts(0)
+{
+}
+
+const ShadowAccount
+ConcurrentShadowAccounts::
+activateAccount(const AccountKey & account)
+{
+    ShadowAccount result;
+    withAccount(account, [&] (AccountEntry & a) { result = a; });
+    return result;
+}
+
+const ShadowAccount
+ConcurrentShadowAccounts::
+syncFromMaster(const AccountKey & account, const Account & master)
+{
+    ShadowAccount result;
+    withAccount(account, [&] (AccountEntry & a)
+        {
+            ExcAssert(!a.uninitialized);
+            a.syncFromMaster(master);
+            result = a;
+        });
+    return result;
+}
+
+const ShadowAccount
+ConcurrentShadowAccounts::
+initializeAndMergeState(const AccountKey & account, const Account & master)
+{
+    ShadowAccount result;
+    withAccount(account, [&] (AccountEntry & a)
+        {
+            ExcAssert(a.uninitialized);
+            a.initializeAndMergeState(master);
+            a.uninitialized = false;
+            result = a;
+        });
+    return result;
+}
+
+void
+ConcurrentShadowAccounts::
+checkInvariants() const
+{
+    for (const Stripe & stripe: stripes) {
+        std::lock_guard<ML::Spinlock> guard(stripe.lock);
+        for (auto & a: stripe.accounts)
+            a.second.checkInvariants();
+    }
+}
+
+const ShadowAccount
+ConcurrentShadowAccounts::
+getAccount(const AccountKey & accountKey) const
+{
+    ShadowAccount result;
+    withExistingAccount(accountKey,
+                        [&] (const AccountEntry & a) { result = a; });
+    return result;
+}
+
+bool
+ConcurrentShadowAccounts::
+accountExists(const AccountKey & accountKey) const
+{
+    const Stripe & stripe = stripeOf(accountKey);
+    std::lock_guard<ML::Spinlock> guard(stripe.lock);
+    return stripe.accounts.count(accountKey);
+}
+
+bool
+ConcurrentShadowAccounts::
+createAccountAtomic(const AccountKey & accountKey)
+{
+    bool result;
+    withAccount(accountKey, [&] (AccountEntry & a)
+        {
+            // record that this account creation is requested for the
+            // first time
+            result = a.first;
+            a.first = false;
+        },
+        false /* call onCreate */);
+    return result;
+}
+
+vector<pair<AccountKey, ShadowAccount> >
+ConcurrentShadowAccounts::
+snapshot() const
+{
+    vector<pair<AccountKey, ShadowAccount> > result;
+    result.reserve(numAccounts);
+    for (const Stripe & stripe: stripes) {
+        std::lock_guard<ML::Spinlock> guard(stripe.lock);
+        for (auto & a: stripe.accounts)
+            result.emplace_back(a.first, amountsOf(a.second));
+    }
+    return result;
+}
+
+void
+ConcurrentShadowAccounts::
+syncTo(Accounts & master) const
+{
+    for (auto & a: snapshot()) {
+        a.second.syncToMaster(master.getAccountImpl(a.first));
+        master.accountChanged(a.first);
+    }
+}
+
+void
+ConcurrentShadowAccounts::
+syncFrom(const Accounts & master)
+{
+    for (Stripe & stripe: stripes) {
+        std::lock_guard<ML::Spinlock> guard(stripe.lock);
+        for (auto & a: stripe.accounts) {
+            a.second.syncFromMaster(master.getAccountImpl(a.first));
+            if (master.outOfSyncAccounts.count(a.first) > 0)
+                a.second.outOfSync = true;
+        }
+    }
+}
+
+void
+ConcurrentShadowAccounts::
+sync(Accounts & master)
+{
+    for (auto & a: snapshot()) {
+        a.second.syncToMaster(master.getAccountImpl(a.first));
+        master.accountChanged(a.first);
+
+        // the balance is derived again from the current amounts, which
+        // bids may have moved on since the snapshot
+        const Account & masterAccount = master.getAccountImpl(a.first);
+        withAccount(a.first, [&] (AccountEntry & entry)
+                    {
+                        entry.syncFromMaster(masterAccount);
+                    },
+                    false);
+    }
+}
+
+bool
+ConcurrentShadowAccounts::
+isInitialized(const AccountKey & accountKey) const
+{
+    bool result;
+    withExistingAccount(accountKey, [&] (const AccountEntry & a)
+                        {
+                            result = !a.uninitialized;
+                        });
+    return result;
+}
+
+bool
+ConcurrentShadowAccounts::
+isStalled(const AccountKey & accountKey) const
+{
+    bool result;
+    withExistingAccount(accountKey, [&] (const AccountEntry & a)
+        {
+            result = a.uninitialized
+                && a.requested.minutesUntil(Date::now()) >= 1.0;
+        });
+    return result;
+}
+
+void
+ConcurrentShadowAccounts::
+reinitializeStalledAccount(const AccountKey & accountKey)
+{
+    ExcAssert(isStalled(accountKey));
+    withAccount(accountKey, [&] (AccountEntry & a)
+        {
+            a.first = true;
+            a.requested = Date::now();
+        });
+}
+
+bool
+ConcurrentShadowAccounts::
+authorizeBid(const AccountKey & accountKey,
+             const std::string & item,
+             Amount amount)
+{
+    bool result;
+    withAccount(accountKey, [&] (AccountEntry & a)
+        {
+            result = !a.outOfSync && a.authorizeBid(item, amount);
+        });
+    return result;
+}
+
+void
+ConcurrentShadowAccounts::
+commitBid(const AccountKey & accountKey,
+          const std::string & item,
+          Amount amountPaid,
+          const LineItems & lineItems)
+{
+    withAccount(accountKey, [&] (AccountEntry & a)
+                {
+                    a.commitBid(item, amountPaid, lineItems);
+                });
+}
+
+void
+ConcurrentShadowAccounts::
+cancelBid(const AccountKey & accountKey,
+          const std::string & item)
+{
+    withAccount(accountKey, [&] (AccountEntry & a) { a.cancelBid(item); });
+}
+
+void
+ConcurrentShadowAccounts::
+forceWinBid(const AccountKey & accountKey,
+            Amount amountPaid,
+            const LineItems & lineItems)
+{
+    withAccount(accountKey, [&] (AccountEntry & a)
+                {
+                    a.forceWinBid(amountPaid, lineItems);
+                });
+}
+
+void
+ConcurrentShadowAccounts::
+commitDetachedBid(const AccountKey & accountKey,
+                  Amount amountAuthorized,
+                  Amount amountPaid,
+                  const LineItems & lineItems)
+{
+    withAccount(accountKey, [&] (AccountEntry & a)
+                {
+                    a.commitDetachedBid(amountAuthorized, amountPaid,
+                                        lineItems);
+                });
+}
+
+void
+ConcurrentShadowAccounts::
+commitEvent(const AccountKey & accountKey, const Amount & amountToCommit)
+{
+    withAccount(accountKey, [&] (AccountEntry & a)
+                {
+                    a.commitEvent(amountToCommit);
+                });
+}
+
+Amount
+ConcurrentShadowAccounts::
+detachBid(const AccountKey & accountKey,
+          const std::string & item)
+{
+    Amount result;
+    withAccount(accountKey, [&] (AccountEntry & a)
+                {
+                    result = a.detachBid(item);
+                });
+    return result;
+}
+
+void
+ConcurrentShadowAccounts::
+attachBid(const AccountKey & accountKey,
+          const std::string & item,
+          Amount amountAuthorized)
+{
+    withAccount(accountKey, [&] (AccountEntry & a)
+                {
+                    a.attachBid(item, amountAuthorized);
+                });
+}
+
+void
+ConcurrentShadowAccounts::
+logBidEvents()
+{
+    for (Stripe & stripe: stripes) {
+        std::lock_guard<ML::Spinlock> guard(stripe.lock);
+        for (auto & a: stripe.accounts)
+            a.second.logBidEvents(a.first.toString('.'));
+    }
+}
+
+size_t
+ConcurrentShadowAccounts::
+reclaimExpiredCommitments(double maxAgeSeconds)
+{
+    Date now = Date::now();
+    size_t result = 0;
+    for (Stripe & stripe: stripes) {
+        std::lock_guard<ML::Spinlock> guard(stripe.lock);
+        for (auto & a: stripe.accounts)
+            result += a.second.reclaimExpiredCommitments(now, maxAgeSeconds);
+    }
+    return result;
+}
+
+std::vector<AccountKey>
+ConcurrentShadowAccounts::
+getAccountKeys(const AccountKey & prefix) const
+{
+    std::vector<AccountKey> result;
+    for (const Stripe & stripe: stripes) {
+        std::lock_guard<ML::Spinlock> guard(stripe.lock);
+        for (auto & a: stripe.accounts) {
+            if (a.first.hasPrefix(prefix))
+                result.push_back(a.first);
+        }
+    }
+
+    // same order as ShadowAccounts
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+void
+ConcurrentShadowAccounts::
+forEachAccount(const std::function<void (const AccountKey &,
+                                         const ShadowAccount &)> &
+               onAccount) const
+{
+    for (const Stripe & stripe: stripes) {
+        std::lock_guard<ML::Spinlock> guard(stripe.lock);
+        for (auto & a: stripe.accounts)
+            onAccount(a.first, a.second);
+    }
+}
+
+void
+ConcurrentShadowAccounts::
+forEachInitializedAndActiveAccount(
+        const std::function<void (const AccountKey &,
+                                  const ShadowAccount &)> & onAccount)
+{
+    for (const Stripe & stripe: stripes) {
+        std::lock_guard<ML::Spinlock> guard(stripe.lock);
+        for (auto & a: stripe.accounts) {
+            if (a.second.uninitialized
+                || a.second.status == Account::CLOSED)
+                continue;
+            onAccount(a.first, a.second);
+        }
+    }
+}
+
+} // namespace RTBKIT
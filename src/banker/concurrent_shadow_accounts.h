@@ -0,0 +1,250 @@
+/* concurrent_shadow_accounts.h                                    -*- C++ -*-
+
+   Shadow accounts that can be used from several threads at once.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "account.h"
+#include "jml/arch/spinlock.h"
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* CONCURRENT SHADOW ACCOUNTS                                                */
+/*****************************************************************************/
+
+/** Same interface as ShadowAccounts, but safe to call from any number of
+    threads so that bid authorization doesn't need to be funneled through
+    a single one.
+
+    Accounts are spread over a fixed set of stripes by the hash of their
+    key.  Each stripe has its own spinlock and hash table, and every
+    operation on an account takes the lock of its stripe once for the
+    lookup and the change together; operations on accounts of different
+    stripes never contend.
+
+    Synchronizing with the master copies the amounts of each account under
+    its stripe's lock, so every account is seen in a consistent state, and
+    does the work on the master without holding any lock.  The master
+    Accounts themselves are not locked and must only be used by the
+    synchronizing thread.
+
+    onNewAccount is called without any lock held.  The callbacks of the
+    forEach methods run with a stripe's lock held and must not call back
+    into this object.
+*/
+struct ConcurrentShadowAccounts {
+
+    ConcurrentShadowAccounts();
+
+    ConcurrentShadowAccounts(const ConcurrentShadowAccounts &) = delete;
+    void operator = (const ConcurrentShadowAccounts &) = delete;
+
+    /** Callback called once whenever a new account is created, by the
+        thread that created it and before it operates on the account.
+        Other threads may already be using the account by then.
+    */
+    std::function<void (AccountKey)> onNewAccount;
+
+    const ShadowAccount activateAccount(const AccountKey & account);
+
+    const ShadowAccount syncFromMaster(const AccountKey & account,
+                                       const Account & master);
+
+    /** Initialize an account by merging with the initial state as
+        received from the master banker.
+    */
+    const ShadowAccount
+    initializeAndMergeState(const AccountKey & account,
+                            const Account & master);
+
+    void checkInvariants() const;
+
+    const ShadowAccount getAccount(const AccountKey & accountKey) const;
+
+    bool accountExists(const AccountKey & accountKey) const;
+
+    bool createAccountAtomic(const AccountKey & accountKey);
+
+    /*************************************************************************/
+    /* SYNCHRONIZATION                                                       */
+    /*************************************************************************/
+
+    void syncTo(Accounts & master) const;
+    void syncFrom(const Accounts & master);
+    void sync(Accounts & master);
+
+    bool isInitialized(const AccountKey & accountKey) const;
+    bool isStalled(const AccountKey & accountKey) const;
+    void reinitializeStalledAccount(const AccountKey & accountKey);
+
+    /*************************************************************************/
+    /* BID OPERATIONS                                                        */
+    /*************************************************************************/
+
+    bool authorizeBid(const AccountKey & accountKey,
+                      const std::string & item,
+                      Amount amount);
+
+    void commitBid(const AccountKey & accountKey,
+                   const std::string & item,
+                   Amount amountPaid,
+                   const LineItems & lineItems);
+
+    void cancelBid(const AccountKey & accountKey,
+                   const std::string & item);
+
+    void forceWinBid(const AccountKey & accountKey,
+                     Amount amountPaid,
+                     const LineItems & lineItems);
+
+    /// Commit a bid that has been detached from its tracking
+    void commitDetachedBid(const AccountKey & accountKey,
+                           Amount amountAuthorized,
+                           Amount amountPaid,
+                           const LineItems & lineItems);
+
+    /// Commit a specific currency (amountToCommit)
+    void commitEvent(const AccountKey & accountKey,
+                     const Amount & amountToCommit);
+
+    Amount detachBid(const AccountKey & accountKey,
+                     const std::string & item);
+
+    void attachBid(const AccountKey & accountKey,
+                   const std::string & item,
+                   Amount amountAuthorized);
+
+    void logBidEvents();
+
+    /** Cancel the commitments of every account that are older than
+        maxAgeSeconds; see ShadowAccount::reclaimExpiredCommitments.
+    */
+    size_t reclaimExpiredCommitments(double maxAgeSeconds);
+
+    /*************************************************************************/
+    /* ENUMERATION                                                           */
+    /*************************************************************************/
+
+    std::vector<AccountKey>
+    getAccountKeys(const AccountKey & prefix = AccountKey()) const;
+
+    void
+    forEachAccount(const std::function<void (const AccountKey &,
+                                             const ShadowAccount &)> &
+                   onAccount) const;
+
+    void
+    forEachInitializedAndActiveAccount(
+            const std::function<void (const AccountKey &,
+                                      const ShadowAccount &)> & onAccount);
+
+    size_t size() const
+    {
+        return numAccounts;
+    }
+
+    bool empty() const
+    {
+        return numAccounts == 0;
+    }
+
+private:
+    struct AccountEntry : public ShadowAccount {
+        AccountEntry()
+            : requested(Date::now()), uninitialized(true), first(true),
+              outOfSync(false)
+        {
+        }
+
+        Date requested;
+        bool uninitialized;   ///< see ShadowAccounts::AccountEntry
+        bool first;
+        bool outOfSync;       ///< no more bids until resynchronized
+    };
+
+    typedef std::unordered_map<AccountKey, AccountEntry> AccountMap;
+
+    struct Stripe {
+        mutable ML::Spinlock lock;
+        AccountMap accounts;
+        char padding[64];     ///< keeps the locks on separate cache lines
+    };
+
+    static const size_t NUM_STRIPES = 64;
+
+    Stripe & stripeOf(const AccountKey & accountKey)
+    {
+        return stripes[std::hash<AccountKey>()(accountKey) % NUM_STRIPES];
+    }
+
+    const Stripe & stripeOf(const AccountKey & accountKey) const
+    {
+        return stripes[std::hash<AccountKey>()(accountKey) % NUM_STRIPES];
+    }
+
+    /** Run f on the account under its stripe's lock, creating it first if
+        needed.
+    */
+    template<typename F>
+    void withAccount(const AccountKey & accountKey, F && f,
+                     bool callOnNewAccount = true)
+    {
+        Stripe & stripe = stripeOf(accountKey);
+        {
+            std::lock_guard<ML::Spinlock> guard(stripe.lock);
+            auto it = stripe.accounts.find(accountKey);
+            if (it != stripe.accounts.end()) {
+                f(it->second);
+                return;
+            }
+            it = stripe.accounts.insert(std::make_pair(accountKey,
+                                                       AccountEntry()))
+                .first;
+            ++numAccounts;
+            if (!callOnNewAccount || !onNewAccount) {
+                f(it->second);
+                return;
+            }
+        }
+
+        // called unlocked as it may well call back in here
+        onNewAccount(accountKey);
+
+        std::lock_guard<ML::Spinlock> guard(stripe.lock);
+        f(stripe.accounts[accountKey]);
+    }
+
+    /** Run f on the account under its stripe's lock; throws if it is
+        unknown.
+    */
+    template<typename F>
+    void withExistingAccount(const AccountKey & accountKey, F && f) const
+    {
+        const Stripe & stripe = stripeOf(accountKey);
+        std::lock_guard<ML::Spinlock> guard(stripe.lock);
+        auto it = stripe.accounts.find(accountKey);
+        if (it == stripe.accounts.end())
+            throw ML::Exception("getting unknown account "
+                                + accountKey.toString());
+        f(it->second);
+    }
+
+    /** Copy of the amounts of every account, taken under the lock of its
+        stripe, with the pending commitments left out.
+    */
+    std::vector<std::pair<AccountKey, ShadowAccount> > snapshot() const;
+
+    Stripe stripes[NUM_STRIPES];
+    std::atomic<size_t> numAccounts;
+};
+
+} // namespace RTBKIT
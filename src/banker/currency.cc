@@ -285,10 +285,17 @@ bool
 CurrencyPool::
 operator == (const CurrencyPool & other) const
 {
+    // absent slots hold zero, which getAvailable() would return anyway
+    bool slotsEqual = true;
+    for (unsigned i = 0;  i < NUM_SLOTS;  ++i)
+        slotsEqual &= slots[i] == other.slots[i];
+    if (!slotsEqual)
+        return false;
+
     auto checkContains = [] (const CurrencyPool & pool1,
                              const CurrencyPool & pool2)
         {
-            for (auto amt: pool1.currencyAmounts) {
+            for (auto amt: pool1.overflow) {
                 if (pool2.getAvailable(amt.currencyCode) != amt)
                     return false;
             }
@@ -303,7 +310,11 @@ Amount
 CurrencyPool::
 getAvailable(const CurrencyCode & currency) const
 {
-    for (auto & am: currencyAmounts) {
+    int slot = slotOf(currency);
+    if (slot >= 0)
+        return Amount(currency, slots[slot]);
+
+    for (auto & am: overflow) {
         if (am.currencyCode == currency) {
             return am;
         }
@@ -324,8 +335,8 @@ CurrencyPool::
 toJson() const
 {
     Json::Value result(Json::objectValue);
-    for (auto a: currencyAmounts)
-        result[a.getCurrencyStr()] = a.value;
+    forEach([&] (const Amount & a)
+            { result[a.getCurrencyStr()] = a.value; });
     return result;
 }
 
@@ -352,11 +363,12 @@ toString() const
         return "0";
 
     string result;
-    for (unsigned i = 0;  i < currencyAmounts.size();  ++i) {
-        if (i > 0)
-            result += ", ";
-        result += currencyAmounts[i].toString();
-    }
+    forEach([&] (const Amount & a)
+        {
+            if (!result.empty())
+                result += ", ";
+            result += a.toString();
+        });
     return result;
 }
 
@@ -369,8 +381,18 @@ void
 CurrencyPool::
 serialize(ML::DB::Store_Writer & store) const
 {
-    store << (unsigned char)0
-          << currencyAmounts;
+    // same layout as the compact_vector<Amount> this used to be
+    store << (unsigned char)0;
+    ML::DB::serialize_compact_size(store, size());
+    forEach([&] (const Amount & a)
+        {
+            // Amount drops the currency of a zero amount, which would no
+            // longer be listed once read back
+            if (a)
+                store << a;
+            else store << (unsigned char)1 << (uint32_t)a.currencyCode
+                       << ML::DB::compact_size_t(0);
+        });
 }
 
 void
@@ -381,7 +403,26 @@ reconstitute(ML::DB::Store_Reader & store)
     store >> version;
     if (version != 0)
         throw ML::Exception("error reconstituting currency pool");
-    store >> currencyAmounts;
+
+    clear();
+    unsigned long long n = ML::DB::reconstitute_compact_size(store);
+    for (unsigned i = 0;  i < n;  ++i) {
+        Amount a;
+        store >> a;
+        /* zero amounts written before they kept their currency code have
+           none, they are left out instead of being listed as "NONE" */
+        if (a.currencyCode == CurrencyCode::CC_NONE)
+            continue;
+        int slot = slotOf(a.currencyCode);
+        if (slot >= 0) {
+            slots[slot] = a.value;
+            present |= 1u << slot;
+        }
+        else overflow.push_back(a);
+    }
+    std::sort(overflow.begin(), overflow.end(),
+              [] (Amount am1, Amount am2)
+              { return am1.currencyCode < am2.currencyCode; });
 }
 
 bool
@@ -389,14 +430,16 @@ CurrencyPool::
 isSameOrPastVersion(const CurrencyPool & otherPool)
     const
 {
-    for (const Amount & amount: currencyAmounts) {
-        const Amount otherAmount
-            = otherPool.getAvailable(amount.currencyCode);
-        if (amount < otherAmount)
-            return false;
-    }
+    bool result = true;
+    forEach([&] (const Amount & amount)
+        {
+            const Amount otherAmount
+                = otherPool.getAvailable(amount.currencyCode);
+            if (amount < otherAmount)
+                result = false;
+        });
 
-    return true;
+    return result;
 }
 
 /*****************************************************************************/
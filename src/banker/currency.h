@@ -10,6 +10,8 @@
 #include <cstddef>
 #include <ratio>
 #include <type_traits>
+#include <vector>
+#include <algorithm>
 
 #include <boost/preprocessor/cat.hpp>
 
@@ -361,43 +363,86 @@ Amount createAmount(Integer amount, CurrencyCode currency)
 /** This aggregates amounts over multiple currencies.  The values are kept
     separately so that they can be combined according to application
     specific logic.
+
+    The currencies that have a CurrencyCode get a fixed inline slot so that
+    a pool never allocates and pool-wide arithmetic is a straight loop over
+    the slots.  Codes without a slot go to a sorted overflow vector.  A
+    currency is "present" once a non zero amount of it has been added, even
+    if it went back to zero since; present currencies are the ones that
+    show up in toJson(), toString() and the serialization, in increasing
+    currency code order.
 */
 struct CurrencyPool {
 
+    /// Number of inline slots, one per known non NONE currency code
+    enum { NUM_SLOTS = 4 };
+
+    /// Slot of a currency code or -1 if it goes in the overflow.  Slots are
+    /// in increasing code order.
+    static int slotOf(CurrencyCode code)
+    {
+        switch (code) {
+        case CurrencyCode::CC_CLK: return 0;
+        case CurrencyCode::CC_EUR: return 1;
+        case CurrencyCode::CC_IMP: return 2;
+        case CurrencyCode::CC_USD: return 3;
+        default: return -1;
+        }
+    }
+
+    static CurrencyCode slotCode(int slot)
+    {
+        static const CurrencyCode codes[NUM_SLOTS] = {
+            CurrencyCode::CC_CLK, CurrencyCode::CC_EUR,
+            CurrencyCode::CC_IMP, CurrencyCode::CC_USD
+        };
+        return codes[slot];
+    }
+
     void clear()
     {
-        currencyAmounts.clear();
+        for (unsigned i = 0;  i < NUM_SLOTS;  ++i)
+            slots[i] = 0;
+        present = 0;
+        overflow.clear();
     }
 
     bool empty() const
     {
-        return currencyAmounts.empty();
+        return present == 0 && overflow.empty();
     }
 
     CurrencyPool()
     {
+        clear();
     }
 
     CurrencyPool(const Amount & amount)
-        : currencyAmounts(1, amount)
     {
-        if (!amount)
-            currencyAmounts.clear();
+        clear();
+        operator += (amount);
     }
 
     CurrencyPool & operator += (const Amount & amount)
     {
         if (!amount) return *this;
 
-        for (auto & am: currencyAmounts) {
+        int slot = slotOf(amount.currencyCode);
+        if (slot >= 0) {
+            slots[slot] += amount.value;
+            present |= 1u << slot;
+            return *this;
+        }
+
+        for (auto & am: overflow) {
             if (am.currencyCode == amount.currencyCode) {
                 am += amount;
                 return *this;
             }
         }
 
-        currencyAmounts.push_back(amount);
-        std::sort(currencyAmounts.begin(), currencyAmounts.end(),
+        overflow.push_back(amount);
+        std::sort(overflow.begin(), overflow.end(),
                   [] (Amount am1, Amount am2)
                   { return am1.currencyCode < am2.currencyCode; });
 
@@ -425,21 +470,31 @@ struct CurrencyPool {
 
     CurrencyPool & operator += (const CurrencyPool & other)
     {
-        for (auto & am: other.currencyAmounts)
+        // absent slots hold zero so they can be added blindly
+        for (unsigned i = 0;  i < NUM_SLOTS;  ++i)
+            slots[i] += other.slots[i];
+        present |= other.nonZeroSlots();
+        for (auto & am: other.overflow)
             operator += (am);
         return *this;
     }
 
     CurrencyPool & operator -= (const CurrencyPool & other)
     {
-        for (auto & am: other.currencyAmounts)
+        for (unsigned i = 0;  i < NUM_SLOTS;  ++i)
+            slots[i] -= other.slots[i];
+        present |= other.nonZeroSlots();
+        for (auto & am: other.overflow)
             operator -= (am);
         return *this;
     }
 
     CurrencyPool operator *= (double factor)
     {
-        for (auto & am: currencyAmounts) am = am * factor;
+        for (unsigned i = 0;  i < NUM_SLOTS;  ++i)
+            slots[i] = static_cast<int64_t>(static_cast<double>(slots[i])
+                                            * factor);
+        for (auto & am: overflow) am = am * factor;
         return *this;
     }
 
@@ -471,10 +526,17 @@ struct CurrencyPool {
     {
         CurrencyPool result;
 
-        for (auto & am: other.currencyAmounts) {
+        for (unsigned i = 0;  i < NUM_SLOTS;  ++i) {
+            int64_t value = std::min(slots[i], other.slots[i]);
+            bool keep = (other.present >> i & 1) && value != 0;
+            result.slots[i] = keep ? value : 0;
+            result.present |= unsigned(keep) << i;
+        }
+
+        for (auto & am: other.overflow) {
             Amount a = getAvailable(am.currencyCode).limit(am);
             if (a)
-                result.currencyAmounts.push_back(a);
+                result.overflow.push_back(a);
         }
 
         return result;
@@ -485,9 +547,16 @@ struct CurrencyPool {
     {
         CurrencyPool result;
 
-        for (auto & am: currencyAmounts) {
+        for (unsigned i = 0;  i < NUM_SLOTS;  ++i) {
+            bool keep = slots[i] >= 0;
+            result.slots[i] = keep ? slots[i] : 0;
+            result.present |= unsigned(keep) << i;
+        }
+        result.present &= present;
+
+        for (auto & am: overflow) {
             if (am.isNonNegative())
-                result.currencyAmounts.push_back(am);
+                result.overflow.push_back(am);
         }
 
         return result;
@@ -518,24 +587,57 @@ struct CurrencyPool {
 
     bool isNonNegative() const
     {
-        for (auto & am: currencyAmounts)
+        bool result = true;
+        for (unsigned i = 0;  i < NUM_SLOTS;  ++i)
+            result &= slots[i] >= 0;
+        for (auto & am: overflow)
             if (!am.isNonNegative())
                 return false;
-        return true;
+        return result;
     }
 
     bool isZero() const
     {
-        for (auto & am: currencyAmounts)
+        bool result = true;
+        for (unsigned i = 0;  i < NUM_SLOTS;  ++i)
+            result &= slots[i] == 0;
+        for (auto & am: overflow)
             if (!am.isZero())
                 return false;
-        return true;
+        return result;
+    }
+
+    /** Calls f(const Amount &) for every present currency, in increasing
+        currency code order.
+    */
+    template<typename F>
+    void forEach(F && f) const
+    {
+        auto it = overflow.begin(), end = overflow.end();
+        for (unsigned i = 0;  i < NUM_SLOTS;  ++i) {
+            if (!(present >> i & 1))
+                continue;
+            Amount am(slotCode(i), slots[i]);
+            for (;  it != end && it->currencyCode < am.currencyCode;  ++it)
+                f(*it);
+            f(am);
+        }
+        for (;  it != end;  ++it)
+            f(*it);
+    }
+
+    /** Number of present currencies. */
+    size_t size() const
+    {
+        return __builtin_popcount(present) + overflow.size();
     }
 
     void serialize(ML::DB::Store_Writer & store) const;
     void reconstitute(ML::DB::Store_Reader & store);
 
-    ML::compact_vector<Amount, 1> currencyAmounts;  /// Amounts per currency
+    int64_t slots[NUM_SLOTS];       ///< Amount per slot, zero if not present
+    unsigned present;               ///< Bit i set if slot i is present
+    std::vector<Amount> overflow;   ///< Currencies without a slot, sorted
 
     Json::Value toJson() const;
     std::string toString() const;
@@ -543,6 +645,17 @@ struct CurrencyPool {
     static CurrencyPool fromJson(const Json::Value & json);
 
     bool isSameOrPastVersion(const CurrencyPool & otherPool) const;
+
+private:
+    /// Mask of the slots holding a non zero amount, the ones that become
+    /// present when this pool is added to another one.
+    unsigned nonZeroSlots() const
+    {
+        unsigned mask = 0;
+        for (unsigned i = 0;  i < NUM_SLOTS;  ++i)
+            mask |= unsigned(slots[i] != 0) << i;
+        return mask;
+    }
 };
 
 std::ostream & operator << (std::ostream & stream, CurrencyPool pool);
@@ -0,0 +1,387 @@
+#include "journal.h"
+
+#include <glog/logging.h>
+#include "utils/dlog.h"
+#include "jml/db/persistent.h"
+#include "jml/utils/xxhash.h"
+#include "jml/arch/exception.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <sstream>
+
+namespace {
+
+const unsigned char JOURNAL_VERSION = 0;
+const std::string SEGMENT_PREFIX = "journal.";
+
+// anything bigger than this is a corrupted length field
+const uint32_t MAX_RECORD_SIZE = 64 * 1024 * 1024;
+
+}
+
+MTX::AccountJournal::AccountJournal(
+            const std::string& directory, int sync_interval_ms):
+                directory(directory), sync_interval(sync_interval_ms),
+                current_segment(0), truncated_segment(0), shutdown(false),
+                fd(-1), fd_segment(0){
+    if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST)
+        throw ML::Exception(errno, "creating journal directory " + directory);
+}
+
+MTX::AccountJournal::~AccountJournal(){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        shutdown = true;
+    }
+    cond.notify_one();
+    if (writer.joinable())
+        writer.join();
+    if (fd != -1)
+        ::close(fd);
+}
+
+std::string
+MTX::AccountJournal::segment_path(uint64_t segment) const{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llu", (unsigned long long)segment);
+    return directory + "/" + SEGMENT_PREFIX + name;
+}
+
+std::vector<uint64_t>
+MTX::AccountJournal::list_segments() const{
+    std::vector<uint64_t> segments;
+    DIR* dir = opendir(directory.c_str());
+    if (!dir)
+        throw ML::Exception(errno, "opening journal directory " + directory);
+    while (struct dirent* entry = readdir(dir)){
+        std::string name = entry->d_name;
+        if (name.compare(0, SEGMENT_PREFIX.size(), SEGMENT_PREFIX) != 0)
+            continue;
+        char* end;
+        const char* id = name.c_str() + SEGMENT_PREFIX.size();
+        unsigned long long segment = strtoull(id, &end, 10);
+        if (end != id && *end == '\0')
+            segments.push_back(segment);
+    }
+    closedir(dir);
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+size_t
+MTX::AccountJournal::replay(uint64_t after_segment,
+                 const std::map<std::string, uint64_t>& pending,
+                 const std::function<void (const Record&)>& on_record){
+    uint64_t first_kept = after_segment;
+    for (const auto& p : pending)
+        first_kept = std::min(first_kept, p.second - 1);
+
+    size_t replayed = 0;
+    std::vector<uint64_t> segments = list_segments();
+    for (auto segment : segments){
+        current_segment = std::max(current_segment, segment);
+        if (segment <= first_kept)
+            continue;
+        size_t n;
+        if (segment > after_segment){
+            n = replay_segment(segment, on_record);
+        }else{
+            // only the accounts that redis doesn't hold
+            n = 0;
+            replay_segment(segment, [&](const Record& record){
+                auto it = pending.find(record.key);
+                if (it == pending.end() || it->second > segment)
+                    return;
+                on_record(record);
+                ++n;
+            });
+        }
+        LOG(INFO) << "replayed " << n << " records from "
+                  << segment_path(segment);
+        replayed += n;
+    }
+    // everything up to what redis holds can go
+    truncated_segment = first_kept;
+    current_segment = std::max(current_segment, after_segment);
+    return replayed;
+}
+
+size_t
+MTX::AccountJournal::replay_segment(uint64_t segment,
+                 const std::function<void (const Record&)>& on_record){
+    std::string path = segment_path(segment);
+    int in = ::open(path.c_str(), O_RDONLY);
+    if (in == -1)
+        throw ML::Exception(errno, "opening journal segment " + path);
+
+    std::string data;
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = ::read(in, buf, sizeof(buf))) > 0)
+        data.append(buf, n);
+    ::close(in);
+    if (n == -1)
+        throw ML::Exception(errno, "reading journal segment " + path);
+
+    size_t replayed = 0;
+    size_t pos = 0;
+    while (pos + 2 * sizeof(uint32_t) <= data.size()){
+        uint32_t len, checksum;
+        memcpy(&len, data.data() + pos, sizeof(len));
+        memcpy(&checksum, data.data() + pos + sizeof(len), sizeof(checksum));
+        const char* payload = data.data() + pos + 2 * sizeof(uint32_t);
+        if (len > MAX_RECORD_SIZE
+                || pos + 2 * sizeof(uint32_t) + len > data.size()){
+            LOG(WARNING) << "truncated record at offset " << pos
+                         << " in " << path;
+            break;
+        }
+        if (XXH32(payload, len, 0) != checksum){
+            LOG(WARNING) << "corrupted record at offset " << pos
+                         << " in " << path;
+            break;
+        }
+
+        Record record;
+        ML::DB::Store_Reader store(payload, len);
+        unsigned char version, type;
+        store >> version >> type;
+        if (version != JOURNAL_VERSION)
+            throw ML::Exception("unknown journal record version in " + path);
+        record.type = (RecordType)type;
+        store >> record.key;
+        int account_type;
+        switch (record.type){
+            case SET_BUDGET:
+            case ADD_ADJUSTMENT:
+                store >> record.amount;
+                break;
+            case SET_BALANCE:
+                store >> record.amount >> account_type;
+                record.account_type = (RTBKIT::AccountType)account_type;
+                break;
+            case SYNC_FROM_SHADOW:
+                store >> record.shadow;
+                break;
+            case CREATE_ACCOUNT:
+                store >> account_type;
+                record.account_type = (RTBKIT::AccountType)account_type;
+                break;
+            case CLOSE_ACCOUNT:
+                break;
+            default:
+                throw ML::Exception("unknown journal record type in " + path);
+        }
+
+        on_record(record);
+        ++replayed;
+        pos += 2 * sizeof(uint32_t) + len;
+    }
+    return replayed;
+}
+
+void
+MTX::AccountJournal::start(){
+    std::vector<uint64_t> segments = list_segments();
+    if (!segments.empty())
+        current_segment = std::max(current_segment, segments.back());
+    ++current_segment;
+    LOG(INFO) << "journaling to " << segment_path(current_segment);
+    writer = std::thread([this](){ this->run(); });
+}
+
+void
+MTX::AccountJournal::append(const Record& record){
+    std::ostringstream payload;
+    {
+        ML::DB::Store_Writer store(payload);
+        store << JOURNAL_VERSION << (unsigned char)record.type << record.key;
+        switch (record.type){
+            case SET_BUDGET:
+            case ADD_ADJUSTMENT:
+                store << record.amount;
+                break;
+            case SET_BALANCE:
+                store << record.amount << (int)record.account_type;
+                break;
+            case SYNC_FROM_SHADOW:
+                store << record.shadow;
+                break;
+            case CREATE_ACCOUNT:
+                store << (int)record.account_type;
+                break;
+            case CLOSE_ACCOUNT:
+                break;
+        }
+    }
+
+    std::string p = payload.str();
+    uint32_t len = p.size();
+    uint32_t checksum = XXH32(p.data(), len, 0);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (chunks.empty() || chunks.back().segment != current_segment)
+        chunks.push_back(Chunk{current_segment, std::string()});
+    std::string& data = chunks.back().data;
+    data.append((const char*)&len, sizeof(len));
+    data.append((const char*)&checksum, sizeof(checksum));
+    data.append(p);
+}
+
+void
+MTX::AccountJournal::log_set_budget(const RTBKIT::AccountKey& key,
+                                    const RTBKIT::CurrencyPool& budget){
+    Record r;
+    r.type = SET_BUDGET;
+    r.key = key.toString();
+    r.amount = budget;
+    append(r);
+}
+
+void
+MTX::AccountJournal::log_set_balance(const RTBKIT::AccountKey& key,
+                                     const RTBKIT::CurrencyPool& balance,
+                                     RTBKIT::AccountType type){
+    Record r;
+    r.type = SET_BALANCE;
+    r.key = key.toString();
+    r.amount = balance;
+    r.account_type = type;
+    append(r);
+}
+
+void
+MTX::AccountJournal::log_add_adjustment(const RTBKIT::AccountKey& key,
+                                        const RTBKIT::CurrencyPool& adjustment){
+    Record r;
+    r.type = ADD_ADJUSTMENT;
+    r.key = key.toString();
+    r.amount = adjustment;
+    append(r);
+}
+
+void
+MTX::AccountJournal::log_sync_from_shadow(const std::string& name,
+                                          const RTBKIT::ShadowAccount& shadow){
+    Record r;
+    r.type = SYNC_FROM_SHADOW;
+    r.key = name;
+    r.shadow = shadow;
+    append(r);
+}
+
+void
+MTX::AccountJournal::log_create_account(const RTBKIT::AccountKey& key,
+                                        RTBKIT::AccountType type){
+    Record r;
+    r.type = CREATE_ACCOUNT;
+    r.key = key.toString();
+    r.account_type = type;
+    append(r);
+}
+
+void
+MTX::AccountJournal::log_close_account(const RTBKIT::AccountKey& key){
+    Record r;
+    r.type = CLOSE_ACCOUNT;
+    r.key = key.toString();
+    append(r);
+}
+
+uint64_t
+MTX::AccountJournal::rotate(){
+    std::lock_guard<std::mutex> guard(lock);
+    return current_segment++;
+}
+
+void
+MTX::AccountJournal::truncate(uint64_t segment){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        truncated_segment = std::max(truncated_segment, segment);
+    }
+    for (auto s : list_segments()){
+        if (s > segment)
+            break;
+        DLOGINFO("dropping journal segment " << s);
+        if (unlink(segment_path(s).c_str()) == -1 && errno != ENOENT)
+            LOG(ERROR) << "couldn't remove " << segment_path(s)
+                       << ": " << strerror(errno);
+    }
+}
+
+void
+MTX::AccountJournal::run(){
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;){
+        cond.wait_for(guard, sync_interval);
+        bool done = shutdown;
+
+        std::deque<Chunk> pending;
+        pending.swap(chunks);
+        uint64_t truncated = truncated_segment;
+        guard.unlock();
+
+        if (!pending.empty()){
+            for (auto& chunk : pending){
+                if (chunk.segment <= truncated)
+                    continue;
+                write_chunk(chunk.segment, chunk.data);
+            }
+            sync_file();
+        }
+        if (fd != -1 && fd_segment <= truncated){
+            ::close(fd);
+            fd = -1;
+        }
+
+        guard.lock();
+        if (done && chunks.empty())
+            return;
+    }
+}
+
+void
+MTX::AccountJournal::write_chunk(uint64_t segment, const std::string& data){
+    if (fd == -1 || fd_segment != segment){
+        if (fd != -1){
+            sync_file();
+            ::close(fd);
+        }
+        std::string path = segment_path(segment);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd == -1){
+            LOG(ERROR) << "couldn't open " << path << ": " << strerror(errno);
+            return;
+        }
+        fd_segment = segment;
+    }
+
+    const char* p = data.data();
+    size_t left = data.size();
+    while (left){
+        ssize_t n = ::write(fd, p, left);
+        if (n == -1){
+            if (errno == EINTR)
+                continue;
+            LOG(ERROR) << "journal write failed: " << strerror(errno);
+            return;
+        }
+        p += n;
+        left -= n;
+    }
+}
+
+void
+MTX::AccountJournal::sync_file(){
+    if (fd != -1 && fdatasync(fd) == -1)
+        LOG(ERROR) << "journal fdatasync failed: " << strerror(errno);
+}
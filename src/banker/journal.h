@@ -0,0 +1,157 @@
+#ifndef __MTX_JOURNAL_H__
+#define __MTX_JOURNAL_H__
+
+#include <string>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+
+#include "account.h"
+#include "account_key.h"
+
+namespace MTX {
+
+/*****************************************************************************/
+/* ACCOUNT JOURNAL                                                           */
+/*****************************************************************************/
+
+/** Local append-only log of the account mutations applied by the master
+    banker since the last successful redis dump.
+
+    The journal is split in numbered segments (<directory>/journal.<id>).
+    Every redis dump starts by rotating to a new segment, and once redis has
+    acknowledged the dump all the segments up to the rotated one can be
+    dropped.  At startup the segments that are more recent than what redis
+    holds are replayed on top of the loaded accounts.
+
+    Records are appended from the event loop into an in-memory buffer and a
+    background thread writes and fdatasync()s them in batches every
+    sync_interval_ms milliseconds, so a crash loses at most one batch.
+
+    On-disk record layout (host byte order, the file never leaves the box) :
+
+        uint32_t payload length
+        uint32_t XXH32 checksum of the payload
+        payload  (ML::DB serialization, see Record)
+*/
+struct AccountJournal {
+
+    enum RecordType {
+        SET_BUDGET       = 1,
+        SET_BALANCE      = 2,
+        ADD_ADJUSTMENT   = 3,
+        SYNC_FROM_SHADOW = 4,
+        CREATE_ACCOUNT   = 5,
+        CLOSE_ACCOUNT    = 6
+    };
+
+    struct Record {
+        Record() : type(SET_BUDGET), account_type(RTBKIT::AT_NONE) { }
+
+        RecordType type;
+        std::string key;
+        RTBKIT::CurrencyPool amount;      // budget, balance, adjustment
+        RTBKIT::AccountType account_type; // balance, create
+        RTBKIT::ShadowAccount shadow;     // sync from shadow
+    };
+
+    AccountJournal(const std::string& directory, int sync_interval_ms);
+
+    // flushes whatever is pending and stops the writer thread
+    ~AccountJournal();
+
+    /*
+    Replays, in order, every record stored in the segments whose id is
+    greater than after_segment. Corrupted or truncated records end the
+    replay of their segment. Must be called before start().
+    pending : accounts left out of the redis state, with the first segment
+    whose records they still need; these records are replayed even when
+    they are older than after_segment.
+    @return the number of records replayed
+    */
+    size_t replay(uint64_t after_segment,
+                  const std::map<std::string, uint64_t>& pending,
+                  const std::function<void (const Record&)>& on_record);
+
+    /*
+    Starts the writer thread, new records go to a segment that is newer
+    than any segment already on disk.
+    */
+    void start();
+
+    void log_set_budget(const RTBKIT::AccountKey& key,
+                        const RTBKIT::CurrencyPool& budget);
+
+    void log_set_balance(const RTBKIT::AccountKey& key,
+                         const RTBKIT::CurrencyPool& balance,
+                         RTBKIT::AccountType type);
+
+    void log_add_adjustment(const RTBKIT::AccountKey& key,
+                            const RTBKIT::CurrencyPool& adjustment);
+
+    // name : the raw "a:b:c" form of the key
+    void log_sync_from_shadow(const std::string& name,
+                              const RTBKIT::ShadowAccount& shadow);
+
+    void log_create_account(const RTBKIT::AccountKey& key,
+                            RTBKIT::AccountType type);
+
+    void log_close_account(const RTBKIT::AccountKey& key);
+
+    /*
+    Closes the current segment and starts a new one. Everything logged
+    before the call lives in segments <= the returned id.
+    */
+    uint64_t rotate();
+
+    /*
+    Drops all the segments <= segment, once their content is known to be
+    safely stored somewhere else.
+    */
+    void truncate(uint64_t segment);
+
+private:
+
+    void append(const Record& record);
+
+    void run();
+
+    void write_chunk(uint64_t segment, const std::string& data);
+
+    void sync_file();
+
+    std::string segment_path(uint64_t segment) const;
+
+    std::vector<uint64_t> list_segments() const;
+
+    size_t replay_segment(uint64_t segment,
+                          const std::function<void (const Record&)>& on_record);
+
+    struct Chunk {
+        uint64_t segment;
+        std::string data;
+    };
+
+    std::string directory;
+    std::chrono::milliseconds sync_interval;
+
+    // protected by lock
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<Chunk> chunks;
+    uint64_t current_segment;
+    uint64_t truncated_segment;
+    bool shutdown;
+
+    // only touched by the writer thread
+    int fd;
+    uint64_t fd_segment;
+
+    std::thread writer;
+};
+
+}
+#endif
@@ -0,0 +1,90 @@
+#include "save_script.h"
+
+#include <glog/logging.h>
+
+#include <boost/algorithm/string.hpp>
+
+/*
+KEYS : account, generations hash, active set, archive set
+ARGV : account name, generation, account JSON, "1" if the account is closed
+*/
+const std::string MTX::SaveScript::SCRIPT =
+    "local gen = tonumber(redis.call('HGET', KEYS[2], ARGV[1]) or 0)\n"
+    "if gen > tonumber(ARGV[2]) then return 0 end\n"
+    "redis.call('SET', KEYS[1], ARGV[3])\n"
+    "redis.call('HSET', KEYS[2], ARGV[1], ARGV[2])\n"
+    "local from, to = KEYS[4], KEYS[3]\n"
+    "if ARGV[4] == '1' then from, to = KEYS[3], KEYS[4] end\n"
+    "if redis.call('SMOVE', from, to, ARGV[1]) == 1 then\n"
+    "    if ARGV[4] == '1' then return 2 end\n"
+    "else\n"
+    "    redis.call('SADD', to, ARGV[1])\n"
+    "end\n"
+    "return 1\n";
+
+MTX::SaveScript::SaveScript(std::shared_ptr<Redis::AsyncConnection> conn,
+        const std::string& prefix, const std::string& generations,
+        const std::string& active, const std::string& archive)
+    : conn(conn), prefix(prefix), generations(generations),
+      active(active), archive(archive){
+}
+
+Redis::Results
+MTX::SaveScript::run(const std::vector<Write>& writes, uint64_t generation){
+    Redis::Results results;
+    results.resize(writes.size());
+    std::vector<size_t> todo;
+    for(size_t i = 0; i < writes.size(); ++i)
+        todo.push_back(i);
+
+    // a second NOSCRIPT is reported, the script doesn't stay loaded
+    for(int attempt = 0; attempt < 2 && !todo.empty(); ++attempt){
+        if(sha.empty()){
+            Redis::Result loaded =
+                    conn->exec(Redis::Command("SCRIPT", "LOAD", SCRIPT));
+            if(!loaded.ok() || loaded.reply().type() != Redis::STRING){
+                std::string error = loaded.ok()
+                        ? "unexpected reply to SCRIPT LOAD" : loaded.error();
+                LOG(ERROR) << "couldn't load the save script: " << error;
+                for(size_t i : todo)
+                    results[i] = Redis::Result(error);
+                return results;
+            }
+            sha = loaded.reply().asString();
+        }
+
+        Redis::CommandBuffer commands;
+        for(size_t i : todo){
+            const Write& write = writes[i];
+            commands.start("EVALSHA", 10);
+            commands.addArg(sha);
+            commands.addArg((int64_t)4);
+            commands.addArg(prefix, write.key);
+            commands.addArg(generations);
+            commands.addArg(active);
+            commands.addArg(archive);
+            commands.addArg(write.key);
+            commands.addArg((int64_t)generation);
+            commands.addArg(write.account);
+            commands.addArg(write.closed ? "1" : "0");
+        }
+        Redis::Results replies = conn->execMulti(commands);
+
+        std::vector<size_t> retry;
+        for(size_t j = 0; j < todo.size(); ++j){
+            Redis::Result reply = j < replies.size() ? replies[j]
+                    : Redis::Result(replies.ok() ? "no reply" : replies.error());
+            if(attempt == 0 && !reply.ok()
+                    && boost::starts_with(reply.error(), "NOSCRIPT"))
+                retry.push_back(todo[j]);
+            else
+                results[todo[j]] = reply;
+        }
+        if(!retry.empty()){
+            LOG(WARNING) << "redis lost the save script, loading it again";
+            sha.clear();
+        }
+        todo.swap(retry);
+    }
+    return results;
+}
@@ -0,0 +1,69 @@
+#ifndef __MTX_SAVE_SCRIPT_H__
+#define __MTX_SAVE_SCRIPT_H__
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "soa/service/redis.h"
+
+namespace MTX {
+
+/*****************************************************************************/
+/* SAVE SCRIPT                                                               */
+/*****************************************************************************/
+
+/** Server side compare-and-set of the accounts for --redis_cas : an
+    account is written with the generation of its dump unless a later
+    generation already wrote it, and moved between the active and the
+    archive sets according to its status.
+
+    The script is loaded once per connection, the first time it is needed,
+    and then run with EVALSHA.  A server that lost it (restarted, or
+    SCRIPT FLUSH) answers NOSCRIPT : it is then loaded again and the
+    writes it refused are sent again, once.
+
+    Every write is a script run of its own : when some accounts are
+    refused the others are still written, there is no all or nothing.
+*/
+struct SaveScript {
+
+    struct Write {
+        std::string key;      // account name
+        std::string account;  // account JSON
+        bool closed;
+    };
+
+    /*
+    @param prefix of the account keys
+    @param generations hash of the generation that last wrote every account
+    @param active and archive sets of the account names
+    */
+    SaveScript(std::shared_ptr<Redis::AsyncConnection> conn,
+               const std::string& prefix, const std::string& generations,
+               const std::string& active, const std::string& archive);
+
+    /*
+    Writes the accounts at generation. One result per write, in order :
+    the error, or the script's integer reply, 0 if a later generation
+    wrote the account, 2 if the account was moved to the archive and 1
+    otherwise.
+    */
+    Redis::Results run(const std::vector<Write>& writes, uint64_t generation);
+
+    static const std::string SCRIPT;
+
+private :
+
+    std::shared_ptr<Redis::AsyncConnection> conn;
+    std::string prefix;
+    std::string generations;
+    std::string active;
+    std::string archive;
+
+    // of the loaded script, empty until then
+    std::string sha;
+};
+
+}
+#endif
@@ -0,0 +1,184 @@
+#include "snapshot.h"
+
+#include <glog/logging.h>
+#include "utils/dlog.h"
+#include "jml/db/persistent.h"
+#include "jml/utils/xxhash.h"
+#include "jml/arch/exception.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <sstream>
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = "MTXSNAP";
+const uint32_t SNAPSHOT_VERSION = 1;
+
+// XXH32 takes an int length, bigger bodies are hashed in chained blocks
+const size_t CHECKSUM_BLOCK = 1 << 30;
+
+uint32_t checksum(const char* data, size_t size){
+    uint32_t h = 0;
+    do {
+        size_t n = std::min(size, CHECKSUM_BLOCK);
+        h = XXH32(data, n, h);
+        data += n;
+        size -= n;
+    } while (size);
+    return h;
+}
+
+bool valid_header(const MTX::AccountsSnapshot::Header& header,
+                  size_t file_size, const std::string& path){
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0){
+        LOG(WARNING) << path << " is not a snapshot";
+        return false;
+    }
+    if (header.version != SNAPSHOT_VERSION
+            || header.header_size != sizeof(header)){
+        LOG(WARNING) << "unsupported snapshot version " << header.version
+                     << " in " << path;
+        return false;
+    }
+    if (header.header_size + header.body_size != file_size){
+        LOG(WARNING) << "truncated snapshot " << path;
+        return false;
+    }
+    return true;
+}
+
+}
+
+void
+MTX::AccountsSnapshot::write(const std::string& path,
+                             const RTBKIT::Accounts& accounts,
+                             uint64_t generation,
+                             uint64_t journal_segment){
+    std::ostringstream stream;
+    {
+        ML::DB::Store_Writer store(stream);
+        accounts.serialize(store);
+    }
+    std::string body = stream.str();
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(header);
+    header.generation = generation;
+    header.journal_segment = journal_segment;
+    size_t n = 0;
+    accounts.forEachAccount([&](const RTBKIT::AccountKey&,
+                                const RTBKIT::Account&){ ++n; });
+    header.accounts = n;
+    header.body_size = body.size();
+    header.checksum = checksum(body.data(), body.size());
+
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw ML::Exception(errno, "opening snapshot " + tmp);
+
+    auto write_all = [&](const char* p, size_t left){
+        while (left){
+            ssize_t w = ::write(fd, p, left);
+            if (w == -1){
+                if (errno == EINTR)
+                    continue;
+                int err = errno;
+                ::close(fd);
+                unlink(tmp.c_str());
+                throw ML::Exception(err, "writing snapshot " + tmp);
+            }
+            p += w;
+            left -= w;
+        }
+    };
+    write_all((const char*)&header, sizeof(header));
+    write_all(body.data(), body.size());
+
+    if (fdatasync(fd) == -1){
+        int err = errno;
+        ::close(fd);
+        unlink(tmp.c_str());
+        throw ML::Exception(err, "syncing snapshot " + tmp);
+    }
+    ::close(fd);
+
+    if (rename(tmp.c_str(), path.c_str()) == -1)
+        throw ML::Exception(errno, "renaming snapshot " + tmp);
+    DLOGINFO("snapshot " << generation << " written to " << path);
+}
+
+bool
+MTX::AccountsSnapshot::read_header(const std::string& path, Header& header){
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1){
+        if (errno != ENOENT)
+            LOG(WARNING) << "couldn't open " << path << ": " << strerror(errno);
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0
+           && (size_t)st.st_size >= sizeof(header)
+           && ::read(fd, &header, sizeof(header)) == sizeof(header)
+           && valid_header(header, st.st_size, path);
+    ::close(fd);
+    return ok;
+}
+
+bool
+MTX::AccountsSnapshot::read(const std::string& path,
+                            RTBKIT::Accounts& accounts,
+                            Header& header){
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1){
+        if (errno != ENOENT)
+            LOG(WARNING) << "couldn't open " << path << ": " << strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(header)){
+        ::close(fd);
+        return false;
+    }
+    void* addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED){
+        LOG(WARNING) << "couldn't map " << path << ": " << strerror(errno);
+        return false;
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    bool ok = false;
+    const char* data = (const char*)addr;
+    memcpy(&header, data, sizeof(header));
+    const char* body = data + sizeof(header);
+    if (valid_header(header, st.st_size, path)){
+        if (checksum(body, header.body_size) != header.checksum){
+            LOG(WARNING) << "corrupted snapshot " << path;
+        }else{
+            try{
+                RTBKIT::Accounts loaded;
+                ML::DB::Store_Reader store(body, header.body_size);
+                loaded.reconstitute(store);
+                accounts = loaded;
+                ok = true;
+            }catch(const std::exception& e){
+                LOG(WARNING) << "couldn't decode snapshot " << path
+                             << ": " << e.what();
+            }
+        }
+    }
+    munmap(addr, st.st_size);
+    return ok;
+}
@@ -0,0 +1,62 @@
+#ifndef __MTX_SNAPSHOT_H__
+#define __MTX_SNAPSHOT_H__
+
+#include <string>
+#include <stdint.h>
+
+#include "account.h"
+
+namespace MTX {
+
+/*****************************************************************************/
+/* ACCOUNTS SNAPSHOT                                                         */
+/*****************************************************************************/
+
+/** Local on-disk copy of the whole account tree, written at every redis
+    dump so that a restarting banker doesn't have to wait for redis.
+
+    The file is a fixed size header followed by the ML::DB serialization of
+    RTBKIT::Accounts. It is mmapped on load and the header plus the body
+    checksum are validated before anything is decoded. Files are written
+    to <path>.tmp and renamed so a crash never leaves a partial snapshot.
+*/
+struct AccountsSnapshot {
+
+    struct Header {
+        char magic[8];             // "MTXSNAP\0"
+        uint32_t version;
+        uint32_t header_size;
+        uint64_t generation;       // persist generation, see banker:generation
+        uint64_t journal_segment;  // last journal segment included
+        uint64_t accounts;
+        uint64_t body_size;
+        uint32_t checksum;         // chained XXH32 of the body
+        uint32_t reserved;
+    };
+
+    /*
+    Writes the snapshot atomically, throws ML::Exception on error.
+    */
+    static void write(const std::string& path,
+                      const RTBKIT::Accounts& accounts,
+                      uint64_t generation,
+                      uint64_t journal_segment);
+
+    /*
+    Reads the snapshot header only.
+    @return false if the file is missing or the header is invalid
+    */
+    static bool read_header(const std::string& path, Header& header);
+
+    /*
+    Loads and validates the snapshot.
+    @return false if the file is missing or invalid, accounts are then
+            left untouched
+    */
+    static bool read(const std::string& path,
+                     RTBKIT::Accounts& accounts,
+                     Header& header);
+};
+
+}
+#endif
@@ -42,32 +42,29 @@
 // CLI paramters
 DEFINE_int32(http_port, 7001, "Port to listen on with HTTP protocol");
 DEFINE_string(ip, "0.0.0.0", "IP/Hostname to bind to");
-DEFINE_string(redis_uri, "127.0.0.1:6379", "redis host:port");
+DEFINE_string(redis_uri, "127.0.0.1:6379", "redis host:port, or a comma separated list of them to spread the accounts across, each followed by its |host:port fallbacks. Changing the number of instances needs the stored accounts migrated");
+DEFINE_string(redis_fallback_uris, "", "Comma separated redis host:port tried in turn when the first redis_uri is down");
 DEFINE_int32(redis_db, 0, "Redis DB number");
 DEFINE_int32(redis_dump_interval, 5, "Redis dump interval");
 DEFINE_string(name, "MasterBanker", "Master banker name");
 DEFINE_string(carbon_host, "127.0.0.1", "carbon host");
 DEFINE_int32(carbon_port, 2003, "carbon port");
+DEFINE_int32(http_threads, 0, "HTTP I/O threads, 0 to serve from the accounts thread");
 
 struct event_base *base;
 std::shared_ptr<CarbonLogger> clog;
 std::shared_ptr<MTX::MasterBanker> banker;
 
-void signal_handler(int signal){
+/* run on the loop, which the last dump needs to reach redis : the banker
+   breaks it once the dump is stored */
+void signal_cb(evutil_socket_t sig, short what, void* arg){
     LOG(WARNING) << "shutting down";
-    event_base_loopbreak(base);
-    banker->persist_redis();
-    clog->stop_dumping_thread();
+    banker->shutdown();
 }
 
 int
 main(int argc, char **argv)
 {
-    struct evhttp *http;
-    struct evhttp_bound_socket *handle;
-
-    unsigned short port = 0;
-
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
     	return (1);
 
@@ -81,20 +78,38 @@ main(int argc, char **argv)
     	return 1;
     }
 
-    /* Create a new evhttp object to handle requests. */
-    http = evhttp_new(base);
-    if (!http) {
-    	LOG(ERROR) << "couldn't create evhttp. Exiting.";
-    	return 1;
+    /* one connection per shard, with the addresses of its fallbacks */
+    std::vector<std::vector<Redis::Address>> shards;
+    std::stringstream uris(FLAGS_redis_uri);
+    std::string shard, uri;
+    while (std::getline(uris, shard, ',')) {
+        std::vector<Redis::Address> addresses;
+        std::stringstream alternatives(shard);
+        while (std::getline(alternatives, uri, '|'))
+            if (!uri.empty())
+                addresses.push_back(Redis::Address(uri));
+        if (!addresses.empty())
+            shards.push_back(addresses);
+    }
+    if (shards.empty()) {
+        LOG(ERROR) << "no redis to connect to: exiting";
+        return 1;
+    }
+    std::stringstream fallbacks(FLAGS_redis_fallback_uris);
+    while (std::getline(fallbacks, uri, ','))
+        if (!uri.empty())
+            shards[0].push_back(Redis::Address(uri));
+
+    /* Redis I/O runs on the accounts loop, and reconnects by itself */
+    std::vector<std::shared_ptr<Redis::AsyncConnection>> redis;
+    for (auto& addresses : shards) {
+        auto connection = std::make_shared<Redis::AsyncConnection>();
+        connection->connect(addresses, base);
+        if(FLAGS_redis_db != 0)
+            connection->select(FLAGS_redis_db);
+        connection->test();
+        redis.push_back(connection);
     }
-
-    auto address = Redis::Address(FLAGS_redis_uri);
-
-    std::shared_ptr<Redis::AsyncConnection> redis;
-    redis = std::make_shared<Redis::AsyncConnection>(FLAGS_redis_uri);
-    if(FLAGS_redis_db != 0)
-        redis->select(FLAGS_redis_db);
-    redis->test();
 
     /* Start carbon loop in a separate thread */
     boost::asio::io_service ios;
@@ -109,19 +124,16 @@ main(int argc, char **argv)
     banker = std::make_shared<MTX::MasterBanker>(base, redis, clog);
     banker->initialize();
 
-    /* The callback */
-    evhttp_set_gencb(http, MTX::MasterBanker::request_cb, banker.get());
-
     /* Now we tell the evhttp what port to listen on */
-    handle = evhttp_bind_socket_with_handle(http,
-                    FLAGS_ip.c_str(), (unsigned short)FLAGS_http_port);
-    if (!handle) {
-    	LOG(ERROR) << "couldn't bind to port " << port << ". Exiting.";
+    if (!banker->listen(FLAGS_ip, FLAGS_http_port, FLAGS_http_threads)) {
+    	LOG(ERROR) << "couldn't bind to port " << FLAGS_http_port << ". Exiting.";
     	return 1;
     }
 
-    std::signal(SIGINT, signal_handler);
-    std::signal(SIGTERM, signal_handler);
+    event* sigint = evsignal_new(base, SIGINT, signal_cb, NULL);
+    event* sigterm = evsignal_new(base, SIGTERM, signal_cb, NULL);
+    event_add(sigint, NULL);
+    event_add(sigterm, NULL);
 
     event* e = event_new(base, -1, EV_TIMEOUT | EV_PERSIST,
                                 MTX::MasterBanker::persist, banker.get());
@@ -132,5 +144,6 @@ main(int argc, char **argv)
             ":" << FLAGS_http_port << " ...";
     event_base_dispatch(base);
 
+    clog->stop_dumping_thread();
     return 0;
 }
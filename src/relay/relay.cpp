@@ -16,17 +16,27 @@
 
 #include <boost/algorithm/string.hpp>
 
+#include <strings.h>
 #include <algorithm>
 
 
 DEFINE_int32(mbr_upstream_connections, 15, "Minimum amount of connections for each upstream");
 DEFINE_int32(mbr_requests_recycling, 100000, "Amount of request made by each connection before recycling it");
+DEFINE_int32(mbr_change_poll_ms, 50, "Interval between two polls of the shards for a /v1/changes long poll");
+DEFINE_int32(mbr_loop_lag_probe_ms, 10, "Interval between two measures of the event loop lag in ms, 0 to disable them");
+DEFINE_int32(mbr_shed_lag_ms, 250, "Loop lag in ms above which requests to every shard get a 503, 0 to never shed them");
+DEFINE_int32(mbr_shed_retry_after, 1, "Seconds in the Retry-After of a shed request");
 
 
 MTX::Relay::Relay(const rapidjson::Document& conf, struct event_base *base){
     LOG(INFO) << "building configuration ...";
 
     this->base = base;
+    shed_requests = 0;
+    if(FLAGS_mbr_loop_lag_probe_ms > 0)
+        loop_lag.reset(new LoopLagMonitor(base, FLAGS_mbr_loop_lag_probe_ms,
+                                          &loop_lag_histogram));
+
     rapidjson::StringBuffer buffer;
     rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
     conf.Accept(writer);
@@ -129,6 +139,18 @@ MTX::Relay::process_request(struct evhttp_request *req){
         DLOGINFO("\t" << it->first << " : " << it->second);
 #endif
 
+    if(path == "/v1/_stats" && cmdtype == "GET"){
+        send_stats(req);
+        return;
+    }
+
+    if(path == "/v1/changes" && cmdtype == "GET"){
+        // every shard has its own change feed
+        if(!shed(req))
+            changes_shoot(req, qs_map);
+        return;
+    }
+
     std::string parent_account =
         get_parent_account(path, cmdtype, qs_map);
 
@@ -137,13 +159,65 @@ MTX::Relay::process_request(struct evhttp_request *req){
         single_shoot(req, parent_account, uri);
     }else if(parent_account.size()){
         // it's a multiple request
-        multiple_shoot(req, uri);
+        if(!shed(req))
+            multiple_shoot(req, uri);
     }else{
         evhttp_send_reply(req, 500, "Error", NULL);
     }
 
 }
 
+bool
+MTX::Relay::shed(struct evhttp_request *req){
+    if(FLAGS_mbr_shed_lag_ms <= 0 || !loop_lag
+            || loop_lag->lag() <= (uint64_t)FLAGS_mbr_shed_lag_ms * 1000)
+        return false;
+    ++shed_requests;
+    send_unavailable(req, std::to_string(FLAGS_mbr_shed_retry_after));
+    return true;
+}
+
+void
+MTX::Relay::send_unavailable(struct evhttp_request *req,
+                             const std::string& retry_after){
+    evhttp_add_header(evhttp_request_get_output_headers(req),
+                      "Retry-After", retry_after.c_str());
+    evhttp_send_reply(req, 503, "Service Unavailable", NULL);
+}
+
+void
+MTX::Relay::send_stats(struct evhttp_request *req){
+    MTX::LatencyHistogram::Snapshot lag = loop_lag_histogram.snapshot();
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("lag_us");
+    writer.Uint64(loop_lag ? loop_lag->lag() : 0);
+    writer.Key("loop_lag");
+    writer.StartObject();
+    writer.Key("count");
+    writer.Uint64(lag.count);
+    writer.Key("mean_us");
+    writer.Uint64(lag.mean());
+    writer.Key("p50_us");
+    writer.Uint64(lag.percentile(0.5));
+    writer.Key("p90_us");
+    writer.Uint64(lag.percentile(0.9));
+    writer.Key("p99_us");
+    writer.Uint64(lag.percentile(0.99));
+    writer.EndObject();
+    writer.Key("shed");
+    writer.Uint64(shed_requests);
+    writer.EndObject();
+
+    struct evbuffer* req_buf = evhttp_request_get_output_buffer(req);
+    evbuffer_add(req_buf, buffer.GetString(), buffer.GetSize());
+    evhttp_add_header(evhttp_request_get_output_headers(req),
+                      "Content-Type", "application/json");
+    evhttp_send_reply(req, HTTP_OK, "OK", req_buf);
+}
+
 void
 MTX::Relay::single_shoot(
         struct evhttp_request *req,
@@ -225,11 +299,14 @@ MTX::Relay::multiple_shoot(
         struct evhttp_request *relay_req =
             evhttp_request_new(multiple_relay_cb, holder);
 
-        // set the headers
+        // set the headers, the merged reply has no single version so
+        // conditional requests are not passed on
         struct evkeyval *header;
         struct evkeyvalq *headers = evhttp_request_get_input_headers(req);
         for (header = headers->tqh_first; header;
             header = header->next.tqe_next){
+            if(!strcasecmp(header->key, "If-None-Match"))
+                continue;
             evhttp_add_header(
                 relay_req->output_headers, header->key, header->value);
         }
@@ -261,10 +338,17 @@ MTX::Relay::process_relay(
         struct evbuffer* req_buf =
             evhttp_request_get_output_buffer(original_req);
         evbuffer_add_printf(req_buf, "%s", body.c_str());
+        // the version of the account, for conditional requests
+        const char* etag = evhttp_find_header(
+            evhttp_request_get_input_headers(relay_req), "ETag");
+        if(etag)
+            evhttp_add_header(
+                evhttp_request_get_output_headers(original_req), "ETag", etag);
         // send the reply
+        int code = evhttp_request_get_response_code(relay_req);
         evhttp_send_reply(original_req,
-            evhttp_request_get_response_code(relay_req),
-            "OK",
+            code,
+            code == HTTP_NOTMODIFIED ? "Not Modified" : "OK",
             req_buf);
     }else{
         DLOGINFO("relay request is NULL");
@@ -288,6 +372,12 @@ MTX::Relay::process_multiple_relay(
         evhttp_request_get_input_buffer(relay_req);
     std::string body = get_body(buf);
     holder->bodies.push_back(body);
+    if(evhttp_request_get_response_code(relay_req) == 503){
+        // the shard is shedding, there is no partial reply to merge
+        const char* retry_after = evhttp_find_header(
+            evhttp_request_get_input_headers(relay_req), "Retry-After");
+        holder->retry_after = retry_after ? retry_after : "1";
+    }
 
     holder->response_counter += 1;
 
@@ -296,18 +386,22 @@ MTX::Relay::process_multiple_relay(
         return false;
     }
 
-    // we got all the answers, we can reply now
-    std::string result_body = add_replies(holder->bodies);
-    DLOGINFO("result_body : " << result_body);
-    struct evbuffer* req_buf =
-        evhttp_request_get_output_buffer(holder->original_req);
-    evbuffer_add_printf(req_buf, "%s", result_body.c_str());
+    if(holder->retry_after.size()){
+        send_unavailable(holder->original_req, holder->retry_after);
+    }else{
+        // we got all the answers, we can reply now
+        std::string result_body = add_replies(holder->bodies);
+        DLOGINFO("result_body : " << result_body);
+        struct evbuffer* req_buf =
+            evhttp_request_get_output_buffer(holder->original_req);
+        evbuffer_add_printf(req_buf, "%s", result_body.c_str());
 
-    // send the reply
-    evhttp_send_reply(holder->original_req,
-        evhttp_request_get_response_code(relay_req),
-        "OK",
-        req_buf);
+        // send the reply
+        evhttp_send_reply(holder->original_req,
+            evhttp_request_get_response_code(relay_req),
+            "OK",
+            req_buf);
+    }
 
     // clean up connections
     for(std::size_t i = 0; i < holder->connections.size(); ++i){
@@ -317,6 +411,207 @@ MTX::Relay::process_multiple_relay(
     return true;
 }
 
+void
+MTX::Relay::changes_shoot(
+        struct evhttp_request *req,
+        std::map<std::string, std::string>& qs_map){
+
+    changes_placeholder* holder = new changes_placeholder;
+    holder->self = this;
+    holder->original_req = req;
+    holder->retry_event = nullptr;
+    holder->waiting = false;
+    holder->closed = false;
+
+    // the version is the versions of the shards joined by dots, anything
+    // else gets every account
+    boost::split(holder->versions, qs_map["since"], boost::is_any_of("."));
+    if(holder->versions.size() != shards.size())
+        holder->versions.assign(shards.size(), "");
+
+    int wait_ms = std::min(std::max(atoi(qs_map["wait"].c_str()), 0), 60000);
+    struct timeval wait = {wait_ms / 1000, (wait_ms % 1000) * 1000};
+    struct timeval now;
+    evutil_gettimeofday(&now, NULL);
+    evutil_timeradd(&now, &wait, &holder->deadline);
+
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                  changes_closed_cb, holder);
+    shoot_changes(holder);
+}
+
+void
+MTX::Relay::shoot_changes(changes_placeholder* holder){
+    holder->bodies.assign(shards.size(), "");
+    holder->response_counter = 0;
+    holder->failed = false;
+    holder->retry_after.clear();
+
+    size_t i = 0;
+    shard_map::iterator it;
+    for(it = shards.begin(); it != shards.end(); ++it, ++i){
+        std::pair<std::string, unsigned short> banker_uri = it->second;
+        // the pools of the single account requests, a shard's number
+        // being the slot its accounts hash to
+        MTX::HttpConnectionPool& conn_pool = get_connection_pool(
+                banker_uri.first, banker_uri.second, it->first);
+        struct evhttp_connection* conn = conn_pool.get_connection();
+
+        changes_shard_request* shard_req = new changes_shard_request;
+        shard_req->holder = holder;
+        shard_req->shard = i;
+        shard_req->connection = conn;
+        shard_req->conn_pool = &conn_pool;
+        struct evhttp_request *relay_req =
+            evhttp_request_new(changes_cb, shard_req);
+        evhttp_add_header(relay_req->output_headers,
+                          "Host", banker_uri.first.c_str());
+        conn_pool.set_connection_header(relay_req, conn);
+
+        std::string uri = "/v1/changes?since=" + holder->versions[i];
+        evhttp_make_request(conn, relay_req, EVHTTP_REQ_GET, uri.c_str());
+    }
+}
+
+void
+MTX::Relay::changes_cb(struct evhttp_request *req, void *arg){
+    changes_shard_request* shard_req = (changes_shard_request*)arg;
+    changes_placeholder* holder = shard_req->holder;
+    if(req && evhttp_request_get_response_code(req) == HTTP_OK){
+        holder->bodies[shard_req->shard] =
+            holder->self->get_body(evhttp_request_get_input_buffer(req));
+    }else{
+        holder->failed = true;
+        if(req && evhttp_request_get_response_code(req) == 503){
+            const char* retry_after = evhttp_find_header(
+                evhttp_request_get_input_headers(req), "Retry-After");
+            holder->retry_after = retry_after ? retry_after : "1";
+        }
+    }
+    shard_req->conn_pool->return_connection(shard_req->connection);
+    delete shard_req;
+
+    holder->response_counter += 1;
+    if(holder->response_counter == (int)holder->bodies.size())
+        holder->self->process_changes(holder);
+}
+
+void
+MTX::Relay::changes_retry_cb(evutil_socket_t fd, short what, void* arg){
+    changes_placeholder* holder = (changes_placeholder*)arg;
+    holder->waiting = false;
+    holder->self->shoot_changes(holder);
+}
+
+void
+MTX::Relay::changes_closed_cb(struct evhttp_connection* conn, void* arg){
+    changes_placeholder* holder = (changes_placeholder*)arg;
+    if(holder->waiting){
+        event_free(holder->retry_event);
+        delete holder;
+    }else{
+        // the shards are still answering, process_changes drops it
+        holder->closed = true;
+    }
+}
+
+void
+MTX::Relay::process_changes(changes_placeholder* holder){
+    if(holder->closed){
+        if(holder->retry_event)
+            event_free(holder->retry_event);
+        delete holder;
+        return;
+    }
+
+    // merge the accounts, every shard has its own top level accounts
+    rapidjson::Document result;
+    result.SetObject();
+    rapidjson::Document::AllocatorType& allocator = result.GetAllocator();
+    rapidjson::Value accounts(rapidjson::kObjectType);
+    bool full = true, any_full = false;
+    for(std::size_t i = 0; i < holder->bodies.size() && !holder->failed; ++i){
+        // parsed with the allocator of the result which takes its values
+        rapidjson::Document shard(&allocator);
+        shard.Parse(holder->bodies[i].c_str());
+        if(shard.HasParseError() || !shard.IsObject()
+                || !shard.HasMember("accounts") || !shard["accounts"].IsObject()
+                || !shard.HasMember("version") || !shard["version"].IsString()){
+            LOG(ERROR) << "unable to parse changes : " << holder->bodies[i];
+            holder->failed = true;
+            break;
+        }
+        // asked without a version, the shard listed all its accounts
+        bool shard_full = holder->versions[i].empty()
+            || (shard.HasMember("full") && shard["full"].IsTrue());
+        full = full && shard_full;
+        any_full = any_full || shard_full;
+        holder->versions[i] = shard["version"].GetString();
+        rapidjson::Value& shard_accounts = shard["accounts"];
+        for(auto it = shard_accounts.MemberBegin();
+                it != shard_accounts.MemberEnd(); ++it){
+            accounts.AddMember(it->name, it->value, allocator);
+        }
+    }
+
+    struct evhttp_request* req = holder->original_req;
+    if(holder->failed){
+        evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                      NULL, NULL);
+        if(holder->retry_after.size())
+            send_unavailable(req, holder->retry_after);
+        else
+            evhttp_send_reply(req, 500, "Error", NULL);
+        if(holder->retry_event)
+            event_free(holder->retry_event);
+        delete holder;
+        return;
+    }
+
+    if(any_full && !full){
+        // consumers only drop the accounts missing from a full reply, so
+        // the deltas of the other shards can't go with a shard's full
+        // list : every shard is asked again for all its accounts
+        holder->versions.assign(holder->versions.size(), "");
+        shoot_changes(holder);
+        return;
+    }
+
+    struct timeval now;
+    evutil_gettimeofday(&now, NULL);
+    if(accounts.MemberCount() == 0 && !full
+            && evutil_timercmp(&now, &holder->deadline, <)){
+        // no changes yet, ask again later from the new versions
+        if(!holder->retry_event)
+            holder->retry_event = evtimer_new(base, changes_retry_cb, holder);
+        struct timeval tv = {FLAGS_mbr_change_poll_ms / 1000,
+                             (FLAGS_mbr_change_poll_ms % 1000) * 1000};
+        holder->waiting = true;
+        evtimer_add(holder->retry_event, &tv);
+        return;
+    }
+
+    std::string version = boost::algorithm::join(holder->versions, ".");
+    result.AddMember("accounts", accounts, allocator);
+    result.AddMember("full", full, allocator);
+    rapidjson::Value version_value;
+    version_value.SetString(version.c_str(), version.size(), allocator);
+    result.AddMember("version", version_value, allocator);
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    result.Accept(writer);
+
+    struct evbuffer* req_buf = evhttp_request_get_output_buffer(req);
+    evbuffer_add(req_buf, buffer.GetString(), buffer.GetSize());
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                  NULL, NULL);
+    evhttp_send_reply(req, HTTP_OK, "OK", req_buf);
+    if(holder->retry_event)
+        event_free(holder->retry_event);
+    delete holder;
+}
+
 std::string
 MTX::Relay::get_parent_account(
                    const std::string& path,
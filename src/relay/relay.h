@@ -7,9 +7,11 @@
 #include <rapidjson/document.h>
 #include <string>
 #include <map>
+#include <memory>
 #include <gflags/gflags.h>
 
 #include "utils/http_connection_pool.h"
+#include "utils/loop_lag.h"
 
 namespace MTX {
 
@@ -40,10 +42,49 @@ private :
         std::vector<evhttp_connection*> connections;
         std::vector<std::string> bodies;
         int response_counter;
+        // Retry-After of a shard that shed the request, if any
+        std::string retry_after;
+    };
+
+    // a /v1/changes request, polling every shard until one has changes
+    struct changes_placeholder{
+        Relay* self;
+        evhttp_request* original_req;
+        // version of every shard, in shard order
+        std::vector<std::string> versions;
+        std::vector<std::string> bodies;
+        int response_counter;
+        bool failed;
+        std::string retry_after;  // as for multiple_relay_placeholder
+        struct timeval deadline;
+        struct event* retry_event;
+        bool waiting;   // for retry_event
+        bool closed;    // the client went away
+    };
+
+    struct changes_shard_request{
+        changes_placeholder* holder;
+        size_t shard;
+        evhttp_connection* connection;
+        MTX::HttpConnectionPool* conn_pool;
     };
 
     void process_request(struct evhttp_request *req);
 
+    /*
+    Replies 503 to the requests going to every shard while the loop lags,
+    the requests on a single account are always relayed.
+    @return whether req was answered
+    */
+    bool shed(struct evhttp_request *req);
+
+    // replies to /v1/_stats
+    void send_stats(struct evhttp_request *req);
+
+    // replies 503, asking to come back after retry_after seconds
+    void send_unavailable(struct evhttp_request *req,
+                          const std::string& retry_after);
+
     void process_relay(evhttp_request *relay_req,
                        evhttp_request *original_req,
                        evhttp_connection *relay_conn,
@@ -94,6 +135,24 @@ private :
         struct evhttp_request *req,
         const std::string& uri);
 
+    void
+    changes_shoot(
+        struct evhttp_request *req,
+        std::map<std::string, std::string>& qs_map);
+
+    void shoot_changes(changes_placeholder* holder);
+
+    void process_changes(changes_placeholder* holder);
+
+    static void
+    changes_cb(struct evhttp_request *req, void *arg);
+
+    static void
+    changes_retry_cb(evutil_socket_t fd, short what, void* arg);
+
+    static void
+    changes_closed_cb(struct evhttp_connection* conn, void* arg);
+
     std::string get_body(struct evbuffer *buf);
 
     std::string add_replies(const std::vector<std::string>& bodies);
@@ -109,6 +168,10 @@ private :
 
     struct event_base* base;
 
+    LatencyHistogram loop_lag_histogram;
+    std::unique_ptr<LoopLagMonitor> loop_lag;
+    uint64_t shed_requests;
+
 };
 
 }
@@ -16,6 +16,8 @@
 #include "jml/arch/futex.h"
 #include "jml/arch/wakeup_fd.h"
 #include "jml/utils/vector_utils.h"
+#include <event2/event.h>
+#include <memory>
 
 
 using namespace std;
@@ -285,6 +287,85 @@ std::ostream & operator << (std::ostream & stream, const Command & command)
     return stream << command.formatStr << command.args;
 }
 
+
+/*****************************************************************************/
+/* COMMAND BUFFER                                                            */
+/*****************************************************************************/
+
+void
+CommandBuffer::
+addLength(char type, size_t length)
+{
+    char digits[24];
+    char * current = digits + sizeof(digits);
+    *--current = '\n';
+    *--current = '\r';
+    do {
+        *--current = '0' + length % 10;
+        length /= 10;
+    } while (length);
+    *--current = type;
+    buffer.append(current, digits + sizeof(digits) - current);
+}
+
+void
+CommandBuffer::
+start(const std::string & name, size_t numArgs)
+{
+    ExcAssertEqual(argsLeft, 0);
+    Entry entry;
+    entry.begin = buffer.size();
+    addLength('*', numArgs + 1);
+    addLength('$', name.size());
+    entry.name = buffer.size();
+    entry.nameLength = name.size();
+    buffer.append(name);
+    buffer.append("\r\n", 2);
+    entries.push_back(entry);
+    argsLeft = numArgs;
+}
+
+void
+CommandBuffer::
+addArg(const char * data, size_t size)
+{
+    ExcAssertGreater(argsLeft, 0);
+    addLength('$', size);
+    buffer.append(data, size);
+    buffer.append("\r\n", 2);
+    --argsLeft;
+}
+
+void
+CommandBuffer::
+addArg(int64_t arg)
+{
+    char digits[24];
+    int n = snprintf(digits, sizeof(digits), "%lld", (long long)arg);
+    addArg(digits, n);
+}
+
+void
+CommandBuffer::
+addArg(const std::string & prefix, const std::string & suffix)
+{
+    ExcAssertGreater(argsLeft, 0);
+    addLength('$', prefix.size() + suffix.size());
+    buffer.append(prefix);
+    buffer.append(suffix);
+    buffer.append("\r\n", 2);
+    --argsLeft;
+}
+
+void
+CommandBuffer::
+clear()
+{
+    buffer.clear();
+    entries.clear();
+    argsLeft = 0;
+}
+
 /*****************************************************************************/
 /* ADDRESS                                                                   */
 /*****************************************************************************/
@@ -390,9 +471,15 @@ enum {
 size_t requestDataCreated = 0;
 size_t requestDataDestroyed = 0;
 
+/** Owned by hiredis from the moment it is sent until its callback, which
+    deletes it, even when it timed out before.
+*/
 struct AsyncConnection::RequestData
-    : std::enable_shared_from_this<AsyncConnection::RequestData> {
+    : MTX::MpscQueue<AsyncConnection::RequestData>::Node,
+      MTX::TimerWheel<AsyncConnection::RequestData>::Entry {
     RequestData()
+        : nextInBatch(0), commandPtr(0), borrowed(false), failFast(false),
+          index(0)
     {
         ML::atomic_inc(requestDataCreated);
     }
@@ -406,12 +493,63 @@ struct AsyncConnection::RequestData
     std::string command;
     Date timeout;
     AsyncConnection * connection;
-    int64_t id;
-    Requests::iterator requestIterator;
-    Timeouts::iterator timeoutIterator;
     int state;
+
+    /// submitted along with this one and sent right after it
+    RequestData * nextInBatch;
+
+    /// either a Command or a command of an encoded buffer
+    const Command * commandPtr;
+    Command ownCommand;                 ///< copy when handed to another thread
+    std::shared_ptr<const CommandBuffer> buffer;
+    /// command or buffer of the caller, only valid until queue() returns
+    bool borrowed;
+    /// fails rather than being held while the connection is down
+    bool failFast;
+    size_t index;
+
+    int sendTo(redisAsyncContext * context)
+    {
+        if (buffer)
+            return redisAsyncFormattedCommand(context, resultCallback, this,
+                                              buffer->data(index),
+                                              buffer->length(index));
+        vector<const char *> argv = commandPtr->argv();
+        vector<size_t> argl = commandPtr->argl();
+        return redisAsyncCommandArgv(context, resultCallback, this,
+                                     commandPtr->argc(), &argv[0], &argl[0]);
+    }
 };
 
+namespace {
+
+/** Timeouts are checked every 10ms, and the wheel turns every 10s. */
+const double TIMEOUT_RESOLUTION = 0.01;
+const size_t TIMEOUT_SLOTS = 1024;
+
+/** Set while a synchronous call on the thread owning a LibeventLoop queues
+    its requests.  Nothing can run the loop and reconnect while that call
+    waits, so its requests fail when the connection is down.
+*/
+__thread bool queueingSync = false;
+
+struct SyncQueueing {
+    SyncQueueing(bool onOwnerThread)
+        : previous(queueingSync)
+    {
+        queueingSync = onOwnerThread;
+    }
+
+    ~SyncQueueing()
+    {
+        queueingSync = previous;
+    }
+
+    bool previous;
+};
+
+} // file scope
+
 size_t eventLoopsCreated = 0;
 size_t eventLoopsDestroyed = 0;
 
@@ -434,10 +572,7 @@ struct AsyncConnection::EventLoop {
         
         fds[0].fd = wakeupfd.fd();
         fds[0].events = POLLIN;
-        fds[1].fd = connection->context_->c.fd;
-        fds[1].events = 0;
-
-        registerMe(connection->context_);
+        attach();
 
         thread.reset(new boost::thread(boost::bind(&EventLoop::run, this)));
     }
@@ -464,6 +599,14 @@ struct AsyncConnection::EventLoop {
         wakeupfd.signal();
     }
     
+    /** Start polling a new context. */
+    void attach()
+    {
+        fds[1].fd = connection->context_->c.fd;
+        fds[1].events = 0;
+        registerMe(connection->context_);
+    }
+
     void registerMe(redisAsyncContext * context)
     {
         //cerr << "called registerMe" << endl;
@@ -485,26 +628,22 @@ struct AsyncConnection::EventLoop {
         //cerr << this << " starting run loop" << endl;
 
         while (!finished) {
-            //sleep(1);
-            Date now = Date::now();
-
-            if (connection->earliestTimeout < now)
-                connection->expireTimeouts(now);
-
-            double timeLeft = now.secondsUntil(connection->earliestTimeout);
-
-            //cerr << "timeLeft = " << timeLeft << endl;
-            //cerr << "fds[0].events = " << fds[0].events << endl;
-            //cerr << "fds[1].events = " << fds[1].events << endl;
-
-            int timeout = std::min(1000.0,
-                                   std::max<double>(0, 1000 * timeLeft));
-
-            if (connection->earliestTimeout == Date::positiveInfinity())
-                timeout = 1000000;
-
-            //cerr << "looping; fd0 = " << fds[1].fd << " timeout = "
-            //     << timeout << endl;
+            connection->drainSubmissions();
+
+            // the clock is only read while something can time out or the
+            // connection waits to be opened again
+            int timeout = 1000000;
+            if (!connection->timeouts.empty()) {
+                connection->expireTimeouts(Date::now());
+                timeout = 1000 * connection->timeouts.resolution();
+            }
+            if (!connection->context_) {
+                connection->reconnect();
+                if (!connection->context_)
+                    timeout = std::min<double>(timeout, std::max<double>(0,
+                            1000 * Date::now().secondsUntil(
+                                    connection->reconnectAt)) + 1);
+            }
 
             int res = poll(fds, 2, timeout);
             if (res == -1 && errno != EINTR) {
@@ -512,48 +651,31 @@ struct AsyncConnection::EventLoop {
             }
             if (res == 0) continue;  // just a timeout; loop around again
 
-            //cerr << "poll() returned " << res << endl;
-
             if (fds[0].revents & POLLIN) {
-                //cerr << "got wakeup" << endl;
                 wakeupfd.read();
-                //cerr << "woken up with " << res << " messages" << endl;
             }
+            // Only this thread touches the context, nothing to lock
             if ((fds[1].revents & POLLHUP)
                 || (fds[1].revents & POLLERR)) {
-                /* For now, we simply disconnect when we receive a POLLHUP, but eventually
-                 * we should try to reconnect or at least notify the user through a callback
-                 */
-                onDisconnect(REDIS_ERR_IO);
-                break;
+                /* hiredis sees the failure when it reads, fails the
+                   pending requests and frees the context; we then
+                   reconnect.
+                */
+                redisAsyncHandleRead(connection->context_);
+                continue;
             }
-
             if ((fds[1].revents & POLLOUT)
                 && (fds[1].events & POLLOUT)) {
-                //cerr << "got write on " << fds[1].fd << endl;
-                boost::unique_lock<Lock> guard(connection->lock);
                 redisAsyncHandleWrite(connection->context_);
             }
             if ((fds[1].revents & POLLIN)
-                && (fds[1].events & POLLIN)) {
-                //cerr << "got read on " << fds[1].fd << endl;
-                boost::unique_lock<Lock> guard(connection->lock);
+                && (fds[1].events & POLLIN)
+                && connection->context_) {
                 redisAsyncHandleRead(connection->context_);
             }
-
-            // Now we don't have the lock anymore, do our callbacks
-            while (!connection->replyQueue.empty()) {
-                try {
-                    connection->replyQueue.front()();
-                } catch (...) {
-                    cerr << "warning: redis callback threw" << endl;
-                    //abort();
-                }
-                connection->replyQueue.pop_front();
-            }
         }
 
-        if (!disconnected) {
+        if (!disconnected && connection->context_) {
             // Disconnect
             //cerr << this << " calling redisAsyncDisconnect" << endl;
             redisAsyncDisconnect(connection->context_);
@@ -583,6 +705,7 @@ struct AsyncConnection::EventLoop {
             cerr << "onConnect: code = " << status << " err = " << context->err
                  << " errstr = " << context->errstr << " errno = "
                  << strerror(errno) << endl;
+            eventLoop->connection->connected(false);
             eventLoop->onDisconnect(status);
         }
     }
@@ -591,8 +714,7 @@ struct AsyncConnection::EventLoop {
     {
         //cerr << "connection on fd " << connection->context_->c.fd << endl;
         //cerr << "status = " << status << endl;
-        fds[1].fd = connection->context_->c.fd;
-        wakeup();
+        connection->connected(true);
         disconnected = 0;
         futex_wake(disconnected);
     }
@@ -601,19 +723,16 @@ struct AsyncConnection::EventLoop {
     {
         //cerr << "onDisconnect" << endl;
         EventLoop * eventLoop = reinterpret_cast<EventLoop *>(context->data);
+        if (status != REDIS_OK) {
+            cerr << "disconnection with status " << status << " err = "
+                 << context->err << " errstr = " << context->errstr
+                 << " errno = " << strerror(errno) << endl;
+        }
         eventLoop->onDisconnect(status);
     }
 
     void onDisconnect(int status)
     {
-        if (status != REDIS_OK) {
-            cerr << "disconnection with status " << status << endl;
-            cerr << "onConnect: code = " << status << " err = "
-                 << connection->context_->err
-                 << " errstr = "
-                 << connection->context_->errstr << " errno = "
-                 << strerror(errno) << endl;
-        }
         disconnected = 1;
         futex_wake(disconnected);
     }
@@ -680,23 +799,277 @@ struct AsyncConnection::EventLoop {
     {
         //cerr << this << " doing cleanup" << endl;
         //backtrace();
+        fds[1].fd = -1;
+        fds[1].events = 0;
+        connection->contextFreed();
+    }
+};
+
+
+/*****************************************************************************/
+/* LIBEVENT LOOP                                                             */
+/*****************************************************************************/
+
+/** Drives the connection from the libevent loop of the thread that owns
+    it, the way hiredis' own libevent adapter does.
+*/
+
+struct AsyncConnection::LibeventLoop {
+
+    AsyncConnection * connection;
+    event_base * base;
+    boost::thread::id owner;
+    event * readEvent;
+    event * writeEvent;
+    event * timerEvent;
+    event * reconnectEvent;
+    bool reading;
+    bool writing;
+
+    // signalled when other threads submit requests
+    ML::Wakeup_Fd wakeupfd;
+    event * wakeupEvent;
+
+    LibeventLoop(AsyncConnection * connection, event_base * base)
+        : connection(connection), base(base),
+          owner(boost::this_thread::get_id()),
+          readEvent(0), writeEvent(0),
+          reading(false), writing(false),
+          wakeupfd(O_NONBLOCK)
+    {
+        timerEvent = evtimer_new(base, onTimer, this);
+        reconnectEvent = evtimer_new(base, onReconnect, this);
+        wakeupEvent = event_new(base, wakeupfd.fd(), EV_READ | EV_PERSIST,
+                                onWakeup, this);
+        event_add(wakeupEvent, 0);
+        attach();
+    }
+
+    /** Watch a new context. */
+    void attach()
+    {
+        if (readEvent) event_free(readEvent);
+        if (writeEvent) event_free(writeEvent);
+        reading = writing = false;
+
+        int fd = connection->context_->c.fd;
+        readEvent = event_new(base, fd, EV_READ | EV_PERSIST, onRead, this);
+        writeEvent = event_new(base, fd, EV_WRITE | EV_PERSIST, onWrite, this);
+
+        redisAsyncContext * context = connection->context_;
+        redisAsyncSetConnectCallback(context, onConnect);
+        redisAsyncSetDisconnectCallback(context, onDisconnect);
+        context->ev.data = context->data = this;
+        context->ev.addRead = startReading;
+        context->ev.delRead = stopReading;
+        context->ev.addWrite = startWriting;
+        context->ev.delWrite = stopWriting;
+        context->ev.cleanup = cleanup;
+    }
+
+    ~LibeventLoop()
+    {
+        event_free(readEvent);
+        event_free(writeEvent);
+        event_free(timerEvent);
+        event_free(reconnectEvent);
+        event_free(wakeupEvent);
+    }
+
+    bool onOwnerThread() const
+    {
+        return boost::this_thread::get_id() == owner;
+    }
+
+    void armReconnect(Date when)
+    {
+        double seconds = std::max(0.0, Date::now().secondsUntil(when));
+        timeval tv;
+        tv.tv_sec = (time_t)seconds;
+        tv.tv_usec = (seconds - tv.tv_sec) * 1000000;
+        evtimer_add(reconnectEvent, &tv);
+    }
+
+    /** Tick while requests can time out. */
+    void armTimer()
+    {
+        if (evtimer_pending(timerEvent, 0))
+            return;
+        timeval tv = { 0, (int)(TIMEOUT_RESOLUTION * 1000000) };
+        evtimer_add(timerEvent, &tv);
+    }
+
+    void handleRead()
+    {
+        if (connection->context_)
+            redisAsyncHandleRead(connection->context_);
+    }
+
+    void handleWrite()
+    {
+        if (connection->context_)
+            redisAsyncHandleWrite(connection->context_);
+    }
+
+    /** Synchronous calls on the owner thread can't wait for the loop,
+        which is the caller, so they poll the socket themselves.  They
+        don't wait for a connection that went down either: the loop
+        reconnects once they returned.
+    */
+    void runUntil(const volatile int & done)
+    {
+        while (!done) {
+            if (!connection->context_) {
+                connection->expireTimeouts(Date::now());
+                connection->failHeld("not connected to redis");
+                if (!done)
+                    usleep(TIMEOUT_RESOLUTION * 1000000);
+                continue;
+            }
+
+            int timeout = 1000;
+            if (!connection->timeouts.empty()) {
+                connection->expireTimeouts(Date::now());
+                timeout = 1000 * TIMEOUT_RESOLUTION;
+            }
+
+            pollfd fd;
+            fd.fd = connection->context_->c.fd;
+            fd.events = (reading ? POLLIN : 0) | (writing ? POLLOUT : 0);
+            fd.revents = 0;
+            int res = poll(&fd, 1, timeout);
+            if (res == -1 && errno != EINTR)
+                cerr << "poll() error: " << strerror(errno) << endl;
+            if (res <= 0)
+                continue;
+
+            // hangups and errors show up to hiredis as failed reads
+            if (fd.revents & (POLLIN | POLLHUP | POLLERR))
+                handleRead();
+            else if (fd.revents & POLLOUT)
+                handleWrite();
+        }
+    }
+
+    static void onRead(evutil_socket_t, short, void * arg)
+    {
+        reinterpret_cast<LibeventLoop *>(arg)->handleRead();
+    }
+
+    static void onWrite(evutil_socket_t, short, void * arg)
+    {
+        reinterpret_cast<LibeventLoop *>(arg)->handleWrite();
+    }
+
+    static void onTimer(evutil_socket_t, short, void * arg)
+    {
+        LibeventLoop * loop = reinterpret_cast<LibeventLoop *>(arg);
+        AsyncConnection * connection = loop->connection;
+        connection->expireTimeouts(Date::now());
+        if (!connection->timeouts.empty())
+            loop->armTimer();
+    }
+
+    static void onReconnect(evutil_socket_t, short, void * arg)
+    {
+        reinterpret_cast<LibeventLoop *>(arg)->connection->reconnect();
+    }
+
+    static void onWakeup(evutil_socket_t, short, void * arg)
+    {
+        LibeventLoop * loop = reinterpret_cast<LibeventLoop *>(arg);
+        loop->wakeupfd.tryRead();
+        loop->connection->drainSubmissions();
+    }
+
+    static void onConnect(const redisAsyncContext * context, int status)
+    {
+        LibeventLoop * loop = reinterpret_cast<LibeventLoop *>(context->data);
+        if (status != REDIS_OK)
+            cerr << "onConnect: code = " << status << " err = " << context->err
+                 << " errstr = " << context->errstr << endl;
+        loop->connection->connected(status == REDIS_OK);
+    }
+
+    static void onDisconnect(const redisAsyncContext * context, int status)
+    {
+        if (status != REDIS_OK)
+            cerr << "disconnection with status " << status
+                 << " err = " << context->err
+                 << " errstr = " << context->errstr << endl;
+    }
+
+    static void startReading(void * privData)
+    {
+        LibeventLoop * loop = reinterpret_cast<LibeventLoop *>(privData);
+        loop->reading = true;
+        event_add(loop->readEvent, 0);
+    }
+
+    static void stopReading(void * privData)
+    {
+        LibeventLoop * loop = reinterpret_cast<LibeventLoop *>(privData);
+        loop->reading = false;
+        event_del(loop->readEvent);
+    }
+
+    static void startWriting(void * privData)
+    {
+        LibeventLoop * loop = reinterpret_cast<LibeventLoop *>(privData);
+        loop->writing = true;
+        event_add(loop->writeEvent, 0);
+    }
+
+    static void stopWriting(void * privData)
+    {
+        LibeventLoop * loop = reinterpret_cast<LibeventLoop *>(privData);
+        loop->writing = false;
+        event_del(loop->writeEvent);
+    }
+
+    /** hiredis is about to free the context. */
+    static void cleanup(void * privData)
+    {
+        LibeventLoop * loop = reinterpret_cast<LibeventLoop *>(privData);
+        stopReading(privData);
+        stopWriting(privData);
+        loop->connection->contextFreed();
     }
 };
 
 
 AsyncConnection::
 AsyncConnection()
-    : context_(0), idNum(0)
+    : currentAddress(0),
+      initialBackoff(0.1), maxBackoff(5.0), backoff(0.1),
+      closing(false), up(false), database(0),
+      timeouts(TIMEOUT_RESOLUTION, TIMEOUT_SLOTS, Date::now().secondsSinceEpoch()),
+      numPending(0), context_(0), idNum(0)
 {
 }
 
 AsyncConnection::
 AsyncConnection(const Address & address)
-    : context_(0), idNum(0)
+    : currentAddress(0),
+      initialBackoff(0.1), maxBackoff(5.0), backoff(0.1),
+      closing(false), up(false), database(0),
+      timeouts(TIMEOUT_RESOLUTION, TIMEOUT_SLOTS, Date::now().secondsSinceEpoch()),
+      numPending(0), context_(0), idNum(0)
 {
     connect(address);
 }
 
+AsyncConnection::
+AsyncConnection(const Address & address, event_base * base)
+    : currentAddress(0),
+      initialBackoff(0.1), maxBackoff(5.0), backoff(0.1),
+      closing(false), up(false), database(0),
+      timeouts(TIMEOUT_RESOLUTION, TIMEOUT_SLOTS, Date::now().secondsSinceEpoch()),
+      numPending(0), context_(0), idNum(0)
+{
+    connect(address, base);
+}
+
 AsyncConnection::
 ~AsyncConnection()
 {
@@ -706,12 +1079,54 @@ AsyncConnection::
 void
 AsyncConnection::
 connect(const Address & address)
+{
+    connect(address, 0);
+}
+
+void
+AsyncConnection::
+connect(const Address & address, event_base * base)
+{
+    connect(std::vector<Address>(1, address), base);
+}
+
+void
+AsyncConnection::
+connect(const std::vector<Address> & addresses, event_base * base)
 {
     //cerr << "connecting to redis " << address.uri() << endl;
 
     close();
 
-    this->address = address;
+    if (addresses.empty())
+        throw ML::Exception("no Redis address to connect to");
+    this->addresses = addresses;
+    currentAddress = 0;
+    backoff = initialBackoff;
+    closing = false;
+
+    if (!openContext())
+        checkError("connect");
+
+    if (base)
+        libeventLoop.reset(new LibeventLoop(this, base));
+    else eventLoop.reset(new EventLoop(this));
+}
+
+void
+AsyncConnection::
+setReconnectBackoff(double initialSeconds, double maxSeconds)
+{
+    initialBackoff = backoff = initialSeconds;
+    maxBackoff = maxSeconds;
+}
+
+bool
+AsyncConnection::
+openContext()
+{
+    address = addresses[currentAddress];
+    up = false;
 
     if (address.isTcp()) {
         context_ = redisAsyncConnect(address.tcpHost().c_str(),
@@ -722,9 +1137,116 @@ connect(const Address & address)
     }
     else throw ML::Exception("cannot connect to address that is neither tcp "
                              "or unix");
-    checkError("connect");
 
-    eventLoop.reset(new EventLoop(this));
+    return context_ && !context_->err;
+}
+
+void
+AsyncConnection::
+reconnect()
+{
+    if (context_ || closing || addresses.empty()
+        || Date::now() < reconnectAt)
+        return;
+
+    cerr << "reconnecting to redis " << addresses[currentAddress].uri()
+         << endl;
+
+    if (!openContext()) {
+        if (context_)
+            redisAsyncFree(context_);
+        context_ = 0;
+        connected(false);
+        contextFreed();
+        return;
+    }
+
+    if (eventLoop)
+        eventLoop->attach();
+    else libeventLoop->attach();
+
+    // the new connection starts with the same session
+    std::vector<RequestData *> session;
+    if (!password.empty()) {
+        Command cmd(AUTH);
+        cmd.addArg(password);
+        session.push_back(newRequest("AUTH", OnResult(), Timeout()));
+        session.back()->ownCommand = cmd;
+    }
+    if (database != 0) {
+        Command cmd(SELECT);
+        cmd.addArg(database);
+        session.push_back(newRequest("SELECT", OnResult(), Timeout()));
+        session.back()->ownCommand = cmd;
+    }
+    // ahead of anything held
+    for (RequestData * data: session) {
+        data->commandPtr = &data->ownCommand;
+        data->onResult = [] (const Result & result)
+            {
+                if (!result)
+                    cerr << "couldn't restore the redis session: "
+                         << result.error() << endl;
+            };
+        if (data->sendTo(context_) != REDIS_OK)
+            resultCallback(context_, 0, data);
+    }
+}
+
+void
+AsyncConnection::
+connected(bool ok)
+{
+    if (ok) {
+        backoff = initialBackoff;
+        up = true;
+
+        // held requests stay held until a connection actually works
+        std::deque<RequestData *> resend;
+        resend.swap(held);
+        for (RequestData * data: resend) {
+            if (data->state != WAITING) {
+                // timed out while held
+                --numPending;
+                delete data;
+                continue;
+            }
+            if (data->sendTo(context_) != REDIS_OK)
+                resultCallback(context_, 0, data);
+        }
+        return;
+    }
+
+    // next time, try the next address
+    currentAddress = (currentAddress + 1) % addresses.size();
+}
+
+void
+AsyncConnection::
+contextFreed()
+{
+    context_ = 0;
+    up = false;
+    if (closing)
+        return;
+
+    reconnectAt = Date::now().plusSeconds(backoff);
+    backoff = std::min(backoff * 2, maxBackoff);
+    if (libeventLoop)
+        libeventLoop->armReconnect(reconnectAt);
+}
+
+void
+AsyncConnection::
+wait(int & done)
+{
+    if (libeventLoop && libeventLoop->onOwnerThread()) {
+        libeventLoop->runUntil(done);
+        return;
+    }
+
+    while (!done)
+        futex_wait(done, 0);
 }
 
 void
@@ -745,10 +1267,12 @@ test()
             futex_wake(done);
         };
 
-    queue(PING, onResponse, 2.0);
+    {
+        SyncQueueing sync(sendsDirectly());
+        queue(PING, onResponse, 2.0);
+    }
 
-    while (!done)
-        futex_wait(done, 0);
+    wait(done);
     
     if (error != "")
         throw ML::Exception("couldn't connect to Redis: " + error);
@@ -772,12 +1296,16 @@ auth(std::string password)
             futex_wake(done);
         };
 
+    this->password = password;
+
     Command authCmd(AUTH);
     authCmd.addArg(password);
-    queue(authCmd, onResponse, 2.0);
+    {
+        SyncQueueing sync(sendsDirectly());
+        queue(authCmd, onResponse, 2.0);
+    }
 
-    while (!done)
-        futex_wait(done, 0);
+    wait(done);
 
     if (error != "")
         throw ML::Exception("couldn't authenticate redis connection: " + error);
@@ -801,12 +1329,16 @@ select(int database)
             futex_wake(done);
         };
 
+    this->database = database;
+
     Command cmd(SELECT);
     cmd.addArg(database);
-    queue(cmd, onResponse, 2.0);
+    {
+        SyncQueueing sync(sendsDirectly());
+        queue(cmd, onResponse, 2.0);
+    }
 
-    while (!done)
-        futex_wait(done, 0);
+    wait(done);
 
     if (error != "")
         throw ML::Exception("couldn't select redis database: " + error);
@@ -818,60 +1350,51 @@ void
 AsyncConnection::
 close()
 {
-    if (!context_) return;
+    closing = true;
+
+    if (libeventLoop) {
+        // runs the pending callbacks with an error; the context is already
+        // gone if hiredis dropped the connection
+        if (context_)
+            redisAsyncFree(context_);
+        libeventLoop.reset();
+    }
 
     if (eventLoop) {
         eventLoop->shutdown();
         eventLoop.reset();
     }
+
+    failSubmissions("connection closed");
+
+    for (RequestData * data: held) {
+        --numPending;
+        timeouts.cancel(data);
+        std::unique_ptr<RequestData> failed(data);
+        if (failed->state == WAITING)
+            failed->onResult(Result("connection closed"));
+    }
+    held.clear();
     
     context_ = 0;
+    up = false;
 }
 
 void
 AsyncConnection::
 resultCallback(redisAsyncContext * context, void * reply, void * privData)
 {
-    //cerr << "resultCallback with reply " << reply << " privData "
-    //     << privData << endl;
-    //cerr << "context->err = " << context->err << endl;
-    //cerr << "context->errstr = " << context->errstr << endl;
-    //cerr << "context->c.errstr = " << context->c.errstr << endl;
-
     ExcAssert(privData);
 
-    // Get a shared pointer to our data so it doesn't go away
-    RequestData * dataRawPtr
-        = reinterpret_cast<RequestData *>(privData);
-    std::shared_ptr<RequestData> data
-        = dataRawPtr->shared_from_this();
-
-    //cerr << "command " << data->command << endl;
-    //cerr << "reply " << reply << endl;
-
-    // Remove from data structures
+    std::unique_ptr<RequestData> data
+        (reinterpret_cast<RequestData *>(privData));
     AsyncConnection * c = data->connection;
 
-    {
-        boost::unique_lock<Lock> guard(c->lock);
-        
-        if (data->requestIterator != c->requests.end()) {
-            c->requests.erase(data->requestIterator);
-            data->requestIterator = c->requests.end();
-        }
-        
-        if (data->timeoutIterator != c->timeouts.end()) {
-            c->timeouts.erase(data->timeoutIterator);
-            data->timeoutIterator = c->timeouts.end();
-            if (c->timeouts.empty())
-                c->earliestTimeout = Date::positiveInfinity();
-            else c->earliestTimeout = c->timeouts.begin()->first;
-        }
-
-        if (data->state != WAITING) return;  // raced; timeout happened
-        data->state = REPLIED;
-    }
+    c->timeouts.cancel(data.get());
+    --c->numPending;
 
+    if (data->state != WAITING) return;  // timeout happened
+    data->state = REPLIED;
 
     Result result;
 
@@ -891,80 +1414,177 @@ resultCallback(redisAsyncContext * context, void * reply, void * privData)
     }
     else {
         // Context encountered an error; return it
-        result = Result(data->connection->context_->errstr);
+        result = Result(c->context_ ? c->context_->errstr
+                                    : "connection closed");
     }
 
-    // Queue up a reply object so it can be called without the lock held.  If
-    // we call directly from here, then the lock has to be held and so deadlock
-    // is possible.
-    c->replyQueue.push_back(std::bind(data->onResult, result));
+    // Called on the I/O thread, which holds no lock
+    try {
+        data->onResult(result);
+    } catch (...) {
+        cerr << "warning: redis callback threw" << endl;
+    }
 }
 
-int64_t
+AsyncConnection::RequestData *
 AsyncConnection::
-queue(const Command & command,
-      const OnResult & onResult,
-      Timeout timeout)
+newRequest(const std::string & command,
+           const OnResult & onResult,
+           Timeout timeout)
 {
-    boost::unique_lock<Lock> guard(lock);
-
-    ExcAssert(context_);
-    ExcAssert(!context_->err);
-    
-    // Check basics
-    if (timeout.expiry.isADate() && Date::now() >= timeout.expiry) {
-        onResult(Result(Result::timeoutError));
-        return -1;
-    }
-
-    int64_t id = idNum++;
-    
-    // Create data structure to be passed around
-    std::shared_ptr<RequestData> data(new RequestData);
+    RequestData * data = new RequestData;
     data->onResult = onResult;
     data->timeout = timeout.expiry;
-    data->command = command.formatStr;
-    //data->timeout = Date::notADate();
+    data->command = command;
     data->connection = this;
-    data->id = id;
-    data->requestIterator = requests.end();
-    data->timeoutIterator = timeouts.end();
     data->state = WAITING;
+    data->failFast = queueingSync;
+    ++numPending;
+    return data;
+}
 
-    ExcAssertEqual(requests.count(id), 0);
+bool
+AsyncConnection::
+sendsDirectly() const
+{
+    return libeventLoop && libeventLoop->onOwnerThread();
+}
 
-    //cerr << "data = " << data << endl;
+void
+AsyncConnection::
+submit(RequestData * first)
+{
+    // the whole chain is a single node so it stays in one piece
+    if (!submissions.push(first))
+        return;
+    if (eventLoop)
+        eventLoop->wakeup();
+    else if (libeventLoop)
+        libeventLoop->wakeupfd.signal();
+}
 
-    auto it = requests.insert(make_pair(id, data)).first;
-    data->requestIterator = it;
+void
+AsyncConnection::
+drainSubmissions()
+{
+    submissions.clear_signal();
+    while (RequestData * data = submissions.pop())
+        send(data);
+}
 
-    // Does the servicing thread possibly need to be woken up?
-    bool needWakeup = false;
-    
-    if (timeout.expiry.isADate()) {
-        needWakeup = !timeouts.empty()
-            && timeout.expiry < timeouts.begin()->first;
-        data->timeoutIterator = timeouts.insert(make_pair(timeout.expiry, it));
-        earliestTimeout = timeouts.begin()->first;
+void
+AsyncConnection::
+send(RequestData * first)
+{
+    Date now = Date::now();
+    std::shared_ptr<const CommandBuffer> borrowed, copy;
+
+    for (RequestData * data = first, * next;  data;  data = next) {
+        next = data->nextInBatch;
+
+        // Check basics
+        if (data->timeout.isADate() && now >= data->timeout) {
+            --numPending;
+            std::unique_ptr<RequestData> expired(data);
+            expired->onResult(Result(Result::timeoutError));
+            continue;
+        }
+
+        if (data->failFast && (!context_ || context_->err)) {
+            --numPending;
+            std::unique_ptr<RequestData> failed(data);
+            failed->onResult(Result("not connected to redis"));
+            continue;
+        }
+
+        if (data->timeout.isADate()) {
+            timeouts.schedule(data, data->timeout.secondsSinceEpoch());
+            if (libeventLoop)
+                libeventLoop->armTimer();
+        }
+
+        // sent once the connection is back, after what is already held
+        if (!up || context_->err || !held.empty()) {
+            if (data->borrowed) {
+                // the caller's command is gone by the time it is sent
+                if (!data->buffer) {
+                    data->ownCommand = *data->commandPtr;
+                    data->commandPtr = &data->ownCommand;
+                }
+                else {
+                    // copied once for the whole chain
+                    if (data->buffer != borrowed) {
+                        borrowed = data->buffer;
+                        copy = std::make_shared<CommandBuffer>(*borrowed);
+                    }
+                    data->buffer = copy;
+                }
+                data->borrowed = false;
+            }
+            held.push_back(data);
+            continue;
+        }
+
+        if (data->sendTo(context_) != REDIS_OK) {
+            //cerr << "result not OK" << endl;
+            resultCallback(context_, 0, data);
+        }
     }
-    
-    vector<const char *> argv = command.argv();
-    vector<size_t> argl = command.argl();
+}
 
-    int result = redisAsyncCommandArgv(context_, resultCallback, data.get(),
-                                       command.argc(),
-                                       &argv[0],
-                                       &argl[0]);
-    
-    if (result != REDIS_OK) {
-        //cerr << "result not OK" << endl;
-        resultCallback(context_, 0, data.get());
-        return -1;
+void
+AsyncConnection::
+failHeld(const std::string & error)
+{
+    std::deque<RequestData *> kept, failed;
+    for (RequestData * data: held)
+        (data->failFast ? failed : kept).push_back(data);
+    held.swap(kept);
+
+    // the callbacks may queue more
+    for (RequestData * data: failed) {
+        --numPending;
+        timeouts.cancel(data);
+        std::unique_ptr<RequestData> request(data);
+        if (request->state == WAITING)
+            request->onResult(Result(error));
     }
-    
-    if (needWakeup)
-        eventLoop->wakeup();
-    
+}
+
+void
+AsyncConnection::
+failSubmissions(const std::string & error)
+{
+    while (RequestData * first = submissions.pop()) {
+        for (RequestData * data = first, * next;  data;  data = next) {
+            next = data->nextInBatch;
+            --numPending;
+            std::unique_ptr<RequestData> failed(data);
+            failed->onResult(Result(error));
+        }
+    }
+}
+
+int64_t
+AsyncConnection::
+queue(const Command & command,
+      const OnResult & onResult,
+      Timeout timeout)
+{
+    int64_t id = __sync_fetch_and_add(&idNum, 1);
+
+    RequestData * data = newRequest(command.formatStr, onResult, timeout);
+    if (sendsDirectly()) {
+        data->commandPtr = &command;
+        data->borrowed = true;
+        send(data);
+    }
+    else {
+        data->ownCommand = command;
+        data->commandPtr = &data->ownCommand;
+        submit(data);
+    }
+
     return id;
 }
 
@@ -982,10 +1602,12 @@ exec(const Command & command, Timeout timeout)
             futex_wake(done);
         };
 
-    queue(command, onResponse, timeout);
+    {
+        SyncQueueing sync(sendsDirectly());
+        queue(command, onResponse, timeout);
+    }
 
-    while (!done)
-        futex_wait(done, 0);
+    wait(done);
  
     return result;
 }
@@ -1030,17 +1652,33 @@ queueMulti(const std::vector<Command> & commands,
     
     auto results
         = std::make_shared<MultiAggregator>(commands.size(), onResults);
-    
-    // Make sure they all get executed as a block
-    boost::unique_lock<Lock> guard(lock);
-    
-    // Now queue them one at a time
+
+    bool direct = sendsDirectly();
+
+    // Chained so that they all get executed as a block
+    RequestData * first = 0, * last = 0;
     for (unsigned i = 0;  i < commands.size();  ++i) {
-        queue(commands[i],
-              std::bind(&MultiAggregator::result, results, i,
-                        std::placeholders::_1),
-              timeout);
+        RequestData * data
+            = newRequest(commands[i].formatStr,
+                         std::bind(&MultiAggregator::result, results, i,
+                                   std::placeholders::_1),
+                         timeout);
+        if (direct) {
+            data->commandPtr = &commands[i];
+            data->borrowed = true;
+        }
+        else {
+            data->ownCommand = commands[i];
+            data->commandPtr = &data->ownCommand;
+        }
+        if (last) last->nextInBatch = data;
+        else first = data;
+        last = data;
     }
+
+    if (direct)
+        send(first);
+    else submit(first);
 }
 
 Results
@@ -1057,46 +1695,100 @@ execMulti(const std::vector<Command> & commands, Timeout timeout)
             futex_wake(done);
         };
 
-    queueMulti(commands, onResponse, timeout);
+    {
+        SyncQueueing sync(sendsDirectly());
+        queueMulti(commands, onResponse, timeout);
+    }
 
-    while (!done)
-        futex_wait(done, 0);
+    wait(done);
  
     return results;
 }
 
 void
 AsyncConnection::
-cancel(int handle)
+queueMulti(const CommandBuffer & commands,
+           const OnResults & onResults,
+           Timeout timeout)
 {
-    throw ML::Exception("AsyncConnection::cancel(): not done");
+    if (commands.empty())
+        throw ML::Exception("can't call queueMulti with an empty list "
+                            "of commands");
+
+    auto results
+        = std::make_shared<MultiAggregator>(commands.size(), onResults);
+
+    // sent right away on the I/O thread, otherwise copied once for all
+    // the commands
+    bool direct = sendsDirectly();
+    std::shared_ptr<const CommandBuffer> buffer;
+    if (direct)
+        buffer.reset(&commands, [] (const CommandBuffer *) {});
+    else buffer = std::make_shared<CommandBuffer>(commands);
+
+    RequestData * first = 0, * last = 0;
+    for (unsigned i = 0;  i < commands.size();  ++i) {
+        RequestData * data
+            = newRequest(commands.name(i),
+                         std::bind(&MultiAggregator::result, results, i,
+                                   std::placeholders::_1),
+                         timeout);
+        data->buffer = buffer;
+        data->borrowed = direct;
+        data->index = i;
+        if (last) last->nextInBatch = data;
+        else first = data;
+        last = data;
+    }
+
+    if (direct)
+        send(first);
+    else submit(first);
 }
 
-void
+Results
 AsyncConnection::
-expireTimeouts(Date now)
+execMulti(const CommandBuffer & commands, Timeout timeout)
 {
-    boost::unique_lock<Lock> guard(lock);
-    
-    auto it = timeouts.begin(), end = timeouts.end();
-    for (;  it != end;  ++it) {
-        if (it->first > now) break;
-
-        auto resultIt = it->second;
-        auto data = resultIt->second;
+    Results results;
+    int done = 0;
 
-        data->state = TIMEDOUT;
-        data->onResult(Result(Result::timeoutError));
-        data->timeoutIterator = end;
+    auto onResponse = [&] (const Redis::Results & redisResults)
+        {
+            results = redisResults;
+            done = 1;
+            futex_wake(done);
+        };
 
-        // Let it be cleaned up from hiredis once it's finished
+    {
+        SyncQueueing sync(sendsDirectly());
+        queueMulti(commands, onResponse, timeout);
     }
 
-    timeouts.erase(timeouts.begin(), it);
+    wait(done);
+
+    return results;
+}
+
+void
+AsyncConnection::
+cancel(int handle)
+{
+    throw ML::Exception("AsyncConnection::cancel(): not done");
+}
+
+void
+AsyncConnection::
+expireTimeouts(Date now)
+{
+    // Let them be cleaned up from hiredis once they're finished
+    auto onExpired = [] (RequestData * data)
+        {
+            data->state = TIMEDOUT;
+            data->onResult(Result(Result::timeoutError));
+        };
 
-    if (timeouts.empty())
-        earliestTimeout = Date::positiveInfinity();
-    else earliestTimeout = timeouts.begin()->first;
+    timeouts.expire(now.secondsSinceEpoch(), onExpired);
 }
 
 } // namespace Redis
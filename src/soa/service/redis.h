@@ -23,6 +23,11 @@
 #include <boost/thread/thread.hpp>
 #include <boost/thread/recursive_mutex.hpp>
 #include <deque>
+#include <atomic>
+#include "utils/mpsc_queue.h"
+#include "utils/timer_wheel.h"
+
+struct event_base;
 
 
 namespace Redis {
@@ -331,6 +336,86 @@ extern const Command TTL;
 extern const Command AUTH;
 extern const Command SELECT;
 
+
+/*****************************************************************************/
+/* COMMAND BUFFER                                                            */
+/*****************************************************************************/
+
+/** Commands already encoded in the Redis protocol, back to back in one
+    buffer, for bulk operations where a Command would cost a string per
+    argument plus the argv and argl vectors on every send.  The number of
+    arguments of a command is given when it is started.  The buffer keeps
+    its capacity when cleared so it can be reused from one bulk operation
+    to the next.
+*/
+
+struct CommandBuffer {
+    CommandBuffer()
+        : argsLeft(0)
+    {
+    }
+
+    /** Start a command that takes numArgs arguments. */
+    void start(const std::string & name, size_t numArgs);
+
+    void addArg(const char * data, size_t size);
+
+    void addArg(const std::string & arg)
+    {
+        addArg(arg.data(), arg.size());
+    }
+
+    void addArg(int64_t arg);
+
+    /** Add a single argument made of two parts, such as a key prefix and
+        a name, without concatenating them first.
+    */
+    void addArg(const std::string & prefix, const std::string & suffix);
+
+    /** Number of commands in the buffer. */
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+    bool empty() const
+    {
+        return entries.empty();
+    }
+
+    void clear();
+
+    /** Protocol text of command i. */
+    const char * data(size_t i) const
+    {
+        return buffer.data() + entries[i].begin;
+    }
+
+    size_t length(size_t i) const
+    {
+        return (i + 1 < entries.size() ? entries[i + 1].begin : buffer.size())
+            - entries[i].begin;
+    }
+
+    std::string name(size_t i) const
+    {
+        return buffer.substr(entries[i].name, entries[i].nameLength);
+    }
+
+private:
+    void addLength(char type, size_t length);
+
+    struct Entry {
+        size_t begin;
+        size_t name;
+        size_t nameLength;
+    };
+
+    std::string buffer;
+    std::vector<Entry> entries;
+    size_t argsLeft;            ///< arguments the last command still needs
+};
+
 /*****************************************************************************/
 /* ADDRESS                                                                   */
 /*****************************************************************************/
@@ -369,9 +454,37 @@ struct AsyncConnection {
     
     AsyncConnection(const Address & address);
 
+    /** Connect on an existing libevent loop instead of a thread of our
+        own.  The connection then belongs to the thread running the loop,
+        which must be the one constructing it: reads, writes, timeouts and
+        result callbacks all happen there and nothing is locked.  Commands
+        queued from other threads are handed over to the loop, and
+        synchronous calls made on the loop thread drive the connection
+        themselves until their reply arrives.
+    */
+    AsyncConnection(const Address & address, event_base * base);
+
     ~AsyncConnection();
 
     void connect(const Address & address);
+    void connect(const Address & address, event_base * base);
+
+    /** Connect to the first address, the others being fallbacks.
+
+        When the connection drops, the requests waiting for a reply fail,
+        and the connection is opened again after a backoff delay, first to
+        the same address and then to the next ones in turn for as long as
+        that fails.  Requests queued in the meantime are held and sent
+        once it is back, after the password and database given to auth()
+        and select().
+    */
+    void connect(const std::vector<Address> & addresses,
+                 event_base * base = 0);
+
+    /** Delay before reconnecting, doubled after every failed attempt up to
+        maxSeconds.  Defaults to 0.1s and 5s.
+    */
+    void setReconnectBackoff(double initialSeconds, double maxSeconds);
 
     /** Test the connection by sending a ping and waiting for the response.
         This is synchronous.  Once this method returns, it is sure that
@@ -424,43 +537,113 @@ struct AsyncConnection {
     /** Execute multiple commands synchronously. */
     Results execMulti(const std::vector<Command> & command,
                       Timeout timeout = Timeout());
+
+    /** Same for commands already encoded in a buffer, which are sent
+        without being copied into Command objects first.
+    */
+    void queueMulti(const CommandBuffer & commands,
+                    const OnResults & onResults = OnResults(),
+                    Timeout timeout = Timeout());
+
+    Results execMulti(const CommandBuffer & commands,
+                      Timeout timeout = Timeout());
     
     /** Cancel the given command. */
     void cancel(int handle);
     
     size_t numRequestsPending() const
     {
-        return requests.size();
+        return numPending;
     }
 
+    /** Only exact when called from the I/O thread. */
     size_t numTimeoutsPending() const
     {
         return timeouts.size();
     }
     
 private:
-    std::deque<std::function<void ()> > replyQueue;
-    
     static void resultCallback(redisAsyncContext * context, void *, void *);
 
     struct RequestData;
 
-    typedef boost::recursive_mutex Lock;
-    Lock lock;
+    RequestData * newRequest(const std::string & command,
+                             const OnResult & onResult,
+                             Timeout timeout);
 
-    typedef std::map<uint64_t, std::shared_ptr<RequestData> > Requests;
-    Requests requests;
-    
-    typedef std::multimap<Datacratic::Date, Requests::iterator> Timeouts;
-    Timeouts timeouts;
+    /** True when the caller is the I/O thread and can talk to hiredis. */
+    bool sendsDirectly() const;
+
+    /** Hand a chain of requests over to the I/O thread, which sends them
+        back to back.
+    */
+    void submit(RequestData * first);
+
+    /** Send the requests submitted by other threads.  I/O thread only, like
+        everything touching the hiredis context and the timeouts.
+    */
+    void drainSubmissions();
+
+    /** Send a chain of requests to hiredis. */
+    void send(RequestData * first);
+
+    /** Fail the requests that never got sent. */
+    void failSubmissions(const std::string & error);
+
+    /** Fail the held requests of synchronous calls on the I/O thread. */
+    void failHeld(const std::string & error);
+
+    /** Requests sent while the connection is down, in order. */
+    std::deque<RequestData *> held;
+
+    /** Open a context to the current address.  Returns false if that
+        failed straight away.
+    */
+    bool openContext();
+
+    /** Open the connection again if it is down and its delay is over, then
+        send what was held.  I/O thread only.
+    */
+    void reconnect();
+
+    /** Called by the loops when hiredis frees the context. */
+    void contextFreed();
+
+    /** Called by the loops when the connection succeeds or fails. */
+    void connected(bool ok);
+
+    std::vector<Address> addresses;
+    size_t currentAddress;
+    double initialBackoff;
+    double maxBackoff;
+    double backoff;
+    Date reconnectAt;
+    bool closing;
+    /** Connected to the current address: requests sent before that would
+        fail along with the attempt, so they are held until it succeeds.
+    */
+    bool up;
+
+    std::string password;
+    int database;
+
+    /** Wait until a synchronous call sets done. */
+    void wait(int & done);
+
+    /** Requests submitted by any thread, in order, lock free. */
+    MTX::MpscQueue<RequestData> submissions;
+
+    /** Requests waiting for a reply that have a timeout. */
+    MTX::TimerWheel<RequestData> timeouts;
+
+    /** Requests created and not yet destroyed. */
+    std::atomic<size_t> numPending;
 
     /** Called when something knows that at least one timeout is expired;
         expire them.
     */
     void expireTimeouts(Datacratic::Date now);
 
-    Datacratic::Date earliestTimeout;
-
     void checkError(const char * command)
     {
         if (!context_)
@@ -479,6 +662,9 @@ private:
     struct EventLoop;
     std::shared_ptr<EventLoop> eventLoop;
 
+    struct LibeventLoop;
+    std::shared_ptr<LibeventLoop> libeventLoop;
+
     struct MultiAggregator;
 };
 
@@ -0,0 +1,130 @@
+#include "json_stream.h"
+#include <event2/buffer.h>
+
+namespace {
+
+const size_t FLUSH_SIZE = 16 * 1024;
+
+}
+
+MTX::JsonStream::JsonStream(struct evbuffer* out):
+                out(out), need_comma(false){
+    buf.reserve(FLUSH_SIZE + 256);
+}
+
+MTX::JsonStream::~JsonStream(){
+    flush();
+}
+
+void
+MTX::JsonStream::flush(){
+    if(buf.size()){
+        evbuffer_add(out, buf.data(), buf.size());
+        buf.clear();
+    }
+}
+
+void
+MTX::JsonStream::begin_object(){
+    separate();
+    buf += '{';
+    need_comma = false;
+}
+
+void
+MTX::JsonStream::end_object(){
+    buf += '}';
+    need_comma = true;
+    if(buf.size() >= FLUSH_SIZE)
+        flush();
+}
+
+void
+MTX::JsonStream::begin_array(){
+    separate();
+    buf += '[';
+    need_comma = false;
+}
+
+void
+MTX::JsonStream::end_array(){
+    buf += ']';
+    need_comma = true;
+    if(buf.size() >= FLUSH_SIZE)
+        flush();
+}
+
+void
+MTX::JsonStream::key(const char* name, size_t size){
+    separate();
+    quoted(name, size);
+    buf += ':';
+    need_comma = false;
+}
+
+void
+MTX::JsonStream::value(int64_t v){
+    separate();
+    // same digits as jsoncpp's valueToString(Int)
+    char digits[32];
+    char* current = digits + sizeof(digits);
+    uint64_t u = v < 0 ? -(uint64_t)v : v;
+    do{
+        *--current = '0' + u % 10;
+        u /= 10;
+    }while(u);
+    if(v < 0)
+        *--current = '-';
+    buf.append(current, digits + sizeof(digits) - current);
+    need_comma = true;
+}
+
+void
+MTX::JsonStream::value(const char* s, size_t size){
+    separate();
+    quoted(s, size);
+    need_comma = true;
+}
+
+void
+MTX::JsonStream::raw(const char* s, size_t size){
+    separate();
+    buf.append(s, size);
+    need_comma = true;
+}
+
+void
+MTX::JsonStream::end(){
+    buf += '\n';
+    need_comma = false;
+    flush();
+}
+
+void
+MTX::JsonStream::quoted(const char* s, size_t size){
+    // escapes like jsoncpp's valueToQuotedString, which stops at a NUL
+    static const char hex[] = "0123456789ABCDEF";
+    buf += '"';
+    for(size_t i = 0; i < size && s[i]; ++i){
+        char c = s[i];
+        switch(c){
+            case '"': buf += "\\\""; break;
+            case '\\': buf += "\\\\"; break;
+            case '\b': buf += "\\b"; break;
+            case '\f': buf += "\\f"; break;
+            case '\n': buf += "\\n"; break;
+            case '\r': buf += "\\r"; break;
+            case '\t': buf += "\\t"; break;
+            default:
+                if(c > 0 && c <= 0x1F){
+                    buf += "\\u00";
+                    buf += hex[c >> 4];
+                    buf += hex[c & 0xF];
+                }else{
+                    buf += c;
+                }
+                break;
+        }
+    }
+    buf += '"';
+}
@@ -0,0 +1,68 @@
+#ifndef __MTX_JSON_STREAM_H__
+#define __MTX_JSON_STREAM_H__
+#include <string>
+#include <stdint.h>
+
+struct evbuffer;
+
+namespace MTX {
+
+/*
+Writes JSON text straight into an evbuffer, without building a Json::Value
+first. The output is byte for byte what jsoncpp's FastWriter produces for
+the same document, as long as callers emit object members in sorted key
+order like FastWriter does, and end() is called to add its trailing
+newline.
+
+Small writes are gathered in a local buffer and moved to the evbuffer in
+large chunks.
+*/
+struct JsonStream{
+
+    explicit JsonStream(struct evbuffer* out);
+
+    // flushes what is still buffered
+    ~JsonStream();
+
+    void begin_object();
+    void end_object();
+
+    void begin_array();
+    void end_array();
+
+    void key(const char* name, size_t size);
+    void key(const std::string& name){
+        key(name.data(), name.size());
+    }
+
+    void value(int64_t v);
+    void value(const char* s, size_t size);
+    void value(const std::string& s){
+        value(s.data(), s.size());
+    }
+
+    // already encoded JSON value
+    void raw(const char* s, size_t size);
+
+    // ends the document with FastWriter's newline and flushes
+    void end();
+
+    void flush();
+
+private:
+
+    void separate(){
+        if(need_comma)
+            buf += ',';
+    }
+
+    void quoted(const char* s, size_t size);
+
+    struct evbuffer* out;
+    std::string buf;
+    bool need_comma;
+};
+
+}
+
+#endif
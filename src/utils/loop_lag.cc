@@ -0,0 +1,49 @@
+#include "loop_lag.h"
+#include <chrono>
+
+MTX::LoopLagMonitor::LoopLagMonitor(struct event_base* base, int interval_ms,
+                                    LatencyHistogram* histogram):
+                interval_ms(interval_ms), histogram(histogram),
+                due(0), last(0){
+    event = evtimer_new(base, MTX::LoopLagMonitor::tick_cb, this);
+    arm();
+}
+
+MTX::LoopLagMonitor::~LoopLagMonitor(){
+    event_free(event);
+}
+
+int64_t
+MTX::LoopLagMonitor::now(){
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t
+MTX::LoopLagMonitor::lag() const{
+    // past its due time the timer is late by as much, fired or not
+    int64_t late = now() - due.load(std::memory_order_relaxed);
+    int64_t result = last.load(std::memory_order_relaxed);
+    return late > result ? late : result;
+}
+
+void
+MTX::LoopLagMonitor::arm(){
+    due.store(now() + interval_ms * 1000LL, std::memory_order_relaxed);
+    struct timeval tv;
+    tv.tv_sec = interval_ms / 1000;
+    tv.tv_usec = (interval_ms % 1000) * 1000;
+    evtimer_add(event, &tv);
+}
+
+void
+MTX::LoopLagMonitor::tick_cb(evutil_socket_t fd, short what, void* arg){
+    LoopLagMonitor* monitor = (LoopLagMonitor*)arg;
+    int64_t late = now() - monitor->due.load(std::memory_order_relaxed);
+    if(late < 0)
+        late = 0;
+    monitor->last.store(late, std::memory_order_relaxed);
+    if(monitor->histogram)
+        monitor->histogram->record(late);
+    monitor->arm();
+}
@@ -0,0 +1,57 @@
+#ifndef __MTX_LOOP_LAG_H__
+#define __MTX_LOOP_LAG_H__
+#include <atomic>
+#include <stdint.h>
+#include <event2/event.h>
+
+#include "stats.h"
+
+namespace MTX {
+
+/*
+Measures how late an event loop runs its callbacks, with a timer armed
+every interval_ms on it : whatever the loop does between the timer being
+due and firing is time every other event waits as well.
+
+lag() can be read from any thread and accounts for a loop stalled right
+now, not only for the last time the timer fired, so requests queued
+behind a long callback see it before it ends.
+*/
+struct LoopLagMonitor{
+
+    /*
+    @param histogram when set, gets the lag of every tick, in us
+    */
+    LoopLagMonitor(struct event_base* base, int interval_ms,
+                   LatencyHistogram* histogram = nullptr);
+
+    // frees the timer, the loop must not be running anymore
+    ~LoopLagMonitor();
+
+    LoopLagMonitor(const LoopLagMonitor&) = delete;
+    LoopLagMonitor& operator=(const LoopLagMonitor&) = delete;
+
+    // current lag of the loop, in us
+    uint64_t lag() const;
+
+    // monotonic time, in us
+    static int64_t now();
+
+private:
+
+    static void tick_cb(evutil_socket_t fd, short what, void* arg);
+
+    void arm();
+
+    struct event* event;
+    int interval_ms;
+    LatencyHistogram* histogram;
+
+    // when the timer should fire, and how late it fired the last time
+    std::atomic<int64_t> due;
+    std::atomic<int64_t> last;
+};
+
+}
+
+#endif
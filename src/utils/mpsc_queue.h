@@ -0,0 +1,87 @@
+#ifndef __MTX_MPSC_QUEUE_H__
+#define __MTX_MPSC_QUEUE_H__
+#include <atomic>
+
+namespace MTX {
+
+/*
+Intrusive lock-free multiple producers / single consumer queue
+(Dmitry Vyukov's algorithm). Items must derive from MpscQueue<T>::Node
+and are owned by whoever pops them.
+
+push() never blocks nor allocates. pop() may return nullptr while a
+producer is in the middle of a push; that producer is then guaranteed to
+complete its push after the pop, so callers pair the queue with a wakeup
+mechanism (see push() return value).
+*/
+template<typename T>
+struct MpscQueue{
+
+    struct Node{
+        std::atomic<Node*> next;
+    };
+
+    MpscQueue() : head(&stub), tail(&stub), signaled(false){
+        stub.next.store(nullptr, std::memory_order_relaxed);
+    }
+
+    /*
+    Enqueues an item, safe from any thread.
+    @return true if the consumer needs to be woken up
+    */
+    bool push(T* item){
+        enqueue(item);
+        return !signaled.exchange(true, std::memory_order_acq_rel);
+    }
+
+    /*
+    Called by the consumer once it has been woken up and before draining
+    the queue, so any later push wakes it up again.
+    */
+    void clear_signal(){
+        signaled.store(false, std::memory_order_release);
+    }
+
+    // consumer only
+    T* pop(){
+        Node* t = tail;
+        Node* next = t->next.load(std::memory_order_acquire);
+        if(t == &stub){
+            if(!next)
+                return nullptr;
+            tail = next;
+            t = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if(next){
+            tail = next;
+            return static_cast<T*>(t);
+        }
+        if(t != head.load(std::memory_order_acquire))
+            return nullptr;
+        enqueue(&stub);
+        next = t->next.load(std::memory_order_acquire);
+        if(next){
+            tail = next;
+            return static_cast<T*>(t);
+        }
+        return nullptr;
+    }
+
+private:
+
+    void enqueue(Node* n){
+        n->next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    std::atomic<Node*> head;
+    Node* tail;
+    Node stub;
+    std::atomic<bool> signaled;
+};
+
+}
+
+#endif
@@ -13,19 +13,26 @@ MTX::Router::~Router(){}
 void MTX::Router::addAsyncRoute(
         const std::string& method,
         const std::string& action,
-        MTX::Router::request_async_action f){
+        MTX::Router::request_async_action f,
+        const std::string& name){
     DLOGINFO("registering action : " << method << " " << action);
+    std::map<std::string, Route>* actions;
     if(method == "GET")
-        get_actions.insert(std::make_pair(action, f));
+        actions = &get_actions;
     else if(method == "POST")
-        post_actions.insert(std::make_pair(action, f));
+        actions = &post_actions;
     else if(method == "PUT")
-        put_actions.insert(std::make_pair(action, f));
+        actions = &put_actions;
     else{
         std::string err = "addAsyncRoute:  unknow method ";
         err += method;
         throw std::logic_error(err);
     }
+    std::shared_ptr<RequestStats>& stats =
+            route_stats[name.empty() ? action : name];
+    if(!stats)
+        stats = std::make_shared<RequestStats>();
+    actions->insert(std::make_pair(action, Route{f, stats}));
 }
 
 bool MTX::Router::route(
@@ -34,7 +41,7 @@ bool MTX::Router::route(
         const std::map<std::string, std::string>& qs,
         const std::map<std::string, std::string>& headers,
         const std::string& body,
-        std::string& response_body){
+        MTX::Router::account_operation& operation){
 
     std::string action = "";
     std::string account = "*";
@@ -46,6 +53,8 @@ bool MTX::Router::route(
             action = "activeaccounts";
         }else if(path == "/v1/summary"){
             action = "summary";
+        }else if(path == "/v1/changes"){
+            action = "changes";
         }else{
             return false;
         }
@@ -69,7 +78,7 @@ bool MTX::Router::route(
         }
     }
     DLOGINFO("action : [" << action << "], account : [" << account << "]");
-    std::map<std::string, request_async_action>::const_iterator it;
+    std::map<std::string, Route>::const_iterator it;
     if(method == "GET"){
         if((it = get_actions.find(action)) == get_actions.end()){
             return false;
@@ -86,7 +95,11 @@ bool MTX::Router::route(
         return false;
     }
 
-    response_body = it->second(path, qs, headers, account, body);
+    operation.stats = it->second.stats.get();
+    account_operation decoded =
+            it->second.action(path, qs, headers, account, body);
+    decoded.stats = operation.stats;
+    operation = std::move(decoded);
     return true;
 }
 
@@ -2,7 +2,11 @@
 #define __MTX_ROUTER_H__
 #include <string>
 #include <map>
+#include <memory>
 #include <functional>
+#include "utils/stats.h"
+
+struct evbuffer;
 
 namespace MTX {
 
@@ -12,7 +16,40 @@ struct Router{
 
     ~Router();
 
-    typedef std::function<std::string
+    /*
+    A request goes through three stages, each of which may throw :
+    - the action decodes the request and returns the operation
+    - the operation touches the state it runs on and returns the encoder
+    - the encoder writes the response body into the reply buffer
+    Only the operation needs to run on the thread owning that state.
+
+    An encoder returning true has more of the body to write : the reply is
+    then sent in chunks, the encoder being called again with the same
+    buffer each time the previous chunk has gone out.
+    */
+    typedef std::function<bool (struct evbuffer* out)> response_encoder;
+
+    struct account_operation {
+        // top level account the operation is confined to, when empty apply
+        // runs once per partition of the state and gather builds the
+        // encoder
+        std::string top_level;
+        // owner is the state apply runs on, opaque to the router : the
+        // service routing the requests decides what it is
+        std::function<response_encoder (void* owner)> apply;
+        std::function<response_encoder ()> gather;
+        // when set, apply stores there the ETag of the reply, and returns
+        // no encoder if it matches the If-None-Match of the request
+        std::shared_ptr<std::string> etag;
+        // long polling : while there is nothing to reply yet apply or
+        // gather return no encoder, the operation is then run again a
+        // little later
+        bool long_poll = false;
+        // set by route(), even when the action throws
+        RequestStats* stats = nullptr;
+    };
+
+    typedef std::function<account_operation
                 (const std::string& path,
                  const std::map<std::string, std::string>& qs,
                  const std::map<std::string, std::string>& headers,
@@ -24,29 +61,45 @@ struct Router{
     @param method : is the request method : PUT, POST, etc
     @param action : is the last sub at the path, ie for :
     /v1/accounts/<account>/shadow then the action is shadow
+    @param name : what the route's stats are kept under, the action when
+    empty; routes with the same name share them
     */
     void addAsyncRoute(const std::string& method,
                        const std::string& action,
-                       request_async_action f);
+                       request_async_action f,
+                       const std::string& name = "");
+
+    // stats of every route, by name
+    const std::map<std::string, std::shared_ptr<RequestStats>>&
+    stats() const{
+        return route_stats;
+    }
 
     /*
-    Routes a request based on the path and method. If the
-    route was not found then return false, true otherwise
+    Routes a request based on the path and method and decodes it into
+    operation. If the route was not found then return false, true otherwise
     */
     bool route(const std::string& method,
                const std::string& path,
                const std::map<std::string, std::string>& qs,
                const std::map<std::string, std::string>& headers,
                const std::string& body,
-               std::string& response_body);
+               account_operation& operation);
 
 private:
 
     bool check_base_path(const std::string& path);
 
-    std::map<std::string, request_async_action> get_actions;
-    std::map<std::string, request_async_action> post_actions;
-    std::map<std::string, request_async_action> put_actions;
+    struct Route{
+        request_async_action action;
+        std::shared_ptr<RequestStats> stats;
+    };
+
+    std::map<std::string, Route> get_actions;
+    std::map<std::string, Route> post_actions;
+    std::map<std::string, Route> put_actions;
+
+    std::map<std::string, std::shared_ptr<RequestStats>> route_stats;
 
     std::string base_path;
     
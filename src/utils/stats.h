@@ -0,0 +1,103 @@
+#ifndef __MTX_STATS_H__
+#define __MTX_STATS_H__
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace MTX {
+
+/*
+Lock free latency histogram, any thread can record into it. Samples are
+counted in power of two buckets of microseconds, which tells a slow
+percentile from a fast one for the price of a few relaxed adds. Counts
+are cumulative, interval figures come from the difference of two
+snapshots.
+*/
+struct LatencyHistogram{
+
+    // bucket 0 holds 0us, bucket i holds [2^(i-1), 2^i) us, the last one
+    // everything above
+    static const size_t BUCKETS = 40;
+
+    struct Snapshot{
+        uint64_t count;
+        uint64_t sum;       // us
+        uint64_t buckets[BUCKETS];
+
+        // upper bound of the bucket holding the quantile q, in us
+        uint64_t percentile(double q) const{
+            if(count == 0)
+                return 0;
+            uint64_t rank = (uint64_t)(q * count);
+            if(rank >= count)
+                rank = count - 1;
+            uint64_t seen = 0;
+            for(size_t i = 0; i < BUCKETS; ++i){
+                seen += buckets[i];
+                if(seen > rank)
+                    return i ? (uint64_t)1 << i : 0;
+            }
+            return (uint64_t)1 << (BUCKETS - 1);
+        }
+
+        uint64_t mean() const{
+            return count ? sum / count : 0;
+        }
+
+        // samples recorded since an earlier snapshot
+        Snapshot operator - (const Snapshot& earlier) const{
+            Snapshot result;
+            result.count = count - earlier.count;
+            result.sum = sum - earlier.sum;
+            for(size_t i = 0; i < BUCKETS; ++i)
+                result.buckets[i] = buckets[i] - earlier.buckets[i];
+            return result;
+        }
+    };
+
+    LatencyHistogram() : sum(0){
+        for(auto& b : buckets)
+            b.store(0, std::memory_order_relaxed);
+    }
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(uint64_t us){
+        size_t i = us ? 64 - __builtin_clzll(us) : 0;
+        if(i >= BUCKETS)
+            i = BUCKETS - 1;
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    // not atomic as a whole, samples being recorded meanwhile may only be
+    // partly in
+    Snapshot snapshot() const{
+        Snapshot result;
+        result.count = 0;
+        for(size_t i = 0; i < BUCKETS; ++i){
+            result.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+            result.count += result.buckets[i];
+        }
+        result.sum = sum.load(std::memory_order_relaxed);
+        return result;
+    }
+
+private:
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> buckets[BUCKETS];
+};
+
+// what is kept about the requests of a route
+struct RequestStats{
+    RequestStats() : requests(0), errors(0){ }
+
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> errors;     // replied with a 4xx or 5xx
+    LatencyHistogram latency;         // until the reply started
+};
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef __MTX_TIMER_WHEEL_H__
+#define __MTX_TIMER_WHEEL_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace MTX {
+
+/*
+Intrusive hashed timer wheel. Items must derive from TimerWheel<T>::Entry
+and stay owned by the caller; scheduling and cancelling are O(1) and an
+expiry pass only visits the slots of the ticks that went by.
+
+Deadlines are rounded up to the next tick, so an item never expires early
+and at most one tick late. Deadlines further away than a revolution wait in
+their slot for the right round. Not thread safe.
+*/
+template<typename T>
+struct TimerWheel{
+
+    struct Entry{
+        Entry() : prev(nullptr), next(nullptr), tick(0){}
+
+        bool scheduled() const{
+            return prev != nullptr;
+        }
+
+    private:
+        friend struct TimerWheel;
+        Entry* prev;
+        Entry* next;
+        uint64_t tick;
+    };
+
+    /*
+    @param tick_seconds wheel resolution
+    @param num_slots rounded up to a power of two
+    @param now current time in seconds, wheel starts there
+    */
+    TimerWheel(double tick_seconds, size_t num_slots, double now) :
+                    tick_seconds(tick_seconds), count(0){
+        size_t n = 1;
+        while(n < num_slots)
+            n *= 2;
+        slots.resize(n);
+        for(auto& slot : slots)
+            slot.prev = slot.next = &slot;
+        current = tick_of(now);
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // reschedules the item if it already was
+    void schedule(T* item, double when){
+        Entry* e = item;
+        if(e->scheduled())
+            unlink(e);
+        uint64_t tick = tick_of(when);
+        if(when > tick * tick_seconds)
+            ++tick;
+        e->tick = tick > current ? tick : current + 1;
+        Entry& slot = slots[e->tick & (slots.size() - 1)];
+        e->prev = slot.prev;
+        e->next = &slot;
+        slot.prev->next = e;
+        slot.prev = e;
+        ++count;
+    }
+
+    void cancel(T* item){
+        Entry* e = item;
+        if(e->scheduled())
+            unlink(e);
+    }
+
+    /*
+    Unschedules the items due at now and calls on_expired(T*) for each of
+    them, which may schedule or cancel items itself.
+    @return number of expired items
+    */
+    template<typename F>
+    size_t expire(double now, F&& on_expired){
+        uint64_t to = tick_of(now);
+        if(to <= current)
+            return 0;
+        // past a revolution every slot is visited once
+        uint64_t from = to - current > slots.size()
+                        ? to - slots.size() + 1 : current + 1;
+        current = to;
+
+        // gathered first so the callbacks can't disturb the walk
+        Entry* due = nullptr;
+        for(uint64_t t = from; t <= to && count; ++t){
+            Entry& slot = slots[t & (slots.size() - 1)];
+            for(Entry* e = slot.next; e != &slot;){
+                Entry* next = e->next;
+                if(e->tick <= to){
+                    unlink(e);
+                    e->next = due;
+                    due = e;
+                }
+                e = next;
+            }
+        }
+
+        size_t n = 0;
+        while(due){
+            Entry* e = due;
+            due = e->next;
+            e->next = nullptr;
+            on_expired(static_cast<T*>(e));
+            ++n;
+        }
+        return n;
+    }
+
+    size_t size() const{
+        return count;
+    }
+
+    bool empty() const{
+        return count == 0;
+    }
+
+    double resolution() const{
+        return tick_seconds;
+    }
+
+private:
+
+    uint64_t tick_of(double t) const{
+        return t > 0 ? (uint64_t)(t / tick_seconds) : 0;
+    }
+
+    void unlink(Entry* e){
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        e->prev = e->next = nullptr;
+        --count;
+    }
+
+    double tick_seconds;
+    std::vector<Entry> slots;   // list heads
+    uint64_t current;           // last tick expired
+    size_t count;
+};
+
+}
+
+#endif
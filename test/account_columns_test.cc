@@ -0,0 +1,171 @@
+/*
+The scans over the account columns must find what walking the map finds :
+active accounts, accounts changed since a version, closed accounts to
+evict and trees whose budgets are not consistent.
+*/
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "banker/account.h"
+
+#include <set>
+
+using namespace std;
+using namespace RTBKIT;
+
+namespace {
+
+Accounts
+makeAccounts()
+{
+    Accounts accounts;
+    for (string top: { "t1", "t2", "t3" }) {
+        accounts.setBudget({top}, MicroUSD(1000));
+        accounts.setBalance({top, "a"}, MicroUSD(300), AT_BUDGET);
+        accounts.setBalance({top, "a", "s"}, MicroUSD(100), AT_SPEND);
+        accounts.setBalance({top, "b"}, MicroUSD(200), AT_SPEND);
+    }
+    return accounts;
+}
+
+set<AccountKey>
+changedSince(const Accounts & accounts, uint64_t version)
+{
+    set<AccountKey> result;
+    accounts.forEachAccountChangedSince(version,
+            [&] (const AccountKey & key, const Account &)
+            { BOOST_CHECK(result.insert(key).second); });
+    return result;
+}
+
+set<AccountKey>
+changedSinceFromMap(const Accounts & accounts, uint64_t version)
+{
+    set<AccountKey> result;
+    accounts.forEachAccount([&] (const AccountKey & key, const Account &)
+            {
+                if (accounts.getAccountVersion(key) > version)
+                    result.insert(key);
+            });
+    return result;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( test_changed_since )
+{
+    Accounts accounts = makeAccounts();
+    uint64_t version = accounts.lastVersion->load();
+    BOOST_CHECK(changedSince(accounts, version).empty());
+    BOOST_CHECK_EQUAL(changedSince(accounts, 0).size(), accounts.size());
+
+    accounts.setBalance({"t2", "a", "s"}, MicroUSD(50), AT_SPEND);
+    set<AccountKey> expected = { {"t2"}, {"t2", "a"}, {"t2", "a", "s"} };
+    BOOST_CHECK(changedSince(accounts, version) == expected);
+    BOOST_CHECK(changedSinceFromMap(accounts, version) == expected);
+
+    // the copies rebuild their columns
+    Accounts copy = accounts;
+    BOOST_CHECK(changedSince(copy, version) == expected);
+}
+
+BOOST_AUTO_TEST_CASE( test_active_and_evicted )
+{
+    Accounts accounts = makeAccounts();
+    accounts.closeAccount({"t1", "a"});
+    accounts.closeAccount({"t3", "b"});
+
+    vector<AccountKey> active;
+    accounts.forEachAccount([&] (const AccountKey & key, const Account & a)
+            {
+                if (a.status == Account::ACTIVE)
+                    active.push_back(key);
+            });
+    BOOST_CHECK(accounts.getActiveAccountKeys() == active);
+    BOOST_CHECK_EQUAL(active.size(), accounts.size() - 3);
+
+    // t1:a goes once t1:a:s, closed with it, is gone
+    size_t before = accounts.size();
+    BOOST_CHECK_EQUAL(accounts.evictClosedAccounts(
+                              Datacratic::Date::now().plusSeconds(1)), 3);
+    BOOST_CHECK_EQUAL(accounts.size(), before - 3);
+    BOOST_CHECK(accounts.getAccountKeys({"t1", "a"}).empty());
+    BOOST_CHECK(accounts.getActiveAccountKeys() == active);
+    BOOST_CHECK_EQUAL(accounts.getEvictedPrefixes({"t3", "b"}).size(), 1);
+
+    // nothing closed is left
+    BOOST_CHECK_EQUAL(accounts.evictClosedAccounts(
+                              Datacratic::Date::now().plusSeconds(1)), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_closed_between_dumps )
+{
+    // closed after the last dump, the account may not be archived yet
+    Accounts accounts = makeAccounts();
+    uint64_t saved = accounts.lastVersion->load();
+    accounts.setBalance({"t1", "c"}, MicroUSD(10), AT_SPEND);
+    accounts.closeAccount({"t1", "c"});
+    accounts.closeAccount({"t3", "b"});
+    Datacratic::Date later = Datacratic::Date::now().plusSeconds(1);
+    BOOST_CHECK_EQUAL(accounts.evictClosedAccounts(later, saved), 0);
+    BOOST_CHECK_EQUAL(accounts.getAccountKeys({"t1", "c"}).size(), 1);
+
+    // once a dump wrote them they can go
+    saved = accounts.lastVersion->load();
+    BOOST_CHECK_EQUAL(accounts.evictClosedAccounts(later, saved), 2);
+    BOOST_CHECK(accounts.getAccountKeys({"t1", "c"}).empty());
+    BOOST_CHECK(accounts.getAccountKeys({"t3", "b"}).empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_evict_restore_cycles )
+{
+    // the ids evicted accounts leave are taken by the next ones
+    Accounts accounts = makeAccounts();
+    size_t size = accounts.size();
+    size_t indexSize = accounts.indexSize();
+    for (int cycle = 0;  cycle < 20;  ++cycle) {
+        AccountKey key({"t2", "a", "c" + to_string(cycle)});
+        accounts.setBalance(key, MicroUSD(10), AT_SPEND);
+        accounts.closeAccount(key);
+        Json::Value archived = accounts.getAccount(key).toJson();
+        BOOST_CHECK_EQUAL(accounts.evictClosedAccounts(
+                                  Datacratic::Date::now().plusSeconds(1)), 1);
+        BOOST_CHECK_EQUAL(accounts.size(), size);
+        BOOST_CHECK_EQUAL(accounts.indexSize(), indexSize + 1);
+
+        accounts.restoreEvictedAccount(key, archived);
+        BOOST_CHECK(accounts.getAccount(key).toJson() == archived);
+        BOOST_CHECK_EQUAL(accounts.indexSize(), indexSize + 1);
+        BOOST_CHECK_EQUAL(accounts.evictClosedAccounts(
+                                  Datacratic::Date::now().plusSeconds(1)), 1);
+    }
+    BOOST_CHECK_EQUAL(accounts.indexSize(), indexSize + 1);
+
+    // and the scans still see the accounts left
+    BOOST_CHECK_EQUAL(changedSince(accounts, 0).size(), accounts.size());
+    BOOST_CHECK(changedSince(accounts, 0) == changedSinceFromMap(accounts, 0));
+    BOOST_CHECK(accounts.getAccountKeys({"t2", "a"}).size() == 2);
+}
+
+BOOST_AUTO_TEST_CASE( test_inter_account_consistency )
+{
+    Accounts accounts = makeAccounts();
+    accounts.ensureInterAccountConsistency();
+    for (string top: { "t1", "t2", "t3" })
+        BOOST_CHECK(!accounts.isAccountInconsistent({top}));
+
+    // a child budget that its parent didn't allocate
+    Json::Value json = accounts.getAccount({"t2", "a", "s"}).toJson();
+    json["budgetIncreases"]["USD/1M"] = 150;
+    accounts.restoreAccount({"t2", "a", "s"}, json, true);
+    accounts.ensureInterAccountConsistency();
+
+    for (string top: { "t1", "t2", "t3" }) {
+        BOOST_CHECK_EQUAL(accounts.isAccountInconsistent({top}),
+                          !accounts.checkBudgetConsistency({top}));
+    }
+    BOOST_CHECK(accounts.isAccountInconsistent({"t2"}));
+    BOOST_CHECK(!accounts.isAccountInconsistent({"t3"}));
+}
@@ -0,0 +1,103 @@
+/*
+Time and allocations per decode of a shadow account body, as the shadow
+route receives them : through Json::parse() and ShadowAccount::fromJson(),
+and through read_shadow_account(). The bodies have the shape of the ones
+the router agents send, in one currency with no line item, and in two
+currencies with a handful of line items.
+
+    account_json_bench [iterations]
+*/
+#include "banker/account_json.h"
+#include "soa/jsoncpp/reader.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+using namespace std;
+using namespace RTBKIT;
+
+namespace {
+
+atomic<uint64_t> allocations(0);
+
+}
+
+void * operator new (size_t size)
+{
+    ++allocations;
+    if (void * p = malloc(size ? size : 1))
+        return p;
+    throw bad_alloc();
+}
+
+void operator delete (void * p) noexcept
+{
+    free(p);
+}
+
+namespace {
+
+string
+shadowBody(bool twoCurrencies, int lineItems)
+{
+    auto amount = [&] (int64_t value)
+        {
+            CurrencyPool result = MicroUSD(value);
+            if (twoCurrencies)
+                result += MicroEUR(value / 2);
+            return result;
+        };
+
+    Accounts accounts;
+    AccountKey key({"campaign", "strategy"});
+    accounts.setBudget({"campaign"}, amount(1000000000));
+    accounts.setBalance(key, amount(10000000), AT_SPEND);
+
+    ShadowAccount shadow;
+    shadow.syncFromMaster(accounts.getAccount(key));
+    for (int i = 0;  i < 200;  ++i) {
+        string item = "auction-" + to_string(i);
+        shadow.authorizeBid(item, MicroUSD(1500));
+        if (i % 4 == 0)
+            continue;
+        LineItems items;
+        if (lineItems)
+            items["creative-" + to_string(i % lineItems)] += MicroUSD(900);
+        shadow.commitBid(item, MicroUSD(900), items);
+    }
+    return shadow.toJson().toString();
+}
+
+template<typename Decode>
+void
+bench(const string & name, const string & body, int n, Decode decode)
+{
+    uint64_t before = allocations.load();
+    auto start = chrono::steady_clock::now();
+    for (int i = 0;  i < n;  ++i)
+        decode(body);
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now()
+                                               - start).count() / n;
+    cout << "  " << name << ": " << ns << " ns, "
+         << double(allocations.load() - before) / n << " allocations" << endl;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    int n = argc > 1 ? stoi(argv[1]) : 100000;
+    for (auto shape: { make_pair(false, 0), make_pair(true, 5) }) {
+        string body = shadowBody(shape.first, shape.second);
+        cout << body.size() << " bytes, " << (shape.first ? 2 : 1)
+             << " currencies, " << shape.second << " line items" << endl;
+        bench("Json::parse + fromJson", body, n, [] (const string & body)
+              { return ShadowAccount::fromJson(Json::parse(body)); });
+        bench("read_shadow_account", body, n, MTX::read_shadow_account);
+    }
+    return 0;
+}
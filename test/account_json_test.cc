@@ -0,0 +1,187 @@
+/*
+The streaming writers of account_json.h must give, byte for byte, what
+toJson().toString(), that is jsoncpp's FastWriter, gives : member order,
+escaping of the names and the trailing newline. The shadow account
+decoder must give what ShadowAccount::fromJson(Json::parse()) gives, or
+throw what it throws.
+*/
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "banker/account_json.h"
+#include "soa/jsoncpp/reader.h"
+
+#include <event2/buffer.h>
+
+using namespace std;
+using namespace RTBKIT;
+
+namespace {
+
+// what a JsonStream writes for value
+template<typename T, typename... Args>
+string
+streamed(const T & value, Args... args)
+{
+    evbuffer * buffer = evbuffer_new();
+    {
+        MTX::JsonStream out(buffer);
+        MTX::write_json(out, value, args...);
+        out.end();
+    }
+    string result(evbuffer_get_length(buffer), '\0');
+    evbuffer_remove(buffer, &result[0], result.size());
+    evbuffer_free(buffer);
+    return result;
+}
+
+// names that need escaping, and that sort differently as keys and strings
+const char * const lineItemNames[] = {
+    "plain", "B", "a", "quote\"", "back\\slash", "new\nline", "tab\t",
+    "control\x01\x1f", "utf8 \xc3\xa9", "slash/", "", "a.b", "a:b", "a_b"
+};
+
+// the decoded account, or the message of what decoding threw
+template<typename Decode>
+string
+decoded(Decode decode, const string & body)
+{
+    try {
+        return decode(body).toJson().toString();
+    } catch (const std::exception & exc) {
+        return string("threw: ") + exc.what();
+    }
+}
+
+void
+checkDecoder(const string & body)
+{
+    BOOST_TEST_MESSAGE(body);
+    string expected = decoded([] (const string & body)
+                              { return ShadowAccount::fromJson(Json::parse(body)); },
+                              body);
+    BOOST_CHECK_EQUAL(decoded(MTX::read_shadow_account, body), expected);
+}
+
+Accounts
+makeAccounts()
+{
+    Accounts accounts;
+    // ["a", "b"] sorts before ["a.b"] as a key, but "a.b" < "a:b"
+    for (auto key: vector<AccountKey>{ {"a"}, {"a.b"}, {"a_b"}, {"B"} })
+        accounts.setBudget(key, MicroUSD(1000));
+    accounts.setBalance({"a", "b"}, MicroUSD(300), AT_BUDGET);
+    accounts.setBalance({"a", "b", "c"}, MicroUSD(100), AT_SPEND);
+    accounts.setBalance({"a", "b.c"}, MicroEUR(50), AT_SPEND);
+    accounts.addAdjustment({"a", "b", "c"}, MicroUSD(-5));
+    accounts.closeAccount({"B"});
+
+    ShadowAccount shadow;
+    shadow.syncFromMaster(accounts.getAccount({"a", "b", "c"}));
+    for (auto name: lineItemNames) {
+        BOOST_REQUIRE(shadow.authorizeBid(name, MicroUSD(2)));
+        LineItems items;
+        items[name] += MicroUSD(1);
+        shadow.commitBid(name, MicroUSD(1), items);
+    }
+    accounts.syncFromShadow({"a", "b", "c"}, shadow);
+    return accounts;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( test_pools_and_line_items )
+{
+    CurrencyPool pool;
+    BOOST_CHECK_EQUAL(streamed(pool), pool.toJson().toString());
+    pool += MicroUSD(-12);
+    pool += MicroEUR(7);
+    pool += Amount(CurrencyCode::CC_IMP, 1);
+    pool += Amount(CurrencyCode::CC_CLK, 0);
+    BOOST_CHECK_EQUAL(streamed(pool), pool.toJson().toString());
+    pool -= MicroEUR(7);
+    BOOST_CHECK_EQUAL(streamed(pool), pool.toJson().toString());
+
+    LineItems items;
+    for (auto name: lineItemNames)
+        items[name] += MicroUSD(3);
+    BOOST_CHECK_EQUAL(streamed(items), items.toJson().toString());
+}
+
+BOOST_AUTO_TEST_CASE( test_accounts_and_summaries )
+{
+    Accounts accounts = makeAccounts();
+
+    BOOST_CHECK_EQUAL(streamed(accounts), accounts.toJson().toString());
+    for (auto & key: accounts.getAccountKeys()) {
+        Account account = accounts.getAccount(key);
+        BOOST_CHECK_EQUAL(streamed(account), account.toJson().toString());
+
+        AccountSummary summary = accounts.getAccountSummary(key);
+        BOOST_CHECK_EQUAL(streamed(summary), summary.toJson().toString());
+        BOOST_CHECK_EQUAL(streamed(summary, true), summary.toJson(true).toString());
+    }
+
+    vector<AccountKey> keys = accounts.getAccountKeys();
+    BOOST_CHECK_EQUAL(streamed(keys),
+                      Datacratic::jsonEncode(keys).toString());
+}
+
+BOOST_AUTO_TEST_CASE( test_read_shadow_account )
+{
+    ShadowAccount shadow;
+    shadow.syncFromMaster(makeAccounts().getAccount({"a", "b", "c"}));
+    for (auto name: lineItemNames) {
+        BOOST_REQUIRE(shadow.authorizeBid(name, MicroUSD(2)));
+        LineItems items;
+        items[name] += MicroUSD(1);
+        shadow.commitBid(name, MicroUSD(1), items);
+    }
+    string body = shadow.toJson().toString();
+    BOOST_CHECK_EQUAL(MTX::read_shadow_account(body).toJson().toString(), body);
+
+    // valid bodies
+    for (string body: {
+            body,
+            string("{\"md\":{\"objectType\":\"ShadowAccount\",\"version\":1}}"),
+            string("{\"balance\":{\"USD/1M\":5,\"USD/1M\":7},\"extra\":[1,{\"a\":2}],"
+                   "\"md\":{\"version\":1,\"objectType\":\"ShadowAccount\"}}"),
+            string("{\"lineItems\":{\"x\":{\"EUR/1M\":3}},\"spent\":{\"EUR/1M\":true},"
+                   "\"balance\":{\"EUR/1M\":-1.5},\"commitmentsMade\":null,"
+                   "\"md\":{\"objectType\":\"ShadowAccount\",\"version\":1}}"),
+            // a comment, which only jsoncpp accepts
+            string("// sync\n{\"md\":{\"objectType\":\"ShadowAccount\",\"version\":1}}")
+        })
+        checkDecoder(body);
+
+    // malformed bodies
+    for (string body: {
+            string(""), string("{"), string("{\"md\":}"), string("[1,"),
+            string("{\"md\":{\"objectType\":\"ShadowAccount\",\"version\":1}"),
+            string("{\"md\":{\"objectType\":\"ShadowAccount\" \"version\":1}}"),
+            string("{\"spent\":{\"USD/1M\":1e}}"), string("nul")
+        })
+        checkDecoder(body);
+
+    // type errors and wrong metadata
+    for (string body: {
+            string("{}"), string("[]"), string("3"),
+            string("{\"md\":[]}"),
+            string("{\"md\":{\"objectType\":\"Account\",\"version\":1}}"),
+            string("{\"md\":{\"objectType\":\"ShadowAccount\",\"version\":2}}"),
+            string("{\"md\":{\"objectType\":\"ShadowAccount\",\"version\":\"1\"}}"),
+            string("{\"spent\":{\"USD/1M\":\"12\"},"
+                   "\"md\":{\"objectType\":\"ShadowAccount\",\"version\":1}}"),
+            string("{\"spent\":{\"USD/1M\":[12]},"
+                   "\"md\":{\"objectType\":\"ShadowAccount\",\"version\":1}}"),
+            string("{\"spent\":{\"USD/1M\":18446744073709551615},"
+                   "\"md\":{\"objectType\":\"ShadowAccount\",\"version\":1}}"),
+            string("{\"spent\":{\"XYZ\":1},"
+                   "\"md\":{\"objectType\":\"ShadowAccount\",\"version\":1}}"),
+            string("{\"spent\":{\"USD/1M\":1},"
+                   "\"md\":{\"objectType\":\"ShadowAccount\",\"version\":1}}")
+        })
+        checkDecoder(body);
+}
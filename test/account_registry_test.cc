@@ -0,0 +1,95 @@
+/*
+Ids and key segments of erased accounts are given out again : accounts
+inserted and erased in cycles must keep the registry the same size, and
+every account must still be found from its key and its raw name.
+*/
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "banker/account_registry.h"
+
+#include <map>
+
+using namespace std;
+using namespace RTBKIT;
+
+namespace {
+
+void
+checkFound(const AccountRegistry & registry,
+           const map<AccountKey, uint32_t> & ids)
+{
+    for (auto & e: ids) {
+        BOOST_CHECK_EQUAL(registry.find(e.first), e.second);
+        BOOST_CHECK_EQUAL(registry.find(e.first.toString()), e.second);
+        BOOST_CHECK(registry.key(e.second) == e.first);
+    }
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( test_insert_erase_cycles )
+{
+    AccountRegistry registry;
+    map<AccountKey, uint32_t> ids;
+    uint32_t top = registry.insert({"top"}, AccountRegistry::NO_ID);
+    ids[{"top"}] = top;
+    for (int i = 0;  i < 100;  ++i) {
+        AccountKey key({"top", "c" + to_string(i)});
+        ids[key] = registry.insert(key, top);
+    }
+    checkFound(registry, ids);
+
+    size_t size = registry.size(), segments = registry.segmentCount();
+    for (int cycle = 0;  cycle < 50;  ++cycle) {
+        // half the children go, and come back under other names
+        string gone = cycle % 2 == 0 ? "c" : "n";
+        string back = cycle % 2 == 0 ? "n" : "c";
+        for (int i = 0;  i < 100;  i += 2) {
+            AccountKey key({"top", gone + to_string(i)});
+            BOOST_REQUIRE(ids.count(key));
+            registry.erase(ids[key]);
+            ids.erase(key);
+            BOOST_CHECK_EQUAL(registry.find(key), AccountRegistry::NO_ID);
+            BOOST_CHECK_EQUAL(registry.find(key.toString()),
+                              AccountRegistry::NO_ID);
+        }
+        for (int i = 0;  i < 100;  i += 2) {
+            AccountKey key({"top", back + to_string(i)});
+            ids[key] = registry.insert(key, top);
+        }
+        checkFound(registry, ids);
+        BOOST_CHECK_EQUAL(registry.size(), size);
+        BOOST_CHECK_EQUAL(registry.segmentCount(), segments);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_shared_segments )
+{
+    // a segment stays while an account still ends with it
+    AccountRegistry registry;
+    uint32_t a = registry.insert({"a"}, AccountRegistry::NO_ID);
+    uint32_t b = registry.insert({"b"}, AccountRegistry::NO_ID);
+    uint32_t as = registry.insert({"a", "s"}, a);
+    uint32_t bs = registry.insert({"b", "s"}, b);
+    BOOST_CHECK_EQUAL(registry.segmentCount(), 3);
+
+    registry.erase(as);
+    BOOST_CHECK_EQUAL(registry.segmentCount(), 3);
+    BOOST_CHECK(registry.key(bs) == AccountKey({"b", "s"}));
+    registry.erase(bs);
+    BOOST_CHECK_EQUAL(registry.segmentCount(), 2);
+
+    // the freed ids come back, with their new keys
+    uint32_t ax = registry.insert({"a", "x"}, a);
+    uint32_t by = registry.insert({"b", "y"}, b);
+    BOOST_CHECK(ax == as || ax == bs);
+    BOOST_CHECK(by == as || by == bs);
+    BOOST_CHECK_EQUAL(registry.size(), 4);
+    BOOST_CHECK_EQUAL(registry.find("a:x"), ax);
+    BOOST_CHECK_EQUAL(registry.find("b:y"), by);
+    BOOST_CHECK_EQUAL(registry.find("b:s"), AccountRegistry::NO_ID);
+    BOOST_CHECK(registry.key(by) == AccountKey({"b", "y"}));
+}
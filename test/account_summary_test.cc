@@ -0,0 +1,107 @@
+/*
+Summaries read from the subtree totals kept up to date by every mutation
+must be the ones computed by walking the whole subtree, down to which
+currencies they list.
+*/
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "banker/account.h"
+
+using namespace std;
+using namespace RTBKIT;
+
+namespace {
+
+// the summary as computed before the subtree totals existed
+AccountSummary
+recursiveSummary(const Accounts & accounts, const AccountKey & key)
+{
+    AccountSummary result;
+
+    const Account a = accounts.getAccount(key);
+
+    result.account = a;
+    result.spent = a.spent;
+    result.budget = a.budgetIncreases - a.budgetDecreases;
+    result.effectiveBudget = a.budgetIncreases - a.budgetDecreases
+                    + a.recycledIn - a.recycledOut
+                    + a.allocatedIn - a.allocatedOut;
+    result.inFlight = a.commitmentsMade - a.commitmentsRetired;
+    result.adjustments = a.adjustmentsIn - a.adjustmentsOut;
+
+    for (const AccountKey & child: accounts.getAccountKeys(key, key.size() + 1)) {
+        if (child.size() == key.size() + 1)
+            result.addChild(child.back(), recursiveSummary(accounts, child),
+                            true);
+    }
+
+    result.adjustedSpent = result.spent - result.adjustments;
+    result.available = (result.effectiveBudget - result.adjustedSpent
+                        - result.inFlight);
+    return result;
+}
+
+void
+checkSummaries(const Accounts & accounts)
+{
+    for (const AccountKey & key: accounts.getAccountKeys()) {
+        BOOST_CHECK_EQUAL(accounts.getAccountSummary(key).toJson(),
+                          recursiveSummary(accounts, key).toJson());
+        BOOST_CHECK_EQUAL(accounts.getAccountSummary(key, 0).toJson(true),
+                          recursiveSummary(accounts, key).toJson(true));
+    }
+}
+
+// bids worth amount each, won at paid or cancelled when paid is zero
+void
+bid(Accounts & accounts, const AccountKey & key,
+    Amount amount, Amount paid, int n)
+{
+    ShadowAccount shadow;
+    shadow.syncFromMaster(accounts.getAccount(key));
+    for (int i = 0;  i < n;  ++i) {
+        string item = key.toString() + to_string(i);
+        BOOST_REQUIRE(shadow.authorizeBid(item, amount));
+        if (paid)
+            shadow.commitBid(item, paid, LineItems());
+        else shadow.cancelBid(item);
+    }
+    accounts.syncFromShadow(key, shadow);
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( test_summaries_match_recursive_ones )
+{
+    Accounts accounts;
+    accounts.createBudgetAccount({"top"});
+    accounts.setBudget({"top"}, MicroUSD(1000000));
+    accounts.setBalance({"top", "c1"}, MicroUSD(200000), AT_BUDGET);
+    accounts.setBalance({"top", "c1", "s"}, MicroUSD(100000), AT_SPEND);
+    accounts.setBalance({"top", "c2"}, MicroUSD(50000), AT_SPEND);
+    checkSummaries(accounts);
+
+    // commitments made and retired leave zero amounts behind
+    bid(accounts, {"top", "c1", "s"}, MicroUSD(1000), MicroUSD(0), 3);
+    checkSummaries(accounts);
+    bid(accounts, {"top", "c1", "s"}, MicroUSD(1000), MicroUSD(600), 5);
+    bid(accounts, {"top", "c2"}, MicroUSD(500), MicroUSD(500), 2);
+    checkSummaries(accounts);
+
+    accounts.addAdjustment({"top", "c2"}, MicroUSD(-100));
+    accounts.setBalance({"top", "c1", "s"}, MicroUSD(0), AT_SPEND);
+    checkSummaries(accounts);
+
+    // a second currency, given then taken back
+    accounts.setBudget({"other"}, MicroEUR(1000));
+    accounts.setBalance({"other", "s"}, MicroEUR(300), AT_SPEND);
+    accounts.setBalance({"other", "s"}, MicroEUR(0), AT_SPEND);
+    checkSummaries(accounts);
+
+    accounts.recuperate({"top", "c2"});
+    accounts.closeAccount({"top", "c1"});
+    checkSummaries(accounts);
+}
@@ -0,0 +1,102 @@
+/*
+Time per bid of authorizing then committing it, with a number of other
+bids pending : the insert, find and erase of a CommitmentTable against the
+unordered_map of commitments it replaced, then the whole of
+ShadowAccount::authorizeBid and commitBid.
+
+    commitment_table_bench [bids per run]
+*/
+#include "banker/account.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace RTBKIT;
+
+namespace {
+
+double
+nsPerCall(const chrono::steady_clock::time_point & start, int n)
+{
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start)
+           .count() / n;
+}
+
+// bid ids as the routers make them, 30 to 40 bytes
+vector<string>
+bidIds(int n)
+{
+    vector<string> result;
+    for (int i = 0;  i < n;  ++i)
+        result.push_back("ce1d9e4a-1b8c-4d5e-" + to_string(1000000 + i)
+                         + ":spot-" + to_string(i % 7));
+    return result;
+}
+
+void
+benchTable(int n, int pending)
+{
+    vector<string> ids = bidIds(n + pending);
+    Commitment commitment(MicroUSD(1), Datacratic::Date::now());
+
+    CommitmentTable table;
+    for (int i = 0;  i < pending;  ++i)
+        table.insert(ids[n + i], commitment);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0;  i < n;  ++i) {
+        table.insert(ids[i], commitment);
+        table.erase(table.find(ids[i]));
+    }
+    cout << "CommitmentTable, " << pending << " pending: "
+         << nsPerCall(start, n) << " ns" << endl;
+
+    unordered_map<string, Commitment> map;
+    for (int i = 0;  i < pending;  ++i)
+        map.insert(make_pair(ids[n + i], commitment));
+    start = chrono::steady_clock::now();
+    for (int i = 0;  i < n;  ++i) {
+        map.insert(make_pair(ids[i], commitment));
+        map.erase(map.find(ids[i]));
+    }
+    cout << "unordered_map, " << pending << " pending: "
+         << nsPerCall(start, n) << " ns" << endl;
+}
+
+void
+benchShadowAccount(int n, int pending)
+{
+    vector<string> ids = bidIds(n + pending);
+    Accounts accounts;
+    AccountKey key({"top", "spend"});
+    accounts.setBudget({"top"}, MicroUSD(int64_t(1) << 40));
+    accounts.setBalance(key, MicroUSD(int64_t(1) << 30), AT_SPEND);
+
+    ShadowAccount shadow;
+    shadow.syncFromMaster(accounts.getAccount(key));
+    for (int i = 0;  i < pending;  ++i)
+        shadow.authorizeBid(ids[n + i], MicroUSD(1));
+    LineItems items;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0;  i < n;  ++i) {
+        shadow.authorizeBid(ids[i], MicroUSD(2));
+        shadow.commitBid(ids[i], MicroUSD(1), items);
+    }
+    cout << "ShadowAccount authorize then commit, " << pending
+         << " pending: " << nsPerCall(start, n) << " ns" << endl;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    int n = argc > 1 ? stoi(argv[1]) : 1000000;
+    for (int pending: { 0, 1000, 100000 }) {
+        benchTable(n, pending);
+        benchShadowAccount(n, pending);
+    }
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+CommitmentTable must behave as the map of items to commitments it
+replaced : every item left is found after any sequence of inserts and
+erases, which shift the entries behind them back, whether the item is
+stored inline or, past INLINE_SIZE bytes, on the side.
+*/
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "banker/commitment_table.h"
+
+#include <map>
+#include <random>
+
+using namespace std;
+using namespace RTBKIT;
+
+namespace {
+
+Commitment
+commitment(int64_t value)
+{
+    return Commitment(MicroUSD(value), Datacratic::Date::fromSecondsSinceEpoch(value));
+}
+
+// short bid ids, ones around the inline size and long ones
+string
+item(int n, int length)
+{
+    string result = "bid-" + to_string(n) + "-";
+    while (result.size() < (size_t)length)
+        result += char('a' + result.size() % 26);
+    return result;
+}
+
+const int LENGTHS[] = { 0, 51, 52, 53, 200 };
+
+void
+checkSame(const CommitmentTable & table, const map<string, int64_t> & expected)
+{
+    BOOST_REQUIRE_EQUAL(table.size(), expected.size());
+    for (auto & e: expected) {
+        uint32_t id = table.find(e.first);
+        BOOST_REQUIRE(id != CommitmentTable::NO_ID);
+        BOOST_REQUIRE(table.live(id));
+        BOOST_REQUIRE_EQUAL(table[id].amount.value, e.second);
+    }
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( test_same_as_map )
+{
+    mt19937 rng(1);
+    CommitmentTable table;
+    map<string, int64_t> expected;
+
+    // few distinct items, so that most operations hit present ones and the
+    // table keeps going up and down through its sizes
+    for (int op = 0;  op < 200000;  ++op) {
+        string key = item(rng() % 300, LENGTHS[rng() % 5]);
+        int64_t value = rng() % 1000 + 1;
+        uint32_t id = table.find(key);
+        BOOST_REQUIRE_EQUAL(id != CommitmentTable::NO_ID,
+                            expected.count(key) == 1);
+
+        if (rng() % 2) {
+            auto inserted = table.insert(key, commitment(value));
+            BOOST_REQUIRE_EQUAL(inserted.second, id == CommitmentTable::NO_ID);
+            if (inserted.second)
+                expected[key] = value;
+            else BOOST_REQUIRE_EQUAL(inserted.first, id);
+        }
+        else if (id != CommitmentTable::NO_ID) {
+            table.erase(id);
+            BOOST_REQUIRE(!table.live(id));
+            expected.erase(key);
+        }
+
+        if (op % 1000 == 0)
+            checkSame(table, expected);
+    }
+    checkSame(table, expected);
+}
+
+BOOST_AUTO_TEST_CASE( test_backward_shift_erase )
+{
+    // erasing from the middle of every cluster, in every order, leaves
+    // the entries probed past the hole reachable
+    for (int round = 0;  round < 50;  ++round) {
+        mt19937 rng(round);
+        CommitmentTable table;
+        map<string, int64_t> expected;
+        // just under the half full the table grows past, so it clusters
+        for (int i = 0;  i < 8;  ++i) {
+            string key = item(round * 100 + i, 0);
+            table.insert(key, commitment(i + 1));
+            expected[key] = i + 1;
+        }
+        while (!expected.empty()) {
+            auto it = expected.begin();
+            advance(it, rng() % expected.size());
+            table.erase(table.find(it->first));
+            BOOST_CHECK(table.find(it->first) == CommitmentTable::NO_ID);
+            expected.erase(it);
+            checkSame(table, expected);
+        }
+        BOOST_CHECK(table.empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_long_items )
+{
+    CommitmentTable table;
+    string longItem = item(1, 200);
+    string inlineItem = item(1, 52);
+
+    auto a = table.insert(longItem, commitment(1));
+    auto b = table.insert(inlineItem, commitment(2));
+    BOOST_CHECK(a.second && b.second);
+    // the same beginning and length, but for the last byte
+    string other = longItem;
+    other.back() = '#';
+    BOOST_CHECK(table.find(other) == CommitmentTable::NO_ID);
+    BOOST_CHECK_EQUAL(table.find(longItem), a.first);
+
+    // the node of a long item is reused by a short one, and back
+    table.erase(a.first);
+    BOOST_CHECK(table.find(longItem) == CommitmentTable::NO_ID);
+    auto c = table.insert(item(2, 10), commitment(3));
+    BOOST_CHECK_EQUAL(c.first, a.first);
+    BOOST_CHECK(table.find(longItem) == CommitmentTable::NO_ID);
+    table.erase(c.first);
+    auto d = table.insert(other, commitment(4));
+    BOOST_CHECK_EQUAL(d.first, a.first);
+    BOOST_CHECK_EQUAL(table[table.find(other)].amount.value, 4);
+    BOOST_CHECK(table.find(longItem) == CommitmentTable::NO_ID);
+    BOOST_CHECK_EQUAL(table.find(inlineItem), b.first);
+
+    table.clear();
+    BOOST_CHECK(table.empty());
+    BOOST_CHECK(table.find(other) == CommitmentTable::NO_ID);
+}
@@ -0,0 +1,176 @@
+/*
+ConcurrentShadowAccounts used from many threads at once : onNewAccount is
+called once per account, without a lock held so that it can call back in,
+and sync() running alongside the bids loses none of them, the master
+ending with exactly what the threads spent.
+*/
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "banker/concurrent_shadow_accounts.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace RTBKIT;
+
+namespace {
+
+const int THREADS = 8;
+
+AccountKey
+spendAccount(int n)
+{
+    return AccountKey({"top", "spend" + to_string(n)});
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( test_new_account_callback )
+{
+    const int ACCOUNTS = 500;
+
+    Accounts master;
+    master.setBudget({"top"}, MicroUSD(1000000000));
+    for (int i = 0;  i < ACCOUNTS;  ++i)
+        master.setBalance(spendAccount(i), MicroUSD(1000), AT_SPEND);
+
+    ConcurrentShadowAccounts shadow;
+    mutex lock;
+    map<AccountKey, int> created;
+    atomic<int> reentered(0);
+    shadow.onNewAccount = [&] (AccountKey key)
+        {
+            {
+                lock_guard<mutex> guard(lock);
+                ++created[key];
+            }
+            // no lock is held : calling back in doesn't deadlock, and
+            // the account is there, not initialized yet
+            if (shadow.accountExists(key) && !shadow.isInitialized(key))
+                ++reentered;
+            if (shadow.createAccountAtomic(key)) {
+                lock_guard<mutex> guard(lock);
+                shadow.initializeAndMergeState(key, master.getAccount(key));
+            }
+        };
+
+    // every thread bids on every account, in a different order, so that
+    // they race to create each one
+    atomic<int> authorized(0);
+    vector<thread> threads;
+    for (int t = 0;  t < THREADS;  ++t) {
+        threads.emplace_back([&, t] ()
+            {
+                for (int i = 0;  i < ACCOUNTS;  ++i) {
+                    AccountKey key = spendAccount((i * 7 + t * 61) % ACCOUNTS);
+                    string item = "bid-" + to_string(t);
+                    if (shadow.authorizeBid(key, item, MicroUSD(1))) {
+                        ++authorized;
+                        shadow.cancelBid(key, item);
+                    }
+                }
+            });
+    }
+    for (auto & t: threads)
+        t.join();
+
+    BOOST_CHECK_EQUAL(shadow.size(), ACCOUNTS);
+    BOOST_CHECK_EQUAL(created.size(), ACCOUNTS);
+    for (auto & c: created)
+        BOOST_CHECK_EQUAL(c.second, 1);
+    BOOST_CHECK_EQUAL(reentered.load(), ACCOUNTS);
+    for (int i = 0;  i < ACCOUNTS;  ++i)
+        BOOST_CHECK(shadow.isInitialized(spendAccount(i)));
+    // the thread that created an account bids on it once initialized,
+    // the others may have come in before
+    BOOST_CHECK_GE(authorized.load(), ACCOUNTS);
+    shadow.checkInvariants();
+}
+
+BOOST_AUTO_TEST_CASE( test_sync_while_bidding )
+{
+    const int ACCOUNTS = 16;
+    const int BIDS = 20000;
+
+    Accounts master;
+    master.setBudget({"top"}, MicroUSD(int64_t(1) << 40));
+    for (int i = 0;  i < ACCOUNTS;  ++i)
+        master.setBalance(spendAccount(i), MicroUSD(int64_t(1) << 30),
+                          AT_SPEND);
+
+    ConcurrentShadowAccounts shadow;
+    for (int i = 0;  i < ACCOUNTS;  ++i)
+        shadow.initializeAndMergeState(spendAccount(i),
+                                       master.getAccount(spendAccount(i)));
+
+    // what every thread paid on every account, and how many bids it won
+    vector<vector<int64_t> > paid(THREADS, vector<int64_t>(ACCOUNTS, 0));
+    vector<vector<int64_t> > won(THREADS, vector<int64_t>(ACCOUNTS, 0));
+    atomic<int> refused(0);
+    atomic<bool> bidding(true);
+    thread syncer([&] ()
+        {
+            // the master is only touched from here
+            while (bidding)
+                shadow.sync(master);
+        });
+
+    vector<thread> threads;
+    for (int t = 0;  t < THREADS;  ++t) {
+        threads.emplace_back([&, t] ()
+            {
+                for (int i = 0;  i < BIDS;  ++i) {
+                    int account = (i + t) % ACCOUNTS;
+                    AccountKey key = spendAccount(account);
+                    string item = to_string(t) + "-" + to_string(i);
+                    // the checks aren't thread safe, the threads only count
+                    if (!shadow.authorizeBid(key, item, MicroUSD(3))) {
+                        ++refused;
+                        continue;
+                    }
+                    if (i % 3 == 0)
+                        shadow.cancelBid(key, item);
+                    else {
+                        shadow.commitBid(key, item, MicroUSD(i % 3),
+                                         LineItems());
+                        paid[t][account] += i % 3;
+                        ++won[t][account];
+                    }
+                }
+            });
+    }
+    for (auto & t: threads)
+        t.join();
+    bidding = false;
+    syncer.join();
+    shadow.sync(master);
+
+    BOOST_CHECK_EQUAL(refused.load(), 0);
+    shadow.checkInvariants();
+    for (int a = 0;  a < ACCOUNTS;  ++a) {
+        int64_t total = 0, wins = 0;
+        for (int t = 0;  t < THREADS;  ++t) {
+            total += paid[t][a];
+            wins += won[t][a];
+        }
+        AccountKey key = spendAccount(a);
+        Account account = master.getAccount(key);
+        BOOST_CHECK_EQUAL(account.spent.getAvailable(CurrencyCode::CC_USD).value,
+                          total);
+        BOOST_CHECK_EQUAL(account.spent.getAvailable(CurrencyCode::CC_IMP).value,
+                          wins);
+        // nothing is left pending
+        BOOST_CHECK_EQUAL(
+                account.commitmentsMade.getAvailable(CurrencyCode::CC_USD).value,
+                account.commitmentsRetired.getAvailable(CurrencyCode::CC_USD).value);
+        BOOST_CHECK(shadow.getAccount(key).spent == account.spent);
+        BOOST_CHECK(shadow.getAccount(key).balance == account.balance);
+    }
+}
@@ -0,0 +1,85 @@
+/*
+Time per call of the two account operations that are the heaviest on
+CurrencyPool arithmetic : the sync of a shadow account to the master and
+setBalance, with amounts in one and in two currencies.
+
+    currency_pool_bench [iterations]
+*/
+#include "banker/account.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+using namespace std;
+using namespace RTBKIT;
+
+namespace {
+
+double
+nsPerCall(const chrono::steady_clock::time_point & start, int n)
+{
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start)
+           .count() / n;
+}
+
+CurrencyPool
+amounts(int64_t value, bool twoCurrencies)
+{
+    CurrencyPool result = MicroUSD(value);
+    if (twoCurrencies)
+        result += MicroEUR(value);
+    return result;
+}
+
+void
+benchSyncToMaster(int n, bool twoCurrencies)
+{
+    Accounts accounts;
+    AccountKey key({"top", "spend"});
+    accounts.setBudget({"top"}, amounts(int64_t(1) << 40, twoCurrencies));
+    accounts.setBalance(key, amounts(int64_t(1) << 30, twoCurrencies),
+                        AT_SPEND);
+
+    ShadowAccount shadow;
+    shadow.syncFromMaster(accounts.getAccount(key));
+    auto start = chrono::steady_clock::now();
+    for (int i = 0;  i < n;  ++i) {
+        // what a bid won between two syncs does to the shadow
+        CurrencyPool step = amounts(1, twoCurrencies);
+        shadow.commitmentsMade += step;
+        shadow.commitmentsRetired += step;
+        shadow.spent += step;
+        shadow.balance -= step;
+        accounts.syncFromShadow(key, shadow);
+    }
+    cout << "syncToMaster, " << (twoCurrencies ? 2 : 1) << " currencies: "
+         << nsPerCall(start, n) << " ns" << endl;
+}
+
+void
+benchSetBalance(int n, bool twoCurrencies)
+{
+    Accounts accounts;
+    AccountKey key({"top", "spend"});
+    accounts.setBudget({"top"}, amounts(int64_t(1) << 40, twoCurrencies));
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0;  i < n;  ++i)
+        accounts.setBalance(key, amounts(1000 + i % 2, twoCurrencies),
+                            AT_SPEND);
+    cout << "setBalance, " << (twoCurrencies ? 2 : 1) << " currencies: "
+         << nsPerCall(start, n) << " ns" << endl;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    int n = argc > 1 ? stoi(argv[1]) : 1000000;
+    for (bool two: { false, true }) {
+        benchSyncToMaster(n, two);
+        benchSetBalance(n, two);
+    }
+    return 0;
+}
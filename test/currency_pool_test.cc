@@ -0,0 +1,220 @@
+/*
+CurrencyPool keeps an inline slot per known currency and a presence mask.
+It must behave as the sorted vector of amounts it replaced : which
+currencies are listed after each operation, limit, nonNegative, == and
+the serialized layout.
+*/
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "banker/currency.h"
+#include "jml/db/persistent.h"
+
+#include <algorithm>
+#include <random>
+#include <sstream>
+
+using namespace std;
+using namespace RTBKIT;
+
+namespace {
+
+/* the vector of amounts CurrencyPool used to be */
+struct VectorPool {
+    vector<Amount> amounts;
+
+    VectorPool & operator += (const Amount & amount)
+    {
+        if (!amount) return *this;
+        for (auto & am: amounts) {
+            if (am.currencyCode == amount.currencyCode) {
+                am += amount;
+                return *this;
+            }
+        }
+        amounts.push_back(amount);
+        sort(amounts.begin(), amounts.end(),
+             [] (Amount am1, Amount am2)
+             { return am1.currencyCode < am2.currencyCode; });
+        return *this;
+    }
+
+    VectorPool & operator -= (const Amount & amount)
+    {
+        return operator += (-amount);
+    }
+
+    VectorPool & operator += (const VectorPool & other)
+    {
+        for (auto & am: other.amounts)
+            operator += (am);
+        return *this;
+    }
+
+    VectorPool & operator -= (const VectorPool & other)
+    {
+        for (auto & am: other.amounts)
+            operator -= (am);
+        return *this;
+    }
+
+    Amount getAvailable(CurrencyCode code) const
+    {
+        for (auto & am: amounts)
+            if (am.currencyCode == code)
+                return am;
+        return Amount(code, 0);
+    }
+
+    VectorPool limit(const VectorPool & other) const
+    {
+        VectorPool result;
+        for (auto & am: other.amounts) {
+            Amount a = getAvailable(am.currencyCode).limit(am);
+            if (a)
+                result.amounts.push_back(a);
+        }
+        return result;
+    }
+
+    VectorPool nonNegative() const
+    {
+        VectorPool result;
+        for (auto & am: amounts)
+            if (am.isNonNegative())
+                result.amounts.push_back(am);
+        return result;
+    }
+
+    bool operator == (const VectorPool & other) const
+    {
+        auto contains = [] (const VectorPool & p1, const VectorPool & p2)
+            {
+                for (auto & am: p1.amounts)
+                    if (p2.getAvailable(am.currencyCode) != am)
+                        return false;
+                return true;
+            };
+        return contains(*this, other) && contains(other, *this);
+    }
+};
+
+// every listed currency with its amount, in order
+string
+listed(const CurrencyPool & pool)
+{
+    string result;
+    pool.forEach([&] (const Amount & a)
+                 { result += a.getCurrencyStr() + "=" + to_string(a.value) + " "; });
+    return result;
+}
+
+string
+listed(const VectorPool & pool)
+{
+    string result;
+    for (auto & a: pool.amounts)
+        result += a.getCurrencyStr() + "=" + to_string(a.value) + " ";
+    return result;
+}
+
+const CurrencyCode codes[] = {
+    CurrencyCode::CC_USD, CurrencyCode::CC_EUR,
+    CurrencyCode::CC_IMP, CurrencyCode::CC_CLK
+};
+
+Amount
+randomAmount(mt19937 & rng)
+{
+    // small values so that sums often go back to zero
+    return Amount(codes[rng() % 4], int64_t(rng() % 5) - 2);
+}
+
+CurrencyPool
+roundTrip(const CurrencyPool & pool)
+{
+    ostringstream stream;
+    {
+        ML::DB::Store_Writer store(stream);
+        store << pool;
+    }
+    string data = stream.str();
+    ML::DB::Store_Reader store(data.data(), data.size());
+    CurrencyPool result;
+    store >> result;
+    return result;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( test_same_as_vector_pool )
+{
+    mt19937 rng(1);
+    for (int round = 0;  round < 2000;  ++round) {
+        CurrencyPool a, b;
+        VectorPool va, vb;
+        for (int i = 0, n = rng() % 8;  i < n;  ++i) {
+            Amount am = randomAmount(rng);
+            bool add = rng() % 2;
+            bool first = rng() % 2;
+            if (first) {
+                if (add) { a += am;  va += am; } else { a -= am;  va -= am; }
+            }
+            else {
+                if (add) { b += am;  vb += am; } else { b -= am;  vb -= am; }
+            }
+        }
+        BOOST_REQUIRE_EQUAL(listed(a), listed(va));
+        BOOST_REQUIRE_EQUAL(listed(b), listed(vb));
+        BOOST_CHECK_EQUAL(a == b, va == vb);
+        BOOST_CHECK_EQUAL(a.size(), va.amounts.size());
+        BOOST_CHECK_EQUAL(listed(a.limit(b)), listed(va.limit(vb)));
+        BOOST_CHECK_EQUAL(listed(a.nonNegative()), listed(va.nonNegative()));
+
+        CurrencyPool sum = a;
+        VectorPool vsum = va;
+        sum += b;  vsum += vb;
+        BOOST_CHECK_EQUAL(listed(sum), listed(vsum));
+        sum -= b;  vsum -= vb;
+        BOOST_CHECK_EQUAL(listed(sum), listed(vsum));
+        BOOST_CHECK_EQUAL(listed(a - b), listed(VectorPool(va) -= vb));
+
+        // a listed zero amount stays listed once read back
+        BOOST_CHECK_EQUAL(listed(roundTrip(a)), listed(a));
+        BOOST_CHECK(roundTrip(a) == a);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_present_zero )
+{
+    CurrencyPool pool(MicroUSD(5));
+    pool -= MicroUSD(5);
+    BOOST_CHECK(pool.isZero());
+    BOOST_CHECK(!pool.empty());
+    BOOST_CHECK_EQUAL(pool.toJson().toString(), "{\"USD/1M\":0}\n");
+    BOOST_CHECK(pool == CurrencyPool());
+
+    // adding a pool only lists the currencies it has a non zero amount of
+    CurrencyPool other;
+    other += pool;
+    BOOST_CHECK(other.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_reconstitute_older_layout )
+{
+    // zero amounts used to be written without their currency code
+    ostringstream stream;
+    {
+        ML::DB::Store_Writer store(stream);
+        store << (unsigned char)0;
+        ML::DB::serialize_compact_size(store, 2);
+        store << MicroUSD(5) << Amount();
+    }
+    string data = stream.str();
+    ML::DB::Store_Reader store(data.data(), data.size());
+    CurrencyPool pool;
+    store >> pool;
+    BOOST_CHECK_EQUAL(listed(pool), "USD/1M=5 ");
+}
@@ -0,0 +1,102 @@
+/*
+Replay of the account journal : segments older than what redis holds are
+skipped, but for the accounts that the dumps left out, which get back
+every record since the first segment they still need.
+*/
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "banker/journal.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct JournalDir {
+    JournalDir(){
+        char tmpl[] = "/tmp/journal_test.XXXXXX";
+        BOOST_REQUIRE(mkdtemp(tmpl));
+        path = tmpl;
+    }
+
+    ~JournalDir(){
+        system(("rm -rf " + path).c_str());
+    }
+
+    string path;
+};
+
+RTBKIT::CurrencyPool
+usd(int64_t micros){
+    return RTBKIT::MicroUSD(micros);
+}
+
+/* segment 1 : a, b ; segment 2 : a, b ; segment 3 : c */
+void
+write_segments(const string& dir){
+    MTX::AccountJournal journal(dir, 10);
+    journal.start();
+    journal.log_set_budget(RTBKIT::AccountKey("a"), usd(1));
+    journal.log_set_budget(RTBKIT::AccountKey("b"), usd(1));
+    BOOST_CHECK_EQUAL(journal.rotate(), 1);
+    journal.log_add_adjustment(RTBKIT::AccountKey("a"), usd(2));
+    journal.log_add_adjustment(RTBKIT::AccountKey("b"), usd(2));
+    BOOST_CHECK_EQUAL(journal.rotate(), 2);
+    journal.log_create_account(RTBKIT::AccountKey("c"), RTBKIT::AT_BUDGET);
+}
+
+// "key type" of every record replayed
+vector<string>
+replay(const string& dir, uint64_t after,
+       const map<string, uint64_t>& pending){
+    vector<string> records;
+    MTX::AccountJournal journal(dir, 10);
+    journal.replay(after, pending,
+            [&](const MTX::AccountJournal::Record& r){
+                records.push_back(r.key + " " + to_string(r.type));
+            });
+    return records;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( test_replay_after_segment )
+{
+    JournalDir dir;
+    write_segments(dir.path);
+
+    BOOST_CHECK_EQUAL(replay(dir.path, 0, {}).size(), 5);
+    vector<string> expected = { "c 5" };
+    BOOST_CHECK(replay(dir.path, 2, {}) == expected);
+}
+
+BOOST_AUTO_TEST_CASE( test_replay_pending_accounts )
+{
+    JournalDir dir;
+    write_segments(dir.path);
+
+    // b was left out of the dump of segment 2, but included in the one of 1
+    vector<string> expected = { "b 3", "c 5" };
+    BOOST_CHECK(replay(dir.path, 2, {{"b", 2}}) == expected);
+
+    // ... or in none of them
+    expected = { "b 1", "b 3", "c 5" };
+    BOOST_CHECK(replay(dir.path, 2, {{"b", 1}}) == expected);
+
+    // the segments it still needs outlive a truncation up to its own
+    {
+        MTX::AccountJournal journal(dir.path, 10);
+        journal.truncate(1);
+    }
+    expected = { "b 3", "c 5" };
+    BOOST_CHECK(replay(dir.path, 2, {{"b", 2}}) == expected);
+}
@@ -0,0 +1,104 @@
+/*
+MpscQueue must hand the consumer every item pushed, once, in the order each
+producer pushed them, and ask for a wakeup only when the consumer may be
+waiting.
+*/
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "utils/mpsc_queue.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct Item : public MTX::MpscQueue<Item>::Node {
+    Item() : producer(0), seq(0) {}
+    int producer;
+    int seq;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE( test_single_thread )
+{
+    MTX::MpscQueue<Item> queue;
+    BOOST_CHECK(queue.pop() == nullptr);
+
+    vector<Item> items(5);
+    // only the first push after a clear_signal asks for a wakeup
+    BOOST_CHECK(queue.push(&items[0]));
+    BOOST_CHECK(!queue.push(&items[1]));
+    queue.clear_signal();
+    BOOST_CHECK(queue.push(&items[2]));
+
+    BOOST_CHECK(queue.pop() == &items[0]);
+    BOOST_CHECK(queue.pop() == &items[1]);
+    BOOST_CHECK(!queue.push(&items[3]));
+    BOOST_CHECK(queue.pop() == &items[2]);
+    BOOST_CHECK(queue.pop() == &items[3]);
+    BOOST_CHECK(queue.pop() == nullptr);
+
+    // the last item popped can be pushed again
+    queue.clear_signal();
+    BOOST_CHECK(queue.push(&items[3]));
+    BOOST_CHECK(queue.push(&items[4]) == false);
+    BOOST_CHECK(queue.pop() == &items[3]);
+    BOOST_CHECK(queue.pop() == &items[4]);
+    BOOST_CHECK(queue.pop() == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE( test_many_producers )
+{
+    const int PRODUCERS = 4;
+    const int PER_PRODUCER = 200000;
+
+    MTX::MpscQueue<Item> queue;
+    // the nodes hold an atomic : built in place, never moved
+    vector<vector<Item>> items;
+    for (int p = 0;  p < PRODUCERS;  ++p) {
+        items.emplace_back(PER_PRODUCER);
+        for (int i = 0;  i < PER_PRODUCER;  ++i) {
+            items[p][i].producer = p;
+            items[p][i].seq = i;
+        }
+    }
+
+    atomic<int> wakeups(0);
+    vector<thread> producers;
+    for (int p = 0;  p < PRODUCERS;  ++p) {
+        producers.emplace_back([&, p] ()
+            {
+                for (auto & item: items[p])
+                    if (queue.push(&item))
+                        ++wakeups;
+            });
+    }
+
+    // what a consumer woken up by the signal does, spinning instead
+    vector<int> next(PRODUCERS, 0);
+    int received = 0;
+    bool ordered = true;
+    while (received < PRODUCERS * PER_PRODUCER) {
+        queue.clear_signal();
+        while (Item * item = queue.pop()) {
+            ordered = ordered && item->seq == next[item->producer];
+            next[item->producer] = item->seq + 1;
+            ++received;
+        }
+    }
+    for (auto & t: producers)
+        t.join();
+
+    BOOST_CHECK(ordered);
+    BOOST_CHECK(queue.pop() == nullptr);
+    for (int p = 0;  p < PRODUCERS;  ++p)
+        BOOST_CHECK_EQUAL(next[p], PER_PRODUCER);
+    BOOST_CHECK_GE(wakeups.load(), 1);
+}
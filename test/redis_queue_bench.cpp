@@ -0,0 +1,132 @@
+/*
+Commands per second through Redis::AsyncConnection::queue, from the time
+the first is queued to the time the last reply is handed over : PINGs
+queued by one and by several threads to a connection running its own
+thread, with and without a timeout each, then by the thread running the
+libevent loop the connection belongs to.
+
+    redis_queue_bench [commands] [host:port]
+
+Starts a redis-server of its own when no address is given.
+*/
+#include "redis_server.h"
+
+#include <event2/event.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct Countdown {
+    Countdown(int n) : left(n) {}
+
+    void done(){
+        if(--left == 0){
+            unique_lock<mutex> guard(lock);
+            cond.notify_all();
+        }
+    }
+
+    void wait(){
+        unique_lock<mutex> guard(lock);
+        cond.wait(guard, [&](){ return left == 0; });
+    }
+
+    atomic<int> left;
+    mutex lock;
+    condition_variable cond;
+};
+
+double
+per_second(const chrono::steady_clock::time_point & start, int n){
+    return n / chrono::duration<double>(chrono::steady_clock::now() - start)
+               .count();
+}
+
+void
+bench_threads(const Redis::Address& address, int n, int threads,
+              bool timeout){
+    Redis::AsyncConnection conn(address);
+    conn.test();
+    Countdown replies(n);
+    auto on_result = [&](const Redis::Result& r){ replies.done(); };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> producers;
+    for(int t = 0; t < threads; ++t){
+        producers.emplace_back([&, t](){
+            for(int i = t; i < n; i += threads){
+                if(timeout)
+                    conn.queue(Redis::PING, on_result, 5.0);
+                else conn.queue(Redis::PING, on_result);
+            }
+        });
+    }
+    for(auto& p : producers)
+        p.join();
+    replies.wait();
+    cout << "queue, " << threads << " thread(s), "
+         << (timeout ? "with" : "no") << " timeout: "
+         << per_second(start, n) << " commands/s" << endl;
+}
+
+void
+bench_loop(const Redis::Address& address, int n, bool timeout){
+    event_base* base = event_base_new();
+    {
+        Redis::AsyncConnection conn(address, base);
+        conn.test();
+        int left = n;
+        auto on_result = [&](const Redis::Result& r){ --left; };
+
+        auto start = chrono::steady_clock::now();
+        for(int i = 0; i < n; ++i){
+            if(timeout)
+                conn.queue(Redis::PING, on_result, 5.0);
+            else conn.queue(Redis::PING, on_result);
+        }
+        while(left)
+            event_base_loop(base, EVLOOP_ONCE);
+        cout << "queue, on the loop, " << (timeout ? "with" : "no")
+             << " timeout: " << per_second(start, n) << " commands/s" << endl;
+    }
+    event_base_free(base);
+}
+
+}
+
+int main(int argc, char* argv[]){
+    int n = argc > 1 ? stoi(argv[1]) : 200000;
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t redis = -1;
+    Redis::Address address;
+    if(argc > 2)
+        address = Redis::Address(argv[2]);
+    else{
+        int port = 20000 + getpid() % 20000;
+        redis = start_redis(port);
+        if(redis <= 0){
+            cerr << "couldn't start redis-server, give a host:port" << endl;
+            return 1;
+        }
+        address = Redis::Address::tcp("127.0.0.1", port);
+    }
+
+    for(bool timeout : { false, true }){
+        bench_threads(address, n, 1, timeout);
+        bench_threads(address, n, 4, timeout);
+        bench_loop(address, n, timeout);
+    }
+
+    if(redis > 0)
+        stop_redis(redis);
+    return 0;
+}
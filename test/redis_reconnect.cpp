@@ -0,0 +1,247 @@
+/*
+Reconnection of Redis::AsyncConnection on a libevent loop, against
+redis-server instances started and killed by the test : requests queued
+while the server is down are held and sent in order once it is back,
+after the password given to auth() and the database given to select(),
+synchronous calls on the loop thread fail or time out instead of hanging,
+and a dead address fails over to the next one.
+
+Exits with 77, which ctest reports as skipped, when there is no
+redis-server in the PATH.
+*/
+#include "redis_server.h"
+
+#include <event2/event.h>
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace Datacratic;
+
+namespace {
+
+// runs the loop until cond holds, for at most seconds
+bool
+run_until(event_base* base, const std::function<bool ()>& cond,
+          double seconds){
+    Date deadline = Date::now().plusSeconds(seconds);
+    while(!cond()){
+        if(Date::now() > deadline)
+            return false;
+        event_base_loop(base, EVLOOP_NONBLOCK);
+        usleep(1000);
+    }
+    return true;
+}
+
+void
+run_for(event_base* base, double seconds){
+    run_until(base, []{ return false; }, seconds);
+}
+
+std::string
+get(int port, int database, const std::string& key,
+    const std::string& password = ""){
+    Redis::AsyncConnection c(Redis::Address::tcp("127.0.0.1", port));
+    if(password.size())
+        c.auth(password);
+    if(database)
+        c.select(database);
+    Redis::Result r = c.exec(Redis::GET(key), 2.0);
+    if(!r.ok() || r.reply().type() != Redis::STRING)
+        return "";
+    return r.reply().asString();
+}
+
+// held requests come back in order on the same address, after SELECT
+void
+test_held_requests_resume(event_base* base, int port){
+    pid_t pid = start_redis(port);
+    CHECK(pid > 0);
+    if(pid <= 0)
+        return;
+
+    Redis::AsyncConnection conn;
+    conn.setReconnectBackoff(0.05, 0.2);
+    conn.connect(std::vector<Redis::Address>{
+                    Redis::Address::tcp("127.0.0.1", port)}, base);
+    conn.select(1);
+    CHECK(conn.exec(Redis::SET("before", "1"), 2.0).ok());
+
+    stop_redis(pid);
+    run_for(base, 0.2);
+
+    // a synchronous call on the loop thread fails rather than waiting
+    Date start = Date::now();
+    Redis::Result down = conn.exec(Redis::GET("before"));
+    CHECK(!down.ok());
+    CHECK(Date::now().secondsSince(start) < 1.0);
+
+    // the commands are temporaries, gone long before they are sent
+    std::vector<int> order;
+    for(int i = 0; i < 3; ++i){
+        conn.queue(Redis::SET("held" + std::to_string(i), std::to_string(i)),
+                   [&order, i](const Redis::Result& r){
+                       if(r.ok())
+                           order.push_back(i);
+                   });
+    }
+    int multi = 0;
+    {
+        Redis::CommandBuffer buffer;
+        buffer.start("SET", 2);
+        buffer.addArg("buffered");
+        buffer.addArg("yes");
+        buffer.start("INCR", 1);
+        buffer.addArg("counter");
+        conn.queueMulti(buffer, [&multi](const Redis::Results& r){
+                            multi = r.ok() ? 1 : -1;
+                        });
+    }
+    bool expired = false;
+    conn.queue(Redis::SET("late", "1"), [&expired](const Redis::Result& r){
+                   expired = r.timedOut();
+               }, 0.1);
+
+    CHECK(run_until(base, [&]{ return expired; }, 2.0));
+
+    pid = start_redis(port);
+    CHECK(pid > 0);
+    if(pid <= 0)
+        return;
+    CHECK(run_until(base, [&]{ return order.size() == 3 && multi; }, 10.0));
+    CHECK(order == std::vector<int>({0, 1, 2}));
+    CHECK(multi == 1);
+
+    // replayed after the SELECT of the new session
+    CHECK(get(port, 1, "held2") == "2");
+    CHECK(get(port, 1, "buffered") == "yes");
+    CHECK(get(port, 1, "late") == "");
+    CHECK(get(port, 0, "held0") == "");
+    CHECK(conn.exec(Redis::GET("counter"), 2.0).ok());
+
+    conn.close();
+    stop_redis(pid);
+}
+
+// the new session authenticates before SELECT and the held requests
+void
+test_auth_resent(event_base* base, int port){
+    const std::string password = "secret";
+    pid_t pid = start_redis(port, password);
+    CHECK(pid > 0);
+    if(pid <= 0)
+        return;
+
+    Redis::AsyncConnection conn;
+    conn.setReconnectBackoff(0.05, 0.2);
+    conn.connect(std::vector<Redis::Address>{
+                    Redis::Address::tcp("127.0.0.1", port)}, base);
+    conn.auth(password);
+    conn.select(2);
+    CHECK(conn.exec(Redis::SET("before", "1"), 2.0).ok());
+
+    stop_redis(pid);
+    run_for(base, 0.2);
+
+    bool done = false;
+    conn.queue(Redis::SET("after", "1"), [&done](const Redis::Result& r){
+                   done = r.ok();
+               });
+    pid = start_redis(port, password);
+    CHECK(pid > 0);
+    if(pid <= 0)
+        return;
+    CHECK(run_until(base, [&]{ return done; }, 10.0));
+    CHECK(get(port, 2, "after", password) == "1");
+
+    conn.close();
+    stop_redis(pid);
+}
+
+// a synchronous call on the loop thread gives up at its timeout while the
+// server holds the reply back, and the late reply is dropped
+void
+test_sync_timeout(event_base* base, int port){
+    pid_t pid = start_redis(port);
+    CHECK(pid > 0);
+    if(pid <= 0)
+        return;
+
+    Redis::AsyncConnection conn;
+    conn.connect(std::vector<Redis::Address>{
+                    Redis::Address::tcp("127.0.0.1", port)}, base);
+
+    Date start = Date::now();
+    Redis::Result blocked = conn.exec(
+            Redis::Command("BLPOP", "nothing", "1"), 0.2);
+    CHECK(blocked.timedOut());
+    CHECK(Date::now().secondsSince(start) < 0.9);
+
+    // the BLPOP reply comes before this one's, and isn't taken for it
+    Redis::Result next = conn.exec(Redis::SET("next", "1"), 2.0);
+    CHECK(next.ok());
+    CHECK(next.ok() && next.reply().asString() == "OK");
+
+    conn.close();
+    stop_redis(pid);
+}
+
+// requests held while the first address is down go to the next one
+void
+test_failover(event_base* base, int first, int second){
+    pid_t a = start_redis(first);
+    pid_t b = start_redis(second);
+    CHECK(a > 0 && b > 0);
+    if(a <= 0 || b <= 0){
+        if(a > 0) stop_redis(a);
+        if(b > 0) stop_redis(b);
+        return;
+    }
+
+    Redis::AsyncConnection conn;
+    conn.setReconnectBackoff(0.05, 0.2);
+    conn.connect(std::vector<Redis::Address>{
+                    Redis::Address::tcp("127.0.0.1", first),
+                    Redis::Address::tcp("127.0.0.1", second)}, base);
+    CHECK(conn.exec(Redis::SET("where", "first"), 2.0).ok());
+
+    stop_redis(a);
+    run_for(base, 0.2);
+
+    bool done = false;
+    conn.queue(Redis::SET("where", "second"), [&done](const Redis::Result& r){
+                   done = r.ok();
+               });
+    CHECK(run_until(base, [&]{ return done; }, 10.0));
+    CHECK(get(second, 0, "where") == "second");
+
+    conn.close();
+    stop_redis(b);
+}
+
+}
+
+int main(int argc, char* argv[]){
+    if(!have_redis_server()){
+        std::cerr << "no redis-server in the PATH, skipped" << std::endl;
+        return SKIPPED;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int port = 20000 + getpid() % 20000;
+    event_base* base = event_base_new();
+    test_held_requests_resume(base, port);
+    test_failover(base, port + 1, port + 2);
+    test_auth_resent(base, port + 3);
+    test_sync_timeout(base, port + 4);
+    event_base_free(base);
+
+    if(failures){
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
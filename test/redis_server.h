@@ -0,0 +1,102 @@
+/*
+redis-server instances started and killed by the tests, and the checks
+of the tests that need one. A test exits with SKIPPED, which ctest
+reports as skipped, when there is no redis-server in the PATH.
+*/
+#ifndef __MTX_TEST_REDIS_SERVER_H__
+#define __MTX_TEST_REDIS_SERVER_H__
+
+#include "soa/service/redis.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+
+namespace {
+
+const int SKIPPED = 77;
+
+int failures = 0;
+
+#define CHECK(cond) do{ \
+    if(!(cond)){ \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond << std::endl; \
+        ++failures; \
+    } \
+}while(0)
+
+bool
+listening(int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    bool ok = connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return ok;
+}
+
+// a redis-server without persistence on port, or -1 if it didn't start
+pid_t
+start_redis(int port, const std::string& password = ""){
+    pid_t pid = fork();
+    if(pid == 0){
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        std::string p = std::to_string(port);
+        if(password.empty())
+            execlp("redis-server", "redis-server", "--port", p.c_str(),
+                   "--bind", "127.0.0.1", "--save", "", "--appendonly", "no",
+                   (char*)NULL);
+        else execlp("redis-server", "redis-server", "--port", p.c_str(),
+                    "--bind", "127.0.0.1", "--save", "", "--appendonly", "no",
+                    "--requirepass", password.c_str(), (char*)NULL);
+        _exit(127);
+    }
+    for(int i = 0; i < 500; ++i){
+        if(listening(port))
+            return pid;
+        if(waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+void
+stop_redis(pid_t pid){
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+// whether redis-server can be run at all
+bool
+have_redis_server(){
+    pid_t pid = fork();
+    if(pid == 0){
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        execlp("redis-server", "redis-server", "--version", (char*)NULL);
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+}
+
+#endif
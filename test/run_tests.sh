@@ -0,0 +1,5 @@
+#!/bin/sh
+# Runs the tests of the build tree it is called from, the way the coverage
+# target calls it. The tests needing a redis-server are reported as skipped
+# when there is none in the PATH.
+exec ctest --output-on-failure
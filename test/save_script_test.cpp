@@ -0,0 +1,141 @@
+/*
+The --redis_cas save script against a redis-server started by the test :
+accounts are written unless a later generation wrote them, the others
+being written all the same, closed ones move to the archive, the script
+is loaded once per connection and loaded again when the server lost it.
+
+Exits with 77, which ctest reports as skipped, when there is no
+redis-server in the PATH.
+*/
+#include "redis_server.h"
+#include "banker/save_script.h"
+
+#include <sstream>
+#include <vector>
+
+namespace {
+
+const std::string PREFIX = "banker-";
+const std::string GENERATIONS = "banker:account_generations";
+const std::string ACTIVE = "banker:accounts";
+const std::string ARCHIVE = "banker:archive";
+
+MTX::SaveScript::Write
+write(const std::string& key, const std::string& account, bool closed = false){
+    MTX::SaveScript::Write result;
+    result.key = key;
+    result.account = account;
+    result.closed = closed;
+    return result;
+}
+
+std::string
+get(Redis::AsyncConnection& conn, const std::string& key){
+    Redis::Result r = conn.exec(Redis::GET(key), 2.0);
+    if(!r.ok() || r.reply().type() != Redis::STRING)
+        return "";
+    return r.reply().asString();
+}
+
+bool
+is_member(Redis::AsyncConnection& conn, const std::string& set,
+          const std::string& key){
+    Redis::Result r = conn.exec(Redis::Command("SISMEMBER", set, key), 2.0);
+    return r.ok() && r.reply().asInt() == 1;
+}
+
+// the integer replies, -1 for an error
+std::vector<long long>
+replies(const Redis::Results& results){
+    std::vector<long long> result;
+    for(auto& r : results){
+        result.push_back(r.ok() && r.reply().type() == Redis::INTEGER
+                         ? r.reply().asInt() : -1);
+    }
+    return result;
+}
+
+// number of SCRIPT LOAD the server ran
+int
+script_loads(Redis::AsyncConnection& conn){
+    Redis::Result r = conn.exec(Redis::Command("INFO", "commandstats"), 2.0);
+    if(!r.ok())
+        return -1;
+    std::istringstream info(r.reply().asString());
+    std::string line;
+    while(std::getline(info, line)){
+        // cmdstat_script:calls=N before redis 7, cmdstat_script|load after
+        if(line.compare(0, 20, "cmdstat_script|load:") != 0
+                && line.compare(0, 15, "cmdstat_script:") != 0)
+            continue;
+        size_t calls = line.find("calls=");
+        if(calls != std::string::npos)
+            return std::stoi(line.substr(calls + 6));
+    }
+    return 0;
+}
+
+void
+test_save_script(int port){
+    pid_t pid = start_redis(port);
+    CHECK(pid > 0);
+    if(pid <= 0)
+        return;
+
+    auto conn = std::make_shared<Redis::AsyncConnection>(
+                        Redis::Address::tcp("127.0.0.1", port));
+    Redis::AsyncConnection check(Redis::Address::tcp("127.0.0.1", port));
+    MTX::SaveScript script(conn, PREFIX, GENERATIONS, ACTIVE, ARCHIVE);
+
+    Redis::Results r = script.run({ write("a", "{\"n\":1}"),
+                                    write("b", "{\"n\":1}") }, 5);
+    CHECK(replies(r) == std::vector<long long>({1, 1}));
+    CHECK(get(check, PREFIX + "a") == "{\"n\":1}");
+    CHECK(is_member(check, ACTIVE, "b"));
+
+    // b was written by a later generation : a and c are written anyway
+    CHECK(check.exec(Redis::Command("HSET", GENERATIONS, "b", "9"), 2.0).ok());
+    r = script.run({ write("a", "{\"n\":2}"), write("b", "{\"n\":2}"),
+                     write("c", "{\"n\":2}") }, 6);
+    CHECK(replies(r) == std::vector<long long>({1, 0, 1}));
+    CHECK(get(check, PREFIX + "a") == "{\"n\":2}");
+    CHECK(get(check, PREFIX + "b") == "{\"n\":1}");
+    CHECK(get(check, PREFIX + "c") == "{\"n\":2}");
+
+    // a closed account moves to the archive, once
+    r = script.run({ write("a", "{\"n\":3}", true) }, 7);
+    CHECK(replies(r) == std::vector<long long>({2}));
+    CHECK(is_member(check, ARCHIVE, "a") && !is_member(check, ACTIVE, "a"));
+    r = script.run({ write("a", "{\"n\":3}", true) }, 8);
+    CHECK(replies(r) == std::vector<long long>({1}));
+
+    // loaded once for all the runs on the connection
+    CHECK(script_loads(check) == 1);
+
+    // and again when the server lost it, the refused writes sent again
+    CHECK(check.exec(Redis::Command("SCRIPT", "FLUSH"), 2.0).ok());
+    r = script.run({ write("c", "{\"n\":4}"), write("d", "{\"n\":4}") }, 9);
+    CHECK(replies(r) == std::vector<long long>({1, 1}));
+    CHECK(get(check, PREFIX + "d") == "{\"n\":4}");
+    CHECK(script_loads(check) == 2);
+
+    stop_redis(pid);
+}
+
+}
+
+int main(int argc, char* argv[]){
+    if(!have_redis_server()){
+        std::cerr << "no redis-server in the PATH, skipped" << std::endl;
+        return SKIPPED;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    test_save_script(20000 + getpid() % 20000);
+
+    if(failures){
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
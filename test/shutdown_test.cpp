@@ -0,0 +1,170 @@
+/*
+A master_banker stopped with SIGTERM, before any periodic dump, must leave
+redis with the accounts it last held : the last dump is written through
+the loop before it stops. Run against a redis-server started by the test,
+with the accounts on the base loop and split over partitions.
+
+    shutdown_test <path of master_banker>
+
+Exits with 77, which ctest reports as skipped, when there is no
+redis-server in the PATH.
+*/
+#include "redis_server.h"
+
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+// a master_banker on http_port saving to redis on port, or -1
+pid_t
+start_banker(const std::string& binary, int port, int http_port,
+             const std::vector<std::string>& flags){
+    std::vector<std::string> args = {
+        binary,
+        "--redis_uri=127.0.0.1:" + std::to_string(port),
+        "--http_port=" + std::to_string(http_port),
+        "--ip=127.0.0.1",
+        // nothing is saved but by the shutdown
+        "--redis_dump_interval=3600",
+        "--carbon_port=" + std::to_string(http_port + 1)
+    };
+    args.insert(args.end(), flags.begin(), flags.end());
+
+    pid_t pid = fork();
+    if(pid == 0){
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        std::vector<char*> argv;
+        for(auto& arg : args)
+            argv.push_back(&arg[0]);
+        argv.push_back(NULL);
+        execv(binary.c_str(), argv.data());
+        _exit(127);
+    }
+    for(int i = 0; i < 1000; ++i){
+        if(listening(http_port))
+            return pid;
+        if(waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+// the status code of the reply to a POST of body to path, 0 if none
+int
+post(int http_port, const std::string& path, const std::string& body){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(http_port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if(connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0){
+        close(fd);
+        return 0;
+    }
+    std::string request = "POST " + path + " HTTP/1.1\r\n"
+            "Host: 127.0.0.1\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "Connection: close\r\n\r\n" + body;
+    if(write(fd, request.data(), request.size()) != (ssize_t)request.size()){
+        close(fd);
+        return 0;
+    }
+    std::string reply;
+    char buffer[4096];
+    ssize_t n;
+    while((n = read(fd, buffer, sizeof(buffer))) > 0)
+        reply.append(buffer, n);
+    close(fd);
+    // HTTP/1.1 200 Ok
+    if(reply.size() < 12)
+        return 0;
+    return std::atoi(reply.c_str() + 9);
+}
+
+// exit status of pid, or -1 if it is still running after seconds
+int
+wait_exit(pid_t pid, int seconds){
+    for(int i = 0; i < seconds * 100; ++i){
+        int status = 0;
+        if(waitpid(pid, &status, WNOHANG) == pid)
+            return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+std::string
+get(Redis::AsyncConnection& conn, const std::string& key){
+    Redis::Result r = conn.exec(Redis::GET(key), 2.0);
+    if(!r.ok() || r.reply().type() != Redis::STRING)
+        return "";
+    return r.reply().asString();
+}
+
+void
+test_shutdown(const std::string& binary, int port,
+              const std::vector<std::string>& flags){
+    pid_t redis = start_redis(port);
+    CHECK(redis > 0);
+    if(redis <= 0)
+        return;
+
+    int http_port = port + 1;
+    pid_t banker = start_banker(binary, port, http_port, flags);
+    CHECK(banker > 0);
+    if(banker > 0){
+        CHECK(post(http_port, "/v1/accounts/top/budget",
+                   "{\"USD/1M\":123456789}") == 200);
+        CHECK(post(http_port, "/v1/accounts/other/budget",
+                   "{\"USD/1M\":5}") == 200);
+        CHECK(post(http_port, "/v1/accounts/other/budget",
+                   "{\"USD/1M\":7}") == 200);
+
+        kill(banker, SIGTERM);
+        CHECK(wait_exit(banker, 10) == 0);
+
+        Redis::AsyncConnection check(Redis::Address::tcp("127.0.0.1", port));
+        std::string top = get(check, "banker-top");
+        std::string other = get(check, "banker-other");
+        CHECK(top.find("\"budgetIncreases\":{\"USD/1M\":123456789}")
+              != std::string::npos);
+        CHECK(other.find("\"budgetIncreases\":{\"USD/1M\":7}")
+              != std::string::npos);
+        CHECK(get(check, "banker:generation") == "1");
+    }
+    stop_redis(redis);
+}
+
+}
+
+int main(int argc, char* argv[]){
+    if(argc < 2){
+        std::cerr << "usage: shutdown_test <path of master_banker>" << std::endl;
+        return 1;
+    }
+    if(!have_redis_server()){
+        std::cerr << "no redis-server in the PATH, skipped" << std::endl;
+        return SKIPPED;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int port = 20000 + getpid() % 20000;
+    test_shutdown(argv[1], port, {});
+    test_shutdown(argv[1], port + 3, {"--account_partitions=2",
+                                      "--http_threads=2"});
+    test_shutdown(argv[1], port + 6, {"--redis_cas"});
+
+    if(failures){
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
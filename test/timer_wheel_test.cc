@@ -0,0 +1,146 @@
+/*
+TimerWheel must expire every item at its deadline, never before and at most
+a tick after, however far the deadline is and whatever the callbacks
+schedule or cancel while the wheel expires.
+*/
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "utils/timer_wheel.h"
+
+#include <random>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct Item : public MTX::TimerWheel<Item>::Entry {
+    Item() : deadline(0), expired(-1) {}
+    double deadline;
+    double expired;     // when it expired, -1 if it didn't
+};
+
+typedef MTX::TimerWheel<Item> Wheel;
+
+const double TICK = 0.01;
+
+}
+
+BOOST_AUTO_TEST_CASE( test_expires_on_time )
+{
+    mt19937 rng(1);
+    double now = 1000.0;
+    Wheel wheel(TICK, 64, now);
+
+    // up to three revolutions ahead
+    vector<Item> items(2000);
+    for (auto & item: items) {
+        item.deadline = now + (rng() % 200000) / 100000.0;
+        wheel.schedule(&item, item.deadline);
+    }
+    BOOST_CHECK_EQUAL(wheel.size(), items.size());
+
+    size_t expired = 0;
+    while (!wheel.empty()) {
+        now += (rng() % 7) / 1000.0;
+        expired += wheel.expire(now, [&] (Item * item)
+                                { item->expired = now; });
+    }
+    BOOST_CHECK_EQUAL(expired, items.size());
+    for (auto & item: items) {
+        BOOST_CHECK(!item.scheduled());
+        BOOST_CHECK_GE(item.expired, item.deadline);
+        // a tick late at most, plus the step the clock took
+        BOOST_CHECK_LE(item.expired - item.deadline, TICK + 0.007);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_cancel_and_reschedule )
+{
+    double now = 0;
+    Wheel wheel(TICK, 16, now);
+    Item a, b, c;
+    wheel.schedule(&a, 0.05);
+    wheel.schedule(&b, 0.05);
+    wheel.schedule(&c, 0.05);
+    BOOST_CHECK_EQUAL(wheel.size(), 3);
+
+    wheel.cancel(&b);
+    BOOST_CHECK(!b.scheduled());
+    wheel.cancel(&b);
+    BOOST_CHECK_EQUAL(wheel.size(), 2);
+
+    // rescheduled, c counts once
+    wheel.schedule(&c, 0.5);
+    BOOST_CHECK_EQUAL(wheel.size(), 2);
+
+    vector<Item*> fired;
+    auto collect = [&] (Item * item) { fired.push_back(item); };
+    BOOST_CHECK_EQUAL(wheel.expire(0.04, collect), 0);
+    BOOST_CHECK_EQUAL(wheel.expire(0.06, collect), 1);
+    BOOST_CHECK(fired == vector<Item*>{ &a });
+    BOOST_CHECK_EQUAL(wheel.expire(0.49, collect), 0);
+    BOOST_CHECK_EQUAL(wheel.expire(0.51, collect), 1);
+    BOOST_CHECK(fired.back() == &c);
+    BOOST_CHECK(wheel.empty());
+
+    // a deadline already passed is due at the next tick
+    wheel.schedule(&a, 0.1);
+    BOOST_CHECK_EQUAL(wheel.expire(0.51, collect), 0);
+    BOOST_CHECK_EQUAL(wheel.expire(0.52, collect), 1);
+}
+
+BOOST_AUTO_TEST_CASE( test_beyond_a_revolution )
+{
+    // 8 slots of 10ms : 80ms per revolution
+    Wheel wheel(TICK, 5, 0);
+    Item near, far, farther;
+    wheel.schedule(&near, 0.03);
+    wheel.schedule(&far, 0.03 + 0.08);
+    wheel.schedule(&farther, 0.03 + 0.8);
+
+    vector<Item*> fired;
+    auto collect = [&] (Item * item) { fired.push_back(item); };
+    BOOST_CHECK_EQUAL(wheel.expire(0.035, collect), 1);
+    BOOST_CHECK(fired == vector<Item*>{ &near });
+    BOOST_CHECK_EQUAL(wheel.expire(0.1, collect), 0);
+    BOOST_CHECK_EQUAL(wheel.expire(0.115, collect), 1);
+
+    // the clock jumps over several revolutions at once
+    BOOST_CHECK_EQUAL(wheel.expire(5.0, collect), 1);
+    BOOST_CHECK(fired.back() == &farther);
+    BOOST_CHECK(wheel.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_callbacks_change_the_wheel )
+{
+    Wheel wheel(TICK, 16, 0);
+    Item a, b, later;
+    wheel.schedule(&a, 0.02);
+    wheel.schedule(&b, 0.02);
+    wheel.schedule(&later, 0.5);
+
+    // the first to fire cancels a later item and delays itself
+    Item * first = nullptr;
+    size_t n = wheel.expire(0.05, [&] (Item * item)
+            {
+                if (first)
+                    return;
+                first = item;
+                wheel.cancel(&later);
+                wheel.schedule(item, 0.1);
+            });
+    BOOST_CHECK_EQUAL(n, 2);
+    BOOST_CHECK(!later.scheduled());
+    BOOST_CHECK(first->scheduled());
+    BOOST_CHECK_EQUAL(wheel.size(), 1);
+
+    vector<Item*> fired;
+    BOOST_CHECK_EQUAL(wheel.expire(1.0, [&] (Item * item)
+                                   { fired.push_back(item); }), 1);
+    BOOST_CHECK(fired == vector<Item*>{ first });
+    BOOST_CHECK(wheel.empty());
+}